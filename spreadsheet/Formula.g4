@@ -9,10 +9,19 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
+    | FUNCTION '(' arg (',' arg)* ')'  # Function
     | CELL  # Cell
+    | REF  # Ref
     | NUMBER  # Literal
     ;
 
+// ranges are allowed only as arguments of functions
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +35,15 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference to a deleted cell or range
+REF: '#REF!' ;
+// a name without digits, so that cells are not lexed as functions
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
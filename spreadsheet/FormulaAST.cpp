@@ -4,14 +4,18 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <sstream>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -57,13 +61,18 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+//
+// The comparisons have the lowest grammatic precedence and are left-associative:
+// A < B = C is (A < B) = C, so only a right child comparison needs the parens,
+// and a comparison under any other operation needs them on both sides.
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
 class Expr {
@@ -71,7 +80,22 @@ public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const GetValue& get_value) const = 0;
+    virtual double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const = 0;
+    virtual void Compile(FormulaProgram& program) const = 0;
+    // returns the size of the node and of the nodes under it
+    virtual size_t GetMemoryUsage() const = 0;
+    // returns the range if the node is a range argument of a function
+    virtual const Range* GetRange() const {
+        return nullptr;
+    }
+    // returns the position if the node is a reference to a cell
+    virtual const Position* GetCell() const {
+        return nullptr;
+    }
+    // checks whether the node or a node under it may leave some of its operands unevaluated
+    virtual bool HasBranches() const {
+        return false;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -142,10 +166,10 @@ public:
     }
 
 // При делении на 0 выбрасывайте ошибку вычисления FormulaError
-    double Evaluate(const GetValue& get_value) const override {
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
         double res_value{};
-	double lhs_value = lhs_->Evaluate(get_value);
-	double rhs_value = rhs_->Evaluate(get_value);
+	double lhs_value = lhs_->Evaluate(get_value, ranges);
+	double rhs_value = rhs_->Evaluate(get_value, ranges);
         switch(type_) {
             case Type::Add:
                 res_value = lhs_value + rhs_value;
@@ -164,7 +188,122 @@ public:
                                         : throw FormulaError(FormulaError::Category::Arithmetic);
     }
 
+    void Compile(FormulaProgram& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        switch (type_) {
+            case Type::Add:
+                program.code.push_back({FormulaProgram::OpCode::Add});
+                break;
+            case Type::Subtract:
+                program.code.push_back({FormulaProgram::OpCode::Subtract});
+                break;
+            case Type::Multiply:
+                program.code.push_back({FormulaProgram::OpCode::Multiply});
+                break;
+            case Type::Divide:
+                program.code.push_back({FormulaProgram::OpCode::Divide});
+                break;
+        }
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    bool HasBranches() const override {
+        return lhs_->HasBranches() || rhs_->HasBranches();
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+};
+
+// the comparison is 1 if it holds and 0 otherwise
+class ComparisonExpr final : public Expr {
+public:
+    enum Type : std::uint8_t {
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+    };
+
+public:
+    explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetSign() << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << GetSign();
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_CMP;
+    }
+
+    // both operands are evaluated, the errors of the left one go first
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        const double lhs_value = lhs_->Evaluate(get_value, ranges);
+        const double rhs_value = rhs_->Evaluate(get_value, ranges);
+        return Compare(lhs_value, rhs_value) ? 1.0 : 0.0;
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        program.code.push_back({static_cast<FormulaProgram::OpCode>(
+            static_cast<std::uint8_t>(FormulaProgram::OpCode::Equal) + type_)});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    bool HasBranches() const override {
+        return lhs_->HasBranches() || rhs_->HasBranches();
+    }
+
 private:
+    std::string_view GetSign() const {
+        constexpr std::string_view SIGNS[] = {"=", "<>", "<", "<=", ">", ">="};
+        return SIGNS[type_];
+    }
+
+    bool Compare(double lhs, double rhs) const {
+        switch (type_) {
+            case Equal:
+                return lhs == rhs;
+            case NotEqual:
+                return lhs != rhs;
+            case Less:
+                return lhs < rhs;
+            case LessEqual:
+                return lhs <= rhs;
+            case Greater:
+                return lhs > rhs;
+            case GreaterEqual:
+                return lhs >= rhs;
+        }
+        return false;
+    }
+
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
@@ -198,9 +337,23 @@ public:
         return EP_UNARY;
     }
 
-    double Evaluate(const GetValue& get_value) const override {
-        return type_ == Type::UnaryMinus ? -operand_->Evaluate(get_value) 
-                                         : operand_->Evaluate(get_value); 
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        return type_ == Type::UnaryMinus ? -operand_->Evaluate(get_value, ranges) 
+                                         : operand_->Evaluate(get_value, ranges); 
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        operand_->Compile(program);
+        program.code.push_back({type_ == Type::UnaryMinus ? FormulaProgram::OpCode::UnaryMinus
+                                                          : FormulaProgram::OpCode::UnaryPlus});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
+    bool HasBranches() const override {
+        return operand_->HasBranches();
     }
 
 private:
@@ -227,10 +380,20 @@ public:
     }
 
 // Для чисел метод возвращает значение числа.
-    double Evaluate(const GetValue&) const override {
+    double Evaluate(const GetValue&, const RangeFunctions&) const override {
         return value_;
     }
 
+    void Compile(FormulaProgram& program) const override {
+        program.code.push_back({FormulaProgram::OpCode::Number,
+                                static_cast<std::uint32_t>(program.constants.size())});
+        program.constants.push_back(value_);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
 private:
     double value_;
 };
@@ -258,14 +421,526 @@ public:
     }
 
 // Для чисел метод возвращает значение числа.
-    double Evaluate(const GetValue& get_value) const override {
+    double Evaluate(const GetValue& get_value, const RangeFunctions&) const override {
         return get_value(*cell_);
     }
 
+    void Compile(FormulaProgram& program) const override {
+        program.code.push_back({FormulaProgram::OpCode::Cell,
+                                static_cast<std::uint32_t>(program.cells.size())});
+        program.cells.push_back(*cell_);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    const Position* GetCell() const override {
+        return cell_;
+    }
+
 private:
     const Position* cell_;
 };
 
+// the largest range a formula may refer to, all its cells are linked to the formula
+constexpr size_t MAX_RANGE_CELLS = 1 << 20;
+
+struct FunctionName {
+    std::string_view name;
+    AggregateFunction function;
+    FormulaProgram::OpCode code;
+};
+
+constexpr FunctionName FUNCTIONS[] = {
+    {"SUM", AggregateFunction::Sum, FormulaProgram::OpCode::Sum},
+    {"COUNT", AggregateFunction::Count, FormulaProgram::OpCode::Count},
+    {"AVERAGE", AggregateFunction::Average, FormulaProgram::OpCode::Average},
+    {"MIN", AggregateFunction::Min, FormulaProgram::OpCode::Min},
+    {"MAX", AggregateFunction::Max, FormulaProgram::OpCode::Max},
+};
+
+const FunctionName& GetFunctionName(AggregateFunction function) {
+    for (const FunctionName& name : FUNCTIONS) {
+        if (name.function == function) {
+            return name;
+        }
+    }
+    throw std::logic_error("Unknown aggregate function");
+}
+
+struct LookupFunctionName {
+    std::string_view name;
+    LookupFunction function;
+    FormulaProgram::OpCode code;
+    size_t min_args;
+    size_t max_args;
+    // the bit of an argument is set if the argument is a range, the others are numbers
+    unsigned range_args;
+};
+
+constexpr LookupFunctionName LOOKUP_FUNCTIONS[] = {
+    {"MATCH", LookupFunction::Match, FormulaProgram::OpCode::Match, 2, 3, 0b010},
+    {"VLOOKUP", LookupFunction::VLookup, FormulaProgram::OpCode::VLookup, 3, 4, 0b010},
+    {"XLOOKUP", LookupFunction::XLookup, FormulaProgram::OpCode::XLookup, 3, 5, 0b110},
+};
+
+const LookupFunctionName& GetFunctionName(LookupFunction function) {
+    for (const LookupFunctionName& name : LOOKUP_FUNCTIONS) {
+        if (name.function == function) {
+            return name;
+        }
+    }
+    throw std::logic_error("Unknown lookup function");
+}
+
+struct ConditionalFunctionName {
+    std::string_view name;
+    AggregateFunction function;
+    FormulaProgram::OpCode code;
+    size_t min_args;
+    size_t max_args;
+    // the bit of an argument is set if the argument is a range, the others are numbers
+    unsigned range_args;
+};
+
+constexpr ConditionalFunctionName CONDITIONAL_FUNCTIONS[] = {
+    {"SUMIF", AggregateFunction::Sum, FormulaProgram::OpCode::SumIf, 2, 3, 0b101},
+    {"COUNTIF", AggregateFunction::Count, FormulaProgram::OpCode::CountIf, 2, 2, 0b001},
+    {"AVERAGEIF", AggregateFunction::Average, FormulaProgram::OpCode::AverageIf, 2, 3, 0b101},
+};
+
+const ConditionalFunctionName& GetConditionalFunctionName(AggregateFunction function) {
+    for (const ConditionalFunctionName& name : CONDITIONAL_FUNCTIONS) {
+        if (name.function == function) {
+            return name;
+        }
+    }
+    throw std::logic_error("Unknown conditional function");
+}
+
+enum class LogicalFunction : std::uint8_t {
+    If,
+    And,
+    Or,
+    Not,
+};
+
+struct LogicalFunctionName {
+    std::string_view name;
+    LogicalFunction function;
+    FormulaProgram::OpCode code;
+    size_t min_args;
+    size_t max_args;
+    // the arguments of the logical functions are numbers
+    unsigned range_args;
+};
+
+constexpr LogicalFunctionName LOGICAL_FUNCTIONS[] = {
+    {"IF", LogicalFunction::If, FormulaProgram::OpCode::If, 2, 3, 0},
+    {"AND", LogicalFunction::And, FormulaProgram::OpCode::And, 1, std::numeric_limits<size_t>::max(), 0},
+    {"OR", LogicalFunction::Or, FormulaProgram::OpCode::Or, 1, std::numeric_limits<size_t>::max(), 0},
+    {"NOT", LogicalFunction::Not, FormulaProgram::OpCode::Not, 1, 1, 0},
+};
+
+const LogicalFunctionName& GetFunctionName(LogicalFunction function) {
+    for (const LogicalFunctionName& name : LOGICAL_FUNCTIONS) {
+        if (name.function == function) {
+            return name;
+        }
+    }
+    throw std::logic_error("Unknown logical function");
+}
+
+// outputs the tree of the call of the function
+void PrintFunction(std::ostream& out, std::string_view name, const std::vector<std::unique_ptr<Expr>>& args) {
+    out << '(' << name;
+    for (const auto& arg : args) {
+        out << ' ';
+        arg->Print(out);
+    }
+    out << ')';
+}
+
+// outputs the call of the function as it is written in the formula
+void PrintFunctionFormula(std::ostream& out, std::string_view name, const std::vector<std::unique_ptr<Expr>>& args) {
+    out << name << '(';
+    bool first = true;
+    for (const auto& arg : args) {
+        if (!first) {
+            out << ',';
+        }
+        first = false;
+        arg->PrintFormula(out, EP_ATOM);
+    }
+    out << ')';
+}
+
+// checks whether one of the arguments of the function has branches
+bool HasBranches(const std::vector<std::unique_ptr<Expr>>& args) {
+    return std::any_of(args.begin(), args.end(), [](const auto& arg) {
+        return arg->HasBranches();
+    });
+}
+
+// returns the size of the arguments of the function and of the nodes under them
+size_t GetArgsMemoryUsage(const std::vector<std::unique_ptr<Expr>>& args) {
+    size_t usage = args.capacity() * sizeof(args.front());
+    for (const auto& arg : args) {
+        usage += arg->GetMemoryUsage();
+    }
+    return usage;
+}
+
+// the range is an operand of the function only, it has no value of its own
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const GetValue&, const RangeFunctions&) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        // the corners of the range take two consecutive positions
+        program.code.push_back({FormulaProgram::OpCode::Range,
+                                static_cast<std::uint32_t>(program.cells.size())});
+        program.cells.push_back(range_->from);
+        program.cells.push_back(range_->to);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    const Range* GetRange() const override {
+        return range_;
+    }
+
+private:
+    const Range* range_;
+};
+
+class AggregateExpr final : public Expr {
+public:
+    explicit AggregateExpr(AggregateFunction function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        PrintFunction(out, GetFunctionName(function_).name, args_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        PrintFunctionFormula(out, GetFunctionName(function_).name, args_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // the aggregates of the ranges are taken from ranges, the other
+    // arguments are numbers
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        const bool extremes = function_ == AggregateFunction::Min || function_ == AggregateFunction::Max;
+        AggregateValue value;
+        for (const auto& arg : args_) {
+            if (const Range* range = arg->GetRange()) {
+                if (!range->IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                value.Merge(ranges.aggregate(*range, extremes));
+            } else {
+                value.Add({AggregateInput::Kind::Number, arg->Evaluate(get_value, ranges)});
+            }
+        }
+        return value.GetResult(function_);
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        for (const auto& arg : args_) {
+            arg->Compile(program);
+        }
+        program.code.push_back({GetFunctionName(function_).code, static_cast<std::uint32_t>(args_.size())});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + GetArgsMemoryUsage(args_);
+    }
+
+    bool HasBranches() const override {
+        return ASTImpl::HasBranches(args_);
+    }
+
+private:
+    AggregateFunction function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+// checks the count of the arguments of the function and that the ranges are given where they are expected
+template <typename FunctionName>
+bool HasValidArgs(const FunctionName& name, const std::vector<std::unique_ptr<Expr>>& args) {
+    if (args.size() < name.min_args || args.size() > name.max_args) {
+        return false;
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+        if ((args[i]->GetRange() != nullptr) != (((name.range_args >> i) & 1u) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns the range of the range argument, throws #REF! if it is invalid
+const Range& GetValidRange(const Expr& arg) {
+    const Range& range = *arg.GetRange();
+    if (!range.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    return range;
+}
+
+class LookupExpr final : public Expr {
+public:
+    explicit LookupExpr(LookupFunction function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        PrintFunction(out, GetFunctionName(function_).name, args_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        PrintFunctionFormula(out, GetFunctionName(function_).name, args_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // the key is searched by ranges.find, the found cell is read by get_value;
+    // the key which is not found is a #VALUE! error
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        const double key = args_[0]->Evaluate(get_value, ranges);
+        const Range& range = GetValidRange(*args_[1]);
+        switch (function_) {
+            case LookupFunction::Match:
+                if (!IsVector(range)) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return static_cast<double>(Find(range, key, GetMode(2, get_value, ranges), ranges) + 1);
+            case LookupFunction::VLookup: {
+                const double column = std::trunc(args_[2]->Evaluate(get_value, ranges));
+                if (column < 1) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                if (column > range.GetSize().cols) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                const Range first_column{range.from, {range.to.row, range.from.col}};
+                const size_t offset = Find(first_column, key, GetMode(3, get_value, ranges), ranges);
+                return get_value({range.from.row + static_cast<int>(offset),
+                                  range.from.col + static_cast<int>(column) - 1});
+            }
+            case LookupFunction::XLookup: {
+                const Range& results = GetValidRange(*args_[2]);
+                if (!IsVector(range) || !(results.GetSize() == range.GetSize())) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                const std::optional<size_t> offset = ranges.find(range, key, GetMode(4, get_value, ranges));
+                if (!offset) {
+                    // the value for the key which is not found is evaluated only when it is needed
+                    if (args_.size() > 3) {
+                        return args_[3]->Evaluate(get_value, ranges);
+                    }
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return get_value(GetCellAt(results, *offset));
+            }
+        }
+        throw std::logic_error("Unknown lookup function");
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        for (const auto& arg : args_) {
+            arg->Compile(program);
+        }
+        program.code.push_back({GetFunctionName(function_).code, static_cast<std::uint32_t>(args_.size())});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + GetArgsMemoryUsage(args_);
+    }
+
+    bool HasBranches() const override {
+        return ASTImpl::HasBranches(args_);
+    }
+
+private:
+    // returns the mode selected by the argument at the index, which may be omitted
+    MatchMode GetMode(size_t index, const GetValue& get_value, const RangeFunctions& ranges) const {
+        std::optional<double> argument;
+        if (index < args_.size()) {
+            argument = args_[index]->Evaluate(get_value, ranges);
+        }
+        return GetMatchMode(function_, argument);
+    }
+
+    static size_t Find(const Range& range, double key, MatchMode mode, const RangeFunctions& ranges) {
+        const std::optional<size_t> offset = ranges.find(range, key, mode);
+        if (!offset) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return *offset;
+    }
+
+    LookupFunction function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+class ConditionalExpr final : public Expr {
+public:
+    explicit ConditionalExpr(AggregateFunction function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        PrintFunction(out, GetConditionalFunctionName(function_).name, args_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        PrintFunctionFormula(out, GetConditionalFunctionName(function_).name, args_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // the values at the criteria equal to the key are aggregated by ranges.aggregate_if,
+    // the criteria are aggregated themselves if the values are omitted
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        const double key = args_[1]->Evaluate(get_value, ranges);
+        const Range& criteria = GetValidRange(*args_[0]);
+        const Range& values = args_.size() > 2 ? GetValidRange(*args_[2]) : criteria;
+        if (!(values.GetSize() == criteria.GetSize())) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return ranges.aggregate_if(criteria, values, key).GetResult(function_);
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        for (const auto& arg : args_) {
+            arg->Compile(program);
+        }
+        program.code.push_back({GetConditionalFunctionName(function_).code,
+                                static_cast<std::uint32_t>(args_.size())});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + GetArgsMemoryUsage(args_);
+    }
+
+    bool HasBranches() const override {
+        return ASTImpl::HasBranches(args_);
+    }
+
+private:
+    AggregateFunction function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+// The logical functions take numbers: zero is false, any other number is
+// true, and return 1 or 0. IF evaluates the condition and then only the taken
+// branch, AND and OR stop at the first argument deciding the result, so the
+// errors of the arguments which are not evaluated do not matter.
+class LogicalExpr final : public Expr {
+public:
+    explicit LogicalExpr(LogicalFunction function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        PrintFunction(out, GetFunctionName(function_).name, args_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        PrintFunctionFormula(out, GetFunctionName(function_).name, args_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const GetValue& get_value, const RangeFunctions& ranges) const override {
+        switch (function_) {
+            case LogicalFunction::If:
+                if (args_[0]->Evaluate(get_value, ranges) != 0.0) {
+                    return args_[1]->Evaluate(get_value, ranges);
+                }
+                // the omitted else branch is false
+                return args_.size() > 2 ? args_[2]->Evaluate(get_value, ranges) : 0.0;
+            case LogicalFunction::And:
+                for (const auto& arg : args_) {
+                    if (arg->Evaluate(get_value, ranges) == 0.0) {
+                        return 0.0;
+                    }
+                }
+                return 1.0;
+            case LogicalFunction::Or:
+                for (const auto& arg : args_) {
+                    if (arg->Evaluate(get_value, ranges) != 0.0) {
+                        return 1.0;
+                    }
+                }
+                return 0.0;
+            case LogicalFunction::Not:
+                return args_[0]->Evaluate(get_value, ranges) == 0.0 ? 1.0 : 0.0;
+        }
+        return 0.0;
+    }
+
+    void Compile(FormulaProgram& program) const override {
+        for (const auto& arg : args_) {
+            arg->Compile(program);
+        }
+        program.code.push_back({GetFunctionName(function_).code, static_cast<std::uint32_t>(args_.size())});
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + GetArgsMemoryUsage(args_);
+    }
+
+    bool HasBranches() const override {
+        return function_ != LogicalFunction::Not || ASTImpl::HasBranches(args_);
+    }
+
+private:
+    LogicalFunction function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -280,6 +955,10 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -323,6 +1002,14 @@ public:
         args_.push_back(std::move(node));
     }
 
+    // the reference to a deleted cell or range is printed as #REF!, it is read back as a deleted
+    // cell and becomes a deleted range in the functions expecting a range there
+    void exitRef(FormulaParser::RefContext* /* ctx */) override {
+        cells_.push_front(Position::NONE);
+        auto node = std::make_unique<CellExpr>(&cells_.front());
+        args_.push_back(std::move(node));
+    }
+
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
@@ -347,13 +1034,134 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        ComparisonExpr::Type type;
+        if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else if (ctx->NE()) {
+            type = ComparisonExpr::NotEqual;
+        } else if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = ComparisonExpr::GreaterEqual;
+        }
+
+        auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto from_str = ctx->CELL(0)->getSymbol()->getText();
+        auto to_str = ctx->CELL(1)->getSymbol()->getText();
+        auto from = Position::FromString(from_str);
+        auto to = Position::FromString(to_str);
+        if (!from.IsValid() || !to.IsValid()) {
+            throw FormulaException("Invalid range: " + from_str + ':' + to_str);
+        }
+        auto range = Range::FromCorners(from, to);
+        if (range.GetCellCount() > MAX_RANGE_CELLS) {
+            throw FormulaException("Range is too large: " + range.ToString());
+        }
+
+        ranges_.push_front(range);
+        auto node = std::make_unique<RangeExpr>(&ranges_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->FUNCTION()->getSymbol()->getText();
+        const auto count = ctx->arg().size();
+        assert(args_.size() >= count);
+
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                                                std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+
+        auto iter = std::find_if(std::begin(FUNCTIONS), std::end(FUNCTIONS), [&name](const FunctionName& function) {
+            return function.name == name;
+        });
+        if (iter != std::end(FUNCTIONS)) {
+            args_.push_back(std::make_unique<AggregateExpr>(iter->function, std::move(args)));
+            return;
+        }
+        auto lookup = std::find_if(std::begin(LOOKUP_FUNCTIONS), std::end(LOOKUP_FUNCTIONS),
+                                   [&name](const LookupFunctionName& function) {
+                                       return function.name == name;
+                                   });
+        if (lookup != std::end(LOOKUP_FUNCTIONS)) {
+            RestoreDeletedRanges(*lookup, args);
+            if (!HasValidArgs(*lookup, args)) {
+                throw ParsingError("Invalid arguments of the function: " + name);
+            }
+            args_.push_back(std::make_unique<LookupExpr>(lookup->function, std::move(args)));
+            return;
+        }
+        auto logical = std::find_if(std::begin(LOGICAL_FUNCTIONS), std::end(LOGICAL_FUNCTIONS),
+                                    [&name](const LogicalFunctionName& function) {
+                                        return function.name == name;
+                                    });
+        if (logical != std::end(LOGICAL_FUNCTIONS)) {
+            RestoreDeletedRanges(*logical, args);
+            if (!HasValidArgs(*logical, args)) {
+                throw ParsingError("Invalid arguments of the function: " + name);
+            }
+            args_.push_back(std::make_unique<LogicalExpr>(logical->function, std::move(args)));
+            return;
+        }
+        auto conditional = std::find_if(std::begin(CONDITIONAL_FUNCTIONS), std::end(CONDITIONAL_FUNCTIONS),
+                                        [&name](const ConditionalFunctionName& function) {
+                                            return function.name == name;
+                                        });
+        if (conditional == std::end(CONDITIONAL_FUNCTIONS)) {
+            throw ParsingError("Unknown function: " + name);
+        }
+        RestoreDeletedRanges(*conditional, args);
+        if (!HasValidArgs(*conditional, args)) {
+            throw ParsingError("Invalid arguments of the function: " + name);
+        }
+        args_.push_back(std::make_unique<ConditionalExpr>(conditional->function, std::move(args)));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
+    // replaces the deleted cells given where the function expects ranges with deleted ranges
+    template <typename FunctionName>
+    void RestoreDeletedRanges(const FunctionName& name, std::vector<std::unique_ptr<Expr>>& args) {
+        for (size_t i = 0; i < args.size(); ++i) {
+            const Position* cell = args[i]->GetCell();
+            if (!cell || cell->IsValid() || ((name.range_args >> i) & 1u) == 0) {
+                continue;
+            }
+            // the deleted cell is not referenced anymore
+            for (auto prev = cells_.before_begin(); std::next(prev) != cells_.end(); ++prev) {
+                if (&*std::next(prev) == cell) {
+                    cells_.erase_after(prev);
+                    break;
+                }
+            }
+            ranges_.push_front({Position::NONE, Position::NONE});
+            args[i] = std::make_unique<RangeExpr>(&ranges_.front());
+        }
+    }
+
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -390,7 +1198,8 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto root = listener.MoveRoot();
+    return FormulaAST(std::move(root), listener.MoveCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -402,6 +1211,179 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     }
 }
 
+FormulaAST ParseFormulaAST(const FormulaProgram& program) {
+    using ASTImpl::BinaryOpExpr;
+    using ASTImpl::ComparisonExpr;
+    using ASTImpl::UnaryOpExpr;
+    using OpCode = FormulaProgram::OpCode;
+
+    std::vector<std::unique_ptr<ASTImpl::Expr>> args;
+    std::forward_list<Position> cells;
+    std::forward_list<Range> ranges;
+    // ranges are popped only by the functions
+    auto pop_arg = [&args]() {
+        if (args.empty() || args.back()->GetRange()) {
+            throw FormulaException("Invalid formula program");
+        }
+        auto arg = std::move(args.back());
+        args.pop_back();
+        return arg;
+    };
+
+    for (const auto& instruction : program.code) {
+        switch (instruction.code) {
+            case OpCode::Number:
+                if (instruction.arg >= program.constants.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                args.push_back(std::make_unique<ASTImpl::NumberExpr>(program.constants[instruction.arg]));
+                break;
+            case OpCode::Cell:
+                if (instruction.arg >= program.cells.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                cells.push_front(program.cells[instruction.arg]);
+                args.push_back(std::make_unique<ASTImpl::CellExpr>(&cells.front()));
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide: {
+                auto rhs = pop_arg();
+                auto lhs = pop_arg();
+                BinaryOpExpr::Type type = instruction.code == OpCode::Add        ? BinaryOpExpr::Add
+                                        : instruction.code == OpCode::Subtract   ? BinaryOpExpr::Subtract
+                                        : instruction.code == OpCode::Multiply   ? BinaryOpExpr::Multiply
+                                                                                 : BinaryOpExpr::Divide;
+                args.push_back(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+                break;
+            }
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Less:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual: {
+                auto rhs = pop_arg();
+                auto lhs = pop_arg();
+                // the comparison opcodes follow in the order of the types
+                const auto type = static_cast<ComparisonExpr::Type>(static_cast<std::uint8_t>(instruction.code)
+                                                                    - static_cast<std::uint8_t>(OpCode::Equal));
+                args.push_back(std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs)));
+                break;
+            }
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus: {
+                auto operand = pop_arg();
+                UnaryOpExpr::Type type = instruction.code == OpCode::UnaryMinus ? UnaryOpExpr::UnaryMinus
+                                                                                : UnaryOpExpr::UnaryPlus;
+                args.push_back(std::make_unique<UnaryOpExpr>(type, std::move(operand)));
+                break;
+            }
+            case OpCode::Range: {
+                if (program.cells.size() < 2 || instruction.arg > program.cells.size() - 2) {
+                    throw FormulaException("Invalid formula program");
+                }
+                const Range range{program.cells[instruction.arg], program.cells[instruction.arg + 1]};
+                // the range which cells were deleted is kept as #REF!
+                const bool deleted = range.from == Position::NONE && range.to == Position::NONE;
+                if (!deleted && (!range.IsValid() || range.GetCellCount() > ASTImpl::MAX_RANGE_CELLS)) {
+                    throw FormulaException("Invalid formula program");
+                }
+                ranges.push_front(range);
+                args.push_back(std::make_unique<ASTImpl::RangeExpr>(&ranges.front()));
+                break;
+            }
+            case OpCode::Sum:
+            case OpCode::Count:
+            case OpCode::Average:
+            case OpCode::Min:
+            case OpCode::Max: {
+                if (instruction.arg == 0 || instruction.arg > args.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                std::vector<std::unique_ptr<ASTImpl::Expr>> function_args(
+                    std::make_move_iterator(args.end() - instruction.arg), std::make_move_iterator(args.end()));
+                args.resize(args.size() - instruction.arg);
+                const auto& name = *std::find_if(std::begin(ASTImpl::FUNCTIONS), std::end(ASTImpl::FUNCTIONS),
+                                                 [&instruction](const ASTImpl::FunctionName& function) {
+                                                     return function.code == instruction.code;
+                                                 });
+                args.push_back(std::make_unique<ASTImpl::AggregateExpr>(name.function, std::move(function_args)));
+                break;
+            }
+            case OpCode::Match:
+            case OpCode::VLookup:
+            case OpCode::XLookup: {
+                if (instruction.arg > args.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                std::vector<std::unique_ptr<ASTImpl::Expr>> function_args(
+                    std::make_move_iterator(args.end() - instruction.arg), std::make_move_iterator(args.end()));
+                args.resize(args.size() - instruction.arg);
+                const auto& name = *std::find_if(std::begin(ASTImpl::LOOKUP_FUNCTIONS),
+                                                 std::end(ASTImpl::LOOKUP_FUNCTIONS),
+                                                 [&instruction](const ASTImpl::LookupFunctionName& function) {
+                                                     return function.code == instruction.code;
+                                                 });
+                if (!ASTImpl::HasValidArgs(name, function_args)) {
+                    throw FormulaException("Invalid formula program");
+                }
+                args.push_back(std::make_unique<ASTImpl::LookupExpr>(name.function, std::move(function_args)));
+                break;
+            }
+            case OpCode::SumIf:
+            case OpCode::CountIf:
+            case OpCode::AverageIf: {
+                if (instruction.arg > args.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                std::vector<std::unique_ptr<ASTImpl::Expr>> function_args(
+                    std::make_move_iterator(args.end() - instruction.arg), std::make_move_iterator(args.end()));
+                args.resize(args.size() - instruction.arg);
+                const auto& name = *std::find_if(std::begin(ASTImpl::CONDITIONAL_FUNCTIONS),
+                                                 std::end(ASTImpl::CONDITIONAL_FUNCTIONS),
+                                                 [&instruction](const ASTImpl::ConditionalFunctionName& function) {
+                                                     return function.code == instruction.code;
+                                                 });
+                if (!ASTImpl::HasValidArgs(name, function_args)) {
+                    throw FormulaException("Invalid formula program");
+                }
+                args.push_back(std::make_unique<ASTImpl::ConditionalExpr>(name.function, std::move(function_args)));
+                break;
+            }
+            case OpCode::If:
+            case OpCode::And:
+            case OpCode::Or:
+            case OpCode::Not: {
+                if (instruction.arg > args.size()) {
+                    throw FormulaException("Invalid formula program");
+                }
+                std::vector<std::unique_ptr<ASTImpl::Expr>> function_args(
+                    std::make_move_iterator(args.end() - instruction.arg), std::make_move_iterator(args.end()));
+                args.resize(args.size() - instruction.arg);
+                const auto& name = *std::find_if(std::begin(ASTImpl::LOGICAL_FUNCTIONS),
+                                                 std::end(ASTImpl::LOGICAL_FUNCTIONS),
+                                                 [&instruction](const ASTImpl::LogicalFunctionName& function) {
+                                                     return function.code == instruction.code;
+                                                 });
+                if (!ASTImpl::HasValidArgs(name, function_args)) {
+                    throw FormulaException("Invalid formula program");
+                }
+                args.push_back(std::make_unique<ASTImpl::LogicalExpr>(name.function, std::move(function_args)));
+                break;
+            }
+            default:
+                throw FormulaException("Invalid formula program");
+        }
+    }
+    // a range is not a value of a formula
+    if (args.size() != 1 || args.front()->GetRange()) {
+        throw FormulaException("Invalid formula program");
+    }
+    return FormulaAST(std::move(args.front()), std::move(cells), std::move(ranges));
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
         out << cell.ToString() << ' ';
@@ -416,14 +1398,60 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(GetValue& get_value) const {
-    return root_expr_->Evaluate(get_value);
+double FormulaAST::Execute(const GetValue& get_value, const RangeFunctions& ranges) const {
+    return root_expr_->Evaluate(get_value, ranges);
+}
+
+// checks whether some of the nodes may be left unevaluated
+bool FormulaAST::HasBranches() const {
+    return root_expr_->HasBranches();
+}
+
+// returns the size of the nodes of the tree
+size_t FormulaAST::GetNodesMemoryUsage() const {
+    return root_expr_->GetMemoryUsage();
+}
+
+// returns the size of the nodes of the cell list
+size_t FormulaAST::GetCellsMemoryUsage() const {
+    // a node holds the link to the next node and the position
+    return std::distance(cells_.begin(), cells_.end()) * (sizeof(void*) + sizeof(Position))
+           + std::distance(ranges_.begin(), ranges_.end()) * (sizeof(void*) + sizeof(Range));
+}
+
+// moves the cells and the ranges the formula refers to, the positions are
+// changed in the nodes of the lists, so the tree is not built again
+bool FormulaAST::ApplyLayoutChange(const LayoutChange& change) {
+    bool moved = false;
+    for (Position& cell : cells_) {
+        const Position new_cell = change.Apply(cell);
+        moved = moved || !(new_cell == cell);
+        cell = new_cell;
+    }
+    for (Range& range : ranges_) {
+        const Range new_range = change.Apply(range);
+        moved = moved || !(new_range == range);
+        range = new_range;
+    }
+    // the deleted cells go first; sorting relinks the nodes, so they do not move
+    cells_.sort();
+    ranges_.sort();
+    return moved;
+}
+
+FormulaProgram FormulaAST::Compile() const {
+    FormulaProgram program;
+    root_expr_->Compile(program);
+    return program;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<Range> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    ranges_.sort();
 }
 
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
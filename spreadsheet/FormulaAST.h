@@ -2,6 +2,8 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
+#include "program.h"
 
 #include <forward_list>
 #include <functional>
@@ -20,15 +22,29 @@ using GetValue = std::function<double(const Position)>;
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+                        std::forward_list<Position> cells,
+                        std::forward_list<Range> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(GetValue& get_value) const;
+    double Execute(const GetValue& get_value, const RangeFunctions& ranges) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // translates the tree into the flat postfix program
+    FormulaProgram Compile() const;
+    // checks whether some of the nodes may be left unevaluated: the branches
+    // of IF and the arguments of AND and OR after the deciding one
+    bool HasBranches() const;
+    // returns the size of the nodes of the tree
+    size_t GetNodesMemoryUsage() const;
+    // returns the size of the nodes of the cell list
+    size_t GetCellsMemoryUsage() const;
+    // moves the cells and the ranges the formula refers to as the change moves
+    // the lines of the sheet, the nodes of the tree keep pointing to them;
+    // returns false if none of them moved
+    bool ApplyLayoutChange(const LayoutChange& change);
 
     std::forward_list<Position>& GetCells() {
         return cells_;
@@ -38,12 +54,24 @@ public:
         return cells_;
     }
 
+    std::forward_list<Range>& GetRanges() {
+        return ranges_;
+    }
+
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
     // the list of cell indexes that occur in the formula
     std::forward_list<Position> cells_;
+    // the list of the ranges aggregated or searched by the functions of the formula
+    std::forward_list<Range> ranges_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+// rebuilds the tree from the compiled program without parsing the text
+FormulaAST ParseFormulaAST(const FormulaProgram& program);
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "aggregate.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr double INF = std::numeric_limits<double>::infinity();
+
+size_t ToIndex(FormulaError::Category category) {
+    return static_cast<size_t>(category);
+}
+
+// reads the value of the cell, a missing cell is empty
+AggregateInput ReadInput(const SheetInterface& sheet, Position pos) {
+    const CellInterface* cell = sheet.GetCell(pos);
+    return cell ? AggregateInput::FromValue(cell->GetValueView()) : AggregateInput{};
+}
+}  // namespace
+
+// texts are converted to numbers as they are in formulas, an empty text is an empty cell
+AggregateInput AggregateInput::FromValue(const CellInterface::ValueView& value) {
+    AggregateInput input;
+    if (const auto* error = std::get_if<FormulaError>(&value)) {
+        input.kind = Kind::Error;
+        input.error = error->GetCategory();
+    } else if (const auto* number = std::get_if<double>(&value)) {
+        input.kind = Kind::Number;
+        input.number = *number;
+    } else if (const auto text = std::get<std::string_view>(value); !text.empty()) {
+        if (auto number = TextToNumber(text)) {
+            input.kind = Kind::Number;
+            input.number = *number;
+        } else {
+            input.kind = Kind::Text;
+        }
+    }
+    return input;
+}
+
+// class AggregateValue methods
+void AggregateValue::Add(const AggregateInput& input) {
+    switch (input.kind) {
+        case AggregateInput::Kind::Number:
+            AddToSum(input.number);
+            ++count_;
+            min_ = std::min(min_, input.number);
+            max_ = std::max(max_, input.number);
+            break;
+        case AggregateInput::Kind::Text:
+            ++errors_[ToIndex(FormulaError::Category::Value)];
+            break;
+        case AggregateInput::Kind::Error:
+            ++errors_[ToIndex(input.error)];
+            break;
+        case AggregateInput::Kind::Empty:
+            break;
+    }
+}
+
+// removes the input added before, the extremes are not changed
+void AggregateValue::Remove(const AggregateInput& input) {
+    switch (input.kind) {
+        case AggregateInput::Kind::Number:
+            AddToSum(-input.number);
+            --count_;
+            break;
+        case AggregateInput::Kind::Text:
+            --errors_[ToIndex(FormulaError::Category::Value)];
+            break;
+        case AggregateInput::Kind::Error:
+            --errors_[ToIndex(input.error)];
+            break;
+        case AggregateInput::Kind::Empty:
+            break;
+    }
+}
+
+void AggregateValue::Merge(const AggregateValue& other) {
+    AddToSum(other.sum_);
+    AddToSum(other.compensation_);
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    for (size_t i = 0; i < errors_.size(); ++i) {
+        errors_[i] += other.errors_[i];
+    }
+}
+
+void AggregateValue::SetExtremes(double min, double max) {
+    min_ = min;
+    max_ = max;
+}
+
+// checks that the sum can be updated further
+bool AggregateValue::IsFinite() const {
+    return std::isfinite(sum_) && std::isfinite(compensation_);
+}
+
+// returns the result of the function, throws FormulaError
+double AggregateValue::GetResult(AggregateFunction function) const {
+    if (function == AggregateFunction::Count) {
+        return static_cast<double>(count_);
+    }
+    for (size_t i = 0; i < errors_.size(); ++i) {
+        if (errors_[i] > 0) {
+            throw FormulaError(static_cast<FormulaError::Category>(i));
+        }
+    }
+
+    double result = 0.0;
+    switch (function) {
+        case AggregateFunction::Sum:
+            result = sum_ + compensation_;
+            break;
+        case AggregateFunction::Average:
+            if (count_ == 0) {
+                throw FormulaError(FormulaError::Category::Arithmetic);
+            }
+            result = (sum_ + compensation_) / static_cast<double>(count_);
+            break;
+        case AggregateFunction::Min:
+            result = count_ > 0 ? min_ : 0.0;
+            break;
+        case AggregateFunction::Max:
+            result = count_ > 0 ? max_ : 0.0;
+            break;
+        case AggregateFunction::Count:
+            break;
+    }
+    return std::isfinite(result) ? result : throw FormulaError(FormulaError::Category::Arithmetic);
+}
+
+// the sum is compensated by the Neumaier algorithm
+void AggregateValue::AddToSum(double number) {
+    const double sum = sum_ + number;
+    if (std::abs(sum_) >= std::abs(number)) {
+        compensation_ += (sum_ - sum) + number;
+    } else {
+        compensation_ += (number - sum) + sum_;
+    }
+    sum_ = sum;
+}
+
+// aggregates the values of the cells of the range read from the sheet
+AggregateValue AggregateRange(const SheetInterface& sheet, const Range& range) {
+    AggregateValue value;
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            value.Add(ReadInput(sheet, {row, col}));
+        }
+    }
+    return value;
+}
+
+// class RangeAggregator methods
+RangeAggregator::RangeAggregator(Range range) : range_{range} {
+}
+
+const Range& RangeAggregator::GetRange() const {
+    return range_;
+}
+
+// records the change of the cell of the range, old_value is nullopt if it is unknown
+void RangeAggregator::RecordChange(Position pos, std::optional<AggregateInput> old_value) {
+    if (!valid_) {
+        return;
+    }
+    // applying more changes than there are cells costs more than computing the aggregate again
+    if (!old_value || changes_.size() >= range_.GetCellCount()) {
+        valid_ = false;
+        changes_.clear();
+        return;
+    }
+    changes_.push_back({pos, *old_value});
+}
+
+// returns the aggregate of the current values of the cells
+AggregateValue RangeAggregator::Get(const SheetInterface& sheet, bool extremes) {
+    const bool has_tree = !tree_.empty();
+    if (!valid_ || (extremes && !has_tree) || updates_ + changes_.size() > range_.GetCellCount()) {
+        Build(sheet, extremes || has_tree);
+    } else if (!changes_.empty()) {
+        ApplyChanges(sheet);
+        if (!totals_.IsFinite()) {
+            // the sum overflowed, it cannot be restored by subtracting the number
+            Build(sheet, has_tree);
+        }
+    }
+
+    AggregateValue value = totals_;
+    if (!tree_.empty()) {
+        value.SetExtremes(tree_[1].min, tree_[1].max);
+    }
+    return value;
+}
+
+// returns the size of the buffers of the aggregator
+size_t RangeAggregator::GetMemoryUsage() const {
+    return tree_.capacity() * sizeof(Extremes) + changes_.capacity() * sizeof(changes_.front());
+}
+
+// computes the aggregate from all cells of the range
+void RangeAggregator::Build(const SheetInterface& sheet, bool extremes) {
+    const size_t count = range_.GetCellCount();
+    totals_ = {};
+    changes_.clear();
+    updates_ = 0;
+    valid_ = true;
+    if (extremes) {
+        tree_.assign(2 * count, {INF, -INF});
+    } else {
+        tree_.clear();
+        tree_.shrink_to_fit();
+    }
+
+    size_t index = count;
+    for (int row = range_.from.row; row <= range_.to.row; ++row) {
+        for (int col = range_.from.col; col <= range_.to.col; ++col, ++index) {
+            const AggregateInput input = ReadInput(sheet, {row, col});
+            totals_.Add(input);
+            if (extremes && input.kind == AggregateInput::Kind::Number) {
+                tree_[index] = {input.number, input.number};
+            }
+        }
+    }
+    if (extremes) {
+        for (size_t node = count - 1; node > 0; --node) {
+            tree_[node] = {std::min(tree_[2 * node].min, tree_[2 * node + 1].min),
+                           std::max(tree_[2 * node].max, tree_[2 * node + 1].max)};
+        }
+    }
+}
+
+// applies the recorded changes
+void RangeAggregator::ApplyChanges(const SheetInterface& sheet) {
+    // the first change of a cell holds the value the aggregate knows, the new
+    // value is read once
+    std::stable_sort(changes_.begin(), changes_.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    const int cols = range_.GetSize().cols;
+    for (size_t i = 0; i < changes_.size();) {
+        const Position pos = changes_[i].first;
+        const AggregateInput input = ReadInput(sheet, pos);
+        totals_.Remove(changes_[i].second);
+        totals_.Add(input);
+        if (!tree_.empty()) {
+            UpdateTree(static_cast<size_t>(pos.row - range_.from.row) * cols + (pos.col - range_.from.col), input);
+        }
+        ++updates_;
+        while (i < changes_.size() && changes_[i].first == pos) {
+            ++i;
+        }
+    }
+    changes_.clear();
+}
+
+// sets the leaf of the cell of the range and updates the tree above it
+void RangeAggregator::UpdateTree(size_t index, const AggregateInput& input) {
+    size_t node = tree_.size() / 2 + index;
+    if (input.kind == AggregateInput::Kind::Number) {
+        tree_[node] = {input.number, input.number};
+    } else {
+        tree_[node] = {INF, -INF};
+    }
+    for (node /= 2; node > 0; node /= 2) {
+        tree_[node] = {std::min(tree_[2 * node].min, tree_[2 * node + 1].min),
+                       std::max(tree_[2 * node].max, tree_[2 * node + 1].max)};
+    }
+}
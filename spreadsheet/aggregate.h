@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// The functions which aggregate the numbers of their arguments
+enum class AggregateFunction : std::uint8_t {
+    Sum,
+    Count,
+    Average,
+    Min,
+    Max,
+};
+
+// The value of a cell as an input of the aggregate functions
+struct AggregateInput {
+    enum class Kind : std::uint8_t {
+        Empty,
+        Number,
+        Text,  // a text which is not a number
+        Error,
+    };
+
+    Kind kind = Kind::Empty;
+    double number = 0.0;
+    FormulaError::Category error = FormulaError::Category::Ref;
+
+    // texts are converted to numbers as they are in formulas, an empty text is an empty cell
+    static AggregateInput FromValue(const CellInterface::ValueView& value);
+};
+
+// The inputs of an aggregate function combined: the sum of the numbers,
+// their count and extremes, and the number of errors of every category.
+// The sum is compensated, so adding and removing the same numbers many
+// times does not accumulate the rounding errors. The texts which are not
+// numbers are #VALUE! errors, the empty cells are skipped.
+class AggregateValue {
+public:
+    void Add(const AggregateInput& input);
+    // removes the input added before, the extremes are not changed
+    void Remove(const AggregateInput& input);
+    void Merge(const AggregateValue& other);
+    void SetExtremes(double min, double max);
+
+    // checks that the sum can be updated further
+    bool IsFinite() const;
+    // returns the result of the function, throws FormulaError: COUNT counts the
+    // numbers only, other functions return the error of the first category
+    // found among the inputs
+    double GetResult(AggregateFunction function) const;
+
+private:
+    void AddToSum(double number);
+
+    double sum_ = 0.0;
+    double compensation_ = 0.0;
+    size_t count_ = 0;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+    std::array<size_t, 3> errors_{};
+};
+
+// returns the aggregate of the cells of the range, the extremes are needed for MIN and MAX
+using GetRangeValue = std::function<AggregateValue(const Range& range, bool extremes)>;
+
+// aggregates the values of the cells of the range read from the sheet
+AggregateValue AggregateRange(const SheetInterface& sheet, const Range& range);
+
+// Keeps the aggregate of a range of a sheet up to date. A change of a cell
+// is recorded with the value the cell had before it and is applied on the
+// next read, when the new value is known: the sum and the counts are
+// updated in O(1), the extremes are kept in a segment tree, which is built
+// on the first request of them and updated in O(log n). The aggregate is
+// computed again from all cells when the old value of a changed cell is
+// unknown, when the changes outnumber the cells, and periodically, so that
+// the sum does not drift.
+class RangeAggregator {
+public:
+    explicit RangeAggregator(Range range);
+
+    const Range& GetRange() const;
+    // records the change of the cell of the range, old_value is nullopt if it is unknown
+    void RecordChange(Position pos, std::optional<AggregateInput> old_value);
+    // returns the aggregate of the current values of the cells, the extremes are
+    // set only if they are requested
+    AggregateValue Get(const SheetInterface& sheet, bool extremes);
+    // returns the size of the buffers of the aggregator
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Extremes {
+        double min;
+        double max;
+    };
+
+    // computes the aggregate from all cells of the range
+    void Build(const SheetInterface& sheet, bool extremes);
+    // applies the recorded changes
+    void ApplyChanges(const SheetInterface& sheet);
+    // sets the leaf of the cell of the range and updates the tree above it
+    void UpdateTree(size_t index, const AggregateInput& input);
+
+    Range range_;
+    bool valid_ = false;
+    AggregateValue totals_;
+    // the leaves hold the numbers of the cells in the row-major order, a
+    // node holds the extremes of its children
+    std::vector<Extremes> tree_;
+    // the changed cells with their values before the change
+    std::vector<std::pair<Position, AggregateInput>> changes_;
+    // the number of the changes applied since the aggregate was computed
+    size_t updates_ = 0;
+};
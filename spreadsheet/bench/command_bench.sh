@@ -0,0 +1,39 @@
+#!/bin/sh
+# Generates a replayable command script and compares the time of executing it
+# line by line with SheetHandle and with the block mode (--fast).
+# usage: command_bench.sh [spreadsheet binary] [lines] [script path]
+set -e
+
+BINARY=${1:-./spreadsheet}
+LINES=${2:-1000000}
+SCRIPT=${3:-command_bench.txt}
+
+# 20 columns: column A holds numbers, the others refer to the previous column;
+# every 100000 lines the values of the first row are printed
+awk -v lines="$LINES" 'BEGIN {
+    for (i = 0; i < lines; ++i) {
+        row = int(i / 20) % 16384 + 1
+        col = i % 20
+        if (col == 0) {
+            printf "set A%d %d\n", row, i % 1000
+        } else {
+            printf "set %c%d =%c%d*2+1\n", 65 + col, row, 64 + col, row
+        }
+        if (i % 100000 == 99999) {
+            print "clear A1"
+        }
+    }
+    print "print values"
+    print "exit"
+}' > "$SCRIPT"
+
+measure() {
+    start=$(date +%s.%N)
+    "$BINARY" "$@" < "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    awk -v start="$start" -v end="$end" 'BEGIN { print end - start }'
+}
+
+printf 'lines\t%s\n' "$LINES"
+printf 'line_mode_seconds\t%s\n' "$(measure)"
+printf 'fast_mode_seconds\t%s\n' "$(measure --fast)"
@@ -0,0 +1,125 @@
+// Load generator for the sheet server: several clients send a mix of reads
+// and writes and the latency of every request is measured.
+// usage: server_load socket [clients] [requests per client] [write percent]
+// The clients fill 1000 rows of 10 cells first: column A holds numbers,
+// the other columns refer to the previous one.
+
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr int ROWS = 1000;
+constexpr int COLS = 10;
+
+double Percentile(std::vector<double>& latencies, double fraction) {
+    if (latencies.empty()) {
+        return 0.0;
+    }
+    const size_t index = std::min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()));
+    std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index];
+}
+
+void PrintLatencies(const std::string& name, std::vector<double>& latencies) {
+    std::cout << name << "_requests\t" << latencies.size() << '\n'
+              << name << "_p50_us\t" << Percentile(latencies, 0.50) << '\n'
+              << name << "_p99_us\t" << Percentile(latencies, 0.99) << '\n'
+              << name << "_p999_us\t" << Percentile(latencies, 0.999) << '\n';
+}
+
+std::string MakeText(Position pos, int value) {
+    if (pos.col == 0) {
+        return std::to_string(value);
+    }
+    return "=" + Position{pos.row, pos.col - 1}.ToString() + "+1";
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: server_load socket [clients] [requests per client] [write percent]" << std::endl;
+        return 1;
+    }
+    const std::string socket_path = argv[1];
+    const int clients = argc > 2 ? std::atoi(argv[2]) : 8;
+    const int requests = argc > 3 ? std::atoi(argv[3]) : 20000;
+    const int write_percent = argc > 4 ? std::atoi(argv[4]) : 10;
+
+    {
+        SheetClient client(socket_path);
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                client.SetCell({row, col}, MakeText({row, col}, row));
+            }
+        }
+    }
+
+    std::vector<std::vector<double>> reads(clients);
+    std::vector<std::vector<double>> ranges(clients);
+    std::vector<std::vector<double>> writes(clients);
+    std::vector<std::thread> threads;
+    const auto start = Clock::now();
+    for (int i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i] {
+            SheetClient client(socket_path);
+            std::mt19937 random(i);
+            std::uniform_int_distribution<int> percent(0, 99);
+            std::uniform_int_distribution<int> row(0, ROWS - 1);
+            std::uniform_int_distribution<int> col(0, COLS - 1);
+            for (int request = 0; request < requests; ++request) {
+                const int kind = percent(random);
+                const Position pos{row(random), col(random)};
+                const auto request_start = Clock::now();
+                std::vector<double>* latencies;
+                if (kind < write_percent) {
+                    // writes of column A change the whole row
+                    client.SetCell({pos.row, 0}, MakeText({pos.row, 0}, request));
+                    latencies = &writes[i];
+                } else if (kind < write_percent + 5) {
+                    client.GetValues({pos.row, 0}, {std::min(10, ROWS - pos.row), COLS});
+                    latencies = &ranges[i];
+                } else {
+                    client.GetValue(pos);
+                    latencies = &reads[i];
+                }
+                latencies->push_back(std::chrono::duration<double, std::micro>(Clock::now() - request_start).count());
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    auto merge = [](std::vector<std::vector<double>>& parts) {
+        std::vector<double> result;
+        for (auto& part : parts) {
+            result.insert(result.end(), part.begin(), part.end());
+        }
+        return result;
+    };
+    auto read_latencies = merge(reads);
+    auto range_latencies = merge(ranges);
+    auto write_latencies = merge(writes);
+    std::vector<double> all_latencies = read_latencies;
+    all_latencies.insert(all_latencies.end(), range_latencies.begin(), range_latencies.end());
+    all_latencies.insert(all_latencies.end(), write_latencies.begin(), write_latencies.end());
+
+    std::cout << "clients\t" << clients << '\n'
+              << "requests_per_second\t" << all_latencies.size() / seconds << '\n';
+    PrintLatencies("all", all_latencies);
+    PrintLatencies("get_value", read_latencies);
+    PrintLatencies("get_range", range_latencies);
+    PrintLatencies("set", write_latencies);
+    std::cout.flush();
+}
@@ -0,0 +1,563 @@
+// Benchmark of the sheet operations on synthetic workloads.
+// usage: sheet_bench [--scale factor] [--filter workload] [--output file]
+// Results are tab separated values with a header line:
+//     workload, cells, operation, count, seconds, ns_per_op
+// so that the results of different runs can be joined and compared.
+// The "memory" row reports in count the bytes used by the sheet with all
+// values cached; its time is the time of the accounting. The "tick" row
+// changes single inputs and reads the watched cells after every change.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+using Texts = std::vector<std::pair<Position, std::string>>;
+
+struct Workload {
+    explicit Workload(std::string workload_name) : name{std::move(workload_name)} {
+    }
+
+    std::string name;
+    Texts cells;
+    // setting the source to refer to the sink makes a cycle; NONE if the workload has no such pair
+    Position source = Position::NONE;
+    Position sink = Position::NONE;
+    // the cells read after every change of a single input, as a ticking dashboard does
+    std::vector<Position> watched;
+    // the number of the changes made before the watched cells are read
+    size_t burst = 1;
+    RecalculationMode recalculation = RecalculationMode::Lazy;
+};
+
+std::string Ref(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// the suffix of the names of the workloads run in several recalculation modes
+std::string GetModeName(RecalculationMode recalculation) {
+    switch (recalculation) {
+        case RecalculationMode::Lazy:
+            return "lazy";
+        case RecalculationMode::Eager:
+            return "eager";
+        case RecalculationMode::Validating:
+            return "validating";
+    }
+    return {};
+}
+
+// a grid where every formula refers to the cell above and the cell on the left
+Workload DenseGrid(int rows, int cols) {
+    Workload workload("dense_grid");
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            if (row == 0 || col == 0) {
+                workload.cells.push_back({{row, col}, std::to_string(row + col)});
+            } else {
+                workload.cells.push_back({{row, col}, "=" + Ref(row - 1, col) + "+" + Ref(row, col - 1) + "/2"});
+            }
+        }
+    }
+    workload.source = {0, 1};
+    workload.sink = {rows - 1, cols - 1};
+    return workload;
+}
+
+// every cell refers to the previous one, the chain goes down the columns
+Workload LongChain(int length) {
+    Workload workload("long_chain");
+    Position previous{0, 0};
+    workload.cells.push_back({previous, "1"});
+    for (int i = 1; i < length; ++i) {
+        const Position pos{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+        workload.cells.push_back({pos, "=" + previous.ToString() + "+1"});
+        previous = pos;
+    }
+    workload.source = {0, 0};
+    workload.sink = previous;
+    return workload;
+}
+
+// sum cells, each referring to the same group of inputs
+Workload WideFanIn(int inputs, int sums) {
+    Workload workload("wide_fan_in");
+    std::string formula = "=";
+    for (int row = 0; row < inputs; ++row) {
+        workload.cells.push_back({{row, 0}, std::to_string(row)});
+        formula += (row ? "+" : "") + Ref(row, 0);
+    }
+    for (int i = 0; i < sums; ++i) {
+        workload.cells.push_back({{i, 1}, formula});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 1};
+    return workload;
+}
+
+// many formulas referring to one cell
+Workload WideFanOut(int dependents) {
+    Workload workload("wide_fan_out");
+    workload.cells.push_back({{0, 0}, "1"});
+    for (int i = 0; i < dependents; ++i) {
+        workload.cells.push_back({{i % Position::MAX_ROWS, 1 + i / Position::MAX_ROWS}, "=A1*" + std::to_string(i)});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 1};
+    return workload;
+}
+
+// a table with input columns and formula columns filled down, as after copying one row
+Workload FilledDown(int rows) {
+    Workload workload("filled_down");
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        workload.cells.push_back({{row, 0}, std::to_string(row % 97)});
+        workload.cells.push_back({{row, 1}, std::to_string(row % 13 + 1)});
+        workload.cells.push_back({{row, 2}, "=A" + r + "*B" + r});
+        workload.cells.push_back({{row, 3}, "=C" + r + "-A" + r + "/B" + r});
+        workload.cells.push_back({{row, 4}, row ? "=E" + std::to_string(row) + "+D" + r : "=D1"});
+    }
+    workload.source = {0, 0};
+    workload.sink = {rows - 1, 4};
+    return workload;
+}
+
+// formulas producing and propagating errors: division by zero and text operands
+Workload ErrorHeavy(int rows) {
+    Workload workload("error_heavy");
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        workload.cells.push_back({{row, 0}, row % 3 ? "0" : "text"});
+        if (row == 0) {
+            workload.cells.push_back({{0, 4}, "=1/0"});
+        }
+        workload.cells.push_back({{row, 1}, "=1/A" + r});
+        workload.cells.push_back({{row, 2}, "=B" + r + "+A" + r});
+        workload.cells.push_back({{row, 3}, row % 5 ? "=C" + r + "*2" : "=C" + r + "+E1"});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 3};
+    return workload;
+}
+
+// aggregates of one block of inputs, ten columns wide
+Workload RangeAggregates(int rows) {
+    Workload workload("range_aggregates");
+    constexpr int COLS = 10;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            workload.cells.push_back({{row, col}, std::to_string((row * COLS + col) % 1000)});
+        }
+    }
+    const std::string range = "(A1:" + Ref(rows - 1, COLS - 1) + ")";
+    int row = 0;
+    for (const char* function : {"SUM", "AVERAGE", "MIN", "MAX"}) {
+        workload.cells.push_back({{row, COLS}, "=" + std::string(function) + range});
+        workload.watched.push_back({row++, COLS});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, COLS};
+    return workload;
+}
+
+// lookups of keys in a table of two columns, by exact and approximate matches
+Workload Lookups(int rows, int lookups) {
+    Workload workload("lookups");
+    rows = std::min(rows, Position::MAX_ROWS);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.push_back({{row, 0}, std::to_string(row * 2)});
+        workload.cells.push_back({{row, 1}, std::to_string(row % 1000)});
+    }
+    const std::string last = std::to_string(rows);
+    const std::string table = "A1:B" + last;
+    for (int i = 0; i < lookups; ++i) {
+        const std::string key = Ref(i, 2);
+        workload.cells.push_back({{i, 2}, std::to_string(i * 97 % rows)});
+        std::string formula;
+        switch (i % 3) {
+            case 0:
+                formula = "=VLOOKUP(" + key + "," + table + ",2,0)";
+                break;
+            case 1:
+                formula = "=MATCH(" + key + ",A1:A" + last + ")";
+                break;
+            default:
+                formula = "=XLOOKUP(" + key + ",A1:A" + last + ",B1:B" + last + ",-1,1)";
+                break;
+        }
+        workload.cells.push_back({{i, 3}, formula});
+        workload.watched.push_back({i, 3});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 3};
+    return workload;
+}
+
+// conditional aggregates of one table, every formula with its own key
+Workload ConditionalAggregates(int rows, int formulas) {
+    Workload workload("conditional_aggregates");
+    rows = std::min(rows, Position::MAX_ROWS);
+    constexpr int KEYS = 50;
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.push_back({{row, 0}, std::to_string(row % KEYS)});
+        workload.cells.push_back({{row, 1}, std::to_string(row % 1000)});
+    }
+    const std::string last = std::to_string(rows);
+    const std::string criteria = "A1:A" + last;
+    const std::string values = "B1:B" + last;
+    for (int i = 0; i < formulas; ++i) {
+        const std::string key = Ref(i, 2);
+        workload.cells.push_back({{i, 2}, std::to_string(i % KEYS)});
+        std::string formula;
+        switch (i % 3) {
+            case 0:
+                formula = "=SUMIF(" + criteria + "," + key + "," + values + ")";
+                break;
+            case 1:
+                formula = "=COUNTIF(" + criteria + "," + key + ")";
+                break;
+            default:
+                formula = "=AVERAGEIF(" + criteria + "," + key + "," + values + ")";
+                break;
+        }
+        workload.cells.push_back({{i, 3}, formula});
+        workload.watched.push_back({i, 3});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 3};
+    return workload;
+}
+
+// formulas taking a cheap branch, the other branch of every one of them refers
+// to the end of a long chain summing the inputs
+Workload Branches(int rows, int formulas) {
+    Workload workload("branches");
+    rows = std::min(rows, Position::MAX_ROWS);
+    formulas = std::min(formulas, Position::MAX_ROWS);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.push_back({{row, 0}, std::to_string(row % 1000)});
+        workload.cells.push_back({{row, 1}, row == 0 ? "=A1" : "=" + Ref(row - 1, 1) + "+" + Ref(row, 0)});
+    }
+    const std::string model = Ref(rows - 1, 1);
+    for (int i = 0; i < formulas; ++i) {
+        const std::string key = Ref(i, 2);
+        workload.cells.push_back({{i, 2}, std::to_string(i % 1000)});
+        workload.cells.push_back({{i, 3}, "=IF(" + key + ">=0," + key + "*2," + model + "/" + key + ")"});
+        workload.watched.push_back({i, 3});
+    }
+    workload.source = {0, 0};
+    workload.sink = {0, 3};
+    return workload;
+}
+
+// every input is clamped before it is added to a long chain, the changes of the
+// inputs within the clamp bounds do not change the chain
+Workload ClampedChain(int rows, RecalculationMode recalculation) {
+    Workload workload("clamped_chain_" + GetModeName(recalculation));
+    workload.recalculation = recalculation;
+    rows = std::min(rows, Position::MAX_ROWS);
+    for (int row = 0; row < rows; ++row) {
+        workload.cells.push_back({{row, 0}, std::to_string(row % 1000)});
+        workload.cells.push_back({{row, 1}, "=MIN(MAX(" + Ref(row, 0) + ",0),50)"});
+        workload.cells.push_back({{row, 2}, row == 0 ? "=B1" : "=" + Ref(row - 1, 2) + "+" + Ref(row, 1)});
+    }
+    workload.watched.push_back({rows - 1, 2});
+    workload.source = {0, 0};
+    workload.sink = {rows - 1, 2};
+    return workload;
+}
+
+// the clamped chain changed in bursts of writes, the watched cell is read after every burst
+Workload WriteBursts(int rows, RecalculationMode recalculation) {
+    Workload workload = ClampedChain(rows, recalculation);
+    workload.name = "write_bursts_" + GetModeName(recalculation);
+    workload.burst = 100;
+    return workload;
+}
+
+// random numbers, texts and formulas written over a small area, including rejected cycles
+Workload RandomEdits(int edits, unsigned seed) {
+    Workload workload("random_edits");
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> coordinate(0, 99);
+    std::uniform_int_distribution<int> kind(0, 9);
+    for (int i = 0; i < edits; ++i) {
+        const Position pos{coordinate(random), coordinate(random) % 20};
+        const int k = kind(random);
+        std::string text;
+        if (k < 3) {
+            text = std::to_string(coordinate(random));
+        } else if (k < 4) {
+            text = "label";
+        } else if (k < 5) {
+            text.clear();
+        } else {
+            text = "=" + Ref(coordinate(random), coordinate(random) % 20) + "+" + Ref(coordinate(random), coordinate(random) % 20);
+        }
+        workload.cells.push_back({pos, std::move(text)});
+    }
+    return workload;
+}
+
+// the stream buffer which drops everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char_type* /* data */, std::streamsize count) override {
+        return count;
+    }
+};
+
+class Reporter {
+public:
+    explicit Reporter(std::ostream& output) : output_{output} {
+        output_ << "workload\tcells\toperation\tcount\tseconds\tns_per_op\n";
+    }
+
+    // runs the operation, which returns the number of the operations it made, and reports its time
+    void Measure(const Workload& workload, std::string_view operation, const std::function<size_t()>& func) {
+        const auto start = Clock::now();
+        const size_t count = func();
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        output_ << workload.name << '\t' << workload.cells.size() << '\t' << operation << '\t' << count << '\t'
+                << seconds << '\t' << (count ? seconds * 1e9 / count : 0.0) << std::endl;
+    }
+
+private:
+    std::ostream& output_;
+};
+
+void Run(const Workload& workload, Reporter& reporter) {
+    Sheet sheet;
+    sheet.SetRecalculationMode(workload.recalculation);
+    size_t rejected = 0;
+    reporter.Measure(workload, "set", [&] {
+        for (const auto& [pos, text] : workload.cells) {
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                ++rejected;
+            }
+        }
+        return workload.cells.size();
+    });
+
+    // the cells of the sheet in the order of their positions
+    std::vector<Position> positions;
+    for (const auto& [pos, cell] : sheet.GetCells()) {
+        positions.push_back(pos);
+    }
+    std::sort(positions.begin(), positions.end());
+
+    auto get_values = [&] {
+        for (Position pos : positions) {
+            sheet.GetCell(pos)->GetValue();
+        }
+        return positions.size();
+    };
+    reporter.Measure(workload, "get_value_cold", get_values);
+    reporter.Measure(workload, "get_value_warm", get_values);
+
+    // the printable area is read by viewports of 100x50 cells, as a scrolling UI does
+    const Size printable_size = sheet.GetPrintableSize();
+    std::vector<Range> viewports;
+    for (int row = 0; row < printable_size.rows; row += 100) {
+        for (int col = 0; col < printable_size.cols; col += 50) {
+            viewports.push_back({{row, col}, {std::min(row + 99, Position::MAX_ROWS - 1), std::min(col + 49, Position::MAX_COLS - 1)}});
+        }
+    }
+    reporter.Measure(workload, "viewport_cells", [&] {
+        for (const Range& viewport : viewports) {
+            for (int row = viewport.from.row; row <= viewport.to.row; ++row) {
+                for (int col = viewport.from.col; col <= viewport.to.col; ++col) {
+                    if (const CellInterface* cell = sheet.GetCell({row, col})) {
+                        cell->GetValue();
+                    }
+                }
+            }
+        }
+        return viewports.size() * 5000;
+    });
+    RangeValues values;
+    reporter.Measure(workload, "viewport_batch", [&] {
+        for (const Range& viewport : viewports) {
+            sheet.GetValues(viewport, values);
+        }
+        return viewports.size() * 5000;
+    });
+    reporter.Measure(workload, "memory", [&] {
+        return sheet.GetMemoryUsage().GetTotal();
+    });
+
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+    reporter.Measure(workload, "print_values", [&] {
+        sheet.PrintValues(null_output);
+        return size_t{1};
+    });
+
+    if (!workload.watched.empty()) {
+        std::vector<Position> inputs;
+        for (const auto& [pos, text] : workload.cells) {
+            if (text.empty() || text[0] != '=') {
+                inputs.push_back(pos);
+            }
+        }
+        std::mt19937 random(7);
+        reporter.Measure(workload, "tick", [&] {
+            constexpr size_t TICKS = 1000;
+            for (size_t i = 0; i < TICKS; ++i) {
+                sheet.SetCell(inputs[random() % inputs.size()], std::to_string(random() % 1000));
+                if ((i + 1) % workload.burst != 0) {
+                    continue;
+                }
+                for (Position pos : workload.watched) {
+                    sheet.GetCell(pos)->GetValue();
+                }
+            }
+            return TICKS;
+        });
+        // a polling client takes the changes after every write instead of printing the whole sheet
+        reporter.Measure(workload, "tick_diff", [&] {
+            constexpr size_t TICKS = 1000;
+            std::uint64_t version = sheet.GetValueChanges(0).version;
+            for (size_t i = 0; i < TICKS; ++i) {
+                sheet.SetCell(inputs[random() % inputs.size()], std::to_string(random() % 1000));
+                const ValueChanges changes = sheet.GetValueChanges(version);
+                for (Position pos : changes.cells) {
+                    sheet.GetCell(pos)->GetValue();
+                }
+                version = changes.version;
+            }
+            return TICKS;
+        });
+        // a pushed client is notified of the changed watched values instead of polling them
+        std::vector<SubscriptionId> subscriptions;
+        size_t notified = 0;
+        for (Position pos : workload.watched) {
+            subscriptions.push_back(sheet.Subscribe(Range::FromCorners(pos, pos), [&notified](const std::vector<ValueEvent>& events) {
+                notified += events.size();
+            }));
+        }
+        reporter.Measure(workload, "tick_subscribed", [&] {
+            constexpr size_t TICKS = 1000;
+            for (size_t i = 0; i < TICKS; ++i) {
+                sheet.SetCell(inputs[random() % inputs.size()], std::to_string(random() % 1000));
+            }
+            return TICKS;
+        });
+        for (SubscriptionId id : subscriptions) {
+            sheet.Unsubscribe(id);
+        }
+    }
+
+    if (workload.source.IsValid()) {
+        const std::string cyclic_formula = "=" + workload.sink.ToString();
+        reporter.Measure(workload, "cycle_rejection", [&] {
+            constexpr size_t ATTEMPTS = 10;
+            for (size_t i = 0; i < ATTEMPTS; ++i) {
+                try {
+                    sheet.SetCell(workload.source, cyclic_formula);
+                } catch (const CircularDependencyException&) {
+                    ++rejected;
+                }
+            }
+            return ATTEMPTS;
+        });
+    }
+
+    // the rows are inserted in the middle of the sheet and deleted again, so the cells below move
+    // twice; a sheet filled to the last row cannot move its cells down
+    constexpr int LAYOUT_CHANGES = 10;
+    if (const int rows = sheet.GetPrintableSize().rows; rows + LAYOUT_CHANGES <= Position::MAX_ROWS) {
+        reporter.Measure(workload, "insert_row", [&] {
+            for (int i = 0; i < LAYOUT_CHANGES; ++i) {
+                sheet.InsertRows(rows / 2);
+            }
+            return size_t{LAYOUT_CHANGES};
+        });
+        reporter.Measure(workload, "delete_row", [&] {
+            for (int i = 0; i < LAYOUT_CHANGES; ++i) {
+                sheet.DeleteRows(rows / 2);
+            }
+            return size_t{LAYOUT_CHANGES};
+        });
+    }
+
+    reporter.Measure(workload, "clear", [&] {
+        for (Position pos : positions) {
+            sheet.ClearCell(pos);
+        }
+        return positions.size();
+    });
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    using namespace std::literals;
+
+    double scale = 1.0;
+    std::string filter;
+    std::string output_path;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (argv[i] == "--scale"sv) {
+            scale = std::atof(argv[i + 1]);
+        } else if (argv[i] == "--filter"sv) {
+            filter = argv[i + 1];
+        } else if (argv[i] == "--output"sv) {
+            output_path = argv[i + 1];
+        }
+    }
+    auto scaled = [scale](int size) {
+        return std::max(2, static_cast<int>(size * scale));
+    };
+
+    // the workloads are generated lazily, so that a filtered run does not build all of them
+    const std::vector<std::function<Workload()>> generators = {
+        // the cycle check of a grid formula visits everything above and to the left of it
+        [&] { return DenseGrid(scaled(100), 50); },
+        // evaluating the chain end recurses through the whole chain
+        [&] { return LongChain(scaled(2000)); },
+        [&] { return WideFanIn(scaled(200), scaled(500)); },
+        [&] { return WideFanOut(scaled(50000)); },
+        [&] { return FilledDown(scaled(2000)); },
+        [&] { return ErrorHeavy(scaled(10000)); },
+        [&] { return RandomEdits(scaled(50000), 42); },
+        [&] { return RangeAggregates(scaled(10000)); },
+        [&] { return Lookups(scaled(16000), 30); },
+        [&] { return ConditionalAggregates(scaled(4000), 200); },
+        [&] { return Branches(scaled(2000), scaled(1000)); },
+        [&] { return ClampedChain(scaled(2000), RecalculationMode::Lazy); },
+        [&] { return ClampedChain(scaled(2000), RecalculationMode::Eager); },
+        [&] { return ClampedChain(scaled(2000), RecalculationMode::Validating); },
+        [&] { return WriteBursts(scaled(2000), RecalculationMode::Lazy); },
+        [&] { return WriteBursts(scaled(2000), RecalculationMode::Validating); },
+    };
+
+    std::ofstream file;
+    if (!output_path.empty()) {
+        file.open(output_path);
+    }
+    Reporter reporter(output_path.empty() ? std::cout : file);
+    for (const auto& generate : generators) {
+        Workload workload = generate();
+        if (filter.empty() || workload.name == filter) {
+            Run(workload, reporter);
+        }
+    }
+}
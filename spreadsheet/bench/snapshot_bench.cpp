@@ -0,0 +1,65 @@
+// Compares loading a sheet from the binary snapshot with replaying
+// the texts of its cells through SetCell.
+// usage: snapshot_bench [rows] [cols] [snapshot path]
+
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// column A holds numbers, every next column refers to the previous one and to column A
+std::vector<std::pair<Position, std::string>> GenerateTexts(int rows, int cols) {
+    std::vector<std::pair<Position, std::string>> texts;
+    texts.reserve(static_cast<size_t>(rows) * cols);
+    for (int row = 0; row < rows; ++row) {
+        texts.push_back({Position{row, 0}, std::to_string(row % 100)});
+        for (int col = 1; col < cols; ++col) {
+            std::string formula = "=" + Position{row, col - 1}.ToString() + "*1.01+"
+                                + Position{row, 0}.ToString();
+            texts.push_back({Position{row, col}, std::move(formula)});
+        }
+    }
+    return texts;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const int rows = argc > 1 ? std::atoi(argv[1]) : 10000;
+    const int cols = argc > 2 ? std::atoi(argv[2]) : 20;
+    const std::string path = argc > 3 ? argv[3] : "snapshot_bench.snapshot";
+
+    const auto texts = GenerateTexts(rows, cols);
+
+    auto start = Clock::now();
+    Sheet sheet;
+    for (const auto& [pos, text] : texts) {
+        sheet.SetCell(pos, text);
+    }
+    const double replay_seconds = SecondsSince(start);
+
+    start = Clock::now();
+    SaveSnapshot(sheet, path);
+    const double save_seconds = SecondsSince(start);
+
+    start = Clock::now();
+    auto loaded = LoadSnapshot(path);
+    const double load_seconds = SecondsSince(start);
+
+    std::cout << "cells\t" << texts.size() << '\n'
+              << "text_replay_seconds\t" << replay_seconds << '\n'
+              << "snapshot_save_seconds\t" << save_seconds << '\n'
+              << "snapshot_load_seconds\t" << load_seconds << '\n'
+              << "loaded_cells\t" << loaded->GetCells().size() << std::endl;
+}
@@ -0,0 +1,59 @@
+// Replays a trace recorded with "spreadsheet --record" on a fresh sheet and
+// reports latency histograms per command.
+// usage: trace_replay trace [max seconds]
+// With the limit the exit code is 2 if the replay takes longer, so the tool
+// can gate a release on the replay time.
+
+#include "sheet.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+double ToMicroseconds(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+void PrintHistogram(const std::string& name, const LatencyHistogram& histogram) {
+    std::cout << name << "_count\t" << histogram.GetCount() << '\n';
+    if (histogram.GetCount() == 0) {
+        return;
+    }
+    std::cout << name << "_total_us\t" << ToMicroseconds(histogram.GetTotal()) << '\n'
+              << name << "_p50_us\t" << ToMicroseconds(histogram.GetPercentile(0.5)) << '\n'
+              << name << "_p99_us\t" << ToMicroseconds(histogram.GetPercentile(0.99)) << '\n'
+              << name << "_max_us\t" << ToMicroseconds(histogram.GetMax()) << '\n';
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: trace_replay trace [max seconds]" << std::endl;
+        return 1;
+    }
+
+    auto sheet = CreateSheet();
+    const auto start = std::chrono::steady_clock::now();
+    const TraceReplayStats stats = ReplayTrace(argv[1], *sheet);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    PrintHistogram("set", stats.latencies[static_cast<size_t>(TraceCommand::Set)]);
+    PrintHistogram("clear", stats.latencies[static_cast<size_t>(TraceCommand::Clear)]);
+    PrintHistogram("print_values", stats.latencies[static_cast<size_t>(TraceCommand::PrintValues)]);
+    PrintHistogram("print_texts", stats.latencies[static_cast<size_t>(TraceCommand::PrintTexts)]);
+    PrintHistogram("print_diff", stats.latencies[static_cast<size_t>(TraceCommand::PrintDiff)]);
+    PrintHistogram("insert_rows", stats.latencies[static_cast<size_t>(TraceCommand::InsertRows)]);
+    PrintHistogram("delete_rows", stats.latencies[static_cast<size_t>(TraceCommand::DeleteRows)]);
+    PrintHistogram("insert_cols", stats.latencies[static_cast<size_t>(TraceCommand::InsertCols)]);
+    PrintHistogram("delete_cols", stats.latencies[static_cast<size_t>(TraceCommand::DeleteCols)]);
+    std::cout << "errors\t" << stats.errors << '\n'
+              << "replay_seconds\t" << seconds << std::endl;
+
+    if (argc > 2 && seconds > std::atof(argv[2])) {
+        std::cerr << "replay is slower than " << argv[2] << " s" << std::endl;
+        return 2;
+    }
+}
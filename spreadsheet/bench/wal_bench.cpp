@@ -0,0 +1,93 @@
+// Measures the sustained write throughput of the write-ahead log with one
+// and several committing writers, and the recovery time against the log length.
+// usage: wal_bench [records] [max writers] [directory]
+
+#include "wal.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// every writer commits each of its records, so the records of concurrent writers share fsyncs
+double MeasureCommittedAppends(const std::string& path, int records, int writers) {
+    std::filesystem::remove(path);
+    WriteAheadLog log(path);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int writer = 0; writer < writers; ++writer) {
+        threads.emplace_back([&log, records, writers, writer] {
+            for (int i = writer; i < records; i += writers) {
+                log.Commit(log.Append(WriteAheadLog::Operation::Set, Position{i % 1000, writer},
+                                      "=A1+" + std::to_string(i)));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return records / SecondsSince(start);
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const int records = argc > 1 ? std::atoi(argv[1]) : 200000;
+    const int max_writers = argc > 2 ? std::atoi(argv[2]) : 8;
+    const std::filesystem::path directory = argc > 3 ? argv[3] : "wal_bench";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    const std::string log_path = (directory / "bench.wal").string();
+    const int committed_records = records / 20;
+    for (int writers = 1; writers <= max_writers; writers *= 2) {
+        std::cout << "committed_records_per_second_" << writers << "_writers\t"
+                  << MeasureCommittedAppends(log_path, committed_records, writers) << '\n';
+    }
+
+    // the mutations of the sheet are made durable in groups, the compaction is disabled
+    const std::string sheet_directory = (directory / "sheet").string();
+    for (int length = records / 8; length <= records; length *= 2) {
+        std::filesystem::remove_all(sheet_directory);
+        auto start = Clock::now();
+        {
+            DurableSheet sheet(sheet_directory, UINT64_MAX);
+            for (int i = 0; i < length; ++i) {
+                const Position pos{i / 20, i % 20};
+                sheet.SetCell(pos, pos.col == 0 ? std::to_string(i) : "=" + Position{pos.row, 0}.ToString() + "*2");
+            }
+            sheet.Commit();
+        }
+        const double write_seconds = SecondsSince(start);
+
+        start = Clock::now();
+        DurableSheet recovered(sheet_directory, UINT64_MAX);
+        const double recovery_seconds = SecondsSince(start);
+
+        std::cout << "log_records\t" << length << '\n'
+                  << "sheet_writes_per_second\t" << length / write_seconds << '\n'
+                  << "recovery_seconds\t" << recovery_seconds << '\n'
+                  << "recovered_records\t" << recovered.GetRecoveredRecords() << '\n';
+    }
+
+    // recovery after the log is folded into the snapshot
+    {
+        DurableSheet sheet(sheet_directory, UINT64_MAX);
+        sheet.Compact();
+        sheet.WaitCompaction();
+    }
+    auto start = Clock::now();
+    DurableSheet recovered(sheet_directory, UINT64_MAX);
+    std::cout << "recovery_from_snapshot_seconds\t" << SecondsSince(start) << std::endl;
+
+    std::filesystem::remove_all(directory);
+}
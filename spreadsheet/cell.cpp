@@ -1,12 +1,22 @@
 #include "cell.h"
 #include "formula.h"
+#include "profiler.h"
 #include "sheet.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <string>
 #include <optional>
 #include <deque>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
 
 namespace {
 void AddCellsToDeque(const Sheet& sheet, const std::vector<Position>& positions, std::deque<const Cell*>& pointers) {
@@ -17,143 +27,609 @@ void AddCellsToDeque(const Sheet& sheet, const std::vector<Position>& positions,
         }
     }
 }
-}  // namespace
 
-// base class for cells content
-class Cell::Impl {
+// passes the reads of a formula to the sheet and records the positions of the read cells
+class ReadRecorder final : public SheetInterface {
 public:
-    virtual std::string GetText() const = 0;
-    virtual Value GetValue() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const {
-        return {};
-    };
-    virtual void InvalidateCachedValue() const {
+    ReadRecorder(const SheetInterface& sheet, std::vector<Position>& cells) : sheet_{sheet}, cells_{cells} {
     }
-};
 
-// class of empty cell
-class Cell::EmptyImpl : public Cell::Impl {
-public:
-    std::string GetText() const override {
-        return {};
+    void SetCell(Position /* pos */, std::string /* text */) override {
+        throw std::logic_error("A formula cannot change the sheet");
     }
-    Value GetValue() const override {
-        return {};
+
+    const CellInterface* GetCell(Position pos) const override {
+        cells_.push_back(pos);
+        return sheet_.GetCell(pos);
     }
-};
 
-// class of cell with text
-class Cell::TextImpl : public Cell::Impl {
-public:
-    explicit TextImpl(std::string text) : text_{std::move(text)} {
+    CellInterface* GetCell(Position /* pos */) override {
+        throw std::logic_error("A formula cannot change the sheet");
     }
 
-    std::string GetText() const override {
-        return text_;
+    void ClearCell(Position /* pos */) override {
+        throw std::logic_error("A formula cannot change the sheet");
     }
 
-    Value GetValue() const override {
-        return text_[0] == ESCAPE_SIGN ? text_.substr(1) : text_;
+    Size GetPrintableSize() const override {
+        return sheet_.GetPrintableSize();
     }
+
+    void PrintValues(std::ostream& output) const override {
+        sheet_.PrintValues(output);
+    }
+
+    void PrintTexts(std::ostream& output) const override {
+        sheet_.PrintTexts(output);
+    }
+
 private:
-    std::string text_;
+    const SheetInterface& sheet_;
+    std::vector<Position>& cells_;
 };
 
-// class of cell with formula
-class Cell::FormulaImpl : public Cell::Impl {
-public:
-    explicit FormulaImpl(Sheet& sheet, std::string expression)
-            : sheet_{sheet}, formula_{ParseFormula(expression.substr(1))} {
+// checks whether the values are the same, the numbers are compared with their signs,
+// so that a recalculated -0 is not taken for 0
+bool IsSameValue(const FormulaInterface::Value& lhs, const FormulaInterface::Value& rhs) {
+    if (const double* lhs_number = std::get_if<double>(&lhs)) {
+        const double* rhs_number = std::get_if<double>(&rhs);
+        return rhs_number && *lhs_number == *rhs_number && std::signbit(*lhs_number) == std::signbit(*rhs_number);
+    }
+    return lhs == rhs;
+}
+}  // namespace
 
+// the formula with its cached value and the cells it refers to
+struct Cell::FormulaData {
+    FormulaData(Sheet& sheet, Position pos, std::unique_ptr<FormulaInterface> formula,
+                std::optional<FormulaInterface::Value> cached_value = std::nullopt)
+            : sheet{sheet}, pos{pos}, formula{std::move(formula)}, cached_value{std::move(cached_value)} {
+        for (const Range& range : this->formula->GetRanges()) {
+            aggregators.emplace_back(range);
+        }
     }
 
-    std::string GetText() const override {
-        return '=' + formula_->GetExpression();
+    // calls visit for the ranges of the formula, an aggregator is built for every one of them
+    template <typename Visit>
+    void ForEachRange(const Visit& visit) const {
+        for (const RangeAggregator& aggregator : aggregators) {
+            visit(aggregator.GetRange());
+        }
+    }
+
+    // records the change of the referenced cell in the aggregates and the indexes of the ranges containing it
+    void RecordChange(Position changed_pos, const std::optional<AggregateInput>& old_value) {
+        for (RangeAggregator& aggregator : aggregators) {
+            if (aggregator.GetRange().Contains(changed_pos)) {
+                aggregator.RecordChange(changed_pos, old_value);
+            }
+        }
+        for (const auto& index : lookup_indexes) {
+            if (index->GetRange().Contains(changed_pos)) {
+                index->RecordChange(changed_pos);
+            }
+        }
+        for (const auto& index : criteria_indexes) {
+            if (index->Contains(changed_pos)) {
+                index->RecordChange(changed_pos);
+            }
+        }
     }
 
-    Value GetValue() const override {
-        if(!cached_value_.has_value()) {
-            cached_value_ = formula_->Evaluate(sheet_);
+    // records the cells of the ranges changed after the revision, their old values are not known,
+    // so an aggregate is computed again; the shared indexes are brought up to date by their own revisions
+    void RecordChangesSince(std::uint64_t revision) {
+        for (RangeAggregator& aggregator : aggregators) {
+            sheet.ForEachValueChange(revision, aggregator.GetRange(), [&aggregator](Position changed_pos) {
+                aggregator.RecordChange(changed_pos, std::nullopt);
+                return false;
+            });
+        }
+        for (const auto& index : lookup_indexes) {
+            SyncIndex(*index);
         }
+        for (const auto& index : criteria_indexes) {
+            SyncIndex(*index);
+        }
+    }
 
-        if(std::holds_alternative<double>(cached_value_.value())) {
-            return std::get<double>(cached_value_.value());
+    // records the changes made after the index was last brought up to date, a formula may
+    // take the index from the sheet later than the formulas which calculated it
+    void SyncIndex(LookupIndex& index) const {
+        SyncIndex(index, {index.GetRange()});
+    }
+
+    void SyncIndex(CriteriaIndex& index) const {
+        if (index.GetValues() == index.GetCriteria()) {
+            SyncIndex(index, {index.GetCriteria()});
         } else {
-            return std::get<FormulaError>(cached_value_.value());
+            SyncIndex(index, {index.GetCriteria(), index.GetValues()});
         }
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        return formula_->GetReferencedCells();
+    template <typename Index>
+    void SyncIndex(Index& index, std::initializer_list<Range> ranges) const {
+        const std::uint64_t revision = sheet.GetRevision();
+        const std::uint64_t synced = std::max(index.GetSyncedRevision(), sheet.GetValidationStart());
+        if (synced >= revision) {
+            return;
+        }
+        for (const Range& range : ranges) {
+            // the formulas of the range are verified first, so that the changes of their values are logged
+            sheet.ForEachFormulaCell(range, [](const Cell& cell) {
+                cell.Validate();
+            });
+            sheet.ForEachValueChange(synced, range, [&index](Position changed_pos) {
+                index.RecordChange(changed_pos);
+                return true;
+            });
+        }
+        index.SetSyncedRevision(revision);
+    }
+
+    // the cells and the ranges read by an evaluation of the formula
+    struct Reads {
+        // sorted, without repeated cells
+        std::vector<Position> cells;
+        std::vector<Range> ranges;
+
+        bool Contains(Position pos) const {
+            return std::binary_search(cells.begin(), cells.end(), pos)
+                   || std::any_of(ranges.begin(), ranges.end(), [pos](const Range& range) {
+                          return range.Contains(pos);
+                      });
+        }
+    };
+
+    // evaluates the formula, the aggregates of the ranges are updated by the recorded changes;
+    // the reads of a formula with branches are recorded with its value
+    FormulaInterface::Value Evaluate() {
+        if (!formula->HasBranches()) {
+            return Evaluate(sheet, nullptr);
+        }
+        Reads current;
+        const ReadRecorder recorder(sheet, current.cells);
+        FormulaInterface::Value value = Evaluate(recorder, &current.ranges);
+        std::sort(current.cells.begin(), current.cells.end());
+        current.cells.erase(std::unique(current.cells.begin(), current.cells.end()), current.cells.end());
+        reads = std::move(current);
+        return value;
     }
 
-    void InvalidateCachedValue() const override {
-        cached_value_.reset();
+    // evaluates the formula reading the cells from reader, the ranges are
+    // taken from the sheet and added to read_ranges if it is given
+    FormulaInterface::Value Evaluate(const SheetInterface& reader, std::vector<Range>* read_ranges) {
+        if (aggregators.empty()) {
+            return formula->Evaluate(reader);
+        }
+        auto record = [read_ranges](const Range& range) {
+            if (read_ranges) {
+                read_ranges->push_back(range);
+            }
+        };
+        const RangeFunctions ranges{
+            [this, &record](const Range& range, bool extremes) {
+                record(range);
+                auto iter = std::find_if(aggregators.begin(), aggregators.end(), [&range](const auto& aggregator) {
+                    return aggregator.GetRange() == range;
+                });
+                return iter != aggregators.end() ? iter->Get(sheet, extremes) : AggregateRange(sheet, range);
+            },
+            [this, &record](const Range& range, double key, MatchMode mode) {
+                record(range);
+                return GetLookupIndex(range).Find(sheet, key, mode);
+            },
+            [this, &record](const Range& criteria, const Range& values, double key) {
+                record(criteria);
+                record(values);
+                return GetCriteriaIndex(criteria, values).Get(sheet, key);
+            },
+        };
+        return formula->Evaluate(reader, ranges);
     }
 
-private:
-    Sheet& sheet_;
-    std::unique_ptr<FormulaInterface> formula_;
+    // checks whether the cached value was calculated without reading the cell
+    bool IsIndependentOf(Position changed_pos) const {
+        return cached_value && reads && !reads->Contains(changed_pos);
+    }
+
+    // returns the index of the row or the column range, it is taken from the sheet on the first search
+    LookupIndex& GetLookupIndex(const Range& range) {
+        auto iter = std::find_if(lookup_indexes.begin(), lookup_indexes.end(), [&range](const auto& index) {
+            return index->GetRange() == range;
+        });
+        if (iter != lookup_indexes.end()) {
+            return **iter;
+        }
+        LookupIndex& index = *lookup_indexes.emplace_back(sheet.GetLookupIndex(range));
+        if (sheet.GetRecalculationMode() == RecalculationMode::Validating) {
+            SyncIndex(index);
+        }
+        return index;
+    }
 
-    mutable std::optional<FormulaInterface::Value> cached_value_;
+    // returns the index grouping the values by the criteria, it is taken from the sheet on the first request
+    CriteriaIndex& GetCriteriaIndex(const Range& criteria, const Range& values) {
+        auto iter = std::find_if(criteria_indexes.begin(), criteria_indexes.end(), [&](const auto& index) {
+            return index->GetCriteria() == criteria && index->GetValues() == values;
+        });
+        if (iter != criteria_indexes.end()) {
+            return **iter;
+        }
+        CriteriaIndex& index = *criteria_indexes.emplace_back(sheet.GetCriteriaIndex(criteria, values));
+        if (sheet.GetRecalculationMode() == RecalculationMode::Validating) {
+            SyncIndex(index);
+        }
+        return index;
+    }
+
+    // the sheet the formula is evaluated in
+    Sheet& sheet;
+    // the position of the cell, the aggregates of the dependent cells are updated by it
+    Position pos;
+    std::unique_ptr<FormulaInterface> formula;
+    std::optional<FormulaInterface::Value> cached_value;
+    // the cells referenced by the formula outside its ranges, the formulas of the ranges are found by the sheet
+    std::unordered_set<const Cell*> referenced_cells;
+    // the reads of the evaluation the cached value is calculated by, nullopt
+    // if the formula has no branches or the reads are not known
+    std::optional<Reads> reads;
+    // a formula is higher than all formulas it refers to, the height is valid
+    // while the references version of the sheet is height_version
+    std::uint32_t height = 0;
+    std::uint64_t height_version = 0;
+    // the revision of the sheet the formula was last calculated or verified at, 0 if it was not
+    std::uint64_t verified_at = 0;
+    // the aggregates of the ranges of the formula
+    std::vector<RangeAggregator> aggregators;
+    // the indexes searched by the formula, shared with the other formulas searching the same ranges
+    std::vector<std::shared_ptr<LookupIndex>> lookup_indexes;
+    // the indexes of the conditional aggregates, shared with the other formulas grouping the same ranges
+    std::vector<std::shared_ptr<CriteriaIndex>> criteria_indexes;
 };
 
+// calls visit for the cells the formula refers to and for the formulas of its ranges
+template <typename Visit>
+void Cell::ForEachReferenced(const Visit& visit) const {
+    for (const Cell* cell : formula_->referenced_cells) {
+        visit(cell);
+    }
+    formula_->ForEachRange([this, &visit](const Range& range) {
+        formula_->sheet.ForEachFormulaCell(range, [&visit](const Cell& cell) {
+            visit(&cell);
+        });
+    });
+}
+
+// calls visit for the formulas referring to the cell at pos directly or through their ranges,
+// a formula referring to the cell both ways is passed once
+template <typename Visit>
+void Cell::ForEachDependent(const Sheet& sheet, Position pos, const Cell* cell, const Visit& visit) {
+    static const std::unordered_set<const Cell*> no_cells;
+    const auto& direct = cell ? cell->GetDependentCells() : no_cells;
+    for (const Cell* dependent : direct) {
+        visit(dependent);
+    }
+    sheet.GetRangeReferences().ForEachFormula(pos, [&direct, &visit](const Cell* dependent) {
+        if (!direct.count(dependent)) {
+            visit(dependent);
+        }
+    });
+}
+
+// the contents is prepared before it replaces the contents of the cell
+Cell::Contents::Contents() = default;
+
+Cell::Contents::Contents(Contents&& other) noexcept = default;
+
+Cell::Contents& Cell::Contents::operator=(Contents&& other) noexcept = default;
+
+Cell::Contents::~Contents() = default;
+
 // class Cell methods
-Cell::Cell(Sheet& sheet) : sheet_{sheet}, impl_(new EmptyImpl) {
+Cell::Cell() = default;
+
+Cell::~Cell() = default;
+
+Cell::Kind Cell::GetKind() const {
+    if (formula_) {
+        return Kind::Formula;
+    }
+    return text_ == StringPool::Handle{} ? Kind::Empty : Kind::Text;
 }
 
-Cell::~Cell() {}
+// sets the contents, returns false if the contents is not changed
+bool Cell::Set(Sheet& sheet, Position pos, std::string text) {
+    std::optional<Contents> contents = CreateContents(sheet, pos, std::move(text));
+    if(!contents) {
+        return false;
+    }
+    if(HasCyclicDependence(sheet, contents->formula.get())) {
+        throw CircularDependencyException("Formula has circular dependence");
+    }
+    if ((!IsReferenced() && !sheet.GetRangeReferences().Contains(pos))
+        || sheet.GetRecalculationMode() == RecalculationMode::Validating) {
+        Replace(sheet, std::move(*contents));
+        return true;
+    }
+    // the old value is taken before it is replaced
+    Change change{this, pos, GetAggregateInput()};
+    Replace(sheet, std::move(*contents));
+    if (sheet.GetRecalculationMode() == RecalculationMode::Eager) {
+        Recalculate(sheet, {change});
+    } else {
+        InvalidateCache(sheet, {change});
+    }
+    return true;
+}
 
-void Cell::Set(std::string text) {
-    if(impl_->GetText() == text) {
-        return;
+// sets the contents without the cycle check and the cache invalidation,
+// returns false if the contents is not changed
+bool Cell::Assign(Sheet& sheet, Position pos, std::string text, Contents* previous) {
+    std::optional<Contents> contents = CreateContents(sheet, pos, std::move(text));
+    if(!contents) {
+        return false;
+    }
+    Contents replaced = Replace(sheet, std::move(*contents));
+    if (previous) {
+        *previous = std::move(replaced);
+    }
+    return true;
+}
+
+// puts back the contents replaced by Assign, the text is not parsed again
+void Cell::Restore(Sheet& sheet, Contents previous) {
+    Replace(sheet, std::move(previous));
+}
+
+// creates the contents for the text, returns nullopt if the contents is not changed
+std::optional<Cell::Contents> Cell::CreateContents(Sheet& sheet, Position pos, std::string text) const {
+    if (!text.empty() && (text[0] != FORMULA_SIGN || text.size() == 1)) {
+        // equal texts share one string of the pool, so they are compared by pointer
+        StringPool::Handle interned = sheet.GetStrings().Intern(text);
+        if (interned == text_) {
+            return std::nullopt;
+        }
+        Contents contents;
+        contents.text = std::move(interned);
+        return contents;
     }
 
-    std::unique_ptr<Impl> new_impl;
-    if(text.empty()) {
-        new_impl = std::make_unique<EmptyImpl>();
-    } else if(text[0] == '=' && text.size() > 1) {
-        new_impl = std::make_unique<FormulaImpl>(sheet_, std::move(text));
+    // the text of a formula is printed from its tree, so it is built once
+    std::string current_text = GetText();
+    if(current_text == text) {
+        return std::nullopt;
+    }
+
+    Contents contents;
+    if(!text.empty()) {
+        contents.formula = std::make_unique<FormulaData>(sheet, pos, ParseFormula(text.substr(1)));
         // after parsing the formula, the extra brackets can be removed
         // and texts may be equal
-        if(new_impl->GetText() == impl_->GetText()) {
-            return;
-        }
-        if(HasCyclicDependence(new_impl.get())) {
-            throw CircularDependencyException("Formula has circular dependence");
+        if(FORMULA_SIGN + contents.formula->formula->GetExpression() == current_text) {
+            return std::nullopt;
         }
-    } else {
-        new_impl = std::make_unique<TextImpl>(std::move(text));
     }
-    impl_ = std::move(new_impl);
+    return contents;
+}
 
-    UpdateDependencies();
-    InvalidateCache();
+// replaces the contents and the links to the referenced cells, returns the replaced contents
+Cell::Contents Cell::Replace(Sheet& sheet, Contents contents) {
+    // the cached values of the dependent formulas are checked against the stamp in the validating mode
+    const std::uint64_t revision = sheet.ChangeRevision();
+    if (dependents_) {
+        dependents_->changed_at = revision;
+    }
+    RemoveOldDependencies();
+    std::swap(text_, contents.text);
+    std::swap(formula_, contents.formula);
+    RangeReferences& range_references = sheet.GetRangeReferences();
+    if (contents.formula) {
+        contents.formula->ForEachRange([this, &range_references](const Range& range) {
+            range_references.Remove(range, this);
+        });
+    }
+    if (formula_) {
+        sheet.AddFormulaCell(formula_->pos);
+        formula_->ForEachRange([this, &range_references](const Range& range) {
+            range_references.Add(range, this);
+        });
+    } else if (contents.formula) {
+        sheet.RemoveFormulaCell(contents.formula->pos);
+    }
+    UpdateReferencedCells(sheet);
+    AddNewDependencies();
+    if (formula_) {
+        // the new references may make the dependent formulas higher
+        sheet.ChangeReferences();
+    }
+    return contents;
 }
 
 void Cell::Clear() {
-    impl_.reset(new EmptyImpl);
+    RemoveOldDependencies();
+    text_ = {};
+    formula_.reset();
+}
+
+// set the contents restored from a snapshot without checks
+void Cell::Load(Sheet& sheet, std::string_view text) {
+    formula_.reset();
+    text_ = text.empty() ? StringPool::Handle{} : sheet.GetStrings().Intern(text);
+}
+
+void Cell::Load(Sheet& sheet, Position pos, std::unique_ptr<FormulaInterface> formula,
+                std::optional<FormulaInterface::Value> cached_value) {
+    text_ = {};
+    formula_ = std::make_unique<FormulaData>(sheet, pos, std::move(formula), std::move(cached_value));
+    sheet.AddFormulaCell(pos);
+    formula_->ForEachRange([this, &sheet](const Range& range) {
+        sheet.GetRangeReferences().Add(range, this);
+    });
+}
+
+// adds a dependency between this cell and the cell it refers to
+void Cell::LinkReferencedCell(const Cell* cell) {
+    assert(formula_);
+    formula_->referenced_cells.insert(cell);
+    cell->AddDependentCell(this);
+}
+
+// removes the links from the formulas referring to the cell, the links of
+// its own formula are removed when it is cleared
+void Cell::UnlinkDependentCells() const {
+    for (const Cell* dependent : GetDependentCells()) {
+        dependent->formula_->referenced_cells.erase(this);
+    }
+    dependents_.reset();
+}
+
+// moves the formula to the position, the aggregates of the dependent cells are updated by it
+void Cell::Move(Position pos) const {
+    if (formula_) {
+        formula_->pos = pos;
+    }
+}
+
+// moves the references of the formula as the change moves the lines of the sheet,
+// the formula is not parsed again; the referenced cells move with the references,
+// and the moved ranges are registered again by the sheet
+Cell::Change Cell::ApplyLayoutChange(Sheet& sheet, const LayoutChange& change) const {
+    assert(formula_);
+    FormulaData& data = *formula_;
+    data.formula->ApplyLayoutChange(change);
+    data.cached_value.reset();
+    data.reads.reset();
+    data.verified_at = 0;
+    // the ranges are moved or resized, so the aggregates and the indexes are built again
+    data.aggregators.clear();
+    for (const Range& range : data.formula->GetRanges()) {
+        data.aggregators.emplace_back(range);
+    }
+    data.lookup_indexes.clear();
+    data.criteria_indexes.clear();
+    if (dependents_) {
+        dependents_->changed_at = sheet.GetRevision();
+    }
+    return {this, data.pos, std::nullopt};
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    return ToValue(GetValueView());
 }
+
+// returns the value without copying the text, it is valid until the cell is changed
+Cell::ValueView Cell::GetValueView() const {
+    switch (GetKind()) {
+        case Kind::Text: {
+            std::string_view value = text_.Get();
+            if (value[0] == ESCAPE_SIGN) {
+                value.remove_prefix(1);
+            }
+            return value;
+        }
+        case Kind::Formula:
+            return GetFormulaValue();
+        case Kind::Empty:
+            break;
+    }
+    return std::string_view{};
+}
+
+// returns the value of the formula, it is calculated if it is not cached
+Cell::ValueView Cell::GetFormulaValue() const {
+    auto& cached_value = formula_->cached_value;
+    if (cached_value && formula_->sheet.GetRecalculationMode() == RecalculationMode::Validating) {
+        Validate();
+    }
+    if(!cached_value.has_value()) {
+        CalculateFormula();
+    } else {
+        CountEvent(Counter::CacheHits);
+    }
+
+    if(std::holds_alternative<double>(cached_value.value())) {
+        return std::get<double>(cached_value.value());
+    } else {
+        return std::get<FormulaError>(cached_value.value());
+    }
+}
+
+// calculates the value of the formula and caches it
+void Cell::CalculateFormula() const {
+    FormulaData& data = *formula_;
+    CountEvent(Counter::CacheMisses);
+    CountEvent(Counter::FormulaEvaluations);
+    EvaluationScope scope(this);
+    // the changes of the validating mode are not recorded in the aggregates when they are made
+    if (data.verified_at != 0 && data.sheet.GetRecalculationMode() == RecalculationMode::Validating) {
+        data.RecordChangesSince(GetVerifiedAt());
+    }
+    data.cached_value = data.Evaluate();
+    data.verified_at = data.sheet.GetRevision();
+}
+
+// returns the revision the value of the cell changed at
+std::uint64_t Cell::GetChangedAt() const {
+    return dependents_ ? dependents_->changed_at : 0;
+}
+
+// returns the revision the cached value of the formula is known to be valid at,
+// the values cached before the validating mode was selected are valid at its start
+std::uint64_t Cell::GetVerifiedAt() const {
+    return std::max(formula_->verified_at, formula_->sheet.GetValidationStart());
+}
+
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    switch (GetKind()) {
+        case Kind::Text:
+            return std::string(text_.Get());
+        case Kind::Formula:
+            return FORMULA_SIGN + formula_->formula->GetExpression();
+        case Kind::Empty:
+            break;
+    }
+    return {};
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    return formula_ ? formula_->formula->GetReferencedCells() : std::vector<Position>{};
+}
+
+// returns the cells referenced by the formula of the cell
+const std::unordered_set<const Cell*>& Cell::GetReferencedCellPtrs() const {
+    static const std::unordered_set<const Cell*> no_cells;
+    return formula_ ? formula_->referenced_cells : no_cells;
 }
 
 // the method determines the presence of cyclic dependence in the formula
-bool Cell::HasCyclicDependence(const Impl* new_impl) const {
-    if(new_impl->GetReferencedCells().empty()) {
+bool Cell::HasCyclicDependence(const Sheet& sheet, const FormulaData* formula) const {
+    if(!formula) {
+        return false;
+    }
+    const std::vector<Position> referenced_cells = formula->formula->GetCellReferences();
+    const std::vector<Range> ranges = formula->formula->GetRanges();
+    if(referenced_cells.empty() && ranges.empty()) {
         return false;
     }
+    CountEvent(Counter::CycleChecks);
 
     std::deque<const Cell*> to_visit;
-    AddCellsToDeque(sheet_, new_impl->GetReferencedCells(), to_visit);
+    AddCellsToDeque(sheet, referenced_cells, to_visit);
+    // only the formulas of a range refer to other cells, the cell itself may be
+    // empty yet, so a range containing it is a cycle
+    auto add_range = [&sheet, &to_visit, pos = formula->pos](const Range& range) {
+        if (range.Contains(pos)) {
+            return true;
+        }
+        sheet.ForEachFormulaCell(range, [&to_visit](const Cell& cell) {
+            to_visit.push_back(&cell);
+        });
+        return false;
+    };
+    if (std::any_of(ranges.begin(), ranges.end(), add_range)) {
+        return true;
+    }
 
     std::unordered_set<const Cell*> visited;
  
@@ -168,74 +644,482 @@ bool Cell::HasCyclicDependence(const Impl* new_impl) const {
             continue;
         }
         visited.insert(current_cell);
-        AddCellsToDeque(sheet_, current_cell->GetReferencedCells(), to_visit);
+        CountEvent(Counter::CycleCheckNodes);
+        // the cells the sheet cells refer to are linked, the ranges are taken from the aggregators
+        const auto& current_referenced = current_cell->GetReferencedCellPtrs();
+        to_visit.insert(to_visit.end(), current_referenced.begin(), current_referenced.end());
+        if (current_cell->formula_) {
+            bool found = false;
+            current_cell->formula_->ForEachRange([&add_range, &found](const Range& range) {
+                found = found || add_range(range);
+            });
+            if (found) {
+                return true;
+            }
+        }
     }
     return false;
 }
 
-// the method invalidates cashed values in the cells
-void Cell::InvalidateCache() const {
-    if (!dependent_cells_.empty()) {
-        std::unordered_set<const Cell*> visited;
-        InvalidateCachedValue(visited);
+// invalidates cached values of the changed cells and of all cells that depend
+// on them, the aggregates of the dependent cells record the old values; a
+// formula with branches which did not read the changed cell keeps its value
+void Cell::InvalidateCache(const Sheet& sheet, const std::vector<Change>& changes) {
+    std::unordered_set<const Cell*> visited;
+    std::vector<const Change*> roots;
+    for (const Change& change : changes) {
+        // a cell changed several times keeps the value it had before the first change
+        if (visited.insert(change.cell).second) {
+            roots.push_back(&change);
+        }
     }
+
+    std::vector<const Cell*> to_visit;
+    size_t skipped = 0;
+    auto invalidate = [&sheet, &visited, &to_visit, &skipped](const Cell* cell, Position pos,
+                                                              const std::optional<AggregateInput>& old_value) {
+        if (cell->formula_) {
+            cell->formula_->cached_value.reset();
+        }
+        ForEachDependent(sheet, pos, cell, [&](const Cell* p_cell) {
+            // the dependent cells always have formulas
+            FormulaData& data = *p_cell->formula_;
+            data.RecordChange(pos, old_value);
+            if (visited.count(p_cell)) {
+                return;
+            }
+            // the branch taken by the formula did not read the cell, so neither
+            // the cached value nor the cells depending on it change
+            if (data.IsIndependentOf(pos)) {
+                ++skipped;
+                return;
+            }
+            visited.insert(p_cell);
+            to_visit.push_back(p_cell);
+        });
+    };
+    for (const Change* change : roots) {
+        invalidate(change->cell, change->pos, change->old_value);
+    }
+    while (!to_visit.empty()) {
+        const Cell* current_cell = to_visit.back();
+        to_visit.pop_back();
+        invalidate(current_cell, current_cell->formula_->pos, current_cell->GetAggregateInput());
+    }
+    CountEvent(Counter::CellsInvalidated, visited.size());
+    CountEvent(Counter::InvalidationsSkipped, skipped);
+}
+
+// recalculates the cached values of the formulas depending on the changed
+// cells in the order of their heights, so that a formula is recalculated
+// once after all formulas it refers to; the dependents of a formula which
+// value does not change are not recalculated
+void Cell::Recalculate(const Sheet& sheet, const std::vector<Change>& changes) {
+    std::unordered_set<const Cell*> queued;
+    std::vector<const Change*> roots;
+    for (const Change& change : changes) {
+        // a cell changed several times keeps the value it had before the first change
+        if (queued.insert(change.cell).second) {
+            roots.push_back(&change);
+        }
+    }
+
+    using Entry = std::pair<std::uint32_t, const Cell*>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<>> to_visit;
+    size_t skipped = 0;
+    auto mark_dependents = [&sheet, &queued, &to_visit, &skipped](const Cell* cell, Position pos,
+                                                                  const std::optional<AggregateInput>& old_value) {
+        ForEachDependent(sheet, pos, cell, [&](const Cell* p_cell) {
+            FormulaData& data = *p_cell->formula_;
+            data.RecordChange(pos, old_value);
+            if (queued.count(p_cell)) {
+                return;
+            }
+            if (data.IsIndependentOf(pos)) {
+                ++skipped;
+                return;
+            }
+            queued.insert(p_cell);
+            // a formula which is not calculated only passes the change on, it
+            // goes first, so the heights are not computed while the sheet is filled
+            to_visit.push({data.cached_value ? p_cell->GetHeight() : 0, p_cell});
+        });
+    };
+    for (const Change* change : roots) {
+        mark_dependents(change->cell, change->pos, change->old_value);
+    }
+
+    size_t recalculated = 0;
+    size_t cutoffs = 0;
+    while (!to_visit.empty()) {
+        const Cell* current_cell = to_visit.top().second;
+        to_visit.pop();
+        FormulaData& data = *current_cell->formula_;
+        const std::optional<AggregateInput> old_input = current_cell->GetAggregateInput();
+        std::optional<FormulaInterface::Value> old_value = std::move(data.cached_value);
+        data.cached_value.reset();
+        // the formula which was not calculated stays so until it is read
+        if (old_value) {
+            ++recalculated;
+            current_cell->GetFormulaValue();
+            if (IsSameValue(*data.cached_value, *old_value)) {
+                ++cutoffs;
+                continue;
+            }
+        }
+        mark_dependents(current_cell, data.pos, old_input);
+    }
+    CountEvent(Counter::CellsInvalidated, queued.size());
+    CountEvent(Counter::InvalidationsSkipped, skipped);
+    CountEvent(Counter::CellsRecalculated, recalculated);
+    CountEvent(Counter::RecalculationCutoffs, cutoffs);
+}
+
+// returns the positions of the formulas depending on the cells at the positions directly,
+// through their ranges or through other formulas
+std::vector<Position> Cell::GetDependentPositions(const Sheet& sheet, const std::vector<Position>& positions) {
+    std::vector<Position> dependents;
+    std::unordered_set<const Cell*> visited;
+    std::vector<const Cell*> to_visit;
+    auto add_dependent = [&dependents, &visited, &to_visit](const Cell* dependent) {
+        if (visited.insert(dependent).second) {
+            dependents.push_back(dependent->formula_->pos);
+            to_visit.push_back(dependent);
+        }
+    };
+    for (Position pos : positions) {
+        ForEachDependent(sheet, pos, sheet.GetCellPtr(pos), add_dependent);
+    }
+    while (!to_visit.empty()) {
+        const Cell* current_cell = to_visit.back();
+        to_visit.pop_back();
+        ForEachDependent(sheet, current_cell->formula_->pos, current_cell, add_dependent);
+    }
+    return dependents;
 }
 
-// this method recursively invalidates values cached in cells
-void Cell::InvalidateCachedValue(std::unordered_set<const Cell*> visited) const {
-    impl_->InvalidateCachedValue();
-    for (const auto p_cell : dependent_cells_) {
-        if(visited.count(p_cell)) {
+// calculates the formulas of the cells in the order of their heights, the
+// cells which do not need the calculation are skipped; the values of the
+// formulas of the validating mode are verified in the same order
+void Cell::Calculate(std::vector<const Cell*> cells) {
+    cells.erase(std::remove_if(cells.begin(), cells.end(), [](const Cell* cell) {
+                    return !cell->NeedsCalculation();
+                }), cells.end());
+    // a single formula gains nothing from the order
+    if (cells.size() < 2) {
+        return;
+    }
+    std::vector<std::pair<std::uint32_t, const Cell*>> ordered;
+    ordered.reserve(cells.size());
+    for (const Cell* cell : cells) {
+        ordered.push_back({cell->GetHeight(), cell});
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    for (const auto& [height, cell] : ordered) {
+        cell->GetFormulaValue();
+    }
+}
+
+// checks the cached value of the formula against the stamps of the cells it
+// refers to, the formulas it refers to are checked first; a formula is
+// calculated again only if one of the cells it refers to changed after it
+// was verified, a formula which value does not change keeps its stamp, so
+// that the formulas depending on it are not calculated again
+void Cell::Validate() const {
+    const std::uint64_t revision = formula_->sheet.GetRevision();
+    if (!formula_->cached_value) {
+        // the aggregates of a formula which is not calculated catch up with the changes
+        if (formula_->verified_at != 0) {
+            formula_->RecordChangesSince(GetVerifiedAt());
+            formula_->verified_at = revision;
+        }
+        return;
+    }
+    if (GetVerifiedAt() == revision) {
+        return;
+    }
+
+    size_t validated = 0;
+    size_t recalculated = 0;
+    size_t cutoffs = 0;
+    // the flag is set when the formulas the cell refers to are verified
+    std::vector<std::pair<const Cell*, bool>> to_visit{{this, false}};
+    while (!to_visit.empty()) {
+        auto [current_cell, referenced_visited] = to_visit.back();
+        FormulaData& data = *current_cell->formula_;
+        // a formula which is not calculated is calculated when it is read
+        if (!data.cached_value || current_cell->GetVerifiedAt() == revision) {
+            to_visit.pop_back();
+            continue;
+        }
+        if (!referenced_visited) {
+            to_visit.back().second = true;
+            current_cell->ForEachReferenced([&to_visit, revision](const Cell* referenced) {
+                if (referenced->formula_ && referenced->formula_->cached_value
+                    && referenced->GetVerifiedAt() != revision) {
+                    to_visit.push_back({referenced, false});
+                }
+            });
             continue;
         }
-        visited.insert(p_cell);
-        p_cell->InvalidateCachedValue(visited);
+        to_visit.pop_back();
+        ++validated;
+        const std::uint64_t verified_at = current_cell->GetVerifiedAt();
+        bool changed = std::any_of(data.referenced_cells.begin(), data.referenced_cells.end(),
+                                   [verified_at](const Cell* referenced) {
+                                       return referenced->GetChangedAt() > verified_at;
+                                   });
+        // the cells of the ranges are not stamped, their changes are found in the log of the sheet
+        data.ForEachRange([&data, &changed, verified_at](const Range& range) {
+            if (!changed) {
+                data.sheet.ForEachValueChange(verified_at, range, [&changed](Position /* changed_pos */) {
+                    changed = true;
+                    return false;
+                });
+            }
+        });
+        if (changed) {
+            ++recalculated;
+            std::optional<FormulaInterface::Value> old_value = std::move(data.cached_value);
+            data.cached_value.reset();
+            current_cell->CalculateFormula();
+            if (IsSameValue(*data.cached_value, *old_value)) {
+                ++cutoffs;
+            } else {
+                if (current_cell->dependents_) {
+                    current_cell->dependents_->changed_at = revision;
+                }
+                // the ranges containing the formula find the change in the log of the sheet
+                data.sheet.RecordValueChange(data.pos);
+            }
+        }
+        data.verified_at = revision;
     }
+    CountEvent(Counter::CellsValidated, validated);
+    CountEvent(Counter::CellsRecalculated, recalculated);
+    CountEvent(Counter::RecalculationCutoffs, cutoffs);
 }
 
-// the method updates the links to dependent and referenced cells
-void Cell::UpdateDependencies() {
-    RemoveOldDependencies();
-    UpdateReferencedCells();
-    AddNewDependencies();
+// returns the height of the formula, the heights of the formulas it refers to
+// are computed first if they are outdated
+std::uint32_t Cell::GetHeight() const {
+    const std::uint64_t version = formula_->sheet.GetReferencesVersion();
+    if (formula_->height_version == version) {
+        return formula_->height;
+    }
+    // the flag is set when the heights of the referenced formulas are computed
+    std::vector<std::pair<const Cell*, bool>> to_visit{{this, false}};
+    while (!to_visit.empty()) {
+        auto [current_cell, referenced_visited] = to_visit.back();
+        FormulaData& data = *current_cell->formula_;
+        if (referenced_visited) {
+            to_visit.pop_back();
+            std::uint32_t height = 0;
+            current_cell->ForEachReferenced([&height](const Cell* referenced) {
+                if (referenced->formula_) {
+                    height = std::max(height, referenced->formula_->height + 1);
+                }
+            });
+            data.height = height;
+            data.height_version = version;
+            continue;
+        }
+        if (data.height_version == version) {
+            to_visit.pop_back();
+            continue;
+        }
+        to_visit.back().second = true;
+        current_cell->ForEachReferenced([&to_visit, version](const Cell* referenced) {
+            if (referenced->formula_ && referenced->formula_->height_version != version) {
+                to_visit.push_back({referenced, false});
+            }
+        });
+    }
+    return formula_->height;
+}
+
+// checks whether the cells or the cells they refer to have cyclic dependence
+bool Cell::HasCyclicDependence(const std::vector<const Cell*>& cells) {
+    // false - the cell is on the current path, true - the cell and all cells it refers to are checked
+    std::unordered_map<const Cell*, bool> checked;
+    CountEvent(Counter::CycleChecks);
+    // the flag is set when the cells referenced by the cell are already visited
+    std::vector<std::pair<const Cell*, bool>> to_visit;
+    for (const Cell* start_cell : cells) {
+        to_visit.push_back({start_cell, false});
+        while (!to_visit.empty()) {
+            auto [current_cell, referenced_visited] = to_visit.back();
+            to_visit.pop_back();
+            if (referenced_visited) {
+                checked[current_cell] = true;
+                continue;
+            }
+            if (auto iter = checked.find(current_cell); iter != checked.end()) {
+                if (!iter->second) {
+                    return true;
+                }
+                continue;
+            }
+            checked.emplace(current_cell, false);
+            CountEvent(Counter::CycleCheckNodes);
+            to_visit.push_back({current_cell, true});
+            if (current_cell->formula_) {
+                current_cell->ForEachReferenced([&to_visit](const Cell* p_cell) {
+                    to_visit.push_back({p_cell, false});
+                });
+            }
+        }
+    }
+    return false;
 }
 
 // the method removes the dependency between this cell and the others
 void Cell::RemoveOldDependencies() const {
-    if (referenced_cells.empty()) {
-        return;
-    }
-    for (auto p_cell : referenced_cells) {
-        p_cell->dependent_cells_.erase(this);
+    for (auto p_cell : GetReferencedCellPtrs()) {
+        auto& dependents = p_cell->dependents_;
+        dependents->cells.erase(this);
+        if (dependents->cells.empty()) {
+            dependents.reset();
+        }
     }
 }
 
 // the method adds a dependency between this cell and the referenced
 void Cell::AddNewDependencies() const {
-    for (auto p_cell : referenced_cells) {
-        p_cell->dependent_cells_.insert(this);
+    for (auto p_cell : GetReferencedCellPtrs()) {
+        p_cell->AddDependentCell(this);
     }
 }
 
-// the method clear referenced_cells and add new referenced cells
-void Cell::UpdateReferencedCells() {
-    referenced_cells.clear();
-    for(Position pos : impl_->GetReferencedCells()) {
-        const Cell* p_cell = GetInitializeCell(pos);
-        assert(p_cell);
-        referenced_cells.insert(p_cell);
+// adds the cell to the dependent cells of this cell
+void Cell::AddDependentCell(const Cell* cell) const {
+    if (!dependents_) {
+        dependents_ = std::make_unique<Dependents>();
     }
+    dependents_->cells.insert(cell);
 }
 
-// creates a cell if it does not exist in position pos and return pointer to Cell
-const Cell* Cell::GetInitializeCell(Position pos) const {
-    if (const Cell* cell = sheet_.GetCellPtr(pos); !cell) {
-        sheet_.SetCell(pos, {});
+// the method fills referenced cells of the formula, the cells are created if needed
+void Cell::UpdateReferencedCells(Sheet& sheet) {
+    if (!formula_) {
+        return;
+    }
+    formula_->referenced_cells.clear();
+    // the cells of the ranges are not linked
+    const std::vector<Position> positions = formula_->formula->GetCellReferences();
+    formula_->referenced_cells.reserve(positions.size());
+    for(Position pos : positions) {
+        const Cell* p_cell = sheet.GetOrCreateCell(pos);
+        assert(p_cell);
+        formula_->referenced_cells.insert(p_cell);
     }
-    return sheet_.GetCellPtr(pos);
 }
 
 // checks whether other cells refer to this one
 bool Cell::IsReferenced() const {
-    return !dependent_cells_.empty();
+    return dependents_ && !dependents_->cells.empty();
+}
+// returns cells that depend on this cell
+const std::unordered_set<const Cell*>& Cell::GetDependentCells() const {
+    static const std::unordered_set<const Cell*> no_cells;
+    return dependents_ ? dependents_->cells : no_cells;
+}
+
+// evaluates the cell as if it was placed in the sheet, the cached value is not used
+Cell::Value Cell::GetValueIn(const SheetInterface& sheet) const {
+    if (!formula_) {
+        return GetValue();
+    }
+    CountEvent(Counter::FormulaEvaluations);
+    EvaluationScope scope(this);
+    auto value = formula_->formula->Evaluate(sheet);
+    if(std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return std::get<FormulaError>(value);
+}
+
+// returns the formula of the cell or nullptr if the cell does not contain a formula
+const FormulaInterface* Cell::GetFormula() const {
+    return formula_ ? formula_->formula.get() : nullptr;
+}
+
+// adds the memory of the cell, its contents and its dependencies
+void Cell::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.cells += sizeof(*this);
+    if (dependents_) {
+        usage.dependencies += sizeof(*dependents_) + GetHeapSize(dependents_->cells);
+    }
+    switch (GetKind()) {
+        case Kind::Empty:
+            ++usage.empty_cells;
+            break;
+        case Kind::Text:
+            // the texts are counted with the pool of the sheet
+            ++usage.text_cells;
+            break;
+        case Kind::Formula:
+            usage.cells += sizeof(FormulaData) - sizeof(formula_->cached_value) - sizeof(formula_->referenced_cells)
+                           - sizeof(formula_->reads) - sizeof(formula_->aggregators) - sizeof(formula_->lookup_indexes)
+                           - sizeof(formula_->criteria_indexes);
+            // the aggregates of the ranges are cached values too, the shared
+            // indexes are counted by the sheet
+            usage.cached_values += sizeof(formula_->cached_value) + sizeof(formula_->aggregators)
+                                   + formula_->aggregators.capacity() * sizeof(RangeAggregator)
+                                   + sizeof(formula_->lookup_indexes)
+                                   + formula_->lookup_indexes.capacity() * sizeof(formula_->lookup_indexes.front())
+                                   + sizeof(formula_->criteria_indexes)
+                                   + formula_->criteria_indexes.capacity() * sizeof(formula_->criteria_indexes.front());
+            for (const RangeAggregator& aggregator : formula_->aggregators) {
+                usage.cached_values += aggregator.GetMemoryUsage();
+            }
+            usage.dependencies += sizeof(formula_->referenced_cells) + GetHeapSize(formula_->referenced_cells);
+            // the reads are the dependencies of the cached value
+            usage.dependencies += sizeof(formula_->reads);
+            if (formula_->reads) {
+                usage.dependencies += formula_->reads->cells.capacity() * sizeof(Position)
+                                      + formula_->reads->ranges.capacity() * sizeof(Range);
+            }
+            formula_->formula->AddMemoryUsage(usage);
+            ++usage.formula_cells;
+            break;
+    }
+}
+
+// returns the cached value of the formula without calculating it, a value
+// which is not verified at the current revision is not returned
+std::optional<FormulaInterface::Value> Cell::GetCachedValue() const {
+    if (!formula_ || (formula_->sheet.GetRecalculationMode() == RecalculationMode::Validating
+                      && GetVerifiedAt() != formula_->sheet.GetRevision())) {
+        return std::nullopt;
+    }
+    return formula_->cached_value;
+}
+
+// checks whether reading the value calculates or verifies the formula of the cell
+bool Cell::NeedsCalculation() const {
+    if (!formula_) {
+        return false;
+    }
+    if (!formula_->cached_value) {
+        return true;
+    }
+    return formula_->sheet.GetRecalculationMode() == RecalculationMode::Validating
+           && GetVerifiedAt() != formula_->sheet.GetRevision();
+}
+
+// returns the value of the cell as an input of the aggregate functions,
+// nullopt if the value of the formula is not cached
+std::optional<AggregateInput> Cell::GetAggregateInput() const {
+    if (!formula_) {
+        return AggregateInput::FromValue(GetValueView());
+    }
+    if (!formula_->cached_value) {
+        return std::nullopt;
+    }
+    return std::visit([](const auto& value) {
+        return AggregateInput::FromValue(value);
+    }, *formula_->cached_value);
 }
\ No newline at end of file
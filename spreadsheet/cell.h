@@ -1,60 +1,189 @@
 #pragma once
 
+#include "aggregate.h"
 #include "common.h"
+#include "formula.h"
+#include "string_pool.h"
 
+#include <cstdint>
+#include <optional>
 #include <unordered_set>
 
 class Sheet;
 
+// The cell keeps its contents inline: the handle of a text of the pool of the
+// sheet or the pointer to the formula data, both empty for an empty cell.
+// The set of dependent cells is allocated only for referenced cells together
+// with the revision the value of the cell changed at. The cells of a range
+// are not linked: the sheet keeps the formulas of every range in its
+// RangeReferences, and the empty cells of a range are not created. A text or
+// an empty cell takes four words, one of them the pointer to the virtual
+// methods of CellInterface. The cell does not refer to the sheet: the methods
+// changing the contents take the sheet and the position of the cell as
+// arguments, and only the formula data keeps the sheet it is evaluated in and
+// the position of the cell.
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet);
+    // the change of the contents of a cell with the value the cell had before it
+    struct Change {
+        const Cell* cell;
+        Position pos;
+        // nullopt if the value of the formula was not calculated
+        std::optional<AggregateInput> old_value;
+    };
+    // the contents of the cell: the text or the formula with its cached value
+    struct Contents;
+
+    Cell();
+    Cell(const Cell&) = delete;
+    Cell& operator=(const Cell&) = delete;
     ~Cell();
 
-    void Set(std::string text);
+    // sets the contents, returns false if the contents is not changed
+    bool Set(Sheet& sheet, Position pos, std::string text);
     void Clear();
+    // sets the contents without the cycle check and the cache invalidation,
+    // returns false if the contents is not changed; the replaced contents is
+    // moved to previous if it is given
+    bool Assign(Sheet& sheet, Position pos, std::string text, Contents* previous = nullptr);
+    // puts back the contents replaced by Assign, the text is not parsed again
+    // and the formula keeps its cached value
+    void Restore(Sheet& sheet, Contents previous);
+
+    // set the contents restored from a snapshot without checks,
+    // the dependencies are linked separately with LinkReferencedCell
+    void Load(Sheet& sheet, std::string_view text);
+    void Load(Sheet& sheet, Position pos, std::unique_ptr<FormulaInterface> formula,
+              std::optional<FormulaInterface::Value> cached_value);
+    // adds a dependency between this cell and the cell it refers to
+    void LinkReferencedCell(const Cell* cell);
+
+    // removes the links from the formulas referring to the cell, called before
+    // the cell is deleted with its row or column
+    void UnlinkDependentCells() const;
+    // moves the formula to the position, the cell itself is moved by the sheet
+    void Move(Position pos) const;
+    // moves the references of the formula as the change moves the lines of the
+    // sheet; the moved cells keep their links, the ranges are registered again
+    // by the sheet; the cached value, the aggregates and the indexes are
+    // dropped, the returned change invalidates the dependents
+    Change ApplyLayoutChange(Sheet& sheet, const LayoutChange& change) const;
 
     Value GetValue() const override;
+    // returns the value without copying the text, it is valid until the cell is changed
+    ValueView GetValueView() const override;
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
-    // checks whether other cells refer to this one
+    // checks whether other cells refer to this one outside their ranges
     bool IsReferenced() const;
+    // returns cells that depend on this cell, the formulas of the ranges containing it are not listed
+    const std::unordered_set<const Cell*>& GetDependentCells() const;
+
+    // evaluates the cell as if it was placed in the sheet, the cached value is not used
+    Value GetValueIn(const SheetInterface& sheet) const;
+    // returns the formula of the cell or nullptr if the cell does not contain a formula
+    const FormulaInterface* GetFormula() const;
+    // returns the cached value of the formula without calculating it, in the validating
+    // mode a value which is not verified at the current revision is not returned
+    std::optional<FormulaInterface::Value> GetCachedValue() const;
+    // checks whether reading the value calculates or verifies the formula of the cell
+    bool NeedsCalculation() const;
+    // returns the value of the cell as an input of the aggregate functions,
+    // nullopt if the value of the formula is not cached
+    std::optional<AggregateInput> GetAggregateInput() const;
+    // adds the memory of the cell, its contents and its dependencies
+    void AddMemoryUsage(MemoryUsage& usage) const;
+
+    // checks whether the cells or the cells they refer to have cyclic dependence
+    static bool HasCyclicDependence(const std::vector<const Cell*>& cells);
+    // invalidates cached values of the changed cells and of all cells that depend
+    // on them, the aggregates of the dependent cells record the old values; a
+    // formula with branches which did not read the changed cell keeps its value
+    static void InvalidateCache(const Sheet& sheet, const std::vector<Change>& changes);
+    // recalculates the cached values of the formulas depending on the changed cells
+    // at once; the propagation stops at the formulas which values do not change
+    static void Recalculate(const Sheet& sheet, const std::vector<Change>& changes);
+    // returns the positions of the formulas depending on the cells at the positions directly,
+    // through their ranges or through other formulas; the cells need not exist
+    static std::vector<Position> GetDependentPositions(const Sheet& sheet, const std::vector<Position>& positions);
+    // calculates the formulas of the cells in the order of their heights, so that
+    // a formula finds the formulas it refers to calculated
+    static void Calculate(std::vector<const Cell*> cells);
+    // brings the cached value of the formula and the aggregates of its ranges up
+    // to date with the changes made in the validating recalculation mode
+    void Validate() const;
 
 private:
-    // types of using cells
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    enum class Kind {
+        Empty,
+        Text,
+        Formula,
+    };
+    // the formula with its cached value and the cells it refers to
+    struct FormulaData;
+    // the cells depending on the cell and the revision its value changed at
+    struct Dependents {
+        std::unordered_set<const Cell*> cells;
+        std::uint64_t changed_at = 0;
+    };
 
-    // creates a cell if it does not exist in position pos and return pointer to Cell
-    const Cell* GetInitializeCell(Position pos) const;
+    Kind GetKind() const;
+
+    // creates the contents for the text, returns nullopt if the contents is not changed
+    std::optional<Contents> CreateContents(Sheet& sheet, Position pos, std::string text) const;
+    // replaces the contents and the links to the referenced cells, returns the replaced contents
+    Contents Replace(Sheet& sheet, Contents contents);
+
+    // returns the value of the formula, it is calculated if it is not cached
+    ValueView GetFormulaValue() const;
+    // calculates the value of the formula and caches it
+    void CalculateFormula() const;
+    // returns the revision the value of the cell changed at, 0 for the cells nobody refers to
+    std::uint64_t GetChangedAt() const;
+    // returns the revision the cached value of the formula is known to be valid at
+    std::uint64_t GetVerifiedAt() const;
+    // returns the height of the formula, it is higher than all formulas it refers to
+    std::uint32_t GetHeight() const;
+    // returns the cells referenced by the formula of the cell outside its ranges
+    const std::unordered_set<const Cell*>& GetReferencedCellPtrs() const;
+    // calls visit for the cells the formula refers to and for the formulas of its ranges,
+    // a formula of several ranges may be passed more than once
+    template <typename Visit>
+    void ForEachReferenced(const Visit& visit) const;
+    // calls visit for the formulas referring to the cell at pos directly or through their
+    // ranges, once for every formula; the cell is nullptr if it does not exist
+    template <typename Visit>
+    static void ForEachDependent(const Sheet& sheet, Position pos, const Cell* cell, const Visit& visit);
 
-    // the method updates the links to dependent and referenced cells
-    void UpdateDependencies();
     // the method removes the dependency between this cell and the others
     void RemoveOldDependencies() const;
     // the method adds a dependency between this cell and the referenced
     void AddNewDependencies() const;
-    // the method clear referenced_cells and add new referenced cells
-    void UpdateReferencedCells();
+    // adds the cell to the dependent cells of this cell
+    void AddDependentCell(const Cell* cell) const;
+    // the method fills referenced cells of the formula, the cells are created if needed
+    void UpdateReferencedCells(Sheet& sheet);
 
     // the method determines the presence of cyclic dependence in the formula
-    bool HasCyclicDependence(const Impl* new_impl) const;
-
-    // the method invalidates cashed values in the cells
-    void InvalidateCache() const;
-    // this method recursively invalidates values cached in cells
-    void InvalidateCachedValue(std::unordered_set<const Cell*> visited) const;
+    bool HasCyclicDependence(const Sheet& sheet, const FormulaData* formula) const;
 
     // fields
-    Sheet& sheet_;
-    // content of the cell
-    std::unique_ptr<Impl> impl_;
-
-    // cells that depends from this cell
-    mutable std::unordered_set<const Cell*> dependent_cells_;
-    // the cells referenced by this cell
-    std::unordered_set<const Cell*> referenced_cells;
+    // the text of a text cell, shared through the pool of the sheet
+    StringPool::Handle text_;
+    // the formula of a formula cell
+    std::unique_ptr<FormulaData> formula_;
+    // cells that depends from this cell, allocated with the first of them
+    mutable std::unique_ptr<Dependents> dependents_;
+};
+
+// the contents is prepared before it replaces the contents of the cell
+struct Cell::Contents {
+    Contents();
+    Contents(Contents&& other) noexcept;
+    Contents& operator=(Contents&& other) noexcept;
+    ~Contents();
+
+    StringPool::Handle text;
+    std::unique_ptr<FormulaData> formula;
 };
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "command_processor.h"
+#include "wal.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+using namespace std::literals;
+
+namespace {
+// returns the first word of the line and removes it with the following space
+std::string_view TakeWord(std::string_view& line) {
+    const size_t word_end = std::min(line.find(' '), line.size());
+    std::string_view word = line.substr(0, word_end);
+    line.remove_prefix(std::min(word_end + 1, line.size()));
+    return word;
+}
+
+// returns the version of the sheet written in decimal digits
+std::uint64_t ParseVersion(std::string_view text) {
+    std::uint64_t version = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), version);
+    if (text.empty() || error != std::errc{} || end != text.data() + text.size()) {
+        throw std::invalid_argument("Invalid version: "s + std::string(text));
+    }
+    return version;
+}
+
+// changes the layout by the arguments "rows 5 [count]" or "cols C [count]" of the insert or delete command,
+// a row is written as its number and a column as its letters
+void ChangeLayout(Sheet& sheet, std::string_view command, std::string_view arguments) {
+    const std::string_view axis = TakeWord(arguments);
+    const std::string_view line = TakeWord(arguments);
+    int count = 1;
+    if (!arguments.empty()) {
+        const auto [end, error] = std::from_chars(arguments.data(), arguments.data() + arguments.size(), count);
+        if (error != std::errc{} || end != arguments.data() + arguments.size()) {
+            throw std::invalid_argument("Invalid count: "s + std::string(arguments));
+        }
+    }
+    const bool insert = command == "insert"sv;
+    if (axis == "rows"sv) {
+        const int row = Position::FromString("A"s + std::string(line)).row;
+        if (insert) {
+            sheet.InsertRows(row, count);
+        } else {
+            sheet.DeleteRows(row, count);
+        }
+    } else if (axis == "cols"sv) {
+        const int col = Position::FromString(std::string(line) + '1').col;
+        if (insert) {
+            sheet.InsertCols(col, count);
+        } else {
+            sheet.DeleteCols(col, count);
+        }
+    } else {
+        throw std::invalid_argument("Unknown command: "s + std::string(command) + ' ' + std::string(axis));
+    }
+}
+}  // namespace
+
+CommandProcessor::CommandProcessor(SheetInterface& sheet, size_t block_size, size_t batch_size)
+        : sheet_{sheet}
+        , bulk_sheet_{dynamic_cast<Sheet*>(&sheet)}
+        , cells_{bulk_sheet_}
+        , block_size_{std::max<size_t>(block_size, 1)}
+        , batch_size_{std::max<size_t>(batch_size, 1)} {
+    if (auto* durable_sheet = dynamic_cast<DurableSheet*>(&sheet)) {
+        cells_ = &durable_sheet->GetSheet();
+    }
+}
+
+// executes the commands until exit or the end of the input
+CommandProcessor::Stats CommandProcessor::Run(std::istream& input, std::ostream& output) {
+    stats_ = {};
+    pending_sets_.reserve(batch_size_);
+
+    std::vector<char> buffer(block_size_);
+    // bytes of the buffer holding data not executed yet
+    size_t filled = 0;
+    bool running = true;
+    while (running) {
+        if (filled == buffer.size()) {
+            // the line does not fit into the buffer
+            buffer.resize(buffer.size() * 2);
+        }
+        input.read(buffer.data() + filled, static_cast<std::streamsize>(buffer.size() - filled));
+        filled += static_cast<size_t>(input.gcount());
+
+        const std::string_view data(buffer.data(), filled);
+        size_t line_begin = 0;
+        for (size_t line_end = data.find('\n'); running && line_end != data.npos;
+             line_end = data.find('\n', line_begin)) {
+            running = Execute(data.substr(line_begin, line_end - line_begin), output);
+            line_begin = line_end + 1;
+        }
+
+        if (!input) {
+            if (running && line_begin < filled) {
+                Execute(data.substr(line_begin), output);
+            }
+            break;
+        }
+        // the pending commands refer to the buffer which is going to be overwritten
+        FlushSets();
+        std::copy(buffer.begin() + line_begin, buffer.begin() + filled, buffer.begin());
+        filled -= line_begin;
+    }
+    FlushSets();
+    FlushOutput(output);
+    return stats_;
+}
+
+// executes the command, returns false on exit
+bool CommandProcessor::Execute(std::string_view line, std::ostream& output) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.empty()) {
+        return true;
+    }
+    ++stats_.commands;
+
+    std::string_view arguments = line;
+    const std::string_view command = TakeWord(arguments);
+    if (command == "set"sv) {
+        const Position pos = Position::FromString(TakeWord(arguments));
+        pending_sets_.emplace_back(pos, arguments);
+        if (pending_sets_.size() >= batch_size_) {
+            FlushSets();
+        }
+        return true;
+    }
+
+    // the other commands see the sheet with all the previous sets applied
+    FlushSets();
+    if (line == "exit"sv) {
+        return false;
+    }
+    try {
+        if (command == "clear"sv) {
+            sheet_.ClearCell(Position::FromString(arguments));
+        } else if (line == "print values"sv) {
+            sheet_.PrintValues(buffer_);
+            FlushOutput(output);
+        } else if (line == "print texts"sv) {
+            sheet_.PrintTexts(buffer_);
+            FlushOutput(output);
+        } else if (command == "print"sv && arguments.substr(0, 5) == "diff "sv) {
+            GetCells(line).PrintDiff(buffer_, ParseVersion(arguments.substr(5)));
+            FlushOutput(output);
+        } else if (command == "insert"sv || command == "delete"sv) {
+            // a DurableSheet does not log the layout changes: its log is replayed over
+            // the snapshots which may contain the records already, and they are not repeatable
+            if (!bulk_sheet_) {
+                throw std::invalid_argument("Not supported by the sheet: "s + std::string(line));
+            }
+            ChangeLayout(*bulk_sheet_, command, arguments);
+        } else if (line == "stats"sv) {
+            buffer_ << GetCells(line).GetStats();
+            FlushOutput(output);
+        } else if (line == "memory"sv) {
+            buffer_ << GetCells(line).GetMemoryUsage();
+            FlushOutput(output);
+        } else {
+            throw std::invalid_argument("Unknown command: "s + std::string(line));
+        }
+    } catch (const std::exception& exc) {
+        ReportError(exc);
+    }
+    return true;
+}
+
+// writes the collected set commands to the sheet
+void CommandProcessor::FlushSets() {
+    if (pending_sets_.empty()) {
+        return;
+    }
+    if (bulk_sheet_ && pending_sets_.size() > 1) {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(pending_sets_.size());
+        for (const auto& [pos, text] : pending_sets_) {
+            cells.emplace_back(pos, std::string(text));
+        }
+        try {
+            bulk_sheet_->SetCells(std::move(cells));
+            ++stats_.bulk_writes;
+            pending_sets_.clear();
+            return;
+        } catch (const std::exception&) {
+            // the batch is rolled back, the rejected commands are found one by one
+        }
+    }
+    for (const auto& [pos, text] : pending_sets_) {
+        try {
+            sheet_.SetCell(pos, std::string(text));
+        } catch (const std::exception& exc) {
+            ReportError(exc);
+        }
+    }
+    pending_sets_.clear();
+}
+
+// writes the buffered output
+void CommandProcessor::FlushOutput(std::ostream& output) {
+    const std::string data = buffer_.str();
+    output.write(data.data(), static_cast<std::streamsize>(data.size()));
+    output.flush();
+    buffer_.str({});
+}
+
+void CommandProcessor::ReportError(const std::exception& exc) {
+    ++stats_.errors;
+    buffer_ << "Error: "sv << exc.what() << '\n';
+}
+
+// returns the sheet holding the cells, throws if the command cannot read it
+const Sheet& CommandProcessor::GetCells(std::string_view line) const {
+    if (!cells_) {
+        throw std::invalid_argument("Not supported by the sheet: "s + std::string(line));
+    }
+    return *cells_;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <iosfwd>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// High-throughput processing of the SheetHandle commands:
+//     set pos text, clear pos, print values, print texts, print diff version,
+//     insert rows|cols line [count], delete rows|cols line [count], stats, memory, exit
+// The input is read in large blocks and split into lines and words without
+// copying. Consecutive set commands of a block are collected and written to a Sheet with
+// one SetCells call; if the batch is rejected, its commands are repeated one by
+// one, so the result is the same as with sequential execution. The output is
+// buffered and flushed only at print commands and at the end of the input.
+// A rejected command does not stop the processing, its error is written to the
+// output. Unlike SheetHandle, the text of set is the rest of the line, so it
+// may contain spaces. The commands which SheetInterface does not have need a
+// Sheet; a DurableSheet serves only the reading ones, print diff, stats and memory.
+class CommandProcessor {
+public:
+    struct Stats {
+        size_t commands = 0;
+        size_t errors = 0;
+        // number of batches of set commands written at once
+        size_t bulk_writes = 0;
+    };
+
+    explicit CommandProcessor(SheetInterface& sheet, size_t block_size = 1 << 20, size_t batch_size = 1 << 14);
+
+    // executes the commands until exit or the end of the input
+    Stats Run(std::istream& input, std::ostream& output);
+
+private:
+    // executes the command, returns false on exit
+    bool Execute(std::string_view line, std::ostream& output);
+    // writes the collected set commands to the sheet
+    void FlushSets();
+    // writes the buffered output
+    void FlushOutput(std::ostream& output);
+    void ReportError(const std::exception& exc);
+    // returns the sheet holding the cells, throws if the command cannot read it
+    const Sheet& GetCells(std::string_view line) const;
+
+    SheetInterface& sheet_;
+    // the sheet supporting bulk writes, nullptr if the sheet is not a Sheet
+    Sheet* bulk_sheet_;
+    // the sheet holding the cells, read by the commands which SheetInterface does not have:
+    // the sheet itself or the sheet of a DurableSheet, nullptr for the other sheets
+    const Sheet* cells_;
+    size_t block_size_;
+    size_t batch_size_;
+
+    // set commands referring to the current block of the input
+    std::vector<std::pair<Position, std::string_view>> pending_sets_;
+    std::ostringstream buffer_;
+    Stats stats_;
+};
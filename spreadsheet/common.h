@@ -33,6 +33,50 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек, например A1:B10. Углы from и to входят в
+// диапазон, from — левый верхний угол, to — правый нижний.
+struct Range {
+    Position from;
+    Position to;
+
+    bool operator==(const Range& rhs) const;
+    bool operator<(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // Возвращает число строк и столбцов диапазона.
+    Size GetSize() const;
+    // Возвращает число ячеек диапазона.
+    size_t GetCellCount() const;
+    std::string ToString() const;
+
+    // Возвращает диапазон с углами first и second, заданными в любом порядке.
+    static Range FromCorners(Position first, Position second);
+};
+
+// Вставка или удаление строк либо столбцов таблицы: count строк (столбцов)
+// вставляются перед строкой (столбцом) at, если count больше нуля, или
+// удаляются, начиная с at, если count меньше нуля. Ячейки после них
+// сдвигаются.
+struct LayoutChange {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    Axis axis = Axis::Rows;
+    int at = 0;
+    int count = 0;
+
+    // Возвращает новую позицию ячейки. Удалённая ячейка и ячейка, сдвинутая
+    // за пределы таблицы, получают позицию Position::NONE.
+    Position Apply(Position pos) const;
+    // Возвращает новый диапазон: вставка внутри диапазона расширяет его,
+    // удаление части его строк (столбцов) сужает. Диапазон, все ячейки
+    // которого удалены, становится некорректным — {Position::NONE, Position::NONE}.
+    Range Apply(const Range& range) const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -77,6 +121,8 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение, но текст не копируется, а указывает на содержимое ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -84,6 +130,9 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает видимое значение ячейки без копирования текста. Представление
+    // действительно до следующего изменения таблицы.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -95,6 +144,11 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Копирует текст представления в значение
+CellInterface::Value ToValue(const CellInterface::ValueView& view);
+// Возвращает представление значения, действительное, пока существует value
+CellInterface::ValueView ToValueView(const CellInterface::Value& value);
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
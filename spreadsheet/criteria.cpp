@@ -0,0 +1,189 @@
+#include "criteria.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+constexpr double NOT_NUMBER = std::numeric_limits<double>::quiet_NaN();
+
+// reads the value of the cell, a missing cell is empty
+AggregateInput ReadInput(const SheetInterface& sheet, Position pos) {
+    const CellInterface* cell = sheet.GetCell(pos);
+    return cell ? AggregateInput::FromValue(cell->GetValueView()) : AggregateInput{};
+}
+
+// returns the number the criterion is matched by or NaN, -0 is read as 0,
+// so that both are one key of the hash table
+double ToKey(const AggregateInput& input) {
+    return input.kind == AggregateInput::Kind::Number ? input.number + 0.0 : NOT_NUMBER;
+}
+
+// returns the cell at the offset of the range counted in the row-major order
+Position GetPositionAt(const Range& range, size_t offset) {
+    const size_t cols = static_cast<size_t>(range.GetSize().cols);
+    return {range.from.row + static_cast<int>(offset / cols), range.from.col + static_cast<int>(offset % cols)};
+}
+}  // namespace
+
+// returns the offset of the cell in the range, counted in the row-major order
+size_t GetOffset(const Range& range, Position pos) {
+    return static_cast<size_t>(pos.row - range.from.row) * range.GetSize().cols + (pos.col - range.from.col);
+}
+
+// aggregates the values at the criteria equal to the key reading all cells of the ranges from the sheet
+AggregateValue AggregateRangeIf(const SheetInterface& sheet, const Range& criteria, const Range& values, double key) {
+    AggregateValue value;
+    const Size size = criteria.GetSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (ToKey(ReadInput(sheet, {criteria.from.row + row, criteria.from.col + col})) == key) {
+                value.Add(ReadInput(sheet, {values.from.row + row, values.from.col + col}));
+            }
+        }
+    }
+    return value;
+}
+
+// class CriteriaIndex methods
+CriteriaIndex::CriteriaIndex(Range criteria, Range values) : criteria_{criteria}, values_{values} {
+}
+
+const Range& CriteriaIndex::GetCriteria() const {
+    return criteria_;
+}
+
+const Range& CriteriaIndex::GetValues() const {
+    return values_;
+}
+
+// checks whether the cell is in one of the ranges
+bool CriteriaIndex::Contains(Position pos) const {
+    return criteria_.Contains(pos) || values_.Contains(pos);
+}
+
+// returns the revision of the sheet the changes of the cells are recorded up to
+std::uint64_t CriteriaIndex::GetSyncedRevision() const {
+    return synced_revision_;
+}
+
+void CriteriaIndex::SetSyncedRevision(std::uint64_t revision) {
+    synced_revision_ = revision;
+}
+
+// records the change of the cell of the ranges
+void CriteriaIndex::RecordChange(Position pos) {
+    if (!valid_) {
+        return;
+    }
+    // reading more cells than there are in the ranges costs more than grouping all of them again
+    if (changes_.size() >= keys_.size()) {
+        valid_ = false;
+        changes_.clear();
+        return;
+    }
+    // a cell may be a criterion of one offset and a value of another one
+    if (criteria_.Contains(pos)) {
+        AddChange(static_cast<std::uint32_t>(GetOffset(criteria_, pos)));
+    }
+    if (!(values_ == criteria_) && values_.Contains(pos)) {
+        AddChange(static_cast<std::uint32_t>(GetOffset(values_, pos)));
+    }
+}
+
+// returns the aggregate of the values at the criteria equal to the key
+AggregateValue CriteriaIndex::Get(const SheetInterface& sheet, double key) {
+    if (!valid_ || updates_ + changes_.size() > keys_.size()) {
+        Build(sheet);
+    } else if (!changes_.empty()) {
+        ApplyChanges(sheet);
+    }
+    auto iter = groups_.find(key + 0.0);
+    return iter != groups_.end() ? iter->second.value : AggregateValue{};
+}
+
+// returns the size of the copy of the cells and of the groups
+size_t CriteriaIndex::GetMemoryUsage() const {
+    return keys_.capacity() * sizeof(double) + inputs_.capacity() * sizeof(AggregateInput) + GetHeapSize(groups_)
+           + changes_.capacity() * sizeof(std::uint32_t);
+}
+
+// reads all cells of the ranges and groups them
+void CriteriaIndex::Build(const SheetInterface& sheet) {
+    const size_t count = criteria_.GetCellCount();
+    const bool separate_values = !(values_ == criteria_);
+    keys_.resize(count);
+    inputs_.resize(separate_values ? count : 0);
+    groups_.clear();
+    changes_.clear();
+    updates_ = 0;
+    valid_ = true;
+
+    for (size_t offset = 0; offset < count; ++offset) {
+        keys_[offset] = ToKey(ReadInput(sheet, GetPositionAt(criteria_, offset)));
+        if (separate_values) {
+            inputs_[offset] = ReadInput(sheet, GetPositionAt(values_, offset));
+        }
+        AddToGroup(static_cast<std::uint32_t>(offset));
+    }
+}
+
+// reads the changed cells and moves them between the groups
+void CriteriaIndex::ApplyChanges(const SheetInterface& sheet) {
+    std::sort(changes_.begin(), changes_.end());
+    changes_.erase(std::unique(changes_.begin(), changes_.end()), changes_.end());
+    // a sum which overflowed cannot be restored by subtracting the number
+    auto is_finite = [this](double key) {
+        auto iter = groups_.find(key);
+        return iter == groups_.end() || iter->second.value.IsFinite();
+    };
+    bool finite = true;
+    for (const std::uint32_t offset : changes_) {
+        const double old_key = keys_[offset];
+        RemoveFromGroup(offset);
+        keys_[offset] = ToKey(ReadInput(sheet, GetPositionAt(criteria_, offset)));
+        if (!inputs_.empty()) {
+            inputs_[offset] = ReadInput(sheet, GetPositionAt(values_, offset));
+        }
+        AddToGroup(offset);
+        finite = finite && is_finite(old_key) && is_finite(keys_[offset]);
+        ++updates_;
+    }
+    changes_.clear();
+    if (!finite) {
+        Build(sheet);
+    }
+}
+
+// every formula holding the index records the change, the repeated offset is not added
+void CriteriaIndex::AddChange(std::uint32_t offset) {
+    if (changes_.empty() || changes_.back() != offset) {
+        changes_.push_back(offset);
+    }
+}
+
+void CriteriaIndex::AddToGroup(std::uint32_t offset) {
+    const double key = keys_[offset];
+    if (std::isnan(key)) {
+        return;
+    }
+    Group& group = groups_[key];
+    // the values which are the criteria themselves are the numbers of the keys
+    group.value.Add(inputs_.empty() ? AggregateInput{AggregateInput::Kind::Number, key} : inputs_[offset]);
+    ++group.cells;
+}
+
+void CriteriaIndex::RemoveFromGroup(std::uint32_t offset) {
+    const double key = keys_[offset];
+    if (std::isnan(key)) {
+        return;
+    }
+    auto iter = groups_.find(key);
+    // the last cell takes the group with the rounding errors of its sum
+    if (--iter->second.cells == 0) {
+        groups_.erase(iter);
+        return;
+    }
+    iter->second.value.Remove(inputs_.empty() ? AggregateInput{AggregateInput::Kind::Number, key} : inputs_[offset]);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "aggregate.h"
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// returns the aggregate of the cells of the values range which stand at the
+// cells of the criteria range equal to the key; the ranges have one size
+using GetConditionalValue = std::function<AggregateValue(const Range& criteria, const Range& values, double key)>;
+
+// returns the offset of the cell in the range, counted in the row-major order
+size_t GetOffset(const Range& range, Position pos);
+
+// aggregates the values at the criteria equal to the key reading all cells
+// of the ranges from the sheet; as in the lookup functions, only the numbers
+// of the criteria are matched, texts which are not numbers, errors and
+// empty cells never match
+AggregateValue AggregateRangeIf(const SheetInterface& sheet, const Range& criteria, const Range& values, double key);
+
+// Groups the values of a range by the numbers of the criteria range, so
+// that SUMIF, COUNTIF and AVERAGEIF with any key take one aggregate from a
+// hash table. The values and the criteria are read on the first request
+// and every group is aggregated in one pass; a changed cell is recorded and
+// read again on the next request, its value is moved between the groups in
+// O(1). The groups are computed again periodically, so that the sums do
+// not drift, and when the changes outnumber the cells.
+class CriteriaIndex {
+public:
+    CriteriaIndex(Range criteria, Range values);
+
+    const Range& GetCriteria() const;
+    const Range& GetValues() const;
+    // checks whether the cell is in one of the ranges
+    bool Contains(Position pos) const;
+    // records the change of the cell of the ranges
+    void RecordChange(Position pos);
+    // returns the revision of the sheet the changes of the cells are recorded up to; the
+    // validating recalculation mode does not record the changes when they are made, the
+    // formulas sharing the index bring it up to date when they use it
+    std::uint64_t GetSyncedRevision() const;
+    void SetSyncedRevision(std::uint64_t revision);
+    // returns the aggregate of the values at the criteria equal to the key
+    AggregateValue Get(const SheetInterface& sheet, double key);
+    // returns the size of the copy of the cells and of the groups
+    size_t GetMemoryUsage() const;
+
+private:
+    // the aggregate of the values of the group and the count of its cells
+    struct Group {
+        AggregateValue value;
+        std::uint32_t cells = 0;
+    };
+
+    // reads all cells of the ranges and groups them
+    void Build(const SheetInterface& sheet);
+    // reads the changed cells and moves them between the groups
+    void ApplyChanges(const SheetInterface& sheet);
+    void AddChange(std::uint32_t offset);
+    void AddToGroup(std::uint32_t offset);
+    void RemoveFromGroup(std::uint32_t offset);
+
+    Range criteria_;
+    Range values_;
+    bool valid_ = false;
+    // the numbers of the criteria by their offsets, NaN for the cells which are not numbers
+    std::vector<double> keys_;
+    // the values by their offsets, not kept when the values are the criteria themselves
+    std::vector<AggregateInput> inputs_;
+    std::unordered_map<double, Group> groups_;
+    // the offsets of the changed cells, possibly repeated
+    std::vector<std::uint32_t> changes_;
+    // the number of the changes applied since the groups were computed
+    size_t updates_ = 0;
+    std::uint64_t synced_revision_ = 0;
+};
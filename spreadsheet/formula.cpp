@@ -1,10 +1,13 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
 #include <sstream>
 
 using namespace std::literals;
@@ -39,18 +42,11 @@ struct FromCellValueToDouble {
     double operator()(double num) {
         return num;
     }
-    double operator()(const std::string& text) {
-        if (text.empty()) {
-            return 0.0;
+    double operator()(std::string_view text) {
+        if (auto num = TextToNumber(text)) {
+            return *num;
         }
-        std::istringstream str_to_double(text);
-        double num;
-        str_to_double >> num;
-
-        if(!str_to_double.eof() || str_to_double.fail()) {
-            throw FormulaError(FormulaError::Category::Value);
-        }
-        return num;
+        throw FormulaError(FormulaError::Category::Value);
     }
     double operator()(const FormulaError& e) {
         throw e;
@@ -61,11 +57,32 @@ struct FromCellValueToDouble {
 class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression)
-        : ast_(ParseFormulaAST(std::move(expression))) {
+        : ast_(ParseFormulaAST(std::move(expression)))
+        , has_branches_(ast_.HasBranches()) {
+    }
+
+    explicit Formula(const FormulaProgram& program)
+        : ast_(ParseFormulaAST(program))
+        , has_branches_(ast_.HasBranches()) {
     }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        std::function<double(const Position)> get_value = [&sheet](const Position pos) {
+        const RangeFunctions ranges{
+            [&sheet](const Range& range, bool /* extremes */) {
+                return AggregateRange(sheet, range);
+            },
+            [&sheet](const Range& range, double key, MatchMode mode) {
+                return FindInRangeByScan(sheet, range, key, mode);
+            },
+            [&sheet](const Range& criteria, const Range& values, double key) {
+                return AggregateRangeIf(sheet, criteria, values, key);
+            },
+        };
+        return Evaluate(sheet, ranges);
+    }
+
+    Value Evaluate(const SheetInterface& sheet, const RangeFunctions& ranges) const override {
+        GetValue get_value = [&sheet](const Position pos) {
             if (!pos.IsValid()) {
                  throw FormulaError(FormulaError::Category::Ref);
             }
@@ -73,11 +90,10 @@ public:
             if(!p_cell) {
                 return 0.0;
             }
-            auto cell_value = p_cell->GetValue();
-            return std::visit(FromCellValueToDouble(), cell_value);
+            return CellValueToNumber(p_cell->GetValueView());
         };
         try {
-            return ast_.Execute(get_value);
+            return ast_.Execute(get_value, ranges);
         } catch (const FormulaError& e) {
             return e;
         }
@@ -90,16 +106,101 @@ public:
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        auto cell_list = ast_.GetCells();
-        cell_list.unique();
-        return std::vector<Position>(cell_list.begin(), cell_list.end());
+        std::vector<Position> cells = GetCellReferences();
+        if (ast_.GetRanges().empty()) {
+            return cells;
+        }
+        for (const Range& range : GetRanges()) {
+            for (int row = range.from.row; row <= range.to.row; ++row) {
+                for (int col = range.from.col; col <= range.to.col; ++col) {
+                    cells.push_back({row, col});
+                }
+            }
+        }
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        return cells;
+    }
+
+    std::vector<Position> GetCellReferences() const override {
+        // the deleted cells are sorted first, they are #REF! and refer to no cell
+        auto first_cell = std::find_if(ast_.GetCells().begin(), ast_.GetCells().end(), [](Position pos) {
+            return pos.IsValid();
+        });
+        std::vector<Position> cells(first_cell, ast_.GetCells().end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        return cells;
+    }
+
+    std::vector<Range> GetRanges() const override {
+        std::vector<Range> ranges;
+        for (const Range& range : ast_.GetRanges()) {
+            // the deleted ranges are #REF!, they are not read
+            if (range.IsValid() && (ranges.empty() || !(ranges.back() == range))) {
+                ranges.push_back(range);
+            }
+        }
+        return ranges;
+    }
+
+    bool HasBranches() const override {
+        return has_branches_;
+    }
+
+    FormulaProgram Compile() const override {
+        return ast_.Compile();
+    }
+
+    bool ApplyLayoutChange(const LayoutChange& change) override {
+        return ast_.ApplyLayoutChange(change);
+    }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.formula_nodes += sizeof(*this) + ast_.GetNodesMemoryUsage();
+        usage.references += ast_.GetCellsMemoryUsage();
     }
 
 private:
     FormulaAST ast_;
+    // computed once, the tree does not change
+    bool has_branches_;
 };
 }  // namespace
 
+std::optional<double> TextToNumber(std::string_view text) {
+    if (text.empty()) {
+        return 0.0;
+    }
+    // the common case is parsed in place; the stream, which decides the
+    // accepted forms, parses the rest
+    double num;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), num);
+    if (error == std::errc{} && end == text.data() + text.size() && std::isfinite(num)) {
+        return num;
+    }
+    std::istringstream str_to_double{std::string(text)};
+    str_to_double >> num;
+
+    if(!str_to_double.eof() || str_to_double.fail()) {
+        return std::nullopt;
+    }
+    return num;
+}
+
+double CellValueToNumber(const CellInterface::Value& value) {
+    return std::visit(FromCellValueToDouble(), ToValueView(value));
+}
+
+double CellValueToNumber(const CellInterface::ValueView& value) {
+    return std::visit(FromCellValueToDouble(), value);
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    CountEvent(Counter::Parses);
+    ScopedTimer timer(Counter::ParseNanoseconds);
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(const FormulaProgram& program) {
+    return std::make_unique<Formula>(program);
 }
\ No newline at end of file
@@ -1,17 +1,45 @@
 #pragma once
 
+#include "aggregate.h"
 #include "common.h"
+#include "criteria.h"
+#include "lookup.h"
+#include "memory_usage.h"
+#include "program.h"
 
 #include <memory>
+#include <optional>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, COUNT, AVERAGE, MIN и MAX, аргументы которых —
+//   числа или диапазоны ячеек: SUM(A1:A10), MAX(A1:B5,C1*2)
+// * Функции поиска числа в строке или столбце: MATCH(B1,A1:A100,0),
+//   VLOOKUP(B1,A1:C100,3,0), XLOOKUP(B1,A1:A100,C1:C100,-1)
+// * Условные агрегатные функции SUMIF, COUNTIF и AVERAGEIF, которые агрегируют
+//   значения ячеек, стоящих напротив ячеек с числом-критерием:
+//   SUMIF(A1:A100,B1,C1:C100), COUNTIF(A1:A100,5)
+// * Сравнения =, <>, <, <=, > и >=, значение которых 1 или 0: A1>=B1
+// * Логические функции IF, AND, OR и NOT: IF(A1>0,B1,C1*2), AND(A1,B1<5).
+//   Ноль — ложь, любое другое число — истина. IF вычисляет только выбранную
+//   ветвь, AND и OR — аргументы до первого, определяющего результат, поэтому
+//   ошибки невычисленных аргументов не влияют на значение.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
+
+// Значения диапазонов, которые формула получает извне, а не вычисляет по
+// ячейкам листа: агрегаты диапазонов, результаты поиска в них и агрегаты
+// значений, отобранных по критерию.
+struct RangeFunctions {
+    GetRangeValue aggregate;
+    FindInRange find;
+    GetConditionalValue aggregate_if;
+};
+
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -25,6 +53,10 @@ public:
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // Вычисляет формулу так же, но агрегаты диапазонов, перечисленных в
+    // GetRanges(), результаты поиска в них и условные агрегаты берёт у ranges,
+    // а не считает по ячейкам листа.
+    virtual Value Evaluate(const SheetInterface& sheet, const RangeFunctions& ranges) const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
@@ -34,8 +66,46 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Возвращает ячейки, на которые формула ссылается вне диапазонов. Список
+    // отсортирован по возрастанию и не содержит повторяющихся ячеек.
+    virtual std::vector<Position> GetCellReferences() const = 0;
+    // Возвращает диапазоны, значения которых агрегируют или в которых ищут
+    // функции формулы, в том числе диапазоны критериев.
+    // Ячейки диапазонов входят в список GetReferencedCells(). Список
+    // отсортирован и не содержит повторяющихся диапазонов.
+    virtual std::vector<Range> GetRanges() const = 0;
+
+    // Возвращает true, если формула может не прочитать часть ячеек из
+    // GetReferencedCells(): в ней есть IF, AND или OR. Значение такой формулы
+    // зависит только от ячеек, прочитанных при её последнем вычислении.
+    virtual bool HasBranches() const = 0;
+
+    // Возвращает формулу в виде плоской постфиксной программы.
+    virtual FormulaProgram Compile() const = 0;
+
+    // Сдвигает ячейки и диапазоны, на которые ссылается формула, так же, как
+    // change сдвигает строки или столбцы таблицы, не разбирая формулу заново.
+    // Ссылки на удалённые ячейки и диапазоны становятся ошибкой #REF! и не
+    // входят в GetReferencedCells() и GetRanges(). Возвращает false, если ни
+    // одна ссылка не изменилась.
+    virtual bool ApplyLayoutChange(const LayoutChange& change) = 0;
+
+    // Добавляет к usage память, занятую формулой: объект формулы и узлы
+    // дерева, а также список ячеек, на которые ссылается формула.
+    virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
 };
 
+// Преобразует значение ячейки в число так же, как это делают формулы.
+// Бросает FormulaError, если значение не может быть трактовано как число.
+double CellValueToNumber(const CellInterface::Value& value);
+double CellValueToNumber(const CellInterface::ValueView& value);
+// Преобразует текст в число так же, как это делают формулы. Возвращает
+// nullopt, если текст не может быть трактован как число.
+std::optional<double> TextToNumber(std::string_view text);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// Восстанавливает формулу из скомпилированной программы без разбора текста.
+// Бросает FormulaException в случае, если программа некорректна.
+std::unique_ptr<FormulaInterface> ParseFormula(const FormulaProgram& program);
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include "importer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <istream>
+
+TsvImporter::TsvImporter(Sheet& sheet, size_t chunk_size, size_t batch_size)
+        : sheet_{sheet}, chunk_size_{std::max<size_t>(chunk_size, 1)}, batch_size_{std::max<size_t>(batch_size, 1)} {
+}
+
+// imports the input so that its first field goes to the origin cell
+TsvImporter::Stats TsvImporter::Import(std::istream& input, Position origin) {
+    Stats stats;
+    batch_.reserve(batch_size_);
+
+    std::vector<char> buffer(chunk_size_);
+    // bytes of the buffer holding data not imported yet
+    size_t filled = 0;
+    while (true) {
+        if (filled == buffer.size()) {
+            // the line does not fit into the buffer
+            buffer.resize(buffer.size() * 2);
+        }
+        input.read(buffer.data() + filled, static_cast<std::streamsize>(buffer.size() - filled));
+        filled += static_cast<size_t>(input.gcount());
+
+        const std::string_view data(buffer.data(), filled);
+        size_t line_begin = 0;
+        for (size_t line_end = data.find('\n'); line_end != data.npos; line_end = data.find('\n', line_begin)) {
+            ImportLine(data.substr(line_begin, line_end - line_begin),
+                       Position{origin.row + static_cast<int>(stats.rows), origin.col}, stats);
+            line_begin = line_end + 1;
+        }
+
+        if (!input) {
+            if (line_begin < filled) {
+                ImportLine(data.substr(line_begin),
+                           Position{origin.row + static_cast<int>(stats.rows), origin.col}, stats);
+            }
+            break;
+        }
+        std::copy(buffer.begin() + line_begin, buffer.begin() + filled, buffer.begin());
+        filled -= line_begin;
+    }
+    Flush();
+    return stats;
+}
+
+TsvImporter::FieldKind TsvImporter::Classify(std::string_view field) {
+    if (field.empty()) {
+        return FieldKind::Empty;
+    }
+    if (field[0] == FORMULA_SIGN && field.size() > 1) {
+        return FieldKind::Formula;
+    }
+    double number;
+    const char* end = field.data() + field.size();
+    if (auto [ptr, error] = std::from_chars(field.data(), end, number); error == std::errc{} && ptr == end) {
+        return FieldKind::Number;
+    }
+    return FieldKind::Text;
+}
+
+void TsvImporter::ImportLine(std::string_view line, Position row_origin, Stats& stats) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    ++stats.rows;
+
+    int col = row_origin.col;
+    size_t field_begin = 0;
+    while (true) {
+        const size_t field_end = std::min(line.find('\t', field_begin), line.size());
+        const std::string_view field = line.substr(field_begin, field_end - field_begin);
+
+        // numbers are stored as text, formulas convert them when they are evaluated
+        switch (Classify(field)) {
+            case FieldKind::Empty:
+                ++stats.empty;
+                break;
+            case FieldKind::Text:
+                ++stats.texts;
+                break;
+            case FieldKind::Number:
+                ++stats.numbers;
+                break;
+            case FieldKind::Formula:
+                ++stats.formulas;
+                break;
+        }
+        if (!field.empty()) {
+            batch_.emplace_back(Position{row_origin.row, col}, std::string(field));
+            if (batch_.size() >= batch_size_) {
+                Flush();
+            }
+        }
+
+        if (field_end == line.size()) {
+            break;
+        }
+        field_begin = field_end + 1;
+        ++col;
+    }
+}
+
+// writes the collected cells to the sheet
+void TsvImporter::Flush() {
+    if (batch_.empty()) {
+        return;
+    }
+    sheet_.SetCells(std::move(batch_));
+    batch_.clear();
+}
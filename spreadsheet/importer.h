@@ -0,0 +1,51 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Streaming import of tab separated values in the layout produced by
+// Sheet::PrintTexts: one line per row, cells are separated by tabs, an empty
+// field is an empty cell. The input is read in chunks and split into rows and
+// fields without copying; the cells are written with Sheet::SetCells in
+// batches of fixed size, so the memory used does not depend on the size of the
+// input, only on the length of its longest line.
+// If a batch is rejected, the batches written before it stay in the sheet.
+class TsvImporter {
+public:
+    struct Stats {
+        size_t rows = 0;
+        size_t empty = 0;
+        size_t texts = 0;
+        size_t numbers = 0;
+        size_t formulas = 0;
+    };
+
+    explicit TsvImporter(Sheet& sheet, size_t chunk_size = 1 << 20, size_t batch_size = 1 << 14);
+
+    // imports the input so that its first field goes to the origin cell
+    Stats Import(std::istream& input, Position origin = {0, 0});
+
+private:
+    enum class FieldKind {
+        Empty,
+        Text,
+        Number,
+        Formula,
+    };
+
+    static FieldKind Classify(std::string_view field);
+
+    void ImportLine(std::string_view line, Position row_origin, Stats& stats);
+    // writes the collected cells to the sheet
+    void Flush();
+
+    Sheet& sheet_;
+    size_t chunk_size_;
+    size_t batch_size_;
+    std::vector<std::pair<Position, std::string>> batch_;
+};
@@ -0,0 +1,299 @@
+#include "lookup.h"
+#include "aggregate.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace {
+constexpr double NOT_NUMBER = std::numeric_limits<double>::quiet_NaN();
+constexpr std::uint32_t MAX_OFFSET = std::numeric_limits<std::uint32_t>::max();
+
+// returns the number of the cell or NaN, -0 is read as 0, so that both are one key of the hash table
+double ReadNumber(const SheetInterface& sheet, Position pos) {
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (!cell) {
+        return NOT_NUMBER;
+    }
+    const AggregateInput input = AggregateInput::FromValue(cell->GetValueView());
+    return input.kind == AggregateInput::Kind::Number ? input.number + 0.0 : NOT_NUMBER;
+}
+
+bool IsSameNumber(double lhs, double rhs) {
+    return lhs == rhs || (std::isnan(lhs) && std::isnan(rhs));
+}
+}  // namespace
+
+// returns the mode selected by the argument of the function, nullopt if the
+// argument is omitted; throws FormulaError for an unknown mode
+MatchMode GetMatchMode(LookupFunction function, std::optional<double> argument) {
+    switch (function) {
+        case LookupFunction::Match:
+            // the type 1, the default one, finds the largest number not greater than the key
+            if (!argument || *argument > 0) {
+                return MatchMode::ExactOrSmaller;
+            }
+            return *argument == 0 ? MatchMode::Exact : MatchMode::ExactOrLarger;
+        case LookupFunction::VLookup:
+            return !argument || *argument != 0 ? MatchMode::ExactOrSmaller : MatchMode::Exact;
+        case LookupFunction::XLookup:
+            if (!argument || *argument == 0) {
+                return MatchMode::Exact;
+            } else if (*argument == -1) {
+                return MatchMode::ExactOrSmaller;
+            } else if (*argument == 1) {
+                return MatchMode::ExactOrLarger;
+            }
+            break;
+    }
+    throw FormulaError(FormulaError::Category::Value);
+}
+
+// checks that the range is a single row or a single column
+bool IsVector(const Range& range) {
+    return range.from.row == range.to.row || range.from.col == range.to.col;
+}
+
+// returns the cell at the offset of the row or the column range
+Position GetCellAt(const Range& range, size_t offset) {
+    if (range.from.row == range.to.row) {
+        return {range.from.row, range.from.col + static_cast<int>(offset)};
+    }
+    return {range.from.row + static_cast<int>(offset), range.from.col};
+}
+
+// finds the key among count numbers comparing all of them
+std::optional<size_t> FindByScan(size_t count, double key, MatchMode mode,
+                                 const std::function<std::optional<double>(size_t)>& get_number) {
+    std::optional<size_t> found;
+    double found_number = 0.0;
+    for (size_t offset = 0; offset < count; ++offset) {
+        const std::optional<double> number = get_number(offset);
+        if (!number) {
+            continue;
+        }
+        // the later cells with the same number are not taken
+        bool better = false;
+        switch (mode) {
+            case MatchMode::Exact:
+                if (*number == key) {
+                    return offset;
+                }
+                break;
+            case MatchMode::ExactOrSmaller:
+                better = *number <= key && (!found || *number > found_number);
+                break;
+            case MatchMode::ExactOrLarger:
+                better = *number >= key && (!found || *number < found_number);
+                break;
+        }
+        if (better) {
+            found = offset;
+            found_number = *number;
+        }
+    }
+    return found;
+}
+
+// finds the key among the cells of the row or the column range read from the sheet
+std::optional<size_t> FindInRangeByScan(const SheetInterface& sheet, const Range& range, double key, MatchMode mode) {
+    return FindByScan(range.GetCellCount(), key, mode, [&sheet, &range](size_t offset) -> std::optional<double> {
+        const double number = ReadNumber(sheet, GetCellAt(range, offset));
+        return std::isnan(number) ? std::nullopt : std::optional<double>{number};
+    });
+}
+
+// class LookupIndex methods
+LookupIndex::LookupIndex(Range range) : range_{range} {
+}
+
+const Range& LookupIndex::GetRange() const {
+    return range_;
+}
+
+// returns the revision of the sheet the changes of the cells are recorded up to
+std::uint64_t LookupIndex::GetSyncedRevision() const {
+    return synced_revision_;
+}
+
+void LookupIndex::SetSyncedRevision(std::uint64_t revision) {
+    synced_revision_ = revision;
+}
+
+// records the change of the cell of the range
+void LookupIndex::RecordChange(Position pos) {
+    if (!valid_) {
+        return;
+    }
+    // one of the differences is zero in a row or a column
+    const auto offset = static_cast<std::uint32_t>(pos.row - range_.from.row + pos.col - range_.from.col);
+    // every formula holding the index records the change, the repeated offset is not added
+    if (!changes_.empty() && changes_.back() == offset) {
+        return;
+    }
+    // reading more cells than there are in the range costs more than reading all of them again
+    if (changes_.size() >= numbers_.size()) {
+        valid_ = false;
+        changes_.clear();
+        return;
+    }
+    changes_.push_back(offset);
+}
+
+// returns the offset of the found cell in the range
+std::optional<size_t> LookupIndex::Find(const SheetInterface& sheet, double key, MatchMode mode) {
+    if (!valid_) {
+        Build(sheet);
+    } else if (!changes_.empty()) {
+        ApplyChanges(sheet);
+    }
+    if (std::isnan(key)) {
+        return std::nullopt;
+    }
+
+    switch (mode) {
+        case MatchMode::Exact: {
+            if (!has_hash_) {
+                BuildHash();
+            }
+            auto iter = hash_.find(key);
+            if (iter == hash_.end()) {
+                return std::nullopt;
+            }
+            return iter->second.first;
+        }
+        case MatchMode::ExactOrSmaller: {
+            if (!has_sorted_) {
+                BuildSorted();
+            }
+            auto iter = sorted_.upper_bound({key, MAX_OFFSET});
+            if (iter == sorted_.begin()) {
+                return std::nullopt;
+            }
+            // the last pair with the number precedes the first one with a larger number
+            return sorted_.lower_bound({std::prev(iter)->first, 0})->second;
+        }
+        case MatchMode::ExactOrLarger: {
+            if (!has_sorted_) {
+                BuildSorted();
+            }
+            auto iter = sorted_.lower_bound({key, 0});
+            if (iter == sorted_.end()) {
+                return std::nullopt;
+            }
+            return iter->second;
+        }
+    }
+    return std::nullopt;
+}
+
+// returns the size of the copy of the numbers and of the indexes
+size_t LookupIndex::GetMemoryUsage() const {
+    // a node of the tree holds its color, three links and the value
+    constexpr size_t sorted_node_size = 4 * sizeof(void*) + sizeof(std::pair<double, std::uint32_t>);
+    return numbers_.capacity() * sizeof(double) + GetHeapSize(hash_) + sorted_.size() * sorted_node_size
+           + changes_.capacity() * sizeof(std::uint32_t);
+}
+
+// reads the numbers of all cells of the range, the indexes are built again on demand
+void LookupIndex::Build(const SheetInterface& sheet) {
+    const size_t count = range_.GetCellCount();
+    numbers_.resize(count);
+    for (size_t offset = 0; offset < count; ++offset) {
+        numbers_[offset] = ReadNumber(sheet, GetCellAt(range_, offset));
+    }
+    changes_.clear();
+    valid_ = true;
+
+    has_hash_ = false;
+    hash_.clear();
+    has_sorted_ = false;
+    sorted_.clear();
+}
+
+// reads the changed cells and updates the indexes
+void LookupIndex::ApplyChanges(const SheetInterface& sheet) {
+    std::sort(changes_.begin(), changes_.end());
+    changes_.erase(std::unique(changes_.begin(), changes_.end()), changes_.end());
+    for (const std::uint32_t offset : changes_) {
+        const double number = ReadNumber(sheet, GetCellAt(range_, offset));
+        if (IsSameNumber(number, numbers_[offset])) {
+            continue;
+        }
+        RemoveFromIndexes(offset);
+        numbers_[offset] = number;
+        AddToIndexes(offset);
+    }
+    changes_.clear();
+}
+
+void LookupIndex::AddToIndexes(std::uint32_t offset) {
+    const double number = numbers_[offset];
+    if (std::isnan(number)) {
+        return;
+    }
+    if (has_sorted_) {
+        sorted_.insert({number, offset});
+    }
+    if (has_hash_) {
+        auto [iter, inserted] = hash_.try_emplace(number, Occurrences{offset, 0});
+        iter->second.first = std::min(iter->second.first, offset);
+        ++iter->second.count;
+    }
+}
+
+void LookupIndex::RemoveFromIndexes(std::uint32_t offset) {
+    const double number = numbers_[offset];
+    if (std::isnan(number)) {
+        return;
+    }
+    if (has_sorted_) {
+        sorted_.erase({number, offset});
+    }
+    if (!has_hash_) {
+        return;
+    }
+    auto iter = hash_.find(number);
+    if (--iter->second.count == 0) {
+        hash_.erase(iter);
+        return;
+    }
+    if (iter->second.first != offset) {
+        return;
+    }
+    // the next cell with the number follows the removed one
+    if (has_sorted_) {
+        iter->second.first = sorted_.lower_bound({number, offset})->second;
+    } else {
+        std::uint32_t next = offset + 1;
+        while (numbers_[next] != number) {
+            ++next;
+        }
+        iter->second.first = next;
+    }
+}
+
+void LookupIndex::BuildHash() {
+    hash_.clear();
+    hash_.reserve(numbers_.size());
+    for (std::uint32_t offset = 0; offset < numbers_.size(); ++offset) {
+        if (!std::isnan(numbers_[offset])) {
+            // the offsets grow, so the first one is kept
+            auto [iter, inserted] = hash_.try_emplace(numbers_[offset], Occurrences{offset, 0});
+            ++iter->second.count;
+        }
+    }
+    has_hash_ = true;
+}
+
+void LookupIndex::BuildSorted() {
+    sorted_.clear();
+    for (std::uint32_t offset = 0; offset < numbers_.size(); ++offset) {
+        if (!std::isnan(numbers_[offset])) {
+            sorted_.insert({numbers_[offset], offset});
+        }
+    }
+    has_sorted_ = true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// How the lookup functions match the key. Only the numbers of the cells are
+// matched: texts which are not numbers, errors and empty cells are never
+// found. Of several cells with the found number the first one is found.
+enum class MatchMode : std::uint8_t {
+    Exact,           // the number equal to the key
+    ExactOrSmaller,  // the largest number not greater than the key
+    ExactOrLarger,   // the smallest number not less than the key
+};
+
+// The functions which search for a key in a row or in a column of cells
+enum class LookupFunction : std::uint8_t {
+    Match,    // MATCH(key, range[, type]): the number of the found cell, counted from 1
+    VLookup,  // VLOOKUP(key, table, column[, approximate]): the cell of the row found in the first column
+    XLookup,  // XLOOKUP(key, range, results[, if_not_found[, mode]]): the cell of the results at the found one
+};
+
+// returns the offset of the found cell in the range, nullopt if there is no such cell
+using FindInRange = std::function<std::optional<size_t>(const Range& range, double key, MatchMode mode)>;
+
+// returns the mode selected by the argument of the function, nullopt if the
+// argument is omitted; throws FormulaError for an unknown mode
+MatchMode GetMatchMode(LookupFunction function, std::optional<double> argument);
+// checks that the range is a single row or a single column
+bool IsVector(const Range& range);
+// returns the cell at the offset of the row or the column range
+Position GetCellAt(const Range& range, size_t offset);
+
+// finds the key among count numbers comparing all of them, get_number
+// returns the number at the offset or nullopt if the cell is not a number
+std::optional<size_t> FindByScan(size_t count, double key, MatchMode mode,
+                                 const std::function<std::optional<double>(size_t)>& get_number);
+// finds the key among the cells of the row or the column range read from the sheet
+std::optional<size_t> FindInRangeByScan(const SheetInterface& sheet, const Range& range, double key, MatchMode mode);
+
+// Finds keys in a row or a column of a sheet without scanning it. The
+// numbers of the cells are copied on the first search; a hash table of the
+// first offset of every number serves the exact searches and an ordered set
+// of the numbers with their offsets serves the others, each is built on the
+// first search which needs it. A changed cell is recorded and read again on
+// the next search, the indexes are updated in O(1) and O(log n).
+class LookupIndex {
+public:
+    explicit LookupIndex(Range range);
+
+    const Range& GetRange() const;
+    // records the change of the cell of the range
+    void RecordChange(Position pos);
+    // returns the revision of the sheet the changes of the cells are recorded up to; the
+    // validating recalculation mode does not record the changes when they are made, the
+    // formulas sharing the index bring it up to date when they use it
+    std::uint64_t GetSyncedRevision() const;
+    void SetSyncedRevision(std::uint64_t revision);
+    // returns the offset of the found cell in the range
+    std::optional<size_t> Find(const SheetInterface& sheet, double key, MatchMode mode);
+    // returns the size of the copy of the numbers and of the indexes
+    size_t GetMemoryUsage() const;
+
+private:
+    // the first offset of a number and the count of the cells with it
+    struct Occurrences {
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+
+    // reads the numbers of all cells of the range, the indexes are built again on demand
+    void Build(const SheetInterface& sheet);
+    // reads the changed cells and updates the indexes
+    void ApplyChanges(const SheetInterface& sheet);
+    void AddToIndexes(std::uint32_t offset);
+    void RemoveFromIndexes(std::uint32_t offset);
+    void BuildHash();
+    void BuildSorted();
+
+    Range range_;
+    bool valid_ = false;
+    // the numbers of the cells by their offsets, NaN for the cells which are not numbers
+    std::vector<double> numbers_;
+    bool has_hash_ = false;
+    std::unordered_map<double, Occurrences> hash_;
+    bool has_sorted_ = false;
+    std::set<std::pair<double, std::uint32_t>> sorted_;
+    // the offsets of the changed cells, a cell changed again after the others is repeated
+    std::vector<std::uint32_t> changes_;
+    std::uint64_t synced_revision_ = 0;
+};
@@ -1,13 +1,30 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <optional>
+#include <random>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "command_processor.h"
 #include "common.h"
 #include "formula.h"
+#include "importer.h"
+#include "overlay.h"
+#include "profiler.h"
+#ifdef __linux__
+#include "server.h"
+#endif
+#include "sheet.h"
+#include "snapshot.h"
+#include "sweep.h"
+#include "wal.h"
 #include "test_runner_p.h"
+#include "trace.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -137,6 +154,18 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestClearFormulaCell() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1");
+    // the cleared formula does not refer to B1 any more
+    sheet->ClearCell("A1"_pos);
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+    sheet->ClearCell("B1"_pos);
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    sheet->SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -351,6 +380,1639 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestRangeAggregates() {
+    using Value = CellInterface::Value;
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A5:A1)");
+    sheet.SetCell("B2"_pos, "=COUNT(A1:A5)+AVERAGE(A1:A5)");
+    sheet.SetCell("B3"_pos, "=MIN(A1:A5,10)*100+MAX(A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A5)");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(15.0));
+    ASSERT_EQUAL(value(sheet, "B2"), Value(8.0));
+    ASSERT_EQUAL(value(sheet, "B3"), Value(105.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells().size(), 5u);
+
+    // the aggregates follow single changes, the extremes too
+    sheet.SetCell("A5"_pos, "-1");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(9.0));
+    ASSERT_EQUAL(value(sheet, "B3"), Value(-96.0));
+    sheet.SetCell("A3"_pos, "=C1*2");
+    sheet.SetCell("C1"_pos, "10");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(26.0));
+    ASSERT_EQUAL(value(sheet, "B3"), Value(-80.0));
+    sheet.ClearCell("A5"_pos);
+    ASSERT_EQUAL(value(sheet, "B2"), Value(4.0 + 27.0 / 4));
+
+    // texts which are not numbers and errors fail all functions but COUNT
+    sheet.SetCell("A1"_pos, "'7");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(33.0));
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("C1"_pos, "=1/0");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(value(sheet, "B3"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet.SetCell("B4"_pos, "=COUNT(A1:A5)");
+    ASSERT_EQUAL(value(sheet, "B4"), Value(3.0));
+    sheet.SetCell("C1"_pos, "1");
+    ASSERT_EQUAL(value(sheet, "B1"), Value(15.0));
+
+    // empty ranges
+    sheet.SetCell("D1"_pos, "=AVERAGE(E1:E3)");
+    sheet.SetCell("D2"_pos, "=MAX(E1:E3)+COUNT(E1:E3)");
+    ASSERT_EQUAL(value(sheet, "D1"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(value(sheet, "D2"), Value(0.0));
+
+    // the cells of a range are not created, so the range changes neither the printed size nor the memory,
+    // only the blocks of 64 by 64 cells it covers are listed
+    {
+        Sheet short_range;
+        short_range.SetCell("A1"_pos, "=SUM(B1:B2)");
+        Sheet ranges;
+        ranges.SetCell("A1"_pos, "=SUM(B1:B64)");
+        ASSERT_EQUAL(ranges.GetMemoryUsage().GetTotal(), short_range.GetMemoryUsage().GetTotal());
+        ASSERT_EQUAL(value(ranges, "A1"), Value(0.0));
+        ASSERT_EQUAL(ranges.GetPrintableSize(), (Size{1, 1}));
+        ASSERT_EQUAL(ranges.GetCells().size(), 1u);
+        ranges.SetCell("B50"_pos, "2");
+        ASSERT_EQUAL(value(ranges, "A1"), Value(2.0));
+        ranges.ClearCell("B50"_pos);
+        ASSERT_EQUAL(value(ranges, "A1"), Value(0.0));
+        ASSERT_EQUAL(ranges.GetCells().size(), 1u);
+        // the formulas of the range are found by the sheet
+        ranges.SetCell("B2"_pos, "=C1");
+        ranges.SetCell("C1"_pos, "3");
+        ASSERT_EQUAL(value(ranges, "A1"), Value(3.0));
+        for (const char* cycle : {"C1", "B3"}) {
+            try {
+                ranges.SetCell(Position::FromString(cycle), "=A1");
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+        }
+    }
+
+    // a batch changing a cell twice
+    sheet.SetCells({{"A1"_pos, "100"}, {"A2"_pos, "text"}, {"A1"_pos, "50"}, {"A2"_pos, "1"}});
+    ASSERT_EQUAL(value(sheet, "B1"), Value(57.0));
+
+    for (const char* text : {"=SUM()", "=FOO(A1)", "=A1:A2", "=SUM(A1:A2", "=SUM(A1:ZZZZ1)", "=SUM(A1:ZZ16384)"}) {
+        try {
+            sheet.SetCell("D3"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    try {
+        sheet.SetCell("A4"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // the compiled program keeps the ranges and the functions
+    const FormulaInterface* formula = sheet.GetCellPtr("B3"_pos)->GetFormula();
+    ASSERT_EQUAL(ParseFormula(formula->Compile())->GetExpression(), formula->GetExpression());
+    ASSERT_EQUAL(formula->GetRanges().size(), 1u);
+
+    // the maintained aggregates agree with the ones computed from the cells
+    std::mt19937 generator(7);
+    const std::vector<std::string> texts = {"", "1.5", "-4", "'12", "word", "=1/0", "=G1+1", "1e308"};
+    sheet.SetCell("F1"_pos, "=SUM(E1:E20)");
+    sheet.SetCell("F2"_pos, "=MIN(E1:E20)+MAX(E1:E20)");
+    sheet.SetCell("F3"_pos, "=AVERAGE(E1:E20,F1)");
+    for (int step = 0; step < 2000; ++step) {
+        sheet.SetCell({static_cast<int>(generator() % 20), 4}, texts[generator() % texts.size()]);
+        for (Position pos : {"F1"_pos, "F2"_pos, "F3"_pos}) {
+            const Cell* cell = sheet.GetCellPtr(pos);
+            ASSERT_EQUAL(cell->GetValue(), cell->GetValueIn(sheet));
+        }
+    }
+}
+
+void TestLookupFunctions() {
+    using Value = CellInterface::Value;
+    const Value not_found = FormulaError(FormulaError::Category::Value);
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 0}, std::to_string((row + 1) * 10));
+        sheet.SetCell({row, 1}, std::to_string(row + 1));
+    }
+    sheet.SetCell("C1"_pos, "=MATCH(30,A1:A5,0)");
+    sheet.SetCell("C2"_pos, "=MATCH(35,A1:A5)*10+MATCH(35,A1:A5,-1)");
+    sheet.SetCell("C3"_pos, "=MATCH(5,A1:A5)");
+    sheet.SetCell("C4"_pos, "=VLOOKUP(40,A1:B5,2,0)*10+VLOOKUP(45,A5:B1,2)");
+    sheet.SetCell("C5"_pos, "=VLOOKUP(40,A1:B5,3,0)");
+    sheet.SetCell("D1"_pos, "=XLOOKUP(25,A1:A5,B1:B5)");
+    sheet.SetCell("D2"_pos, "=XLOOKUP(25,A1:A5,B1:B5,-7)");
+    sheet.SetCell("D3"_pos, "=XLOOKUP(25,A1:A5,B1:B5,0,1)*10+XLOOKUP(25,A1:A5,B1:B5,0,-1)");
+    sheet.SetCell("D4"_pos, "=MATCH(1,A1:B5,0)");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=VLOOKUP(40,A1:B5,2,0)*10+VLOOKUP(45,A1:B5,2)");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(3.0));
+    ASSERT_EQUAL(value(sheet, "C2"), Value(34.0));
+    ASSERT_EQUAL(value(sheet, "C3"), not_found);
+    ASSERT_EQUAL(value(sheet, "C4"), Value(44.0));
+    ASSERT_EQUAL(value(sheet, "C5"), Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(value(sheet, "D1"), not_found);
+    ASSERT_EQUAL(value(sheet, "D2"), Value(-7.0));
+    ASSERT_EQUAL(value(sheet, "D3"), Value(32.0));
+    ASSERT_EQUAL(value(sheet, "D4"), not_found);
+
+    // the indexes follow the changes: the first of equal numbers is found,
+    // texts are matched if they are numbers, other values are never matched
+    sheet.SetCell("A3"_pos, "35");
+    ASSERT_EQUAL(value(sheet, "C1"), not_found);
+    sheet.SetCell("A5"_pos, "30");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(5.0));
+    sheet.SetCell("A2"_pos, "'30");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(2.0));
+    sheet.SetCell("A2"_pos, "=1/0");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(5.0));
+    ASSERT_EQUAL(value(sheet, "D3"), Value(51.0));
+    sheet.SetCell("A1"_pos, "word");
+    ASSERT_EQUAL(value(sheet, "D3"), Value(50.0));
+    sheet.SetCell("B5"_pos, "text");
+    ASSERT_EQUAL(value(sheet, "D3"), not_found);
+
+    // the formulas sharing an index record a change once, so many of them do not make it read all cells again
+    {
+        Sheet cells;
+        for (int row = 0; row < 3; ++row) {
+            cells.SetCell({row, 0}, std::to_string(row));
+        }
+        LookupIndex index(Range{"A1"_pos, "A3"_pos});
+        ASSERT_EQUAL(index.Find(cells, 2, MatchMode::Exact).value_or(-1), 2u);
+        cells.SetCell("A1"_pos, "5");
+        for (int holder = 0; holder < 10; ++holder) {
+            index.RecordChange("A1"_pos);
+        }
+        // the change of A3 is not recorded, an index read again would find 7 there
+        cells.SetCell("A3"_pos, "7");
+        ASSERT_EQUAL(index.Find(cells, 5, MatchMode::Exact).value_or(-1), 0u);
+        ASSERT(!index.Find(cells, 7, MatchMode::Exact));
+    }
+
+    for (const char* text : {"=MATCH(1)", "=MATCH(1,2)", "=MATCH(A1:A2,A1:A2)", "=VLOOKUP(1,A1:B2)",
+                             "=XLOOKUP(1,A1:A2,3)", "=MATCH(1,A1:A2,0,1)"}) {
+        try {
+            sheet.SetCell("E1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    try {
+        sheet.SetCell("A4"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    const FormulaInterface* formula = sheet.GetCellPtr("D3"_pos)->GetFormula();
+    ASSERT_EQUAL(ParseFormula(formula->Compile())->GetExpression(), formula->GetExpression());
+
+    // the indexes agree with the searches through all cells, the parameter sweep too
+    std::mt19937 generator(11);
+    const std::vector<std::string> texts = {"", "1", "2", "3", "-2", "'2", "word", "=1/0", "=H1+1"};
+    const std::vector<std::string> lookups = {
+        "=MATCH(H1,E1:E20,0)", "=MATCH(H1,E1:E20)", "=MATCH(H1,E1:E20,-1)", "=VLOOKUP(H1,E1:G20,2,0)",
+        "=VLOOKUP(H1,E1:G20,3)", "=XLOOKUP(H1,E1:E20,G1:G20,-1,1)", "=XLOOKUP(H1+1,E1:E20,G1:G20,-1,-1)",
+    };
+    std::vector<Position> outputs;
+    for (const std::string& lookup : lookups) {
+        outputs.push_back({static_cast<int>(outputs.size()), 8});
+        sheet.SetCell(outputs.back(), lookup);
+    }
+    for (int step = 0; step < 2000; ++step) {
+        const int row = static_cast<int>(generator() % 20);
+        sheet.SetCell({row, 4}, texts[generator() % texts.size()]);
+        sheet.SetCell({row, 5 + static_cast<int>(generator() % 2)}, std::to_string(generator() % 5));
+        if (step % 10 == 0) {
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(generator() % 5) - 2));
+        }
+        for (Position pos : outputs) {
+            const Cell* cell = sheet.GetCellPtr(pos);
+            ASSERT_EQUAL(cell->GetValue(), cell->GetValueIn(sheet));
+        }
+        if (step % 100 == 0) {
+            const double key = static_cast<double>(generator() % 5) - 2;
+            const auto result = ParameterSweep(sheet, "H1"_pos, outputs).Run({key});
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(key)));
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                ASSERT_EQUAL(result[i][0], sheet.GetCell(outputs[i])->GetValue());
+            }
+        }
+    }
+}
+
+void TestConditionalAggregates() {
+    using Value = CellInterface::Value;
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    const std::vector<std::string> keys = {"1", "2", "1", "3", "'1", "word"};
+    for (int row = 0; row < 6; ++row) {
+        sheet.SetCell({row, 0}, keys[row]);
+        sheet.SetCell({row, 1}, std::to_string((row + 1) * 10));
+    }
+    sheet.SetCell("C1"_pos, "=SUMIF(A1:A6,1,B1:B6)");
+    sheet.SetCell("C2"_pos, "=COUNTIF(A6:A1,1)");
+    sheet.SetCell("C3"_pos, "=AVERAGEIF(A1:A6,0+1,B1:B6)");
+    sheet.SetCell("C4"_pos, "=SUMIF(A1:A6,2)");
+    sheet.SetCell("C5"_pos, "=AVERAGEIF(A1:A6,7,B1:B6)");
+    sheet.SetCell("C6"_pos, "=SUMIF(A1:A6,1,B1:B5)");
+    sheet.SetCell("D1"_pos, "=SUMIF(A1:A6,7,B1:B6)+COUNTIF(A1:A6,-1)");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=COUNTIF(A1:A6,1)");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(90.0));
+    ASSERT_EQUAL(value(sheet, "C2"), Value(3.0));
+    ASSERT_EQUAL(value(sheet, "C3"), Value(30.0));
+    ASSERT_EQUAL(value(sheet, "C4"), Value(2.0));
+    ASSERT_EQUAL(value(sheet, "C5"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(value(sheet, "C6"), Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value(sheet, "D1"), Value(0.0));
+    // the four formulas grouping the same ranges share the index
+    ASSERT_EQUAL(sheet.GetCriteriaIndex(Range{"A1"_pos, "A6"_pos}, Range{"B1"_pos, "B6"_pos}).use_count(), 5);
+
+    // the groups follow the changes of the criteria and of the values, only
+    // the values of the matched cells are aggregated
+    sheet.SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(110.0));
+    ASSERT_EQUAL(value(sheet, "C2"), Value(4.0));
+    sheet.SetCell("B3"_pos, "text");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value(sheet, "C2"), Value(4.0));
+    sheet.SetCell("B3"_pos, "=1/0");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet.SetCell("B4"_pos, "text");
+    sheet.SetCell("B3"_pos, "30");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(110.0));
+    sheet.SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(value(sheet, "C1"), Value(100.0));
+    ASSERT_EQUAL(value(sheet, "C3"), Value(100.0 / 3));
+    sheet.ClearCell("A3"_pos);
+    ASSERT_EQUAL(value(sheet, "C1"), Value(70.0));
+    ASSERT_EQUAL(value(sheet, "C2"), Value(2.0));
+
+    for (const char* text : {"=SUMIF(A1:A2)", "=COUNTIF(A1:A2,1,B1:B2)", "=SUMIF(1,A1:A2)", "=SUMIF(A1:A2,1,2)",
+                             "=COUNTIF(A1:A2,B1:B2)"}) {
+        try {
+            sheet.SetCell("E1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    try {
+        sheet.SetCell("B2"_pos, "=C3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    const FormulaInterface* formula = sheet.GetCellPtr("D1"_pos)->GetFormula();
+    ASSERT_EQUAL(ParseFormula(formula->Compile())->GetExpression(), formula->GetExpression());
+
+    // the groups agree with the aggregates computed from the cells, the parameter sweep too
+    std::mt19937 generator(13);
+    const std::vector<std::string> texts = {"", "1", "2", "-2", "'2", "0.5", "word", "=1/0", "=H1+1"};
+    const std::vector<std::string> conditionals = {
+        "=SUMIF(E1:E20,H1,F1:F20)", "=COUNTIF(E1:E20,H1)", "=AVERAGEIF(E1:E20,H1,F1:F20)", "=SUMIF(E1:E20,H1+1)",
+        "=AVERAGEIF(E1:F10,H1,F11:G20)", "=SUMIF(F1:F20,H1-1,E1:E20)",
+    };
+    std::vector<Position> outputs;
+    for (const std::string& conditional : conditionals) {
+        outputs.push_back({static_cast<int>(outputs.size()), 8});
+        sheet.SetCell(outputs.back(), conditional);
+    }
+    for (int step = 0; step < 2000; ++step) {
+        const int row = static_cast<int>(generator() % 20);
+        sheet.SetCell({row, 4 + static_cast<int>(generator() % 3)}, texts[generator() % texts.size()]);
+        if (step % 10 == 0) {
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(generator() % 5) - 2));
+        }
+        for (Position pos : outputs) {
+            const Cell* cell = sheet.GetCellPtr(pos);
+            ASSERT_EQUAL(cell->GetValue(), cell->GetValueIn(sheet));
+        }
+        if (step % 100 == 0) {
+            const double key = static_cast<double>(generator() % 5) - 2;
+            const auto result = ParameterSweep(sheet, "H1"_pos, outputs).Run({key});
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(key)));
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                ASSERT_EQUAL(result[i][0], sheet.GetCell(outputs[i])->GetValue());
+            }
+        }
+    }
+}
+
+void TestLogicalFunctions() {
+    using Value = CellInterface::Value;
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    const Value arithmetic_error = FormulaError(FormulaError::Category::Arithmetic);
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "10");
+    sheet.SetCell("C1"_pos, "20");
+    sheet.SetCell("D1"_pos, "=1+2>=3");
+    sheet.SetCell("D2"_pos, "=(1<2)=1");
+    sheet.SetCell("D3"_pos, "=1=(2<3)");
+    sheet.SetCell("D4"_pos, "=-(A1<>B1)*2");
+    sheet.SetCell("D5"_pos, "=IF(A1>0,B1,C1)");
+    sheet.SetCell("D6"_pos, "=IF(A1<0,B1)");
+    sheet.SetCell("D7"_pos, "=AND(A1,B1>5,C1)+OR(0,A1=2)*10+NOT(C1)*100");
+    sheet.SetCell("D8"_pos, "=IF(1,2,1/0)+AND(0,1/0)+OR(1,1/0)");
+    sheet.SetCell("D9"_pos, "=AND(1/0,0)");
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=1<2=1");
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=1=(2<3)");
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=-(A1<>B1)*2");
+    ASSERT_EQUAL(value(sheet, "D1"), Value(1.0));
+    ASSERT_EQUAL(value(sheet, "D2"), Value(1.0));
+    ASSERT_EQUAL(value(sheet, "D3"), Value(1.0));
+    ASSERT_EQUAL(value(sheet, "D4"), Value(-2.0));
+    ASSERT_EQUAL(value(sheet, "D5"), Value(10.0));
+    ASSERT_EQUAL(value(sheet, "D6"), Value(0.0));
+    ASSERT_EQUAL(value(sheet, "D7"), Value(1.0));
+    // the errors of the arguments which are not evaluated do not matter
+    ASSERT_EQUAL(value(sheet, "D8"), Value(3.0));
+    ASSERT_EQUAL(value(sheet, "D9"), arithmetic_error);
+    ASSERT(sheet.GetCellPtr("D5"_pos)->GetFormula()->HasBranches());
+    ASSERT(!sheet.GetCellPtr("D4"_pos)->GetFormula()->HasBranches());
+
+    // the formula keeps its value when the cell of the branch it did not take
+    // changes, and so do the cells depending on it
+    sheet.SetCell("E1"_pos, "=D5+1");
+    ASSERT_EQUAL(value(sheet, "E1"), Value(11.0));
+    const SheetStats before = sheet.GetStats();
+    sheet.SetCell("C1"_pos, "=1/0");
+    ASSERT(sheet.GetCellPtr("D5"_pos)->GetCachedValue().has_value());
+    ASSERT(sheet.GetCellPtr("E1"_pos)->GetCachedValue().has_value());
+    ASSERT_EQUAL(value(sheet, "D7"), arithmetic_error);
+    sheet.SetCell("A1"_pos, "-1");
+    ASSERT(!sheet.GetCellPtr("D5"_pos)->GetCachedValue().has_value());
+    ASSERT_EQUAL(value(sheet, "E1"), arithmetic_error);
+    ASSERT_EQUAL(value(sheet, "D6"), Value(10.0));
+    sheet.SetCell("C1"_pos, "5");
+    ASSERT_EQUAL(value(sheet, "E1"), Value(6.0));
+#if SPREADSHEET_STATS
+    ASSERT(sheet.GetStats().invalidations_skipped - before.invalidations_skipped >= 1u);
+#endif
+
+    for (const char* text : {"=IF(1)", "=IF(1,2,3,4)", "=NOT(1,2)", "=AND(A1:A2)", "=IF(A1:A2,1)", "=1<"}) {
+        try {
+            sheet.SetCell("F1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    // the dependencies are static: the branch which is not taken still makes a cycle
+    try {
+        sheet.SetCell("C1"_pos, "=IF(1,0,D5)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    const FormulaInterface* formula = sheet.GetCellPtr("D7"_pos)->GetFormula();
+    ASSERT_EQUAL(ParseFormula(formula->Compile())->GetExpression(), formula->GetExpression());
+
+    // the cached values agree with the values computed from the cells while the
+    // taken branches change, the parameter sweep too
+    std::mt19937 generator(17);
+    const std::vector<std::string> texts = {"", "0", "1", "2", "-1", "'1", "word", "=1/0", "=H1-1"};
+    const std::vector<std::string> logicals = {
+        "=IF(E1>H1,F1,G1)", "=IF(AND(E2,F2<>0),SUM(E1:G10),E3)", "=OR(E4,F4>=H1)+NOT(G4)",
+        "=IF(I1>1,I2,I3*2)", "=IF(E5=H1,MATCH(H1,E1:E10,0))", "=IF(OR(I1,I4<1),SUMIF(E1:E10,H1,F1:F10),1/G5)",
+    };
+    std::vector<Position> outputs;
+    for (const std::string& logical : logicals) {
+        outputs.push_back({static_cast<int>(outputs.size()), 8});
+        sheet.SetCell(outputs.back(), logical);
+    }
+    for (int step = 0; step < 2000; ++step) {
+        const int row = static_cast<int>(generator() % 10);
+        sheet.SetCell({row, 4 + static_cast<int>(generator() % 3)}, texts[generator() % texts.size()]);
+        if (step % 10 == 0) {
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(generator() % 5) - 2));
+        }
+        for (Position pos : outputs) {
+            const Cell* cell = sheet.GetCellPtr(pos);
+            ASSERT_EQUAL(cell->GetValue(), cell->GetValueIn(sheet));
+        }
+        if (step % 100 == 0) {
+            const double key = static_cast<double>(generator() % 5) - 2;
+            const auto result = ParameterSweep(sheet, "H1"_pos, outputs).Run({key});
+            sheet.SetCell("H1"_pos, std::to_string(static_cast<int>(key)));
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                ASSERT_EQUAL(result[i][0], sheet.GetCell(outputs[i])->GetValue());
+            }
+        }
+    }
+}
+
+void TestSheetOverlay() {
+    Sheet base;
+    base.SetCell("A1"_pos, "1");
+    base.SetCell("A2"_pos, "=A1*10");
+    base.SetCell("A3"_pos, "=A2+B1");
+    base.SetCell("B1"_pos, "5");
+    base.SetCell("C1"_pos, "=B1");
+
+    SheetOverlay overlay(base);
+    overlay.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(overlay.GetOverriddenCount(), 1u);
+    ASSERT_EQUAL(overlay.GetConeSize(), 2u);
+    ASSERT_EQUAL(overlay.GetCell("A3"_pos)->GetValue(), CellInterface::Value(25.0));
+    ASSERT_EQUAL(overlay.GetCell("C1"_pos), base.GetCell("C1"_pos));
+
+    // the base sheet keeps its values
+    ASSERT_EQUAL(base.GetCell("A3"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    overlay.SetCell("B1"_pos, "=A1+A1");
+    ASSERT_EQUAL(overlay.GetCell("A3"_pos)->GetValue(), CellInterface::Value(24.0));
+    ASSERT_EQUAL(overlay.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    bool caught = false;
+    try {
+        overlay.SetCell("A1"_pos, "=A3");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(overlay.GetCell("A1"_pos)->GetText(), "2");
+
+    std::ostringstream values;
+    overlay.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "2\t4\t4\n20\t\t\n24\t\t\n");
+}
+
+void TestParameterSweep() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*A1-C1");
+    sheet.SetCell("C1"_pos, "1");
+    sheet.SetCell("D1"_pos, "=1/B1");
+    sheet.SetCell("E1"_pos, "=C1+1");
+
+    ParameterSweep sweep(sheet, "A1"_pos, {"D1"_pos, "B1"_pos, "E1"_pos, "A1"_pos});
+    ASSERT_EQUAL(sweep.GetConeSize(), 2u);
+
+    auto result = sweep.Run({1.0, 2.0, -3.0});
+    using Values = ParameterSweep::Values;
+    ASSERT_EQUAL(result[0], (Values{FormulaError(FormulaError::Category::Arithmetic), 1.0 / 3, 0.125}));
+    ASSERT_EQUAL(result[1], (Values{0.0, 3.0, 8.0}));
+    ASSERT_EQUAL(result[2], (Values{2.0, 2.0, 2.0}));
+    ASSERT_EQUAL(result[3], (Values{1.0, 2.0, -3.0}));
+
+    // the sheet is not modified
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0 / 3));
+
+    sheet.SetCell("C1"_pos, "text");
+    ParameterSweep text_sweep(sheet, "A1"_pos, {"B1"_pos});
+    ASSERT_EQUAL(text_sweep.Run({1.0})[0], (Values{FormulaError(FormulaError::Category::Value)}));
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1*(B2+1.5)");
+    sheet.SetCell("B1"_pos, "'=escaped");
+    sheet.SetCell("C3"_pos, "=1/0");
+    sheet.SetCell("D1"_pos, "=-A2/E5");
+
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    for (bool with_values : {true, false}) {
+        SaveSnapshot(sheet, path, with_values);
+        auto loaded = LoadSnapshot(path);
+
+        std::ostringstream expected_texts;
+        std::ostringstream loaded_texts;
+        sheet.PrintTexts(expected_texts);
+        loaded->PrintTexts(loaded_texts);
+        ASSERT_EQUAL(loaded_texts.str(), expected_texts.str());
+
+        std::ostringstream expected_values;
+        std::ostringstream loaded_values;
+        sheet.PrintValues(expected_values);
+        loaded->PrintValues(loaded_values);
+        ASSERT_EQUAL(loaded_values.str(), expected_values.str());
+
+        // the dependencies are restored
+        loaded->SetCell("B2"_pos, "0.5");
+        ASSERT_EQUAL(loaded->GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(loaded->GetCell("D1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Arithmetic));
+        bool caught = false;
+        try {
+            loaded->SetCell("B2"_pos, "=D1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+    std::filesystem::remove(path);
+
+    bool caught = false;
+    try {
+        LoadSnapshot(path);
+    } catch (const SnapshotException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    const SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    sheet.SetCell("B1"_pos, "2");
+    sheet.GetCell("A1"_pos)->GetValue();
+    sheet.GetCell("A1"_pos)->GetValue();
+    try {
+        sheet.SetCell("C1"_pos, "=A1");
+    } catch (const CircularDependencyException&) {
+    }
+    const SheetStats after = sheet.GetStats();
+
+    ASSERT_EQUAL(after.cells, 3u);
+    ASSERT_EQUAL(after.formula_cells, 1u);
+    ASSERT_EQUAL(after.placeholder_cells, 1u);
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(after.writes - before.writes, 3u);
+    ASSERT_EQUAL(after.parses - before.parses, 2u);
+    ASSERT_EQUAL(after.cache_misses - before.cache_misses, 1u);
+    ASSERT_EQUAL(after.cache_hits - before.cache_hits, 1u);
+    ASSERT_EQUAL(after.formula_evaluations - before.formula_evaluations, 1u);
+    ASSERT_EQUAL(after.cycle_checks - before.cycle_checks, 2u);
+    ASSERT(after.cycle_check_nodes > before.cycle_check_nodes);
+    // setting B1 invalidates B1 and A1
+    ASSERT(after.cells_invalidated - before.cells_invalidated >= 2u);
+#endif
+
+    std::ostringstream output;
+    output << after;
+    ASSERT(output.str().find("placeholder_cells 1\n") != std::string::npos);
+}
+
+void TestValueView() {
+    using namespace std::literals;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "=B1*2");
+    sheet.SetCell("B1"_pos, "2.5");
+
+    using View = CellInterface::ValueView;
+    ASSERT(sheet.GetCell("A1"_pos)->GetValueView() == View("text"sv));
+    ASSERT(sheet.GetCell("A2"_pos)->GetValueView() == View("=escaped"sv));
+    ASSERT(sheet.GetCell("A3"_pos)->GetValueView() == View(5.0));
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    // the view refers to the text of the cell
+    const auto view = std::get<std::string_view>(sheet.GetCell("A1"_pos)->GetValueView());
+    ASSERT_EQUAL(std::get<std::string_view>(sheet.GetCell("A1"_pos)->GetValueView()).data(), view.data());
+    ASSERT_EQUAL(ToValue(sheet.GetCell("A2"_pos)->GetValueView()), CellInterface::Value("=escaped"s));
+
+    // the texts read by formulas are converted as before
+    sheet.SetCell("B1"_pos, " 3");
+    ASSERT(sheet.GetCell("A3"_pos)->GetValueView() == View(6.0));
+    sheet.SetCell("B1"_pos, "1e2");
+    ASSERT(sheet.GetCell("A3"_pos)->GetValueView() == View(200.0));
+    sheet.SetCell("B1"_pos, "3 ");
+    ASSERT(sheet.GetCell("A3"_pos)->GetValueView() == View(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("B1"_pos, "nan");
+    ASSERT(sheet.GetCell("A3"_pos)->GetValueView() == View(FormulaError(FormulaError::Category::Value)));
+
+    SheetOverlay overlay(sheet);
+    overlay.SetCell("B1"_pos, "'4");
+    ASSERT(overlay.GetCell("B1"_pos)->GetValueView() == View("4"sv));
+    ASSERT(overlay.GetCell("A3"_pos)->GetValueView() == View(8.0));
+    ASSERT(overlay.GetCell("A1"_pos)->GetValueView() == View("text"sv));
+}
+
+void TestStringPool() {
+    using namespace std::literals;
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, "USD");
+        sheet.SetCell({row, 1}, row % 2 ? "N/A" : "'N/A");
+    }
+    ASSERT_EQUAL(sheet.GetStrings().GetSize(), 3u);
+    // the cells share one string
+    const auto first = std::get<std::string_view>(sheet.GetCell({0, 0})->GetValueView());
+    const auto last = std::get<std::string_view>(sheet.GetCell({99, 0})->GetValueView());
+    ASSERT_EQUAL(first, "USD"sv);
+    ASSERT_EQUAL(first.data(), last.data());
+    ASSERT_EQUAL(sheet.GetCell({0, 1})->GetValue(), CellInterface::Value("N/A"s));
+    ASSERT_EQUAL(sheet.GetCell({0, 1})->GetText(), "'N/A");
+
+    // setting the same text does not change the cell
+    {
+        Cell::Contents previous;
+        ASSERT(!sheet.GetCellPtr({0, 0})->Assign(sheet, {0, 0}, "USD", &previous));
+        ASSERT(previous.text == StringPool::Handle{});
+        ASSERT(sheet.GetCellPtr({0, 0})->Assign(sheet, {0, 0}, "EUR", &previous));
+        ASSERT_EQUAL(previous.text.Get(), "USD"sv);
+        ASSERT_EQUAL(sheet.GetStrings().GetSize(), 4u);
+    }
+
+    // a text is freed with its last cell
+    sheet.SetCell({0, 0}, "=1");
+    ASSERT_EQUAL(sheet.GetStrings().GetSize(), 3u);
+    for (int row = 0; row < 100; ++row) {
+        sheet.ClearCell({row, 0});
+    }
+    ASSERT_EQUAL(sheet.GetStrings().GetSize(), 2u);
+}
+
+void TestSheetMemoryUsage() {
+    // text and empty cells keep their contents inline: the pointer to the table of the virtual
+    // methods of CellInterface, the handle of the text, the formula and the dependents
+    ASSERT_EQUAL(sizeof(Cell), 4 * sizeof(void*));
+    Sheet sheet;
+    const MemoryUsage empty = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+
+    sheet.SetCell("A1"_pos, "=B1+C1*2");
+    sheet.SetCell("B1"_pos, std::string(100, 'x'));
+    sheet.SetCell("D1"_pos, "short");
+    sheet.GetCell("A1"_pos)->GetValue();
+    const MemoryUsage usage = sheet.GetMemoryUsage();
+
+    // C1 is created empty for the reference
+    ASSERT_EQUAL(usage.empty_cells, 1u);
+    ASSERT_EQUAL(usage.text_cells, 2u);
+    ASSERT_EQUAL(usage.formula_cells, 1u);
+    ASSERT(usage.table > 0u);
+    ASSERT(usage.cells >= 4 * sizeof(Cell));
+    // the texts are stored once in the pool
+    ASSERT(usage.texts > 100u);
+    ASSERT(usage.formula_nodes > 0u);
+    ASSERT(usage.references > 0u);
+    ASSERT(usage.dependencies > 0u);
+    ASSERT(usage.cached_values > 0u);
+    ASSERT_EQUAL(usage.GetTotal(), usage.table + usage.cells + usage.texts + usage.formula_nodes
+                                       + usage.references + usage.dependencies + usage.cached_values);
+
+    // a longer formula takes more nodes
+    sheet.SetCell("A1"_pos, "=B1+C1*2+C1*3+C1*4");
+    ASSERT(sheet.GetMemoryUsage().formula_nodes > usage.formula_nodes);
+
+    std::ostringstream output;
+    output << usage;
+    ASSERT(output.str().find("formula_cells 1\n") != std::string::npos);
+}
+
+void TestEvaluationProfiler() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    sheet.SetCell("B1"_pos, "=C1*2");
+    sheet.SetCell("C1"_pos, "3");
+
+    EvaluationProfiler profiler(sheet);
+    profiler.Start();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(9.0));
+    profiler.Stop();
+    // the cached value is not recorded
+    sheet.SetCell("C1"_pos, "4");
+    sheet.GetCell("A1"_pos)->GetValue();
+    ASSERT(!profiler.IsActive());
+
+#if SPREADSHEET_STATS
+    const auto& events = profiler.GetEvents();
+    ASSERT_EQUAL(events.size(), 2u);
+    // the nested evaluation ends first
+    const auto& inner = events[0];
+    const auto& outer = events[1];
+    ASSERT_EQUAL(inner.depth, 1u);
+    ASSERT_EQUAL(outer.depth, 0u);
+    ASSERT(inner.start >= outer.start);
+    ASSERT(inner.inclusive <= outer.inclusive);
+    ASSERT_EQUAL((outer.exclusive + inner.inclusive).count(), outer.inclusive.count());
+
+    const auto hottest = profiler.GetHottestCells(5);
+    ASSERT_EQUAL(hottest.size(), 2u);
+    for (const auto& cell : hottest) {
+        ASSERT(cell.pos == "A1"_pos || cell.pos == "B1"_pos);
+        ASSERT_EQUAL(cell.evaluations, 1u);
+    }
+
+    std::ostringstream trace;
+    profiler.WriteChromeTrace(trace);
+    ASSERT(trace.str().find("\"name\":\"B1\"") != std::string::npos);
+    ASSERT(trace.str().find("\"ph\":\"X\"") != std::string::npos);
+#endif
+}
+
+void TestSetCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    sheet.SetCells({{"B1"_pos, "=C1*2"}, {"C1"_pos, "3"}, {"D1"_pos, "text"}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "text");
+
+    bool caught = false;
+    try {
+        sheet.SetCells({{"D1"_pos, "changed"}, {"C1"_pos, "=A1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "text");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    caught = false;
+    try {
+        sheet.SetCells({{"C1"_pos, "4"}, {"D1"_pos, "=1+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "3");
+
+    // a cycle which a later text of the batch breaks is rejected, as it is when the cells are set one by one
+    caught = false;
+    try {
+        sheet.SetCells({{"C1"_pos, "=A1"}, {"A1"_pos, "5"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1+1");
+}
+
+void TestEagerRecalculation() {
+    using Value = CellInterface::Value;
+    using CachedValue = std::optional<FormulaInterface::Value>;
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "=MIN(A1,10)");
+    sheet.SetCell("B2"_pos, "=B1*2");
+    sheet.SetCell("B3"_pos, "=B2+B1");
+    sheet.SetCell("B4"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(9.0));
+
+    // the recalculated values are cached at once
+    sheet.SetCell("A1"_pos, "20");
+    ASSERT(sheet.GetCellPtr("B3"_pos)->GetCachedValue() == CachedValue(30.0));
+    // B4 was never read, it is calculated when it is
+    ASSERT(!sheet.GetCellPtr("B4"_pos)->GetCachedValue().has_value());
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), Value(21.0));
+
+    // the clamped value does not change, so the cells depending on it are not recalculated
+    const SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "30");
+    ASSERT(sheet.GetCellPtr("B4"_pos)->GetCachedValue() == CachedValue(31.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(30.0));
+#if SPREADSHEET_STATS
+    const SheetStats after = sheet.GetStats();
+    ASSERT_EQUAL(after.cells_recalculated - before.cells_recalculated, 2u);
+    ASSERT_EQUAL(after.recalculation_cutoffs - before.recalculation_cutoffs, 1u);
+    ASSERT_EQUAL(after.formula_evaluations - before.formula_evaluations, 2u);
+#endif
+
+    // a new formula in the middle makes the formulas above it higher
+    sheet.SetCell("B1"_pos, "=B5");
+    sheet.SetCell("B5"_pos, "=A1/2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(45.0));
+    sheet.SetCells({{"A1"_pos, "=1/0"}, {"B5"_pos, "=A1+C1"}, {"C1"_pos, "1"}});
+    const CachedValue arithmetic_error = FormulaError(FormulaError::Category::Arithmetic);
+    ASSERT(sheet.GetCellPtr("B3"_pos)->GetCachedValue() == arithmetic_error);
+
+    // both modes give the same values for random changes of the inputs and of the formulas
+    Sheet lazy;
+    Sheet eager;
+    eager.SetRecalculationMode(RecalculationMode::Eager);
+    std::mt19937 generator(19);
+    const std::vector<std::string> texts = {
+        "", "0", "1", "-1", "2.5", "word", "=1/0", "=MIN(MAX({0},0),2)", "={0}-{0}+1", "=IF({0}>1,{1},0)",
+        "={0}+{1}", "=SUM(A1:C3)*{0}", "=-{0}",
+    };
+    auto random_cell = [&generator]() {
+        return Position{static_cast<int>(generator() % 6), static_cast<int>(generator() % 4)};
+    };
+    for (int step = 0; step < 3000; ++step) {
+        std::string text = texts[generator() % texts.size()];
+        for (const char* placeholder : {"{0}", "{1}"}) {
+            for (size_t at = text.find(placeholder); at != std::string::npos; at = text.find(placeholder)) {
+                text.replace(at, 3, random_cell().ToString());
+            }
+        }
+        const Position pos = random_cell();
+        bool rejected = false;
+        try {
+            lazy.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            rejected = true;
+        }
+        try {
+            eager.SetCell(pos, text);
+            ASSERT(!rejected);
+        } catch (const CircularDependencyException&) {
+            ASSERT(rejected);
+        }
+        // reading a part of the cells leaves the others to be calculated when they are read
+        for (int row = 0; row < 6; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                if ((row + col + step) % 3 != 0 && eager.GetCellPtr({row, col})) {
+                    ASSERT_EQUAL(eager.GetCell({row, col})->GetValue(), lazy.GetCell({row, col})->GetValue());
+                }
+            }
+        }
+    }
+    std::ostringstream lazy_values;
+    std::ostringstream eager_values;
+    lazy.PrintValues(lazy_values);
+    eager.PrintValues(eager_values);
+    ASSERT_EQUAL(eager_values.str(), lazy_values.str());
+}
+
+void TestValidatingRecalculation() {
+    using Value = CellInterface::Value;
+    using CachedValue = std::optional<FormulaInterface::Value>;
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Validating);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "=MIN(A1,10)");
+    sheet.SetCell("B2"_pos, "=B1*2");
+    sheet.SetCell("B3"_pos, "=B2+B1");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(9.0));
+
+    // a write does not visit the dependent cells, the outdated value is not reported as cached
+    SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "20");
+    ASSERT(!sheet.GetCellPtr("B3"_pos)->GetCachedValue().has_value());
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(30.0));
+    ASSERT(sheet.GetCellPtr("B2"_pos)->GetCachedValue() == CachedValue(20.0));
+#if SPREADSHEET_STATS
+    SheetStats after = sheet.GetStats();
+    ASSERT_EQUAL(after.cells_invalidated - before.cells_invalidated, 0u);
+    ASSERT_EQUAL(after.cells_validated - before.cells_validated, 3u);
+    ASSERT_EQUAL(after.cells_recalculated - before.cells_recalculated, 3u);
+#endif
+
+    // the clamped value does not change, so the cells depending on it are only verified
+    before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "30");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(30.0));
+#if SPREADSHEET_STATS
+    after = sheet.GetStats();
+    ASSERT_EQUAL(after.recalculation_cutoffs - before.recalculation_cutoffs, 1u);
+    ASSERT_EQUAL(after.formula_evaluations - before.formula_evaluations, 1u);
+#endif
+
+    // the aggregates and the indexes catch up with the changes when their formulas are read
+    sheet.SetCells({{"C1"_pos, "1"}, {"C2"_pos, "2"}, {"C3"_pos, "=B1"}, {"D1"_pos, "=SUM(C1:C3)"},
+                    {"D2"_pos, "=MATCH(2,C1:C3,0)"}, {"D3"_pos, "=SUMIF(C1:C3,2,C1:C3)"}});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), Value(13.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), Value(2.0));
+    sheet.SetCell("C2"_pos, "5");
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), Value(2.0));
+
+    // a formula taking a shared index from the sheet finds the changes the formulas
+    // which calculated the index were not read after, the formulas of the range first
+    sheet.SetCells({{"E1"_pos, "1"}, {"E2"_pos, "2"}, {"E3"_pos, "3"}, {"E4"_pos, "=E1+10"},
+                    {"F1"_pos, "=MATCH(3,E1:E4,0)"}, {"G1"_pos, "=SUMIF(E1:E4,3)"}});
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), Value(3.0));
+    sheet.SetCells({{"E1"_pos, "2"}, {"E3"_pos, "5"}});
+    sheet.SetCells({{"F2"_pos, "=MATCH(12,E1:E4,0)"}, {"G2"_pos, "=SUMIF(E1:E4,5)"}});
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetValue(), Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), Value(0.0));
+
+    // the changes logged before rows are inserted are not lost for the ranges which do not move
+    sheet.SetCells({{"H1"_pos, "1"}, {"H2"_pos, "1"}, {"H3"_pos, "=SUM(H1:H2)"}, {"J20"_pos, "1"}});
+    ASSERT_EQUAL(sheet.GetCell("H3"_pos)->GetValue(), Value(2.0));
+    sheet.SetCell("H1"_pos, "2");
+    sheet.InsertRows(10);
+    ASSERT_EQUAL(sheet.GetCell("H3"_pos)->GetValue(), Value(3.0));
+
+    // the other modes find the cached values up to date
+    sheet.SetCell("C1"_pos, "4");
+    sheet.SetRecalculationMode(RecalculationMode::Lazy);
+    ASSERT(sheet.GetCellPtr("D1"_pos)->GetCachedValue() == CachedValue(11.0));
+    sheet.SetCell("C1"_pos, "2");
+    sheet.SetRecalculationMode(RecalculationMode::Validating);
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), Value(4.0));
+
+    // the modes give the same values for random changes of the inputs, of the formulas and of the modes
+    Sheet lazy;
+    Sheet validating;
+    validating.SetRecalculationMode(RecalculationMode::Validating);
+    std::mt19937 generator(23);
+    const std::vector<std::string> texts = {
+        "", "0", "1", "-1", "2.5", "word", "=1/0", "=MIN(MAX({0},0),2)", "={0}-{0}+1", "=IF({0}>1,{1},0)",
+        "={0}+{1}", "=SUM(A1:C3)*{0}", "=-{0}", "=SUMIF(A1:A6,1,B1:B6)", "=MATCH(1,C1:C6,0)",
+    };
+    const std::vector<RecalculationMode> modes = {
+        RecalculationMode::Validating, RecalculationMode::Lazy, RecalculationMode::Eager,
+    };
+    auto random_cell = [&generator]() {
+        return Position{static_cast<int>(generator() % 6), static_cast<int>(generator() % 4)};
+    };
+    for (int step = 0; step < 3000; ++step) {
+        std::string text = texts[generator() % texts.size()];
+        for (const char* placeholder : {"{0}", "{1}"}) {
+            for (size_t at = text.find(placeholder); at != std::string::npos; at = text.find(placeholder)) {
+                text.replace(at, 3, random_cell().ToString());
+            }
+        }
+        const Position pos = random_cell();
+        bool rejected = false;
+        try {
+            lazy.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            rejected = true;
+        }
+        try {
+            validating.SetCell(pos, text);
+            ASSERT(!rejected);
+        } catch (const CircularDependencyException&) {
+            ASSERT(rejected);
+        }
+        if (step % 500 == 499) {
+            validating.SetRecalculationMode(modes[(step / 500) % modes.size()]);
+        }
+        // a part of the cells is read, so that the others fall behind several changes
+        for (int row = 0; row < 6; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                if ((row + col + step) % 3 != 0 && validating.GetCellPtr({row, col})) {
+                    ASSERT_EQUAL(validating.GetCell({row, col})->GetValue(), lazy.GetCell({row, col})->GetValue());
+                }
+            }
+        }
+    }
+    std::ostringstream lazy_values;
+    std::ostringstream validating_values;
+    lazy.PrintValues(lazy_values);
+    validating.PrintValues(validating_values);
+    ASSERT_EQUAL(validating_values.str(), lazy_values.str());
+}
+
+void TestRangeValues() {
+    using namespace std::literals;
+    using Kind = RangeValues::Kind;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("C1"_pos, "'=escaped");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=B1+1");
+    sheet.SetCell("C2"_pos, "=1/0");
+    sheet.SetCell("D2"_pos, "=E5");
+
+    RangeValues values;
+    sheet.GetValues(Range::FromCorners("A1"_pos, "D3"_pos), values);
+    ASSERT_EQUAL(values.size, (Size{3, 4}));
+    const std::vector<Kind> kinds = {
+        Kind::Text, Kind::Text, Kind::Text, Kind::Empty,
+        Kind::Number, Kind::Error, Kind::Error, Kind::Number,
+        Kind::Empty, Kind::Empty, Kind::Empty, Kind::Empty,
+    };
+    ASSERT(values.kinds == kinds);
+    // the numbers of the text cells are texts, as they are for GetValue
+    ASSERT_EQUAL(values.texts[0], "1.5"sv);
+    ASSERT_EQUAL(values.numbers[4], 3.0);
+    ASSERT_EQUAL(values.numbers[7], 0.0);
+    ASSERT_EQUAL(values.texts[1], "text"sv);
+    ASSERT_EQUAL(values.texts[2], "=escaped"sv);
+    ASSERT(values.errors[5] == FormulaError::Category::Value);
+    ASSERT(values.errors[6] == FormulaError::Category::Arithmetic);
+
+    // the buffer is reused for a smaller viewport, a range larger than the table is filled from the table
+    sheet.GetValues(Range::FromCorners("B2"_pos, "B2"_pos), values);
+    ASSERT_EQUAL(values.kinds.size(), 1u);
+    ASSERT(values.GetValueView(0) == CellInterface::ValueView(FormulaError(FormulaError::Category::Value)));
+    sheet.GetValues(Range::FromCorners("A1"_pos, "Z100"_pos), values);
+    ASSERT_EQUAL(values.numbers[GetOffset(Range::FromCorners("A1"_pos, "Z100"_pos), "A2"_pos)], 3.0);
+
+    bool caught = false;
+    try {
+        sheet.GetValues({"B2"_pos, "A1"_pos}, values);
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // the formulas of a viewport are calculated once each, the lower ones first,
+    // so a long chain is not calculated by recursion from its top
+    Sheet chain;
+    chain.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 200; ++row) {
+        chain.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+#if SPREADSHEET_STATS
+    const SheetStats before = chain.GetStats();
+#endif
+    chain.GetValues(Range::FromCorners("A1"_pos, "A200"_pos), values);
+    ASSERT_EQUAL(values.numbers[199], 200.0);
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(chain.GetStats().formula_evaluations - before.formula_evaluations, 199u);
+#endif
+
+    // the values are the values of the cells read one by one in every recalculation mode
+    for (RecalculationMode mode : {RecalculationMode::Lazy, RecalculationMode::Eager, RecalculationMode::Validating}) {
+        Sheet random_sheet;
+        random_sheet.SetRecalculationMode(mode);
+        std::mt19937 generator(31);
+        const std::vector<std::string> texts = {"", "1", "-2.5", "word", "'", "=1/0", "={0}+{1}", "=SUM(A1:C3)"};
+        for (int step = 0; step < 500; ++step) {
+            std::string text = texts[generator() % texts.size()];
+            for (const char* placeholder : {"{0}", "{1}"}) {
+                if (size_t at = text.find(placeholder); at != std::string::npos) {
+                    text.replace(at, 3, Position{static_cast<int>(generator() % 5), static_cast<int>(generator() % 5)}.ToString());
+                }
+            }
+            try {
+                random_sheet.SetCell({static_cast<int>(generator() % 5), static_cast<int>(generator() % 5)}, text);
+            } catch (const CircularDependencyException&) {
+            }
+            const Range range = Range::FromCorners({static_cast<int>(generator() % 5), static_cast<int>(generator() % 5)},
+                                                   {static_cast<int>(generator() % 6), static_cast<int>(generator() % 6)});
+            random_sheet.GetValues(range, values);
+            for (int row = range.from.row; row <= range.to.row; ++row) {
+                for (int col = range.from.col; col <= range.to.col; ++col) {
+                    const CellInterface* cell = random_sheet.GetCell({row, col});
+                    ASSERT_EQUAL(ToValue(values.GetValueView(GetOffset(range, {row, col}))),
+                                 cell ? cell->GetValue() : CellInterface::Value{});
+                }
+            }
+        }
+    }
+}
+
+void TestValueChanges() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    sheet.SetCell("D1"_pos, "2");
+
+    // the changes of an unknown version are all cells
+    ValueChanges changes = sheet.GetValueChanges(0);
+    ASSERT(changes.full);
+    ASSERT(changes.cells == (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+    const std::uint64_t version = changes.version;
+    ASSERT(sheet.GetValueChanges(version).cells.empty());
+    ASSERT(sheet.GetValueChanges(version + 1).full);
+
+    // a changed cell brings the formulas depending on it, the unchanged and rejected writes do not count
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("D1"_pos, "2");
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=C1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    changes = sheet.GetValueChanges(version);
+    ASSERT(!changes.full);
+    ASSERT(changes.cells == (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos}));
+
+    // a deleted cell is listed with an empty value
+    sheet.SetCells({{"E2"_pos, "x"}, {"D1"_pos, "3"}});
+    sheet.ClearCell("E2"_pos);
+    std::ostringstream output;
+    sheet.PrintDiff(output, changes.version);
+    ASSERT_EQUAL(output.str(), "version " + std::to_string(sheet.GetValueChanges(0).version) + "\nD1\t3\nE2\t\n");
+
+    // the old changes of a cell are dropped, the changes after every version are kept
+    std::vector<std::uint64_t> versions;
+    std::vector<Position> changed;
+    for (int i = 0; i < 5000; ++i) {
+        versions.push_back(sheet.GetValueChanges(versions.empty() ? 0 : versions.back()).version);
+        changed.push_back({i % 7, 5});
+        sheet.SetCell(changed.back(), std::to_string(i));
+    }
+    for (size_t i = 0; i < versions.size(); i += 501) {
+        std::vector<Position> expected(changed.begin() + i, changed.end());
+        std::sort(expected.begin(), expected.end());
+        expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+        ASSERT(sheet.GetValueChanges(versions[i]).cells == expected);
+    }
+
+    // the validating mode finds the dependent formulas when the changes are requested
+    sheet.SetRecalculationMode(RecalculationMode::Validating);
+    const std::uint64_t validating_version = sheet.GetValueChanges(0).version;
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT(sheet.GetValueChanges(validating_version).cells == (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos}));
+
+    std::istringstream input("print diff " + std::to_string(validating_version) + "\nprint diff x\n");
+    std::ostringstream processor_output;
+    CommandProcessor(sheet).Run(input, processor_output);
+    ASSERT_EQUAL(processor_output.str(), "version " + std::to_string(validating_version + 1) +
+                                             "\nA1\t7\nB1\t8\nC1\t16\nError: Invalid version: x\n");
+}
+
+void TestSubscriptions() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "=MIN(A1,10)");
+    sheet.SetCell("B2"_pos, "=B1*2");
+    sheet.SetCell("B3"_pos, "=B2+B1");
+
+    // one write calls the callback once with all changed values of the range
+    std::vector<std::vector<ValueEvent>> calls;
+    const SubscriptionId watched = sheet.Subscribe(Range::FromCorners("B1"_pos, "B3"_pos),
+                                                   [&calls](const std::vector<ValueEvent>& events) {
+                                                       calls.push_back(events);
+                                                   });
+    sheet.SetCells({{"A1"_pos, "4"}, {"C1"_pos, "x"}});
+    ASSERT_EQUAL(calls.size(), 1u);
+    ASSERT_EQUAL(calls[0].size(), 3u);
+    ASSERT(calls[0][0].pos == "B1"_pos && calls[0][0].value == Value(4.0));
+    ASSERT(calls[0][2].pos == "B3"_pos && calls[0][2].value == Value(12.0));
+
+    // the clamped value does not change, so the callback is not called
+    sheet.SetCell("A1"_pos, "20");
+    sheet.SetCell("A1"_pos, "30");
+    ASSERT_EQUAL(calls.size(), 2u);
+    ASSERT(calls[1][0].value == Value(10.0));
+
+    // without the callback the events are queued, a cleared cell has an empty value
+    const SubscriptionId queued = sheet.Subscribe(Range::FromCorners("B2"_pos, "C2"_pos));
+    sheet.SetCell("C2"_pos, "text");
+    sheet.ClearCell("C2"_pos);
+    sheet.SetCell("A1"_pos, "1");
+    const std::vector<ValueEvent> events = sheet.TakeEvents(queued);
+    ASSERT_EQUAL(events.size(), 3u);
+    ASSERT(events[0].pos == "C2"_pos && events[0].value == Value("text"s));
+    ASSERT(events[1].pos == "C2"_pos && events[1].value == Value(""s));
+    ASSERT(events[2].pos == "B2"_pos && events[2].value == Value(2.0));
+    ASSERT(sheet.TakeEvents(queued).empty());
+    ASSERT_EQUAL(calls.size(), 3u);
+
+    // only the subscribed cells of the changed ones are calculated
+    sheet.Unsubscribe(watched);
+    sheet.Unsubscribe(queued);
+    const SubscriptionId single = sheet.Subscribe(Range::FromCorners("B1"_pos, "B1"_pos), {});
+    const SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(calls.size(), 3u);
+    ASSERT_EQUAL(sheet.TakeEvents(single).size(), 1u);
+    ASSERT(!sheet.GetCellPtr("B3"_pos)->GetCachedValue().has_value());
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().formula_evaluations - before.formula_evaluations, 1u);
+#else
+    (void)before;
+#endif
+
+    // a callback may change the sheet, its own write notifies it again
+    sheet.Unsubscribe(single);
+    int nested = 0;
+    sheet.Subscribe(Range::FromCorners("A1"_pos, "A1"_pos), [&sheet, &nested](const std::vector<ValueEvent>&) {
+        if (++nested == 1) {
+            sheet.SetCell("A1"_pos, "5");
+        }
+    });
+    sheet.SetCell("A1"_pos, "6");
+    ASSERT_EQUAL(nested, 2);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(15.0));
+}
+
+void TestLayoutChanges() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    for (RecalculationMode mode : {RecalculationMode::Lazy, RecalculationMode::Eager, RecalculationMode::Validating}) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "=A1+A2");
+        sheet.SetCell("C5"_pos, "=SUM(A1:A3)*10+MATCH(2,A1:A3,0)");
+        sheet.SetCell("D5"_pos, "=C5+1");
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), Value(63.0));
+
+        // the references follow the moved cells, a range containing the inserted rows grows
+        sheet.InsertRows(1, 2);
+        // the inserted cells of the range are not created
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A1+A4"s);
+        ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), "=SUM(A1:A5)*10+MATCH(2,A1:A5,0)"s);
+        ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetText(), "=C7+1"s);
+        ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), Value(65.0));
+        sheet.SetCell("A2"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), Value(83.0));
+        sheet.SetCell("A4"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(), Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), Value(103.0));
+
+        // the dependencies are moved with the cells
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=D7");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // a reference to a deleted cell is #REF!, a range loses the deleted rows
+        sheet.DeleteRows(0, 1);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=#REF!+A3"s);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "=SUM(A1:A4)*10+MATCH(2,A1:A4,0)"s);
+        ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT(sheet.GetCell("A4"_pos)->GetReferencedCells() == std::vector<Position>{"A3"_pos});
+        sheet.SetCell("A4"_pos, "=A3");
+        ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetValue(), Value(82.0));
+
+        // the formula with the deleted references keeps them after the compilation
+        sheet.DeleteRows(0, 4);
+        const FormulaInterface* formula = sheet.GetCellPtr("C2"_pos)->GetFormula();
+        ASSERT_EQUAL(formula->GetExpression(), "SUM(#REF!)*10+MATCH(2,#REF!,0)"s);
+        ASSERT(formula->GetRanges().empty());
+        ASSERT_EQUAL(ParseFormula(formula->Compile())->GetExpression(), formula->GetExpression());
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Ref)));
+
+        // the columns are inserted and deleted in the same way
+        sheet.SetCell("A5"_pos, "4");
+        sheet.SetCell("B5"_pos, "5");
+        sheet.SetCell("D5"_pos, "=SUM(A5:B5)+B5");
+        sheet.InsertCols(1);
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "=SUM(A5:C5)+C5"s);
+        sheet.SetCell("B5"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetValue(), Value(15.0));
+        sheet.DeleteCols(0, 2);
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=SUM(A5:A5)+A5"s);
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), Value(10.0));
+    }
+
+    // a text is not moved out of the sheet, the empty cells are
+    Sheet sheet;
+    sheet.SetCell({Position::MAX_ROWS - 1, 0}, "x");
+    sheet.SetCell("B1"_pos, "=A1+B16384");
+    bool caught = false;
+    try {
+        sheet.InsertRows(0);
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+B16384"s);
+    sheet.ClearCell({Position::MAX_ROWS - 1, 0});
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2+#REF!"s);
+    caught = false;
+    try {
+        sheet.DeleteCols(Position::MAX_COLS - 1, 2);
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // a rejected batch puts back the formula with the deleted reference without parsing it
+    Sheet deleted;
+    deleted.SetCell("A1"_pos, "=B1");
+    deleted.SetCell("B1"_pos, "1");
+    deleted.DeleteCols(1);
+    caught = false;
+    try {
+        deleted.SetCells({{"A1"_pos, "=A1+1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(deleted.GetCell("A1"_pos)->GetText(), "=#REF!"s);
+    ASSERT_EQUAL(deleted.GetCell("A1"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Ref)));
+
+    // the printed #REF! is parsed back, as a deleted range where the function expects a range
+    deleted.SetCell("A2"_pos, "=MATCH(#REF!, #REF!, 0)+SUM(#REF!)");
+    ASSERT_EQUAL(deleted.GetCell("A2"_pos)->GetText(), "=MATCH(#REF!,#REF!,0)+SUM(#REF!)"s);
+    ASSERT(deleted.GetCellPtr("A2"_pos)->GetFormula()->GetRanges().empty());
+    ASSERT(deleted.GetCell("A2"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(deleted.GetCell("A2"_pos)->GetValue(), Value(FormulaError(FormulaError::Category::Ref)));
+    std::ostringstream texts;
+    deleted.PrintTexts(texts);
+    Sheet imported;
+    std::istringstream tsv(texts.str());
+    TsvImporter(imported).Import(tsv);
+    std::ostringstream imported_texts;
+    imported.PrintTexts(imported_texts);
+    ASSERT_EQUAL(imported_texts.str(), texts.str());
+
+    // the changes after an earlier version are not known, the subscriptions see the moved values
+    const std::uint64_t version = sheet.GetValueChanges(0).version;
+    const SubscriptionId id = sheet.Subscribe(Range::FromCorners("B1"_pos, "B3"_pos));
+    sheet.InsertRows(0);
+    ASSERT(sheet.GetValueChanges(version).full);
+    const std::vector<ValueEvent> events = sheet.TakeEvents(id);
+    ASSERT_EQUAL(events.size(), 2u);
+    ASSERT(events[0].pos == "B2"_pos && events[0].value == Value(""s));
+    ASSERT(events[1].pos == "B3"_pos && events[1].value == Value(FormulaError(FormulaError::Category::Ref)));
+
+    // the rows are written as numbers and the columns as letters in the commands
+    Sheet commands;
+    commands.SetCell("A1"_pos, "1");
+    commands.SetCell("B2"_pos, "=A1");
+    std::istringstream input("insert rows 1 2\ndelete cols A\ninsert lines 1\ndelete rows 0\nprint texts\n");
+    std::ostringstream output;
+    CommandProcessor(commands).Run(input, output);
+    ASSERT_EQUAL(output.str(), "Error: Unknown command: insert lines\nError: Invalid lines\n\n\n\n=#REF!\n"s);
+}
+
+void TestTsvImportRoundTrip() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "header");
+    sheet.SetCell("C1"_pos, "'=escaped");
+    sheet.SetCell("A2"_pos, "1.5");
+    sheet.SetCell("B2"_pos, "=A2*C4");
+    sheet.SetCell("C3"_pos, "some text");
+    sheet.SetCell("C4"_pos, "=A2+2");
+    sheet.SetCell("D5"_pos, "-2e3");
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+
+    Sheet imported;
+    std::istringstream input(texts.str());
+    // small chunks and batches split lines and fields between reads and writes
+    TsvImporter importer(imported, 8, 3);
+    auto stats = importer.Import(input);
+
+    ASSERT_EQUAL(stats.rows, 5u);
+    ASSERT_EQUAL(stats.formulas, 2u);
+    ASSERT_EQUAL(stats.numbers, 2u);
+    ASSERT_EQUAL(stats.texts, 3u);
+    ASSERT_EQUAL(stats.empty, 13u);
+
+    std::ostringstream imported_texts;
+    imported.PrintTexts(imported_texts);
+    ASSERT_EQUAL(imported_texts.str(), texts.str());
+
+    std::ostringstream values;
+    std::ostringstream imported_values;
+    sheet.PrintValues(values);
+    imported.PrintValues(imported_values);
+    ASSERT_EQUAL(imported_values.str(), values.str());
+}
+
+void TestDurableSheet() {
+    const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_test_durable";
+    std::filesystem::remove_all(directory);
+
+    std::string texts;
+    {
+        DurableSheet sheet(directory.string());
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1*3");
+        sheet.SetCell("C1"_pos, "temporary");
+        sheet.ClearCell("C1"_pos);
+        // the rejected mutation is not logged
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+        }
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        texts = output.str();
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetRecoveredRecords(), 4u);
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        ASSERT_EQUAL(output.str(), texts);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        sheet.Compact();
+        sheet.SetCell("A2"_pos, "=B1+1");
+        sheet.WaitCompaction();
+    }
+    {
+        // a torn record at the end of the log is cut off
+        std::ofstream log(directory / "sheet.wal", std::ios::binary | std::ios::app);
+        log << "\x10\x00\x00";
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetRecoveredRecords(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(7.0));
+        sheet.SetCell("A3"_pos, "last");
+    }
+    {
+        // a torn header may hold any size, the payload is not allocated before it is checked
+        std::ofstream log(directory / "sheet.wal", std::ios::binary | std::ios::app);
+        log.write("\xF0\xFF\xFF\xFF\x00\x00\x00\x00", 8);
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetRecoveredRecords(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "last");
+
+        // the commands which SheetInterface does not have read the sheet of the durable sheet
+        std::istringstream input("print diff 0\ninsert rows 1\n");
+        std::ostringstream output;
+        ASSERT_EQUAL(CommandProcessor(sheet).Run(input, output).errors, 1u);
+        ASSERT(output.str().find("A3\tlast\n") != std::string::npos);
+        // the layout changes are not logged, so they are rejected
+        ASSERT(output.str().find("Error: Not supported by the sheet: insert rows 1\n") != std::string::npos);
+    }
+    std::filesystem::remove_all(directory);
+}
+
+void TestCommandProcessor() {
+    std::istringstream input(
+        "set A1 2\n"
+        "set B1 =A1 * 3\n"
+        "set C1 =B1+A1\n"
+        "set A2 =C1\n"
+        "set A1 =A2\n"
+        "set D1 text\r\n"
+        "\n"
+        "print values\n"
+        "clear C1\n"
+        "set E1 1\n"
+        "set E2 =E1\n"
+        "print texts\n"
+        "wrong command\n"
+        "exit\n"
+        "set A1 5\n");
+    Sheet sheet;
+    std::ostringstream output;
+    auto stats = CommandProcessor(sheet).Run(input, output);
+
+    ASSERT_EQUAL(stats.commands, 13u);
+    ASSERT_EQUAL(stats.errors, 2u);
+    // the first batch is rejected because of the cycle and repeated command by command
+    ASSERT_EQUAL(stats.bulk_writes, 1u);
+    ASSERT_EQUAL(output.str(), "Error: Formula has circular dependence\n"
+                               "2\t6\t8\ttext\n"
+                               "8\t\t\t\n"
+                               "2\t=A1*3\t\ttext\t1\n"
+                               "=C1\t\t\t\t=E1\n"
+                               "Error: Unknown command: wrong command\n");
+
+    // the small block splits the lines and the batches between reads
+    Sheet small_block_sheet;
+    input.clear();
+    input.seekg(0);
+    std::ostringstream small_block_output;
+    CommandProcessor(small_block_sheet, 16).Run(input, small_block_output);
+    ASSERT_EQUAL(small_block_output.str(), output.str());
+
+    // the cycles which the later sets of the batch break are reported and rejected too
+    std::istringstream cycles_input(
+        "set A1 =B1\n"
+        "set B1 =A1\n"
+        "set B1 1\n"
+        "set C1 =D1\n"
+        "set D1 =C1\n"
+        "set C1 2\n"
+        "print texts\n");
+    Sheet cycles_sheet;
+    std::ostringstream cycles_output;
+    ASSERT_EQUAL(CommandProcessor(cycles_sheet).Run(cycles_input, cycles_output).errors, 2u);
+    ASSERT_EQUAL(cycles_output.str(), "Error: Formula has circular dependence\n"
+                                      "Error: Formula has circular dependence\n"
+                                      "=B1\t1\t2\t\n");
+}
+
+#ifdef __linux__
+void TestSheetServer() {
+    const std::string socket_path = (std::filesystem::temp_directory_path() / "spreadsheet_test.sock").string();
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    // the readers would verify the values concurrently in the validating mode
+    sheet.SetRecalculationMode(RecalculationMode::Validating);
+
+    SheetServer server(sheet, socket_path, 3);
+    ASSERT(sheet.GetRecalculationMode() == RecalculationMode::Lazy);
+    std::thread server_thread([&server] {
+        server.Run();
+    });
+    {
+        SheetClient client(socket_path);
+        ASSERT_EQUAL(client.GetValue("B1"_pos), CellInterface::Value(20.0));
+        client.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(client.GetValue("B1"_pos), CellInterface::Value(30.0));
+        client.SetCell("C1"_pos, "=1/0");
+        ASSERT_EQUAL(client.GetValues("A1"_pos, {1, 4}),
+                     (std::vector<CellInterface::Value>{"3", 30.0, FormulaError(FormulaError::Category::Arithmetic),
+                                                        std::string()}));
+        client.ClearCell("C1"_pos);
+        ASSERT_EQUAL(client.PrintTexts(), "3\t=A1*10\n");
+
+        bool caught = false;
+        try {
+            client.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        caught = false;
+        try {
+            client.GetValue(Position{-1, 0});
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // readers see every row either before or after a write of it
+        std::vector<std::thread> clients;
+        for (int i = 0; i < 4; ++i) {
+            clients.emplace_back([&socket_path, i] {
+                SheetClient writer(socket_path);
+                for (int row = 0; row < 50; ++row) {
+                    writer.SetCell(Position{row + 1, i}, std::to_string(row));
+                    writer.SetCell(Position{row + 1, i + 4}, "=" + Position{row + 1, i}.ToString() + "+1");
+                    auto values = writer.GetValues(Position{row + 1, i}, {1, 5});
+                    ASSERT_EQUAL(values[0], CellInterface::Value(std::to_string(row)));
+                    ASSERT_EQUAL(values[4], CellInterface::Value(row + 1.0));
+                }
+            });
+        }
+        for (auto& thread : clients) {
+            thread.join();
+        }
+    }
+    server.Stop();
+    server_thread.join();
+    ASSERT_EQUAL(sheet.GetCell("H50"_pos)->GetValue(), CellInterface::Value(49.0));
+}
+#endif
+
+void TestTraceRoundTrip() {
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.trace").string();
+    {
+        TraceWriter trace(path);
+        trace.Record(TraceCommand::Set, "A1"_pos, "2");
+        trace.Record(TraceCommand::Set, "XFD16384"_pos, "=A1*(2+A1)");
+        trace.Record(TraceCommand::Set, "B1"_pos, "=B1");
+        trace.Record(TraceCommand::PrintValues);
+        trace.Record(TraceCommand::Clear, "A1"_pos);
+        trace.Record(TraceCommand::PrintTexts);
+        trace.RecordPrintDiff(3);
+        trace.RecordLayoutChange(TraceCommand::InsertCols, "B1"_pos, 2);
+    }
+    {
+        TraceReader reader(path);
+        auto record = reader.Next();
+        ASSERT(record && record->command == TraceCommand::Set);
+        ASSERT_EQUAL(record->pos, "A1"_pos);
+        ASSERT_EQUAL(record->text, "2");
+        record = reader.Next();
+        ASSERT_EQUAL(record->pos, "XFD16384"_pos);
+        ASSERT_EQUAL(record->text, "=A1*(2+A1)");
+        auto previous_time = record->time;
+        for (auto command : {TraceCommand::Set, TraceCommand::PrintValues, TraceCommand::Clear, TraceCommand::PrintTexts,
+                             TraceCommand::PrintDiff}) {
+            record = reader.Next();
+            ASSERT(record && record->command == command);
+            ASSERT(record->time >= previous_time);
+            previous_time = record->time;
+        }
+        ASSERT_EQUAL(record->version, 3u);
+        record = reader.Next();
+        ASSERT(record && record->command == TraceCommand::InsertCols);
+        ASSERT_EQUAL(record->pos, "B1"_pos);
+        ASSERT_EQUAL(record->count, 2);
+        ASSERT(!reader.Next());
+    }
+
+    Sheet sheet;
+    auto stats = ReplayTrace(path, sheet);
+    // the cycle and the columns which would move the formula of the last column out of the sheet are rejected
+    ASSERT_EQUAL(stats.errors, 2u);
+    ASSERT_EQUAL(stats.latencies[static_cast<size_t>(TraceCommand::Set)].GetCount(), 3u);
+    ASSERT_EQUAL(stats.latencies[static_cast<size_t>(TraceCommand::PrintTexts)].GetCount(), 1u);
+    ASSERT_EQUAL(stats.latencies[static_cast<size_t>(TraceCommand::PrintDiff)].GetCount(), 1u);
+    ASSERT_EQUAL(stats.latencies[static_cast<size_t>(TraceCommand::InsertCols)].GetCount(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("XFD16384"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(!sheet.GetCell("B1"_pos) || sheet.GetCell("B1"_pos)->GetText().empty());
+    std::filesystem::remove(path);
+
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 100; ++i) {
+        histogram.Add(std::chrono::nanoseconds(i * 10));
+    }
+    ASSERT_EQUAL(histogram.GetCount(), 100u);
+    ASSERT_EQUAL(histogram.GetMax().count(), 1000);
+    // 500 ns falls into [256, 512)
+    ASSERT_EQUAL(histogram.GetPercentile(0.5).count(), 511);
+    ASSERT_EQUAL(histogram.GetPercentile(1.0).count(), 1000);
+}
 }  // namespace
 
 void Test() {
@@ -362,6 +2024,7 @@ void Test() {
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestClearFormulaCell);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
@@ -374,6 +2037,32 @@ void Test() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestConditionalAggregates);
+    RUN_TEST(tr, TestLogicalFunctions);
+    RUN_TEST(tr, TestSheetOverlay);
+    RUN_TEST(tr, TestParameterSweep);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestSheetMemoryUsage);
+    RUN_TEST(tr, TestEvaluationProfiler);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestValidatingRecalculation);
+    RUN_TEST(tr, TestRangeValues);
+    RUN_TEST(tr, TestValueChanges);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestLayoutChanges);
+    RUN_TEST(tr, TestTsvImportRoundTrip);
+    RUN_TEST(tr, TestDurableSheet);
+    RUN_TEST(tr, TestCommandProcessor);
+    RUN_TEST(tr, TestTraceRoundTrip);
+#ifdef __linux__
+    RUN_TEST(tr, TestSheetServer);
+#endif
 }
 
 // ********************************************************
@@ -386,6 +2075,11 @@ void PrintManual(std::ostream& output) {
         << "\t\tclear pos - to delete cell or clear cell contents with pos* position\n"
         << "\t\tprint values - to display on screen values of all cells of the table\n"
         << "\t\tprint texts - to display on screen text content of all cells of the table\n"
+        << "\t\tprint diff version - to display on screen the new version and the cells changed after the version\n"
+        << "\t\tinsert rows row [count], insert cols col [count] - to insert empty rows before the row or columns before the column\n"
+        << "\t\tdelete rows row [count], delete cols col [count] - to delete rows or columns starting with the row or the column\n"
+        << "\t\tstats - to display on screen the counters of the engine\n"
+        << "\t\tmemory - to display on screen the memory used by the table\n"
         << "\t\texit - to end the program\n"s
         << "*pos, for example \"A2\", must contains an alphabetic column number and a numeric row number\n";
 }
@@ -396,12 +2090,24 @@ struct Request {
         CLEAR,
         PRINT_VALUES,
         PRINT_TEXTS,
+        PRINT_DIFF,
+        INSERT_ROWS,
+        DELETE_ROWS,
+        INSERT_COLS,
+        DELETE_COLS,
+        STATS,
+        MEMORY,
         EXIT
     };
 
     RequestType type;
-    std::optional<Position> pos;
-    std::optional<std::string_view> text;
+    std::optional<Position> pos = std::nullopt;
+    // the text is copied: the words refer to the line which is destroyed after parsing
+    std::optional<std::string> text = std::nullopt;
+    // the version of the sheet the diff is printed after
+    std::optional<std::uint64_t> version = std::nullopt;
+    // the number of the inserted or deleted lines, the first one is at pos
+    std::optional<int> count = std::nullopt;
 };
 
 std::vector<std::string_view> SplitIntoWords(std::string_view line) {
@@ -435,14 +2141,36 @@ Request GetRequest(std::istream& input) {
     if (line == "print texts"sv) {
         return {Request::RequestType::PRINT_TEXTS};
     }
+    if (line == "stats"sv) {
+        return {Request::RequestType::STATS};
+    }
+    if (line == "memory"sv) {
+        return {Request::RequestType::MEMORY};
+    }
     
     std::vector<std::string_view> words = SplitIntoWords(line);
     if (words[0] == "set"sv) {
-        return {Request::RequestType::SET, Position::FromString(words[1]), words[2]};
+        return {Request::RequestType::SET, Position::FromString(words[1]), std::string(words[2])};
     }
     if (words[0] == "clear"sv) {
         return {Request::RequestType::CLEAR, Position::FromString(words[1])};
     }
+    if (words[0] == "print"sv && words.size() == 3 && words[1] == "diff"sv) {
+        return {Request::RequestType::PRINT_DIFF, std::nullopt, std::nullopt, std::stoull(std::string(words[2]))};
+    }
+    if ((words[0] == "insert"sv || words[0] == "delete"sv) && (words.size() == 3 || words.size() == 4)) {
+        const bool insert = words[0] == "insert"sv;
+        const int count = words.size() == 4 ? std::stoi(std::string(words[3])) : 1;
+        // a row is written as its number and a column as its letters
+        if (words[1] == "rows"sv) {
+            return {insert ? Request::RequestType::INSERT_ROWS : Request::RequestType::DELETE_ROWS,
+                    Position::FromString("A"s + std::string(words[2])), std::nullopt, std::nullopt, count};
+        }
+        if (words[1] == "cols"sv) {
+            return {insert ? Request::RequestType::INSERT_COLS : Request::RequestType::DELETE_COLS,
+                    Position::FromString(std::string(words[2]) + '1'), std::nullopt, std::nullopt, count};
+        }
+    }
     // errors
 }
 
@@ -451,6 +2179,11 @@ public:
     explicit SheetHandle(std::unique_ptr<SheetInterface> sheet) : sheet_{std::move(sheet)} {
     }
 
+    // every request is recorded to the trace and written to the file before it is executed
+    void RecordTo(std::unique_ptr<TraceWriter> trace) {
+        trace_ = std::move(trace);
+    }
+
     void ProceedRequests(std::istream& input, std::ostream& output) {
         Request request = GetRequest(input);
         while (request.type != Request::RequestType::EXIT) {
@@ -460,9 +2193,15 @@ public:
     }
 private:
     void ExecuteRequest(std::ostream& output, const Request& request) {
+        if (trace_) {
+            Record(request);
+            // a rejected request ends the program without unwinding the stack,
+            // so the trace of the failure is written before it happens
+            trace_->Flush();
+        }
         switch(request.type) {
             case Request::RequestType::SET:
-                sheet_->SetCell(request.pos.value(), std::string(request.text.value()));
+                sheet_->SetCell(request.pos.value(), request.text.value());
                 break;
             case Request::RequestType::CLEAR:
                 sheet_->ClearCell(request.pos.value());
@@ -473,17 +2212,175 @@ private:
             case Request::RequestType::PRINT_TEXTS:
                 sheet_->PrintTexts(output);
                 break;
+            case Request::RequestType::PRINT_DIFF:
+                if (const Sheet* sheet = GetCells()) {
+                    sheet->PrintDiff(output, request.version.value());
+                } else {
+                    throw std::invalid_argument("The sheet does not track the changes");
+                }
+                break;
+            case Request::RequestType::INSERT_ROWS:
+                GetLayoutSheet().InsertRows(request.pos->row, request.count.value());
+                break;
+            case Request::RequestType::DELETE_ROWS:
+                GetLayoutSheet().DeleteRows(request.pos->row, request.count.value());
+                break;
+            case Request::RequestType::INSERT_COLS:
+                GetLayoutSheet().InsertCols(request.pos->col, request.count.value());
+                break;
+            case Request::RequestType::DELETE_COLS:
+                GetLayoutSheet().DeleteCols(request.pos->col, request.count.value());
+                break;
+            case Request::RequestType::STATS:
+                if (const Sheet* sheet = GetCells()) {
+                    output << sheet->GetStats();
+                }
+                break;
+            case Request::RequestType::MEMORY:
+                if (const Sheet* sheet = GetCells()) {
+                    output << sheet->GetMemoryUsage();
+                }
+                break;
         }
     } 
 
+    // returns the sheet holding the cells or nullptr
+    const Sheet* GetCells() const {
+        if (auto* durable_sheet = dynamic_cast<DurableSheet*>(sheet_.get())) {
+            return &durable_sheet->GetSheet();
+        }
+        return dynamic_cast<const Sheet*>(sheet_.get());
+    }
+
+    // returns the sheet the rows and the columns are inserted and deleted in; a DurableSheet
+    // does not log them, its log is replayed over the snapshots which may already contain them
+    Sheet& GetLayoutSheet() {
+        if (auto* sheet = dynamic_cast<Sheet*>(sheet_.get())) {
+            return *sheet;
+        }
+        throw std::invalid_argument("The sheet does not support inserting and deleting rows and columns");
+    }
+
+    void Record(const Request& request) {
+        switch(request.type) {
+            case Request::RequestType::SET:
+                trace_->Record(TraceCommand::Set, request.pos.value(), request.text.value());
+                break;
+            case Request::RequestType::CLEAR:
+                trace_->Record(TraceCommand::Clear, request.pos.value());
+                break;
+            case Request::RequestType::PRINT_VALUES:
+                trace_->Record(TraceCommand::PrintValues);
+                break;
+            case Request::RequestType::PRINT_TEXTS:
+                trace_->Record(TraceCommand::PrintTexts);
+                break;
+            case Request::RequestType::PRINT_DIFF:
+                trace_->RecordPrintDiff(request.version.value());
+                break;
+            case Request::RequestType::INSERT_ROWS:
+                trace_->RecordLayoutChange(TraceCommand::InsertRows, request.pos.value(), request.count.value());
+                break;
+            case Request::RequestType::DELETE_ROWS:
+                trace_->RecordLayoutChange(TraceCommand::DeleteRows, request.pos.value(), request.count.value());
+                break;
+            case Request::RequestType::INSERT_COLS:
+                trace_->RecordLayoutChange(TraceCommand::InsertCols, request.pos.value(), request.count.value());
+                break;
+            case Request::RequestType::DELETE_COLS:
+                trace_->RecordLayoutChange(TraceCommand::DeleteCols, request.pos.value(), request.count.value());
+                break;
+            default:
+                // the counters and the memory do not depend on the commands, they are not recorded
+                break;
+        }
+    }
+
     std::unique_ptr<SheetInterface> sheet_;
+    std::unique_ptr<TraceWriter> trace_;
 };
 
-int main() {
+// writes the Chrome trace of the evaluations and reports the hottest cells
+void ReportProfile(EvaluationProfiler& profiler, const std::string& path) {
+    profiler.Stop();
+    std::ofstream trace(path);
+    profiler.WriteChromeTrace(trace);
+    profiler.PrintReport(std::cerr);
+}
+
+// "--durable dir" keeps the sheet in the directory and recovers it on start,
+// "--fast" executes the commands with CommandProcessor, without the manual,
+// "--serve socket" serves the sheet with SheetServer,
+// "--record trace" records the requests of the line mode to the trace file,
+// it cannot be combined with "--fast" and "--serve",
+// "--profile trace" profiles the evaluations of formulas: the Chrome trace is
+// written to the file on exit and the hottest cells are reported to stderr
+int main(int argc, char* argv[]) {
     //Test();
 
+    using namespace std::literals;
+
+    std::unique_ptr<SheetInterface> sheet;
+    bool fast = false;
+    std::string socket_path;
+    std::string trace_path;
+    std::string profile_path;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == "--durable"sv && i + 1 < argc) {
+            sheet = std::make_unique<DurableSheet>(argv[++i]);
+        } else if (argv[i] == "--fast"sv) {
+            fast = true;
+        } else if (argv[i] == "--serve"sv && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (argv[i] == "--record"sv && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (argv[i] == "--profile"sv && i + 1 < argc) {
+            profile_path = argv[++i];
+        }
+    }
+    if (!trace_path.empty() && (fast || !socket_path.empty())) {
+        std::cerr << "--record cannot be combined with --fast and --serve" << std::endl;
+        return 1;
+    }
+    if (!sheet) {
+        sheet = CreateSheet();
+    }
+
+    std::unique_ptr<EvaluationProfiler> profiler;
+    if (!profile_path.empty()) {
+        auto* durable_sheet = dynamic_cast<DurableSheet*>(sheet.get());
+        profiler = std::make_unique<EvaluationProfiler>(
+            durable_sheet ? durable_sheet->GetSheet() : dynamic_cast<Sheet&>(*sheet));
+        profiler->Start();
+    }
+
+#ifdef __linux__
+    if (!socket_path.empty()) {
+        auto* durable_sheet = dynamic_cast<DurableSheet*>(sheet.get());
+        Sheet& cells = durable_sheet ? durable_sheet->GetSheet() : dynamic_cast<Sheet&>(*sheet);
+        SheetServer server(cells, *sheet, socket_path, std::max(2u, std::thread::hardware_concurrency()));
+        server.Run();
+        return 0;
+    }
+#endif
+
+    if (fast) {
+        std::ios::sync_with_stdio(false);
+        CommandProcessor(*sheet).Run(std::cin, std::cout);
+        if (profiler) {
+            ReportProfile(*profiler, profile_path);
+        }
+        return 0;
+    }
+
     PrintManual(std::cout);
 
-    SheetHandle sheet_handle(CreateSheet());
+    SheetHandle sheet_handle(std::move(sheet));
+    if (!trace_path.empty()) {
+        sheet_handle.RecordTo(std::make_unique<TraceWriter>(trace_path));
+    }
     sheet_handle.ProceedRequests(std::cin, std::cout);
+    if (profiler) {
+        ReportProfile(*profiler, profile_path);
+    }
 }
\ No newline at end of file
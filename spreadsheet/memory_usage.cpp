@@ -0,0 +1,18 @@
+#include "memory_usage.h"
+
+#include <ostream>
+
+// outputs the usage as "name bytes" lines followed by the cell counts
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage) {
+    return output << "table " << usage.table << '\n'
+                  << "cells " << usage.cells << '\n'
+                  << "texts " << usage.texts << '\n'
+                  << "formula_nodes " << usage.formula_nodes << '\n'
+                  << "references " << usage.references << '\n'
+                  << "dependencies " << usage.dependencies << '\n'
+                  << "cached_values " << usage.cached_values << '\n'
+                  << "total " << usage.GetTotal() << '\n'
+                  << "empty_cells " << usage.empty_cells << '\n'
+                  << "text_cells " << usage.text_cells << '\n'
+                  << "formula_cells " << usage.formula_cells << '\n';
+}
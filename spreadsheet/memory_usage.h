@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+// Memory used by a sheet, in bytes, by category. The sizes are counted from
+// the structures themselves: the requested sizes of the objects and of the
+// buffers they own, without the overhead of the allocator. The nodes of hash
+// containers are estimated by the layout of the common standard libraries.
+struct MemoryUsage {
+    // buckets and nodes of the cell table
+    size_t table = 0;
+    // Cell objects with the objects of their contents
+    size_t cells = 0;
+    // the pool of the texts of the text cells
+    size_t texts = 0;
+    // formula objects and the nodes of their trees
+    size_t formula_nodes = 0;
+    // lists of the positions referenced by formulas
+    size_t references = 0;
+    // sets of dependent and referenced cells
+    size_t dependencies = 0;
+    size_t cached_values = 0;
+
+    // the number of cells of each kind of contents
+    size_t empty_cells = 0;
+    size_t text_cells = 0;
+    size_t formula_cells = 0;
+
+    size_t GetTotal() const {
+        return table + cells + texts + formula_nodes + references + dependencies + cached_values;
+    }
+};
+
+// returns the size of the buffer allocated by the string, zero for short strings
+inline size_t GetHeapSize(const std::string& text) {
+    const std::string empty;
+    return text.capacity() > empty.capacity() ? text.capacity() + 1 : 0;
+}
+
+// returns the size of the buckets and the nodes of an unordered container
+template <typename HashContainer>
+size_t GetHeapSize(const HashContainer& container) {
+    // a node holds the link to the next node, the value and the cached hash
+    constexpr size_t node_size = sizeof(void*) + sizeof(typename HashContainer::value_type) + sizeof(size_t);
+    // a single bucket is kept in the container itself
+    const size_t buckets = container.bucket_count() > 1 ? container.bucket_count() * sizeof(void*) : 0;
+    return buckets + container.size() * node_size;
+}
+
+// outputs the usage as "name bytes" lines followed by the cell counts
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage);
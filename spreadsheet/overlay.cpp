@@ -0,0 +1,238 @@
+#include "overlay.h"
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <utility>
+
+// the cell which contents is overridden in the scenario
+class SheetOverlay::OverriddenCell : public CellInterface {
+public:
+    OverriddenCell(const SheetOverlay& overlay, std::string text)
+            : overlay_{overlay}, text_{std::move(text)} {
+        if (text_.size() > 1 && text_[0] == FORMULA_SIGN) {
+            formula_ = ParseFormula(text_.substr(1));
+            text_ = FORMULA_SIGN + formula_->GetExpression();
+        }
+    }
+
+    Value GetValue() const override {
+        return ToValue(GetValueView());
+    }
+
+    ValueView GetValueView() const override {
+        if (!formula_) {
+            std::string_view value = text_;
+            if (!value.empty() && value[0] == ESCAPE_SIGN) {
+                value.remove_prefix(1);
+            }
+            return value;
+        }
+        if (!cached_value_.has_value()) {
+            cached_value_ = formula_->Evaluate(overlay_);
+        }
+        if (std::holds_alternative<double>(cached_value_.value())) {
+            return std::get<double>(cached_value_.value());
+        }
+        return std::get<FormulaError>(cached_value_.value());
+    }
+
+    std::string GetText() const override {
+        return text_;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return formula_ ? formula_->GetReferencedCells() : std::vector<Position>{};
+    }
+
+    void InvalidateCachedValue() const {
+        cached_value_.reset();
+    }
+
+private:
+    const SheetOverlay& overlay_;
+    std::string text_;
+    std::unique_ptr<FormulaInterface> formula_;
+
+    mutable std::optional<FormulaInterface::Value> cached_value_;
+};
+
+// the base cell which value is recalculated in the scenario
+class SheetOverlay::ConeCell : public CellInterface {
+public:
+    ConeCell(const SheetOverlay& overlay, const Cell& base_cell)
+            : overlay_{overlay}, base_cell_{base_cell} {
+    }
+
+    Value GetValue() const override {
+        return ToValue(GetValueView());
+    }
+
+    ValueView GetValueView() const override {
+        if (!cached_value_.has_value()) {
+            cached_value_ = base_cell_.GetValueIn(overlay_);
+        }
+        return ToValueView(cached_value_.value());
+    }
+
+    std::string GetText() const override {
+        return base_cell_.GetText();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return base_cell_.GetReferencedCells();
+    }
+
+    void InvalidateCachedValue() const {
+        cached_value_.reset();
+    }
+
+private:
+    const SheetOverlay& overlay_;
+    const Cell& base_cell_;
+
+    mutable std::optional<Value> cached_value_;
+};
+
+SheetOverlay::SheetOverlay(const Sheet& base) : base_{base} {
+}
+
+SheetOverlay::~SheetOverlay() {}
+
+// overrides the contents of the cell in the scenario, the base sheet is not modified
+void SheetOverlay::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    auto new_cell = std::make_unique<OverriddenCell>(*this, std::move(text));
+    if (HasCyclicDependence(pos, new_cell->GetReferencedCells())) {
+        throw CircularDependencyException("Formula has circular dependence");
+    }
+    overridden_[pos] = std::move(new_cell);
+
+    ExtendCone(pos);
+    InvalidateCache();
+}
+
+// returns the overridden cell, the recalculated cone cell or the base cell
+const CellInterface* SheetOverlay::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    if (auto iter = overridden_.find(pos); iter != overridden_.end()) {
+        return iter->second.get();
+    }
+    const Cell* base_cell = base_.GetCellPtr(pos);
+    if (!base_cell || !cone_.count(base_cell)) {
+        return base_cell;
+    }
+    auto& cone_cell = cone_cells_[base_cell];
+    if (!cone_cell) {
+        cone_cell = std::make_unique<ConeCell>(*this, *base_cell);
+    }
+    return cone_cell.get();
+}
+
+CellInterface* SheetOverlay::GetCell(Position pos) {
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+// overrides the cell in the scenario with an empty one
+void SheetOverlay::ClearCell(Position pos) {
+    SetCell(pos, {});
+}
+
+// returns the size of the minimum rectangular area of the base sheet and the overrides
+Size SheetOverlay::GetPrintableSize() const {
+    Size printable_size = base_.GetPrintableSize();
+    for (const auto& [pos, cell] : overridden_) {
+        if (cell->GetText().empty()) {
+            continue;
+        }
+        printable_size.rows = std::max(pos.row + 1, printable_size.rows);
+        printable_size.cols = std::max(pos.col + 1, printable_size.cols);
+    }
+    return printable_size;
+}
+
+template <typename PrintFunc>
+void SheetOverlay::Print(std::ostream& output, PrintFunc func) const {
+    Size printable_size = GetPrintableSize();
+    for (int i = 0; i < printable_size.rows; ++i) {
+        for (int j = 0; j < printable_size.cols; ++j) {
+            if (j != 0) {
+                output << '\t';
+            }
+            if (const CellInterface* cell = GetCell(Position{i, j}); cell) {
+                func(cell);
+            }
+        }
+        output << std::endl;
+    }
+}
+
+// outputs cell values of the scenario
+void SheetOverlay::PrintValues(std::ostream& output) const {
+    Print(output, [&output](const CellInterface* cell) {
+        std::visit([&output](const auto& value) {
+            output << value;
+        }, cell->GetValueView());
+    });
+}
+
+// outputs text representations of the scenario cells
+void SheetOverlay::PrintTexts(std::ostream& output) const {
+    Print(output, [&output](const CellInterface* cell) {
+        output << cell->GetText();
+    });
+}
+
+size_t SheetOverlay::GetOverriddenCount() const {
+    return overridden_.size();
+}
+
+size_t SheetOverlay::GetConeSize() const {
+    return cone_.size();
+}
+
+// adds the base cell at pos and all its transitive dependents to the cone
+void SheetOverlay::ExtendCone(Position pos) {
+    // the cell may not exist in the base sheet, the formulas of the ranges containing it depend on it
+    for (Position dependent : Cell::GetDependentPositions(base_, {pos})) {
+        cone_.insert(base_.GetCellPtr(dependent));
+    }
+}
+
+// the method determines the presence of cyclic dependence in the overridden formula
+bool SheetOverlay::HasCyclicDependence(Position pos, const std::vector<Position>& referenced) const {
+    std::deque<Position> to_visit(referenced.begin(), referenced.end());
+    std::unordered_set<Position, PositionHasher> visited;
+
+    while (!to_visit.empty()) {
+        Position current = to_visit.front();
+        to_visit.pop_front();
+
+        if (current == pos) {
+            return true;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        if (const CellInterface* cell = GetCell(current); cell) {
+            for (Position next : cell->GetReferencedCells()) {
+                to_visit.push_back(next);
+            }
+        }
+    }
+    return false;
+}
+
+// drops values calculated in the scenario
+void SheetOverlay::InvalidateCache() const {
+    for (const auto& [pos, cell] : overridden_) {
+        cell->InvalidateCachedValue();
+    }
+    for (const auto& [base_cell, cone_cell] : cone_cells_) {
+        cone_cell->InvalidateCachedValue();
+    }
+}
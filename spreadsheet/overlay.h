@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+// What-if scenario on top of a base sheet. The overlay stores only the
+// overridden cells and the values of the base cells that depend on them
+// (the dependent cone, found through the dependency graph of the base sheet).
+// All other reads fall through to the base sheet and its cached values,
+// so the memory used by a scenario is proportional to its delta.
+// The base sheet must outlive the overlay and must not be modified while
+// the overlay is in use. A read falling through to the base sheet calculates
+// and caches the value of a base formula, so overlays sharing a base must not
+// be read from different threads unless the base is not in the validating
+// mode and the values of all its formulas were read before, as SheetServer
+// does when it starts.
+class SheetOverlay : public SheetInterface {
+public:
+    explicit SheetOverlay(const Sheet& base);
+    ~SheetOverlay();
+
+    // overrides the contents of the cell in the scenario, the base sheet is not modified
+    void SetCell(Position pos, std::string text) override;
+
+    // returns the overridden cell, the recalculated cone cell or the base cell
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    // overrides the cell in the scenario with an empty one
+    void ClearCell(Position pos) override;
+    // returns the size of the minimum rectangular area of the base sheet and the overrides
+    Size GetPrintableSize() const override;
+
+    // outputs cell values of the scenario
+    void PrintValues(std::ostream& output) const override;
+    // outputs text representations of the scenario cells
+    void PrintTexts(std::ostream& output) const override;
+
+    // returns the number of overridden cells
+    size_t GetOverriddenCount() const;
+    // returns the number of base cells which values are recalculated in the scenario
+    size_t GetConeSize() const;
+
+private:
+    class OverriddenCell;
+    class ConeCell;
+
+    // adds the base cell at pos and all its transitive dependents to the cone
+    void ExtendCone(Position pos);
+    // the method determines the presence of cyclic dependence in the overridden formula
+    bool HasCyclicDependence(Position pos, const std::vector<Position>& referenced) const;
+    // drops values calculated in the scenario
+    void InvalidateCache() const;
+
+    template <typename PrintFunc>
+    void Print(std::ostream& output, PrintFunc func) const;
+
+    const Sheet& base_;
+    std::unordered_map<Position, std::unique_ptr<OverriddenCell>, PositionHasher> overridden_;
+    // base cells which values depend on the overridden cells
+    std::unordered_set<const Cell*> cone_;
+    // cone cells are created on the first read
+    mutable std::unordered_map<const Cell*, std::unique_ptr<ConeCell>> cone_cells_;
+};
@@ -0,0 +1,181 @@
+#include "profiler.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+std::atomic<EvaluationProfiler*> EvaluationProfiler::active_ = nullptr;
+
+namespace {
+// the exclusive time of every evaluation in progress on the thread is its
+// inclusive time minus the time of the evaluations nested in it
+thread_local std::vector<EvaluationProfiler::Duration> nested_time;
+
+std::uint32_t GetThreadIndex() {
+    static std::atomic<std::uint32_t> next_index = 0;
+    thread_local const std::uint32_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+double ToMicroseconds(EvaluationProfiler::Duration duration) {
+    return static_cast<double>(duration.count()) / 1000.0;
+}
+
+std::string GetName(const std::unordered_map<const Cell*, Position>& positions, const Cell* cell) {
+    auto iter = positions.find(cell);
+    return iter == positions.end() ? "?" : iter->second.ToString();
+}
+}  // namespace
+
+EvaluationProfiler::EvaluationProfiler(const Sheet& sheet, size_t max_events)
+        : sheet_{sheet}, max_events_{max_events} {
+}
+
+// the profiler must not be destroyed while the cells are evaluated on other threads
+EvaluationProfiler::~EvaluationProfiler() {
+    Stop();
+}
+
+// starts recording, the records of the previous run are discarded
+void EvaluationProfiler::Start() {
+    {
+        std::lock_guard lock(mutex_);
+        events_.clear();
+        totals_.clear();
+        dropped_events_ = 0;
+        started_ = std::chrono::steady_clock::now();
+    }
+    EvaluationProfiler* expected = nullptr;
+    if (!active_.compare_exchange_strong(expected, this) && expected != this) {
+        throw std::logic_error("Another evaluation profiler is started");
+    }
+}
+
+void EvaluationProfiler::Stop() {
+    EvaluationProfiler* expected = this;
+    active_.compare_exchange_strong(expected, nullptr);
+}
+
+bool EvaluationProfiler::IsActive() const {
+    return GetActive() == this;
+}
+
+const std::vector<EvaluationProfiler::Event>& EvaluationProfiler::GetEvents() const {
+    return events_;
+}
+
+// returns the number of evaluations which did not fit into the trace
+size_t EvaluationProfiler::GetDroppedEvents() const {
+    std::lock_guard lock(mutex_);
+    return dropped_events_;
+}
+
+void EvaluationProfiler::Record(const Cell* cell, std::uint32_t depth, std::chrono::steady_clock::time_point start,
+                                Duration inclusive, Duration exclusive) {
+    const std::uint32_t thread = GetThreadIndex();
+    std::lock_guard lock(mutex_);
+    CellTotals& totals = totals_[cell];
+    ++totals.evaluations;
+    totals.inclusive += inclusive;
+    totals.exclusive += exclusive;
+    if (events_.size() < max_events_) {
+        events_.push_back({cell, thread, depth, start - started_, inclusive, exclusive});
+    } else {
+        ++dropped_events_;
+    }
+}
+
+// returns the positions of the cells which are still in the sheet
+std::unordered_map<const Cell*, Position> EvaluationProfiler::GetPositions() const {
+    std::unordered_map<const Cell*, Position> positions;
+    positions.reserve(sheet_.GetCells().size());
+    for (const auto& [pos, cell] : sheet_.GetCells()) {
+        positions.emplace(&cell, pos);
+    }
+    return positions;
+}
+
+// returns at most count cells ordered by the exclusive time
+std::vector<EvaluationProfiler::CellProfile> EvaluationProfiler::GetHottestCells(size_t count) const {
+    const auto positions = GetPositions();
+    std::vector<CellProfile> cells;
+    {
+        std::lock_guard lock(mutex_);
+        cells.reserve(totals_.size());
+        for (const auto& [cell, totals] : totals_) {
+            auto iter = positions.find(cell);
+            cells.push_back({iter == positions.end() ? Position::NONE : iter->second,
+                             totals.evaluations, totals.inclusive, totals.exclusive});
+        }
+    }
+    count = std::min(count, cells.size());
+    std::partial_sort(cells.begin(), cells.begin() + count, cells.end(),
+                      [](const CellProfile& lhs, const CellProfile& rhs) {
+                          return lhs.exclusive > rhs.exclusive;
+                      });
+    cells.resize(count);
+    return cells;
+}
+
+// outputs the events in the Chrome trace-event JSON format
+void EvaluationProfiler::WriteChromeTrace(std::ostream& output) const {
+    const auto positions = GetPositions();
+    std::lock_guard lock(mutex_);
+
+    const auto flags = output.flags();
+    output << std::fixed << std::setprecision(3);
+    output << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const Event& event : events_) {
+        output << (first ? "\n" : ",\n");
+        first = false;
+        // complete events of one thread nest by their time, as the evaluations did
+        output << "{\"name\":\"" << GetName(positions, event.cell) << "\",\"cat\":\"formula\",\"ph\":\"X\""
+               << ",\"ts\":" << ToMicroseconds(event.start)
+               << ",\"dur\":" << ToMicroseconds(event.inclusive)
+               << ",\"pid\":1,\"tid\":" << event.thread
+               << ",\"args\":{\"exclusive_us\":" << ToMicroseconds(event.exclusive)
+               << ",\"depth\":" << event.depth << "}}";
+    }
+    output << "\n]}\n";
+    output.flags(flags);
+}
+
+// outputs the table of at most count hottest cells
+void EvaluationProfiler::PrintReport(std::ostream& output, size_t count) const {
+    const auto flags = output.flags();
+    output << std::fixed << std::setprecision(3);
+    output << "cell\tevaluations\texclusive_us\tinclusive_us\n";
+    for (const CellProfile& cell : GetHottestCells(count)) {
+        output << (cell.pos.IsValid() ? cell.pos.ToString() : "?") << '\t'
+               << cell.evaluations << '\t'
+               << ToMicroseconds(cell.exclusive) << '\t'
+               << ToMicroseconds(cell.inclusive) << '\n';
+    }
+    const size_t dropped = GetDroppedEvents();
+    if (dropped > 0) {
+        output << "events not traced: " << dropped << '\n';
+    }
+    output.flags(flags);
+}
+
+#if SPREADSHEET_STATS
+void EvaluationScope::Enter(const Cell* cell) {
+    cell_ = cell;
+    nested_time.push_back(EvaluationProfiler::Duration::zero());
+    start_ = std::chrono::steady_clock::now();
+}
+
+void EvaluationScope::Leave() {
+    const auto inclusive = std::chrono::duration_cast<EvaluationProfiler::Duration>(
+        std::chrono::steady_clock::now() - start_);
+    const auto nested = nested_time.back();
+    nested_time.pop_back();
+    if (!nested_time.empty()) {
+        nested_time.back() += inclusive;
+    }
+    profiler_->Record(cell_, static_cast<std::uint32_t>(nested_time.size()), start_, inclusive, inclusive - nested);
+}
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "common.h"
+#include "stats.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Profiler of formula evaluations. While the profiler is started, every
+// evaluation of a formula is recorded with its start, its inclusive time and
+// its exclusive time, that is without the evaluations of the referenced cells
+// nested in it. The records are exported as a Chrome trace (chrome://tracing,
+// Perfetto) and summed per cell into the report of the hottest cells.
+// Only one profiler is active at a time. When no profiler is started, an
+// evaluation pays one relaxed load; building with SPREADSHEET_STATS=0
+// compiles the profiling out together with the counters.
+class EvaluationProfiler {
+public:
+    using Duration = std::chrono::nanoseconds;
+
+    struct Event {
+        const Cell* cell;
+        std::uint32_t thread;
+        // the number of evaluations the event is nested in
+        std::uint32_t depth;
+        // from the start of the profiler
+        Duration start;
+        Duration inclusive;
+        Duration exclusive;
+    };
+
+    struct CellProfile {
+        // the position is invalid if the cell was deleted before the report
+        Position pos = Position::NONE;
+        std::uint64_t evaluations = 0;
+        Duration inclusive{0};
+        Duration exclusive{0};
+    };
+
+    // at most max_events events are kept for the trace, the per-cell sums
+    // are kept for all evaluations
+    explicit EvaluationProfiler(const Sheet& sheet, size_t max_events = 1 << 20);
+    EvaluationProfiler(const EvaluationProfiler&) = delete;
+    EvaluationProfiler& operator=(const EvaluationProfiler&) = delete;
+    ~EvaluationProfiler();
+
+    // starts recording, the records of the previous run are discarded
+    void Start();
+    void Stop();
+    bool IsActive() const;
+
+    const std::vector<Event>& GetEvents() const;
+    // returns the number of evaluations which did not fit into the trace
+    size_t GetDroppedEvents() const;
+    // returns at most count cells ordered by the exclusive time
+    std::vector<CellProfile> GetHottestCells(size_t count) const;
+
+    // outputs the events in the Chrome trace-event JSON format
+    void WriteChromeTrace(std::ostream& output) const;
+    // outputs the table of at most count hottest cells
+    void PrintReport(std::ostream& output, size_t count = 20) const;
+
+    // returns the started profiler or nullptr
+    static EvaluationProfiler* GetActive() {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+private:
+    friend class EvaluationScope;
+
+    struct CellTotals {
+        std::uint64_t evaluations = 0;
+        Duration inclusive{0};
+        Duration exclusive{0};
+    };
+
+    void Record(const Cell* cell, std::uint32_t depth, std::chrono::steady_clock::time_point start,
+                Duration inclusive, Duration exclusive);
+    // returns the positions of the cells which are still in the sheet
+    std::unordered_map<const Cell*, Position> GetPositions() const;
+
+    static std::atomic<EvaluationProfiler*> active_;
+
+    const Sheet& sheet_;
+    size_t max_events_;
+    std::chrono::steady_clock::time_point started_;
+
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
+    std::unordered_map<const Cell*, CellTotals> totals_;
+    size_t dropped_events_ = 0;
+};
+
+// measures one evaluation of the formula of the cell if a profiler is active
+class EvaluationScope {
+public:
+#if SPREADSHEET_STATS
+    explicit EvaluationScope(const Cell* cell) : profiler_{EvaluationProfiler::GetActive()} {
+        if (profiler_) {
+            Enter(cell);
+        }
+    }
+    ~EvaluationScope() {
+        if (profiler_) {
+            Leave();
+        }
+    }
+#else
+    explicit EvaluationScope(const Cell* /* cell */) {
+    }
+#endif
+    EvaluationScope(const EvaluationScope&) = delete;
+    EvaluationScope& operator=(const EvaluationScope&) = delete;
+
+private:
+#if SPREADSHEET_STATS
+    void Enter(const Cell* cell);
+    void Leave();
+
+    EvaluationProfiler* profiler_;
+    const Cell* cell_ = nullptr;
+    std::chrono::steady_clock::time_point start_;
+#endif
+};
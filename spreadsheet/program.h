@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+// Flat postfix form of a formula. Instructions are executed in order on a
+// stack of operands; the program has no pointers, so it can be copied,
+// evaluated for many inputs at once or stored as is.
+struct FormulaProgram {
+    enum class OpCode : std::uint8_t {
+        Number,      // pushes constants[arg]
+        Cell,        // pushes the value of the cell cells[arg]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+        Range,       // pushes the range with the corners cells[arg] and cells[arg + 1]
+        // the aggregate functions pop arg arguments, numbers or ranges
+        Sum,
+        Count,
+        Average,
+        Min,
+        Max,
+        // the lookup functions pop arg arguments, the ranges where the function expects them
+        Match,
+        VLookup,
+        XLookup,
+        // the conditional aggregate functions pop arg arguments: the criteria
+        // range, the key and the range of the values if it is given
+        SumIf,
+        CountIf,
+        AverageIf,
+        // the comparisons pop two numbers and push 1 or 0
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        // the logical functions pop arg numbers and push the taken branch of IF or 1 or 0
+        If,
+        And,
+        Or,
+        Not,
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::uint32_t arg = 0;
+    };
+
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<Position> cells;
+};
@@ -0,0 +1,131 @@
+#include "range_references.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+
+// adds the reference of the formula to the range, the blocks list the range with its first formula
+void RangeReferences::Add(const Range& range, const Cell* formula) {
+    std::vector<const Cell*>& formulas = formulas_[range];
+    if (formulas.empty()) {
+        ForEachBlock(range, [this, &range](std::uint32_t block) {
+            blocks_[block].push_back(range);
+        });
+    }
+    formulas.push_back(formula);
+}
+
+// removes the reference, the range is removed from the blocks with its last formula
+void RangeReferences::Remove(const Range& range, const Cell* formula) {
+    auto iter = formulas_.find(range);
+    if (iter == formulas_.end()) {
+        return;
+    }
+    std::vector<const Cell*>& formulas = iter->second;
+    auto found = std::find(formulas.begin(), formulas.end(), formula);
+    if (found == formulas.end()) {
+        return;
+    }
+    *found = formulas.back();
+    formulas.pop_back();
+    if (!formulas.empty()) {
+        return;
+    }
+    formulas_.erase(iter);
+    ForEachBlock(range, [this, &range](std::uint32_t block) {
+        auto block_iter = blocks_.find(block);
+        std::vector<Range>& ranges = block_iter->second;
+        *std::find(ranges.begin(), ranges.end(), range) = ranges.back();
+        ranges.pop_back();
+        if (ranges.empty()) {
+            blocks_.erase(block_iter);
+        }
+    });
+}
+
+void RangeReferences::Clear() {
+    formulas_.clear();
+    blocks_.clear();
+}
+
+// checks whether a range contains the cell
+bool RangeReferences::Contains(Position pos) const {
+    auto iter = blocks_.find(GetBlock(pos.row, pos.col));
+    if (iter == blocks_.end()) {
+        return false;
+    }
+    return std::any_of(iter->second.begin(), iter->second.end(), [pos](const Range& range) {
+        return range.Contains(pos);
+    });
+}
+
+// calls visit for the formulas with the ranges containing the cell, a formula
+// with several such ranges is passed once
+void RangeReferences::ForEachFormula(Position pos, const std::function<void(const Cell* formula)>& visit) const {
+    auto iter = blocks_.find(GetBlock(pos.row, pos.col));
+    if (iter == blocks_.end()) {
+        return;
+    }
+    const std::vector<const Cell*>* first = nullptr;
+    std::vector<const Cell*> merged;
+    for (const Range& range : iter->second) {
+        if (!range.Contains(pos)) {
+            continue;
+        }
+        const std::vector<const Cell*>& formulas = formulas_.at(range);
+        if (!first) {
+            first = &formulas;
+            continue;
+        }
+        if (merged.empty()) {
+            merged = *first;
+        }
+        merged.insert(merged.end(), formulas.begin(), formulas.end());
+    }
+    if (!first) {
+        return;
+    }
+    // the lists of one range hold every formula once
+    if (merged.empty()) {
+        std::for_each(first->begin(), first->end(), visit);
+        return;
+    }
+    std::sort(merged.begin(), merged.end());
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+    std::for_each(merged.begin(), merged.end(), visit);
+}
+
+// calls visit for every range with the formulas referring to it
+void RangeReferences::ForEachRange(
+        const std::function<void(const Range& range, const std::vector<const Cell*>& formulas)>& visit) const {
+    for (const auto& [range, formulas] : formulas_) {
+        visit(range, formulas);
+    }
+}
+
+// returns the size of the ranges, the lists of the formulas and the blocks
+size_t RangeReferences::GetMemoryUsage() const {
+    // a node of the tree holds its color, three links and the entry
+    size_t usage = formulas_.size() * (4 * sizeof(void*) + sizeof(Range) + sizeof(std::vector<const Cell*>));
+    for (const auto& [range, formulas] : formulas_) {
+        usage += formulas.capacity() * sizeof(const Cell*);
+    }
+    usage += GetHeapSize(blocks_);
+    for (const auto& [block, ranges] : blocks_) {
+        usage += ranges.capacity() * sizeof(Range);
+    }
+    return usage;
+}
+
+// returns the key of the block of the cell, the row and the column of a block take two bytes each
+std::uint32_t RangeReferences::GetBlock(int row, int col) {
+    return static_cast<std::uint32_t>(row / BLOCK_SIZE) << 16 | static_cast<std::uint32_t>(col / BLOCK_SIZE);
+}
+
+// calls visit for the keys of the blocks covered by the range
+void RangeReferences::ForEachBlock(const Range& range, const std::function<void(std::uint32_t block)>& visit) {
+    for (int row = range.from.row / BLOCK_SIZE; row <= range.to.row / BLOCK_SIZE; ++row) {
+        for (int col = range.from.col / BLOCK_SIZE; col <= range.to.col / BLOCK_SIZE; ++col) {
+            visit(GetBlock(row * BLOCK_SIZE, col * BLOCK_SIZE));
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// The formulas referring to the ranges of a sheet. The cells of a range are
+// not linked to the formulas one by one: a range is kept once with the
+// formulas referring to it, and the blocks of 64 by 64 cells it covers list
+// it, so the formulas depending on a changed cell are found by the ranges of
+// one block. The cells of a range need not exist, an empty cell of a range
+// is not created.
+class RangeReferences {
+public:
+    // adds the reference of the formula to the range, a formula refers to a range once
+    void Add(const Range& range, const Cell* formula);
+    void Remove(const Range& range, const Cell* formula);
+    void Clear();
+
+    // checks whether a range contains the cell
+    bool Contains(Position pos) const;
+    // calls visit for the formulas with the ranges containing the cell, once for every formula
+    void ForEachFormula(Position pos, const std::function<void(const Cell* formula)>& visit) const;
+    // calls visit for every range with the formulas referring to it
+    void ForEachRange(const std::function<void(const Range& range, const std::vector<const Cell*>& formulas)>& visit) const;
+    // returns the size of the ranges, the lists of the formulas and the blocks
+    size_t GetMemoryUsage() const;
+
+private:
+    static constexpr int BLOCK_SIZE = 64;
+
+    // returns the key of the block of the cell
+    static std::uint32_t GetBlock(int row, int col);
+    // calls visit for the keys of the blocks covered by the range
+    static void ForEachBlock(const Range& range, const std::function<void(std::uint32_t block)>& visit);
+
+    std::map<Range, std::vector<const Cell*>> formulas_;
+    // the ranges covering every block which has any
+    std::unordered_map<std::uint32_t, std::vector<Range>> blocks_;
+};
@@ -0,0 +1,590 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+// requests and responses over the limit close the connection
+constexpr std::uint32_t MAX_FRAME_SIZE = 64 << 20;
+// the largest area returned by GetRange
+constexpr std::int64_t MAX_RANGE_CELLS = 1 << 20;
+constexpr size_t READ_BLOCK_SIZE = 64 << 10;
+constexpr int MAX_EVENTS = 64;
+
+enum class ValueKind : std::uint8_t {
+    String,
+    Number,
+    Error,
+};
+
+template <typename T>
+void AppendRaw(std::string& buffer, T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// reads a value from the beginning of data and removes it
+template <typename T>
+T TakeRaw(std::string_view& data) {
+    if (data.size() < sizeof(T)) {
+        throw ServerException("Truncated message");
+    }
+    T value;
+    std::memcpy(&value, data.data(), sizeof(value));
+    data.remove_prefix(sizeof(value));
+    return value;
+}
+
+Position TakePosition(std::string_view& data) {
+    const auto row = TakeRaw<std::int32_t>(data);
+    const auto col = TakeRaw<std::int32_t>(data);
+    return {row, col};
+}
+
+void AppendPosition(std::string& buffer, Position pos) {
+    AppendRaw(buffer, static_cast<std::int32_t>(pos.row));
+    AppendRaw(buffer, static_cast<std::int32_t>(pos.col));
+}
+
+void AppendValue(std::string& buffer, const CellInterface::ValueView& value) {
+    if (const auto* text = std::get_if<std::string_view>(&value)) {
+        AppendRaw(buffer, ValueKind::String);
+        AppendRaw(buffer, static_cast<std::uint32_t>(text->size()));
+        buffer += *text;
+    } else if (const auto* number = std::get_if<double>(&value)) {
+        AppendRaw(buffer, ValueKind::Number);
+        AppendRaw(buffer, *number);
+    } else {
+        AppendRaw(buffer, ValueKind::Error);
+        AppendRaw(buffer, static_cast<std::uint8_t>(std::get<FormulaError>(value).GetCategory()));
+    }
+}
+
+CellInterface::Value TakeValue(std::string_view& data) {
+    switch (TakeRaw<ValueKind>(data)) {
+        case ValueKind::String: {
+            const auto size = TakeRaw<std::uint32_t>(data);
+            if (data.size() < size) {
+                throw ServerException("Truncated message");
+            }
+            std::string text(data.substr(0, size));
+            data.remove_prefix(size);
+            return text;
+        }
+        case ValueKind::Number:
+            return TakeRaw<double>(data);
+        case ValueKind::Error:
+            return FormulaError(static_cast<FormulaError::Category>(TakeRaw<std::uint8_t>(data)));
+    }
+    throw ServerException("Invalid value kind");
+}
+
+// wraps the payload into a frame
+std::string MakeFrame(std::string payload) {
+    std::string frame;
+    frame.reserve(sizeof(std::uint32_t) + payload.size());
+    AppendRaw(frame, static_cast<std::uint32_t>(payload.size()));
+    frame += payload;
+    return frame;
+}
+
+std::string MakeResponse(ServerStatus status, std::string_view payload = {}) {
+    std::string response;
+    response.reserve(sizeof(std::uint32_t) + 1 + payload.size());
+    AppendRaw(response, static_cast<std::uint32_t>(1 + payload.size()));
+    AppendRaw(response, status);
+    response += payload;
+    return response;
+}
+
+sockaddr_un MakeAddress(const std::string& socket_path) {
+    sockaddr_un address{};
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw ServerException("Socket path is too long: " + socket_path);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return address;
+}
+
+void ThrowSystemError(const std::string& message) {
+    throw ServerException(message + ": " + std::strerror(errno));
+}
+}  // namespace
+
+struct SheetServer::Connection {
+    explicit Connection(int fd) : fd{fd} {
+    }
+    ~Connection() {
+        close(fd);
+    }
+
+    const int fd;
+    std::mutex mutex;
+    std::string input;
+    std::string output;
+    // a request of the connection is being executed
+    bool busy = false;
+    bool closed = false;
+    // the loop waits until the socket accepts the rest of the output
+    bool waits_output = false;
+};
+
+SheetServer::SheetServer(Sheet& sheet, std::string socket_path, size_t workers)
+        : SheetServer(sheet, sheet, std::move(socket_path), workers) {
+}
+
+SheetServer::SheetServer(Sheet& sheet, SheetInterface& writer, std::string socket_path, size_t workers)
+        : sheet_{sheet}, writer_{writer}, socket_path_{std::move(socket_path)}
+        , workers_count_{std::max<size_t>(workers, 1)} {
+    const sockaddr_un address = MakeAddress(socket_path_);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        ThrowSystemError("Cannot create socket");
+    }
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listen_fd_, SOMAXCONN) < 0) {
+        close(listen_fd_);
+        ThrowSystemError("Cannot listen on " + socket_path_);
+    }
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (int fd : {listen_fd_, stop_fd_}) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    // the readers share the lock, so reading a value must not verify it
+    if (sheet_.GetRecalculationMode() == RecalculationMode::Validating) {
+        sheet_.SetRecalculationMode(RecalculationMode::Lazy);
+    }
+    // the values of all formulas are calculated before the readers come
+    for (const auto& [pos, cell] : sheet_.GetCells()) {
+        cell.GetValueView();
+    }
+}
+
+SheetServer::~SheetServer() {
+    connections_.clear();
+    close(stop_fd_);
+    close(epoll_fd_);
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+}
+
+// serves the clients until Stop is called
+void SheetServer::Run() {
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workers_count_; ++i) {
+        workers.emplace_back([this] {
+            WorkerLoop();
+        });
+    }
+
+    epoll_event events[MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        const int count = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == stop_fd_) {
+                running = false;
+                continue;
+            }
+            if (fd == listen_fd_) {
+                Accept();
+                continue;
+            }
+            auto iter = connections_.find(fd);
+            if (iter == connections_.end()) {
+                continue;
+            }
+            auto connection = iter->second;
+            bool open = true;
+            if (events[i].events & EPOLLOUT) {
+                std::lock_guard lock(connection->mutex);
+                Flush(*connection);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                open = Read(connection);
+            }
+            if (!open) {
+                // the executing request keeps the connection alive until it is answered
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+                connections_.erase(iter);
+            }
+        }
+    }
+
+    {
+        std::lock_guard lock(tasks_mutex_);
+        stopped_ = true;
+    }
+    has_tasks_.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    tasks_.clear();
+    for (const auto& [fd, connection] : connections_) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    connections_.clear();
+}
+
+// makes Run return, may be called from any thread
+void SheetServer::Stop() {
+    const std::uint64_t value = 1;
+    [[maybe_unused]] auto written = write(stop_fd_, &value, sizeof(value));
+}
+
+void SheetServer::Accept() {
+    while (true) {
+        const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            continue;
+        }
+        connections_.emplace(fd, std::make_shared<Connection>(fd));
+    }
+}
+
+// reads the available data of the connection, returns false if the connection is closed
+bool SheetServer::Read(const std::shared_ptr<Connection>& connection) {
+    std::lock_guard lock(connection->mutex);
+    char buffer[READ_BLOCK_SIZE];
+    while (!connection->closed) {
+        const ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (count > 0) {
+            connection->input.append(buffer, static_cast<size_t>(count));
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        connection->closed = true;
+    }
+    Dispatch(connection);
+    return !connection->closed;
+}
+
+// queues the next request of the connection if the previous one is answered;
+// the connection must be locked
+void SheetServer::Dispatch(const std::shared_ptr<Connection>& connection) {
+    if (connection->busy || connection->closed) {
+        return;
+    }
+    std::string_view input = connection->input;
+    if (input.size() < sizeof(std::uint32_t)) {
+        return;
+    }
+    const auto size = TakeRaw<std::uint32_t>(input);
+    if (size > MAX_FRAME_SIZE) {
+        connection->closed = true;
+        shutdown(connection->fd, SHUT_RDWR);
+        return;
+    }
+    if (input.size() < size) {
+        return;
+    }
+    std::string request(input.substr(0, size));
+    connection->input.erase(0, sizeof(std::uint32_t) + size);
+    connection->busy = true;
+    {
+        std::lock_guard lock(tasks_mutex_);
+        tasks_.push_back({connection, std::move(request)});
+    }
+    has_tasks_.notify_one();
+}
+
+// writes the pending responses of the connection as far as the socket accepts them;
+// the connection must be locked
+void SheetServer::Flush(Connection& connection) {
+    size_t written = 0;
+    while (written < connection.output.size() && !connection.closed) {
+        const ssize_t count = send(connection.fd, connection.output.data() + written,
+                                   connection.output.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (count > 0) {
+            written += static_cast<size_t>(count);
+        } else if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            connection.closed = true;
+            shutdown(connection.fd, SHUT_RDWR);
+        }
+    }
+    connection.output.erase(0, written);
+
+    const bool waits_output = !connection.output.empty() && !connection.closed;
+    if (waits_output != connection.waits_output) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        if (waits_output) {
+            event.events |= EPOLLOUT;
+        }
+        event.data.fd = connection.fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.waits_output = waits_output;
+    }
+}
+
+void SheetServer::WorkerLoop() {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock lock(tasks_mutex_);
+            has_tasks_.wait(lock, [this] {
+                return !tasks_.empty() || stopped_;
+            });
+            if (stopped_) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        std::string response = Execute(task.request);
+        std::lock_guard lock(task.connection->mutex);
+        task.connection->output += response;
+        task.connection->busy = false;
+        Flush(*task.connection);
+        Dispatch(task.connection);
+    }
+}
+
+// executes the request and returns the response frame
+std::string SheetServer::Execute(std::string_view request) {
+    try {
+        const auto type = TakeRaw<ServerRequest>(request);
+        switch (type) {
+            case ServerRequest::Set: {
+                const Position pos = TakePosition(request);
+                std::unique_lock lock(sheet_mutex_);
+                writer_.SetCell(pos, std::string(request));
+                Recalculate(pos);
+                return MakeResponse(ServerStatus::Ok);
+            }
+            case ServerRequest::Clear: {
+                const Position pos = TakePosition(request);
+                std::unique_lock lock(sheet_mutex_);
+                writer_.ClearCell(pos);
+                Recalculate(pos);
+                return MakeResponse(ServerStatus::Ok);
+            }
+            case ServerRequest::GetValue: {
+                const Position pos = TakePosition(request);
+                std::string payload;
+                std::shared_lock lock(sheet_mutex_);
+                const CellInterface* cell = std::as_const(sheet_).GetCell(pos);
+                AppendValue(payload, cell ? cell->GetValueView() : CellInterface::ValueView{});
+                lock.unlock();
+                return MakeResponse(ServerStatus::Ok, payload);
+            }
+            case ServerRequest::GetRange: {
+                const Position top_left = TakePosition(request);
+                const auto rows = TakeRaw<std::int32_t>(request);
+                const auto cols = TakeRaw<std::int32_t>(request);
+                if (rows < 0 || cols < 0 || static_cast<std::int64_t>(rows) * cols > MAX_RANGE_CELLS) {
+                    return MakeResponse(ServerStatus::BadRequest, "Invalid range size");
+                }
+                if (rows > 0 && cols > 0
+                    && (!top_left.IsValid() || !Position{top_left.row + rows - 1, top_left.col + cols - 1}.IsValid())) {
+                    throw InvalidPositionException("Invalid position");
+                }
+                std::string payload;
+                RangeValues values;
+                std::shared_lock lock(sheet_mutex_);
+                if (rows > 0 && cols > 0) {
+                    sheet_.GetValues({top_left, {top_left.row + rows - 1, top_left.col + cols - 1}}, values);
+                }
+                // the texts are views of the cells, so they are copied under the lock
+                for (size_t offset = 0; offset < values.kinds.size(); ++offset) {
+                    AppendValue(payload, values.GetValueView(offset));
+                }
+                lock.unlock();
+                return MakeResponse(ServerStatus::Ok, payload);
+            }
+            case ServerRequest::Print: {
+                const auto kind = TakeRaw<std::uint8_t>(request);
+                std::ostringstream output;
+                std::shared_lock lock(sheet_mutex_);
+                if (kind == 0) {
+                    sheet_.PrintValues(output);
+                } else {
+                    sheet_.PrintTexts(output);
+                }
+                lock.unlock();
+                return MakeResponse(ServerStatus::Ok, output.str());
+            }
+        }
+        return MakeResponse(ServerStatus::BadRequest, "Unknown request");
+    } catch (const InvalidPositionException& exc) {
+        return MakeResponse(ServerStatus::InvalidPosition, exc.what());
+    } catch (const FormulaException& exc) {
+        return MakeResponse(ServerStatus::InvalidFormula, exc.what());
+    } catch (const CircularDependencyException& exc) {
+        return MakeResponse(ServerStatus::CircularDependency, exc.what());
+    } catch (const std::exception& exc) {
+        return MakeResponse(ServerStatus::BadRequest, exc.what());
+    }
+}
+
+// recalculates the cell at pos and the cells that depend on it
+void SheetServer::Recalculate(Position pos) {
+    if (const Cell* cell = sheet_.GetCellPtr(pos)) {
+        cell->GetValueView();
+    }
+    // a formula calculates the formulas it refers to first, so the order does not matter
+    for (Position dependent : Cell::GetDependentPositions(sheet_, {pos})) {
+        sheet_.GetCellPtr(dependent)->GetValueView();
+    }
+}
+
+SheetClient::SheetClient(const std::string& socket_path) : fd_{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)} {
+    if (fd_ < 0) {
+        ThrowSystemError("Cannot create socket");
+    }
+    const sockaddr_un address = MakeAddress(socket_path);
+    if (connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        close(fd_);
+        ThrowSystemError("Cannot connect to " + socket_path);
+    }
+}
+
+SheetClient::~SheetClient() {
+    close(fd_);
+}
+
+void SheetClient::SetCell(Position pos, std::string_view text) {
+    std::string request;
+    AppendRaw(request, ServerRequest::Set);
+    AppendPosition(request, pos);
+    request += text;
+    Call(request);
+}
+
+void SheetClient::ClearCell(Position pos) {
+    std::string request;
+    AppendRaw(request, ServerRequest::Clear);
+    AppendPosition(request, pos);
+    Call(request);
+}
+
+CellInterface::Value SheetClient::GetValue(Position pos) {
+    std::string request;
+    AppendRaw(request, ServerRequest::GetValue);
+    AppendPosition(request, pos);
+    const std::string response = Call(request);
+    std::string_view data = response;
+    return TakeValue(data);
+}
+
+// returns the values of the area in row-major order
+std::vector<CellInterface::Value> SheetClient::GetValues(Position top_left, Size size) {
+    std::string request;
+    AppendRaw(request, ServerRequest::GetRange);
+    AppendPosition(request, top_left);
+    AppendRaw(request, static_cast<std::int32_t>(size.rows));
+    AppendRaw(request, static_cast<std::int32_t>(size.cols));
+    const std::string response = Call(request);
+
+    std::vector<CellInterface::Value> values;
+    values.reserve(static_cast<size_t>(std::max(size.rows, 0)) * std::max(size.cols, 0));
+    std::string_view data = response;
+    while (!data.empty()) {
+        values.push_back(TakeValue(data));
+    }
+    return values;
+}
+
+std::string SheetClient::PrintValues() {
+    std::string request;
+    AppendRaw(request, ServerRequest::Print);
+    AppendRaw(request, std::uint8_t{0});
+    return Call(request);
+}
+
+std::string SheetClient::PrintTexts() {
+    std::string request;
+    AppendRaw(request, ServerRequest::Print);
+    AppendRaw(request, std::uint8_t{1});
+    return Call(request);
+}
+
+// sends the request and returns the response payload following the status
+std::string SheetClient::Call(const std::string& request) {
+    const std::string frame = MakeFrame(request);
+    for (size_t written = 0; written < frame.size();) {
+        const ssize_t count = send(fd_, frame.data() + written, frame.size() - written, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            ThrowSystemError("Cannot send request");
+        }
+        written += static_cast<size_t>(count);
+    }
+
+    auto receive = [this](char* data, size_t size) {
+        for (size_t received = 0; received < size;) {
+            const ssize_t count = recv(fd_, data + received, size - received, 0);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                throw ServerException("Connection is closed");
+            }
+            received += static_cast<size_t>(count);
+        }
+    };
+    std::uint32_t size;
+    receive(reinterpret_cast<char*>(&size), sizeof(size));
+    if (size == 0 || size > MAX_FRAME_SIZE) {
+        throw ServerException("Invalid response");
+    }
+    std::string response(size, '\0');
+    receive(response.data(), size);
+
+    const auto status = static_cast<ServerStatus>(response[0]);
+    std::string payload = response.substr(1);
+    switch (status) {
+        case ServerStatus::Ok:
+            return payload;
+        case ServerStatus::InvalidPosition:
+            throw InvalidPositionException(payload);
+        case ServerStatus::InvalidFormula:
+            throw FormulaException(payload);
+        case ServerStatus::CircularDependency:
+            throw CircularDependencyException(payload);
+        case ServerStatus::BadRequest:
+            break;
+    }
+    throw ServerException(payload);
+}
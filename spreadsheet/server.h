@@ -0,0 +1,143 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Protocol of the sheet server. Every message is a frame: a 32-bit payload
+// size followed by the payload, integers are in the byte order of the host.
+// The request payload starts with ServerRequest:
+//     Set       row, col (int32), text (the rest of the payload)
+//     Clear     row, col
+//     GetValue  row, col
+//     GetRange  row, col, rows, cols (int32)
+//     Print     0 - values, 1 - texts (uint8)
+// The response payload starts with ServerStatus; on success it is followed by
+// a value (GetValue), a row-major list of values (GetRange) or the printed
+// sheet (Print), otherwise by the error message. A value is its kind (uint8:
+// 0 - string, 1 - number, 2 - error) followed by the string size (uint32) and
+// the string, the double or the error category (uint8); an empty cell is an
+// empty string.
+enum class ServerRequest : std::uint8_t {
+    Set,
+    Clear,
+    GetValue,
+    GetRange,
+    Print,
+};
+
+enum class ServerStatus : std::uint8_t {
+    Ok,
+    InvalidPosition,
+    InvalidFormula,
+    CircularDependency,
+    BadRequest,
+};
+
+// Исключение, выбрасываемое при ошибке соединения с сервером или некорректном запросе
+class ServerException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Serves the sheet to many local clients over a Unix domain socket.
+// One thread runs the epoll loop: it accepts connections, reads requests and
+// writes the responses which do not fit into the socket buffer. Requests are
+// executed by the worker threads: reads run concurrently under a shared lock,
+// writes are serialised under an exclusive lock. Requests of one connection are
+// executed in order, one at a time.
+// Formula values are cached by the cells on the first read, so a writer
+// recalculates the cells whose values it invalidated before it releases the
+// lock, and readers only see filled caches. A read in the validating
+// recalculation mode verifies the cached values and changes the cells, so the
+// server switches a sheet in that mode to the lazy mode when it is created;
+// the mode of the served sheet must not be changed while the server runs.
+class SheetServer {
+public:
+    // the socket file is created at once, so clients may connect before Run is called
+    SheetServer(Sheet& sheet, std::string socket_path, size_t workers = 4);
+    // mutations go through writer, which is either the sheet or a wrapper of it, such as DurableSheet
+    SheetServer(Sheet& sheet, SheetInterface& writer, std::string socket_path, size_t workers = 4);
+    SheetServer(const SheetServer&) = delete;
+    SheetServer& operator=(const SheetServer&) = delete;
+    ~SheetServer();
+
+    // serves the clients until Stop is called
+    void Run();
+    // makes Run return, may be called from any thread
+    void Stop();
+
+private:
+    struct Connection;
+    struct Task {
+        std::shared_ptr<Connection> connection;
+        std::string request;
+    };
+
+    void Accept();
+    // reads the available data of the connection, returns false if the connection is closed
+    bool Read(const std::shared_ptr<Connection>& connection);
+    // queues the next request of the connection if the previous one is answered
+    void Dispatch(const std::shared_ptr<Connection>& connection);
+    // writes the pending responses of the connection as far as the socket accepts them
+    void Flush(Connection& connection);
+    void WorkerLoop();
+
+    // executes the request and returns the response frame
+    std::string Execute(std::string_view request);
+    // recalculates the cell at pos and the cells that depend on it
+    void Recalculate(Position pos);
+
+    Sheet& sheet_;
+    SheetInterface& writer_;
+    std::string socket_path_;
+    size_t workers_count_;
+
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int stop_fd_ = -1;
+
+    std::shared_mutex sheet_mutex_;
+
+    std::mutex tasks_mutex_;
+    std::condition_variable has_tasks_;
+    std::deque<Task> tasks_;
+    bool stopped_ = false;
+
+    // connections are added and removed only by the epoll loop
+    std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+};
+
+// Blocking client of SheetServer. Errors reported by the server are thrown as
+// the exceptions the sheet would throw itself.
+class SheetClient {
+public:
+    explicit SheetClient(const std::string& socket_path);
+    SheetClient(const SheetClient&) = delete;
+    SheetClient& operator=(const SheetClient&) = delete;
+    ~SheetClient();
+
+    void SetCell(Position pos, std::string_view text);
+    void ClearCell(Position pos);
+    CellInterface::Value GetValue(Position pos);
+    // returns the values of the area in row-major order
+    std::vector<CellInterface::Value> GetValues(Position top_left, Size size);
+    std::string PrintValues();
+    std::string PrintTexts();
+
+private:
+    // sends the request and returns the response payload following the status
+    std::string Call(const std::string& request);
+
+    int fd_;
+};
@@ -2,13 +2,42 @@
 
 #include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <unordered_set>
+#include <utility>
 
 using namespace std::literals;
 
+namespace {
+// returns the change of the layout inserting or deleting count lines at the line
+LayoutChange MakeLayoutChange(LayoutChange::Axis axis, int at, int count, bool insert) {
+    const int max_lines = axis == LayoutChange::Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (at < 0 || at >= max_lines || count <= 0 || count > max_lines - at) {
+        throw InvalidPositionException("Invalid lines");
+    }
+    return {axis, at, insert ? count : -count};
+}
+}  // namespace
+
+// returns the value of the cell at the offset counted in the row-major order
+CellInterface::ValueView RangeValues::GetValueView(size_t offset) const {
+    switch (kinds[offset]) {
+        case Kind::Number:
+            return numbers[offset];
+        case Kind::Text:
+            return texts[offset];
+        case Kind::Error:
+            return FormulaError(errors[offset]);
+        case Kind::Empty:
+            break;
+    }
+    return std::string_view{};
+}
+
 Sheet::~Sheet() {}
 
 // return pointer to Cell
-Cell* Sheet::GetCellPtr(Position pos) const {
+const Cell* Sheet::GetCellPtr(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
@@ -16,17 +45,278 @@ Cell* Sheet::GetCellPtr(Position pos) const {
     if(iter == table_.end()) {
         return nullptr;
     }
-    const auto& p_cell = iter->second;
-    return p_cell.get();
+    return &iter->second;
+}
+
+Cell* Sheet::GetCellPtr(Position pos) {
+    return const_cast<Cell*>(std::as_const(*this).GetCellPtr(pos));
+}
+
+// returns the cell in position pos, an empty cell is created if there is no cell
+Cell* Sheet::GetOrCreateCell(Position pos) {
+    if (Cell* cell = GetCellPtr(pos); cell) {
+        return cell;
+    }
+    return &table_.try_emplace(pos).first->second;
+}
+
+// returns all cells of the sheet, including empty cells referenced by formulas
+const Sheet::Table& Sheet::GetCells() const {
+    return table_;
+}
+
+// returns the pool of the texts of the text cells
+StringPool& Sheet::GetStrings() {
+    return strings_;
+}
+
+// returns the formulas referring to the ranges of the sheet
+RangeReferences& Sheet::GetRangeReferences() {
+    return range_references_;
+}
+
+const RangeReferences& Sheet::GetRangeReferences() const {
+    return range_references_;
+}
+
+// sets how the values of the formulas follow the changes
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    if (mode == recalculation_mode_) {
+        return;
+    }
+    if (recalculation_mode_ == RecalculationMode::Validating) {
+        // the other modes expect every cached value to be up to date
+        for (const auto& [pos, cell] : table_) {
+            if (cell.GetFormula()) {
+                cell.Validate();
+            }
+        }
+    }
+    if (mode == RecalculationMode::Validating) {
+        // the cached values are valid now, the earlier stamps are not compared with them
+        validation_start_ = revision_;
+    }
+    recalculation_mode_ = mode;
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const {
+    return recalculation_mode_;
+}
+
+// returns the version of the references of the formulas
+std::uint64_t Sheet::GetReferencesVersion() const {
+    return references_version_;
+}
+
+// changes the version of the references, called when a formula is set
+void Sheet::ChangeReferences() {
+    ++references_version_;
+}
+
+// returns the revision of the contents of the sheet
+std::uint64_t Sheet::GetRevision() const {
+    return revision_;
+}
+
+// makes the revision newer and returns it, called when a cell is changed
+std::uint64_t Sheet::ChangeRevision() {
+    return ++revision_;
+}
+
+// returns the revision the validating mode was selected at
+std::uint64_t Sheet::GetValidationStart() const {
+    return validation_start_;
+}
+
+// returns the index of the row or the column range, shared by the formulas searching in it
+std::shared_ptr<LookupIndex> Sheet::GetLookupIndex(const Range& range) {
+    std::weak_ptr<LookupIndex>& entry = lookup_indexes_[range];
+    if (auto index = entry.lock()) {
+        return index;
+    }
+    std::shared_ptr<LookupIndex> index(new LookupIndex(range), [this](LookupIndex* index) {
+        lookup_indexes_.erase(index->GetRange());
+        delete index;
+    });
+    // the index reads the cells on the first search, it holds no changes yet
+    index->SetSyncedRevision(revision_);
+    entry = index;
+    return index;
+}
+
+// returns the index grouping the values by the criteria, shared by the conditional aggregates of the same ranges
+std::shared_ptr<CriteriaIndex> Sheet::GetCriteriaIndex(const Range& criteria, const Range& values) {
+    std::weak_ptr<CriteriaIndex>& entry = criteria_indexes_[{criteria, values}];
+    if (auto index = entry.lock()) {
+        return index;
+    }
+    std::shared_ptr<CriteriaIndex> index(new CriteriaIndex(criteria, values), [this](CriteriaIndex* index) {
+        criteria_indexes_.erase({index->GetCriteria(), index->GetValues()});
+        delete index;
+    });
+    index->SetSyncedRevision(revision_);
+    entry = index;
+    return index;
+}
+
+// reserves space for at least count cells
+void Sheet::Reserve(size_t count) {
+    table_.reserve(count);
+}
+
+// returns the engine counters and the cell counts of the sheet
+SheetStats Sheet::GetStats() const {
+    const CounterValues counters = ReadCounters();
+    auto get = [&counters](Counter counter) {
+        return counters[static_cast<size_t>(counter)];
+    };
+
+    SheetStats stats;
+    stats.formula_evaluations = get(Counter::FormulaEvaluations);
+    stats.cache_hits = get(Counter::CacheHits);
+    stats.cache_misses = get(Counter::CacheMisses);
+    stats.writes = get(Counter::Writes);
+    stats.cells_invalidated = get(Counter::CellsInvalidated);
+    stats.invalidations_skipped = get(Counter::InvalidationsSkipped);
+    stats.cells_recalculated = get(Counter::CellsRecalculated);
+    stats.recalculation_cutoffs = get(Counter::RecalculationCutoffs);
+    stats.cells_validated = get(Counter::CellsValidated);
+    stats.cycle_checks = get(Counter::CycleChecks);
+    stats.cycle_check_nodes = get(Counter::CycleCheckNodes);
+    stats.parses = get(Counter::Parses);
+    stats.parse_time = std::chrono::nanoseconds(get(Counter::ParseNanoseconds));
+
+    stats.cells = table_.size();
+    for (const auto& [pos, cell] : table_) {
+        if (cell.GetFormula()) {
+            ++stats.formula_cells;
+        } else if (cell.GetText().empty()) {
+            ++stats.placeholder_cells;
+        }
+    }
+    return stats;
+}
+
+// returns the memory used by the table and the cells
+MemoryUsage Sheet::GetMemoryUsage() const {
+    MemoryUsage usage;
+    // the cells are kept in the nodes of the table and are counted as cells
+    usage.table = GetHeapSize(table_) - table_.size() * sizeof(Cell);
+    // a node of the tree holds its color, three links and the position
+    usage.table += formula_cells_.size() * (4 * sizeof(void*) + sizeof(Position));
+    usage.dependencies += range_references_.GetMemoryUsage();
+    usage.texts = strings_.GetMemoryUsage();
+    for (const auto& [pos, cell] : table_) {
+        cell.AddMemoryUsage(usage);
+    }
+    for (const auto& [range, entry] : lookup_indexes_) {
+        // a node of the tree holds its color, three links and the entry
+        usage.cached_values += 4 * sizeof(void*) + sizeof(range) + sizeof(entry) + sizeof(LookupIndex);
+        if (auto index = entry.lock()) {
+            usage.cached_values += index->GetMemoryUsage();
+        }
+    }
+    for (const auto& [ranges, entry] : criteria_indexes_) {
+        usage.cached_values += 4 * sizeof(void*) + sizeof(ranges) + sizeof(entry) + sizeof(CriteriaIndex);
+        if (auto index = entry.lock()) {
+            usage.cached_values += index->GetMemoryUsage();
+        }
+    }
+    return usage;
 }
 
 // sets the contents of the cell if the pos position is valid
 void Sheet::SetCell(Position pos, std::string text) {
-    if (Cell* cell = GetCellPtr(pos); cell) {
-        cell->Set(std::move(text));
-    } else {
-        auto new_cell = table_.emplace(pos, new Cell(*this));
-        new_cell.first->second->Set(std::move(text));
+    CountEvent(Counter::Writes);
+    if (GetOrCreateCell(pos)->Set(*this, pos, std::move(text))) {
+        RecordValueChange(pos);
+        if (!subscriptions_.empty()) {
+            NotifySubscriptions({pos});
+        }
+    }
+}
+
+// sets the contents of many cells at once
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
+        }
+    }
+
+    CountEvent(Counter::Writes, cells.size());
+    // a cycle which a later text of the batch breaks must be rejected as it is when the cells
+    // are set one by one; such a cycle goes through a formula replaced by the later text, so
+    // the formulas are checked as they are assigned only before the last text replacing a formula
+    size_t checked_steps = 0;
+    {
+        std::unordered_map<Position, bool, PositionHasher> holds_formula;
+        for (size_t step = 0; step < cells.size(); ++step) {
+            const auto& [pos, text] = cells[step];
+            auto [iter, inserted] = holds_formula.try_emplace(pos, false);
+            if (inserted) {
+                const Cell* cell = GetCellPtr(pos);
+                iter->second = cell && cell->GetFormula();
+            }
+            if (iter->second) {
+                checked_steps = step;
+            }
+            iter->second = text.size() > 1 && text[0] == FORMULA_SIGN;
+        }
+    }
+    std::vector<Cell::Change> changes;
+    std::vector<Cell*> changed_cells;
+    // the replaced contents of the changed cells to restore them if the batch is rejected,
+    // the texts are not parsed again
+    std::vector<Cell::Contents> previous_contents;
+    try {
+        for (size_t step = 0; step < cells.size(); ++step) {
+            auto& [pos, text] = cells[step];
+            Cell* cell = GetOrCreateCell(pos);
+            // the validating mode does not pass the old values to the aggregates
+            std::optional<AggregateInput> old_value;
+            if (recalculation_mode_ != RecalculationMode::Validating) {
+                old_value = cell->GetAggregateInput();
+            }
+            Cell::Contents previous;
+            if (cell->Assign(*this, pos, std::move(text), &previous)) {
+                changes.push_back({cell, pos, std::move(old_value)});
+                changed_cells.push_back(cell);
+                previous_contents.push_back(std::move(previous));
+                if (step < checked_steps && cell->GetFormula() && Cell::HasCyclicDependence({cell})) {
+                    throw CircularDependencyException("Formula has circular dependence");
+                }
+            }
+        }
+        if (Cell::HasCyclicDependence({changed_cells.begin(), changed_cells.end()})) {
+            throw CircularDependencyException("Formula has circular dependence");
+        }
+    } catch (...) {
+        for (size_t i = changes.size(); i > 0; --i) {
+            changed_cells[i - 1]->Restore(*this, std::move(previous_contents[i - 1]));
+        }
+        throw;
+    }
+    for (const Cell::Change& change : changes) {
+        RecordValueChange(change.pos);
+    }
+    switch (recalculation_mode_) {
+        case RecalculationMode::Lazy:
+            Cell::InvalidateCache(*this, changes);
+            break;
+        case RecalculationMode::Eager:
+            Cell::Recalculate(*this, changes);
+            break;
+        case RecalculationMode::Validating:
+            // the cells are stamped when they are assigned
+            break;
+    }
+    if (!subscriptions_.empty()) {
+        std::vector<Position> changed;
+        for (const Cell::Change& change : changes) {
+            changed.push_back(change.pos);
+        }
+        NotifySubscriptions(changed);
     }
 }
 
@@ -42,17 +332,172 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 
 // clears the contents of a cell or deletes a cell if it is not connected to other cells
 void Sheet::ClearCell(Position pos) {
+    CountEvent(Counter::Writes);
     Cell* cell = GetCellPtr(pos);
     if (!cell) {
         return;
     }
+    // the formulas of the ranges containing the cell are invalidated too, the links from
+    // the cells it refers to are removed with the contents
+    const bool changed = cell->Set(*this, pos, {});
     // if any cell depends on the cell being cleared, we only
     // clear the contents and do not delete the cell
-    if(cell->IsReferenced()) {
-        cell->Set({});
+    if (!cell->IsReferenced()) {
+        table_.erase(pos);
+    }
+    if (changed) {
+        RecordValueChange(pos);
+        if (!subscriptions_.empty()) {
+            NotifySubscriptions({pos});
+        }
+    }
+}
+
+// inserts count empty rows before the row, the cells below move down
+void Sheet::InsertRows(int before, int count) {
+    ChangeLayout(MakeLayoutChange(LayoutChange::Axis::Rows, before, count, true));
+}
+
+// deletes count rows starting with the row, the cells below move up
+void Sheet::DeleteRows(int first, int count) {
+    ChangeLayout(MakeLayoutChange(LayoutChange::Axis::Rows, first, count, false));
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ChangeLayout(MakeLayoutChange(LayoutChange::Axis::Cols, before, count, true));
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ChangeLayout(MakeLayoutChange(LayoutChange::Axis::Cols, first, count, false));
+}
+
+// moves the cells and the references of the formulas; a moved cell keeps its node of the
+// table, so the links between the cells stay valid, and only the formulas referring to
+// the moved and the deleted cells are changed
+void Sheet::ChangeLayout(const LayoutChange& change) {
+    std::vector<Table::iterator> moved;
+    std::vector<Table::iterator> deleted;
+    for (auto iter = table_.begin(); iter != table_.end(); ++iter) {
+        const Position new_pos = change.Apply(iter->first);
+        if (new_pos == iter->first) {
+            continue;
+        }
+        if (new_pos.IsValid()) {
+            moved.push_back(iter);
+        } else if (change.count > 0 && !iter->second.GetText().empty()) {
+            throw InvalidPositionException("Cells cannot be moved out of the sheet");
+        } else {
+            // the empty cells moved out of the sheet are deleted
+            deleted.push_back(iter);
+        }
+    }
+    // the cells of a range need not exist, so the formulas with the ranges the change
+    // moves, resizes or deletes are found by the ends of the ranges
+    std::vector<const Cell*> range_referring;
+    range_references_.ForEachRange([&change, &range_referring](const Range& range,
+                                                               const std::vector<const Cell*>& formulas) {
+        if (!(change.Apply(range.to) == range.to)) {
+            range_referring.insert(range_referring.end(), formulas.begin(), formulas.end());
+        }
+    });
+    if (moved.empty() && deleted.empty() && range_referring.empty()) {
         return;
     }
-    table_.erase(pos);
+    ChangeRevision();
+
+    // the formulas referring to the moved and the deleted cells, the deleted formulas are cleared
+    std::unordered_set<const Cell*> deleted_cells;
+    for (auto iter : deleted) {
+        deleted_cells.insert(&iter->second);
+    }
+    std::vector<const Cell*> referring;
+    std::unordered_set<const Cell*> visited;
+    auto add_referring = [&deleted_cells, &referring, &visited](const Cell& cell) {
+        for (const Cell* dependent : cell.GetDependentCells()) {
+            if (!deleted_cells.count(dependent) && visited.insert(dependent).second) {
+                referring.push_back(dependent);
+            }
+        }
+    };
+    for (auto iter : moved) {
+        add_referring(iter->second);
+    }
+    for (auto iter : deleted) {
+        add_referring(iter->second);
+    }
+    for (const Cell* formula : range_referring) {
+        if (!deleted_cells.count(formula) && visited.insert(formula).second) {
+            referring.push_back(formula);
+        }
+    }
+    // the deleted formulas are unlinked from the cells they refer to first, so the
+    // formulas left referring to a deleted cell are the ones which stay in the sheet
+    for (auto iter : deleted) {
+        iter->second.Clear();
+    }
+    for (auto iter : deleted) {
+        iter->second.UnlinkDependentCells();
+        table_.erase(iter);
+    }
+
+    // all nodes are taken out first, so that a moved cell does not meet a cell which has not moved yet
+    std::vector<Table::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (auto iter : moved) {
+        nodes.push_back(table_.extract(iter));
+    }
+    for (Table::node_type& node : nodes) {
+        node.key() = change.Apply(node.key());
+        node.mapped().Move(node.key());
+        table_.insert(std::move(node));
+    }
+
+    std::vector<Cell::Change> changes;
+    changes.reserve(referring.size());
+    for (const Cell* cell : referring) {
+        changes.push_back(cell->ApplyLayoutChange(*this, change));
+    }
+    // the formulas and their ranges are listed again at their new positions
+    formula_cells_.clear();
+    range_references_.Clear();
+    for (const auto& [pos, cell] : table_) {
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            formula_cells_.insert(pos);
+            for (const Range& range : formula->GetRanges()) {
+                range_references_.Add(range, &cell);
+            }
+        }
+    }
+    ChangeReferences();
+    switch (recalculation_mode_) {
+        case RecalculationMode::Lazy:
+            Cell::InvalidateCache(*this, changes);
+            break;
+        case RecalculationMode::Eager:
+            Cell::Recalculate(*this, changes);
+            break;
+        case RecalculationMode::Validating:
+            // the changed formulas are stamped when their references are moved
+            break;
+    }
+
+    // the logged changes refer to the old positions, the next requests list all cells
+    value_changes_.clear();
+    compacted_changes_ = 0;
+    layout_revision_ = revision_;
+    if (!subscriptions_.empty()) {
+        // the subscribed ranges stay in place, so their cells are compared with the new contents
+        CompareSubscribedCells([](const Range& range) {
+            std::vector<Position> cells;
+            cells.reserve(range.GetCellCount());
+            for (int row = range.from.row; row <= range.to.row; ++row) {
+                for (int col = range.from.col; col <= range.to.col; ++col) {
+                    cells.push_back({row, col});
+                }
+            }
+            return cells;
+        });
+    }
 }
 
 // returns the size of the minimum rectangular area of the table
@@ -82,27 +527,328 @@ void Sheet::Print(std::ostream& output, PrintFunc func) const {
             }
             const auto iter = table_.find(Position{i, j});
             if (iter != table_.end()) {
-                const auto& p_cell = iter->second;
-                func(p_cell);
+                func(iter->second);
             }
         }
         output << std::endl;
     }
 }
 
-// outputs cell values — strings, numbers, or FormulaError
-void Sheet::PrintValues(std::ostream& output) const {
-    Print(output, [&output](const std::unique_ptr<Cell>& cell) {
-        std::visit([&output](const auto&& value) {
-            output << value;
-        }, cell->GetValue());
+// writes the values of the cells of the range to values, the formulas which
+// values are not cached are calculated at once, the formulas they refer to first
+void Sheet::GetValues(const Range& range, RangeValues& values) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range");
+    }
+    const size_t count = range.GetCellCount();
+    values.size = range.GetSize();
+    values.kinds.assign(count, RangeValues::Kind::Empty);
+    values.numbers.assign(count, 0.0);
+    values.texts.assign(count, std::string_view{});
+    values.errors.assign(count, FormulaError::Category::Ref);
+
+    auto write = [&values](size_t offset, const Cell& cell) {
+        const CellInterface::ValueView value = cell.GetValueView();
+        if (const auto* text = std::get_if<std::string_view>(&value)) {
+            if (!text->empty()) {
+                values.kinds[offset] = RangeValues::Kind::Text;
+                values.texts[offset] = *text;
+            }
+        } else if (const auto* number = std::get_if<double>(&value)) {
+            values.kinds[offset] = RangeValues::Kind::Number;
+            values.numbers[offset] = *number;
+        } else {
+            values.kinds[offset] = RangeValues::Kind::Error;
+            values.errors[offset] = std::get<FormulaError>(value).GetCategory();
+        }
+    };
+    // the formulas which values are not known are written after they are calculated together
+    std::vector<std::pair<size_t, const Cell*>> pending;
+    auto visit = [&write, &pending](size_t offset, const Cell& cell) {
+        if (cell.NeedsCalculation()) {
+            pending.push_back({offset, &cell});
+        } else {
+            write(offset, cell);
+        }
+    };
+    // a range larger than the table is filled from the table instead of looking up all of its positions
+    if (count > table_.size()) {
+        for (const auto& [pos, cell] : table_) {
+            if (range.Contains(pos)) {
+                visit(GetOffset(range, pos), cell);
+            }
+        }
+    } else {
+        size_t offset = 0;
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            for (int col = range.from.col; col <= range.to.col; ++col, ++offset) {
+                if (auto iter = table_.find({row, col}); iter != table_.end()) {
+                    visit(offset, iter->second);
+                }
+            }
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+
+    std::vector<const Cell*> formulas;
+    formulas.reserve(pending.size());
+    for (const auto& [offset, cell] : pending) {
+        formulas.push_back(cell);
+    }
+    Cell::Calculate(std::move(formulas));
+    for (const auto& [offset, cell] : pending) {
+        write(offset, *cell);
+    }
+}
+
+// returns the cells changed after the version and the formulas depending on them
+ValueChanges Sheet::GetValueChanges(std::uint64_t version) const {
+    ValueChanges changes;
+    changes.version = revision_;
+    if (version == 0 || version > revision_ || version < layout_revision_) {
+        changes.full = true;
+        changes.cells.reserve(table_.size());
+        for (const auto& [pos, cell] : table_) {
+            changes.cells.push_back(pos);
+        }
+        std::sort(changes.cells.begin(), changes.cells.end());
+        return changes;
+    }
+
+    auto first = std::upper_bound(value_changes_.begin(), value_changes_.end(), version,
+                                  [](std::uint64_t revision, const auto& change) {
+                                      return revision < change.first;
+                                  });
+    for (auto iter = first; iter != value_changes_.end(); ++iter) {
+        changes.cells.push_back(iter->second);
+    }
+    // the values of the formulas are compared neither with the old ones nor with each other,
+    // so a formula which value did not change is listed too; a deleted cell keeps the formulas
+    // of the ranges containing it
+    const std::vector<Position> dependents = Cell::GetDependentPositions(*this, changes.cells);
+    changes.cells.insert(changes.cells.end(), dependents.begin(), dependents.end());
+    std::sort(changes.cells.begin(), changes.cells.end());
+    changes.cells.erase(std::unique(changes.cells.begin(), changes.cells.end()), changes.cells.end());
+    return changes;
+}
+
+// outputs the new version and the cells changed after the version with their values
+void Sheet::PrintDiff(std::ostream& output, std::uint64_t version) const {
+    const ValueChanges changes = GetValueChanges(version);
+    output << "version " << changes.version << (changes.full ? " full" : "") << '\n';
+    for (Position pos : changes.cells) {
+        output << pos.ToString() << '\t';
+        if (const Cell* cell = GetCellPtr(pos)) {
+            std::visit([&output](const auto& value) {
+                output << value;
+            }, cell->GetValueView());
+        }
+        output << '\n';
+    }
+    output.flush();
+}
+
+// records the change of the value of the cell at the current revision
+void Sheet::RecordValueChange(Position pos) {
+    value_changes_.push_back({revision_, pos});
+    // only the last change of a cell is needed, so the older ones are dropped when
+    // the changes double, which keeps the log proportional to the changed cells
+    if (value_changes_.size() < 2 * compacted_changes_ + 1024) {
+        return;
+    }
+    std::unordered_set<Position, PositionHasher> kept_cells;
+    std::vector<std::pair<std::uint64_t, Position>> kept;
+    for (auto iter = value_changes_.rbegin(); iter != value_changes_.rend(); ++iter) {
+        if (kept_cells.insert(iter->second).second) {
+            kept.push_back(*iter);
+        }
+    }
+    std::reverse(kept.begin(), kept.end());
+    value_changes_ = std::move(kept);
+    compacted_changes_ = value_changes_.size();
+}
+
+// calls record for the cells of the range which values changed after the revision until it returns false
+void Sheet::ForEachValueChange(std::uint64_t revision, const Range& range,
+                               const std::function<bool(Position)>& record) const {
+    if (revision < layout_revision_) {
+        // the logged changes do not go back to the revision
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            for (int col = range.from.col; col <= range.to.col; ++col) {
+                if (!record({row, col})) {
+                    return;
+                }
+            }
+        }
+        return;
+    }
+    auto first = std::upper_bound(value_changes_.begin(), value_changes_.end(), revision,
+                                  [](std::uint64_t revision, const auto& change) {
+                                      return revision < change.first;
+                                  });
+    for (auto iter = first; iter != value_changes_.end(); ++iter) {
+        if (range.Contains(iter->second) && !record(iter->second)) {
+            return;
+        }
+    }
+}
+
+// adds the cell to the formula cells of the sheet; a snapshot loads the cells in
+// the order of their positions, so the end of the set is tried first
+void Sheet::AddFormulaCell(Position pos) {
+    formula_cells_.emplace_hint(formula_cells_.end(), pos);
+}
+
+void Sheet::RemoveFormulaCell(Position pos) {
+    formula_cells_.erase(pos);
+}
+
+// calls visit for the formula cells of the range, the formulas of every row
+// of the range are found by one search
+void Sheet::ForEachFormulaCell(const Range& range, const std::function<void(const Cell& cell)>& visit) const {
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        auto iter = formula_cells_.lower_bound({row, range.from.col});
+        if (iter == formula_cells_.end()) {
+            break;
+        }
+        if (iter->row > row) {
+            row = iter->row - 1;
+            continue;
+        }
+        for (; iter != formula_cells_.end() && iter->row == row && iter->col <= range.to.col; ++iter) {
+            visit(table_.at(*iter));
+        }
+    }
+}
+
+// subscribes to the changes of the values of the cells of the range
+SubscriptionId Sheet::Subscribe(const Range& range, SubscriptionCallback callback) {
+    RangeValues values;
+    GetValues(range, values);
+    Subscription subscription{range, std::move(callback), {}, {}};
+    for (size_t offset = 0; offset < values.kinds.size(); ++offset) {
+        if (values.kinds[offset] != RangeValues::Kind::Empty) {
+            const Position pos{range.from.row + static_cast<int>(offset / values.size.cols),
+                               range.from.col + static_cast<int>(offset % values.size.cols)};
+            subscription.values.emplace(pos, ToValue(values.GetValueView(offset)));
+        }
+    }
+    const SubscriptionId id = next_subscription_++;
+    subscriptions_.emplace(id, std::move(subscription));
+    return id;
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    subscriptions_.erase(id);
+}
+
+// returns the queued events of the subscription and clears the queue
+std::vector<ValueEvent> Sheet::TakeEvents(SubscriptionId id) {
+    auto iter = subscriptions_.find(id);
+    if (iter == subscriptions_.end()) {
+        return {};
+    }
+    return std::exchange(iter->second.queued, {});
+}
+
+// compares the values of the cells of every subscription given by get_cells with the notified
+// ones; a subscription receives the cells which values differ from the notified ones
+template <typename CellsOf>
+void Sheet::CompareSubscribedCells(CellsOf get_cells) {
+    std::vector<std::pair<SubscriptionId, std::vector<ValueEvent>>> notifications;
+    for (auto& [id, subscription] : subscriptions_) {
+        std::vector<ValueEvent> events;
+        for (Position pos : get_cells(subscription.range)) {
+            const Cell* cell = GetCellPtr(pos);
+            CellInterface::Value value = cell ? cell->GetValue() : CellInterface::Value{};
+            auto iter = subscription.values.find(pos);
+            const bool was_empty = iter == subscription.values.end();
+            if (was_empty ? value == CellInterface::Value{} : iter->second == value) {
+                continue;
+            }
+            if (value == CellInterface::Value{}) {
+                subscription.values.erase(iter);
+            } else if (was_empty) {
+                subscription.values.emplace(pos, value);
+            } else {
+                iter->second = value;
+            }
+            events.push_back({pos, std::move(value)});
+        }
+        if (events.empty()) {
+            continue;
+        }
+        if (subscription.callback) {
+            notifications.emplace_back(id, std::move(events));
+        } else {
+            std::move(events.begin(), events.end(), std::back_inserter(subscription.queued));
+        }
+    }
+    // the callbacks are called when all subscriptions are updated, so that they may change the sheet
+    // and the subscriptions; a subscription removed by an earlier callback is not called
+    for (auto& [id, events] : notifications) {
+        auto iter = subscriptions_.find(id);
+        if (iter != subscriptions_.end()) {
+            // the callback is copied, the subscription may be removed while it is running
+            const SubscriptionCallback callback = iter->second.callback;
+            callback(events);
+        }
+    }
+}
+
+// notifies the subscriptions of the cells changed by one write and of the formulas
+// depending on them; only the subscribed cells of the changed ones are calculated
+void Sheet::NotifySubscriptions(const std::vector<Position>& changed) {
+    std::vector<Position> affected = Cell::GetDependentPositions(*this, changed);
+    affected.insert(affected.end(), changed.begin(), changed.end());
+    std::sort(affected.begin(), affected.end());
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+
+    CompareSubscribedCells([&affected](const Range& range) {
+        // the affected cells of every row of the range are found by binary search,
+        // so a small range costs no more than a few lookups in a large cone
+        std::vector<Position> inside;
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            auto iter = std::lower_bound(affected.begin(), affected.end(), Position{row, range.from.col});
+            if (iter == affected.end()) {
+                break;
+            }
+            if (iter->row > row) {
+                row = iter->row - 1;
+                continue;
+            }
+            for (; iter != affected.end() && iter->row == row && iter->col <= range.to.col; ++iter) {
+                inside.push_back(*iter);
+            }
+        }
+        return inside;
     });
 }
 
+// outputs cell values — strings, numbers, or FormulaError; the values are read by rows
+void Sheet::PrintValues(std::ostream& output) const {
+    const Size printable_size = GetPrintableSize();
+    RangeValues values;
+    for (int row = 0; row < printable_size.rows; ++row) {
+        GetValues({{row, 0}, {row, printable_size.cols - 1}}, values);
+        for (int col = 0; col < printable_size.cols; ++col) {
+            if (col != 0) {
+                output << '\t';
+            }
+            std::visit([&output](const auto& value) {
+                output << value;
+            }, values.GetValueView(static_cast<size_t>(col)));
+        }
+        output << std::endl;
+    }
+}
+
 // outputs text representations of cells
 void Sheet::PrintTexts(std::ostream& output) const {
-    Print(output, [&output](const std::unique_ptr<Cell>& cell) {
-        output << cell->GetText();
+    Print(output, [&output](const Cell& cell) {
+        output << cell.GetText();
     });
 }
 
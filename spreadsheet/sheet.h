@@ -2,24 +2,110 @@
 
 #include "cell.h"
 #include "common.h"
+#include "range_references.h"
+#include "stats.h"
+#include "string_pool.h"
 
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 struct PositionHasher {
-    std::size_t operator()(const Position& pos) const {
+    // the hash is cheap, so it is not cached in the nodes of the tables
+    std::size_t operator()(const Position& pos) const noexcept {
         // each of the fields (row and col) in Position does not exceed 16383 and takes up no more than two bytes
         return std::hash<int>{}((pos.col << 16) + pos.row);
     }
 };
 
+// how the values of the formulas follow the changes of the cells they refer to
+enum class RecalculationMode : std::uint8_t {
+    // the cached values of all dependent formulas are dropped and calculated again when they are read
+    Lazy,
+    // the dependent formulas which values are cached are calculated again at once, the
+    // referenced ones first; a formula which value does not change stops the propagation
+    Eager,
+    // a change only stamps the cell with the revision of the sheet; a cached value is
+    // checked against the stamps of the cells it refers to when it is read and is
+    // calculated again if any of them changed after it was verified
+    Validating,
+};
+
+// The values of a rectangle of cells read at once, the arrays hold the cells
+// in the row-major order. The numbers are kept in a dense array, so that the
+// numbers of a viewport are read without the variants; a text is a view of
+// the text of the cell, valid until the cell is changed. The arrays keep their
+// capacity, so the buffer reused for the next viewport is not allocated again.
+struct RangeValues {
+    enum class Kind : std::uint8_t {
+        // an empty text is an empty cell
+        Empty,
+        Number,
+        Text,
+        Error,
+    };
+
+    Size size;
+    std::vector<Kind> kinds;
+    // 0 for the cells which are not numbers
+    std::vector<double> numbers;
+    // empty for the cells which are not texts
+    std::vector<std::string_view> texts;
+    // the categories of the errors, Ref for the cells which are not errors
+    std::vector<FormulaError::Category> errors;
+
+    // returns the value of the cell at the offset counted in the row-major order
+    CellInterface::ValueView GetValueView(size_t offset) const;
+};
+
+// The cells which values may have changed after a version of the sheet
+struct ValueChanges {
+    // the version of the sheet, the next changes are requested after it
+    std::uint64_t version = 0;
+    // all cells of the sheet are listed when the changes after the version are not known
+    bool full = false;
+    // sorted, without repeated cells
+    std::vector<Position> cells;
+};
+
+// The new value of a subscribed cell
+struct ValueEvent {
+    Position pos;
+    CellInterface::Value value;
+};
+
+// receives the events of one write of the sheet
+using SubscriptionCallback = std::function<void(const std::vector<ValueEvent>& events)>;
+using SubscriptionId = std::uint64_t;
+
 class Sheet : public SheetInterface {
 public:
-    using Table = std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher>;
+    // the cells are kept in the nodes of the table, which do not move
+    using Table = std::unordered_map<Position, Cell, PositionHasher>;
 
     ~Sheet();
     // sets the contents of the cell if the pos position is valid
     void SetCell(Position pos, std::string text) override;
+    // sets the contents of many cells at once: cycles are checked and cached values
+    // are invalidated once for the whole batch; a text is rejected if setting the cells
+    // one by one would reject it, and then none of the cells is changed
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // inserts count empty rows before the row, the cells below move down and the references
+    // of the formulas follow them without parsing; throws InvalidPositionException if a cell
+    // which is not empty would be moved out of the sheet
+    void InsertRows(int before, int count = 1);
+    // deletes count rows starting with the row, the cells below move up; the references
+    // to the deleted cells become #REF!, a range loses the deleted rows
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
 
     // returns a const pointer to the CellInterface with position pos, if it is empty returns nullptr
     const CellInterface* GetCell(Position pos) const override;
@@ -31,17 +117,129 @@ public:
     // returns the size of the minimum rectangular area of the table
     Size GetPrintableSize() const override;
 
+    // writes the values of the cells of the range to values, the formulas which values
+    // are not cached are calculated at once, the formulas they refer to first
+    void GetValues(const Range& range, RangeValues& values) const;
+
+    // returns the cells changed after the version and the formulas depending on them, the
+    // version of the sheet is its revision; all cells are listed for the version 0, for
+    // a version newer than the sheet and for a version older than the last inserted or
+    // deleted rows or columns
+    ValueChanges GetValueChanges(std::uint64_t version) const;
+    // outputs the "version" line with the new version followed by "full" if all cells are
+    // listed, then a "pos<TAB>value" line for every cell changed after the version
+    void PrintDiff(std::ostream& output, std::uint64_t version) const;
+
+    // subscribes to the changes of the values of the cells of the range: after every
+    // SetCell, SetCells, ClearCell or insertion or deletion of rows or columns changing
+    // them the callback receives the new values at once; without the callback the events
+    // are queued until they are taken
+    SubscriptionId Subscribe(const Range& range, SubscriptionCallback callback = {});
+    void Unsubscribe(SubscriptionId id);
+    // returns the queued events of the subscription and clears the queue
+    std::vector<ValueEvent> TakeEvents(SubscriptionId id);
+
     // outputs cell values — strings, numbers, or FormulaError
     void PrintValues(std::ostream& output) const override;
     // outputs text representations of cells
     void PrintTexts(std::ostream& output) const override;
     // return pointer to Cell
-    Cell* GetCellPtr(Position pos) const;
+    const Cell* GetCellPtr(Position pos) const;
+    Cell* GetCellPtr(Position pos);
+    // returns the cell in position pos, an empty cell is created if there is no cell
+    Cell* GetOrCreateCell(Position pos);
+    // returns all cells of the sheet, including empty cells referenced by formulas
+    const Table& GetCells() const;
+    // reserves space for at least count cells
+    void Reserve(size_t count);
+    // returns the engine counters and the cell counts of the sheet
+    SheetStats GetStats() const;
+    // returns the memory used by the table and the cells
+    MemoryUsage GetMemoryUsage() const;
+    // returns the pool of the texts of the text cells
+    StringPool& GetStrings();
+    // returns the formulas referring to the ranges of the sheet
+    RangeReferences& GetRangeReferences();
+    const RangeReferences& GetRangeReferences() const;
+    // sets how the values of the formulas follow the changes, the lazy mode is the default
+    void SetRecalculationMode(RecalculationMode mode);
+    RecalculationMode GetRecalculationMode() const;
+    // returns the version of the references of the formulas, the heights of the
+    // formulas computed for another version are outdated
+    std::uint64_t GetReferencesVersion() const;
+    // changes the version of the references, called when a formula is set
+    void ChangeReferences();
+    // returns the revision of the contents of the sheet, every change of a cell makes it newer
+    std::uint64_t GetRevision() const;
+    // makes the revision newer and returns it, called when a cell is changed
+    std::uint64_t ChangeRevision();
+    // returns the revision the validating mode was selected at, all cached values were valid at it
+    std::uint64_t GetValidationStart() const;
+    // returns the index of the row or the column range, shared by the formulas searching in it;
+    // the index is removed with the last formula holding it
+    std::shared_ptr<LookupIndex> GetLookupIndex(const Range& range);
+    // returns the index grouping the values by the criteria, shared by the conditional aggregates
+    // of the same ranges; the index is removed with the last formula holding it
+    std::shared_ptr<CriteriaIndex> GetCriteriaIndex(const Range& criteria, const Range& values);
+    // records the change of the value of the cell at the current revision, called for the written
+    // cells and for the formulas which values change when they are verified
+    void RecordValueChange(Position pos);
+    // calls record for the cells of the range which values changed after the revision until it
+    // returns false; the cells are taken from the log of the changes, so a cell may be passed
+    // more than once, and all cells of the range are passed for a revision older than the last
+    // insertion or deletion of rows or columns
+    void ForEachValueChange(std::uint64_t revision, const Range& range,
+                            const std::function<bool(Position)>& record) const;
+    // adds the cell to the formula cells of the sheet or removes it, called when the contents are replaced
+    void AddFormulaCell(Position pos);
+    void RemoveFormulaCell(Position pos);
+    // calls visit for the formula cells of the range, the rows without formulas are skipped
+    void ForEachFormulaCell(const Range& range, const std::function<void(const Cell& cell)>& visit) const;
 
 private:
     // print table
     template <typename PrintFunc>
     void Print(std::ostream& output, PrintFunc func) const;
+    // moves the cells and the references of the formulas, see InsertRows and DeleteRows
+    void ChangeLayout(const LayoutChange& change);
+    // notifies the subscriptions of the cells changed by one write and of the formulas depending on them
+    void NotifySubscriptions(const std::vector<Position>& changed);
+    // compares the values of the cells of every subscription given by get_cells with the notified
+    // ones and delivers the changed values
+    template <typename CellsOf>
+    void CompareSubscribedCells(CellsOf get_cells);
+
+    // the subscribed range with the values its cells had at the last notification
+    struct Subscription {
+        Range range;
+        SubscriptionCallback callback;
+        // the empty cells are not kept
+        std::unordered_map<Position, CellInterface::Value, PositionHasher> values;
+        std::vector<ValueEvent> queued;
+    };
     
+    // declared before the table, so that the cells release their texts and indexes first
+    StringPool strings_;
+    std::map<Range, std::weak_ptr<LookupIndex>> lookup_indexes_;
+    std::map<std::pair<Range, Range>, std::weak_ptr<CriteriaIndex>> criteria_indexes_;
     Table table_{};
+    // the positions of the formula cells in the row-major order
+    std::set<Position> formula_cells_;
+    RangeReferences range_references_;
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    // the formulas loaded without the heights have the version 0
+    std::uint64_t references_version_ = 1;
+    // the cells loaded from a snapshot have the revision 0
+    std::uint64_t revision_ = 1;
+    std::uint64_t validation_start_ = 0;
+    // the revision of the last change of the layout, the earlier changes refer to the old positions
+    std::uint64_t layout_revision_ = 0;
+    // the changed cells with the revisions of the changes in the order of the revisions;
+    // the dependent formulas are found when the changes are requested, so a change costs
+    // O(1) in every recalculation mode
+    std::vector<std::pair<std::uint64_t, Position>> value_changes_;
+    // the number of the changes kept by the last compaction of value_changes_
+    size_t compacted_changes_ = 0;
+    std::map<SubscriptionId, Subscription> subscriptions_;
+    SubscriptionId next_subscription_ = 1;
 };
\ No newline at end of file
@@ -0,0 +1,442 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+constexpr std::uint64_t SECTION_ALIGNMENT = 8;
+
+enum Section : std::uint32_t {
+    SECTION_CELLS,
+    SECTION_TEXTS,
+    SECTION_TEXT_BLOB,
+    SECTION_PROGRAMS,
+    SECTION_CODE,
+    SECTION_CONSTANTS,
+    SECTION_POSITIONS,
+    SECTION_EDGES,
+    SECTION_VALUES,
+    SECTION_COUNT,
+};
+
+enum HeaderFlags : std::uint32_t {
+    FLAG_HAS_VALUES = 1,
+};
+
+enum class CellKind : std::uint32_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+enum class ValueKind : std::uint32_t {
+    None,
+    Number,
+    Error,
+};
+
+struct SectionRecord {
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+};
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t flags;
+    SectionRecord sections[SECTION_COUNT];
+};
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    CellKind kind;
+    // index of the text or of the program of the cell
+    std::uint32_t index;
+};
+
+struct TextRecord {
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+// ranges of the program in the code, constants, positions and edges sections
+struct ProgramRecord {
+    std::uint32_t code_offset;
+    std::uint32_t code_count;
+    std::uint32_t constants_offset;
+    std::uint32_t constants_count;
+    std::uint32_t positions_offset;
+    std::uint32_t positions_count;
+    std::uint32_t edges_offset;
+    std::uint32_t edges_count;
+};
+
+// cached value of the formula, one record per program
+struct ValueRecord {
+    double number;
+    ValueKind kind;
+    std::uint32_t error_category;
+};
+
+// the file mapped into memory for reading
+class MappedFile {
+public:
+#ifdef _WIN32
+    // there is no mmap, the file is read into the buffer
+    explicit MappedFile(const std::string& path) {
+        std::ifstream input(path, std::ios::binary | std::ios::ate);
+        if (!input) {
+            throw SnapshotException("Cannot open snapshot " + path);
+        }
+        buffer_.resize(static_cast<size_t>(input.tellg()) / sizeof(std::uint64_t) + 1);
+        size_ = static_cast<size_t>(input.tellg());
+        input.seekg(0);
+        input.read(reinterpret_cast<char*>(buffer_.data()), size_);
+        data_ = reinterpret_cast<const char*>(buffer_.data());
+    }
+#else
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SnapshotException("Cannot open snapshot " + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw SnapshotException("Cannot read snapshot " + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw SnapshotException("Cannot map snapshot " + path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+#endif
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+#ifdef _WIN32
+    std::vector<std::uint64_t> buffer_;
+#endif
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// a typed view of the section of the mapped file
+template <typename T>
+class SectionView {
+public:
+    SectionView(const MappedFile& file, const SectionRecord& record) {
+        if (record.size == 0) {
+            return;
+        }
+        if (record.offset % alignof(T) != 0 || record.size % sizeof(T) != 0
+            || record.offset > file.GetSize() || record.size > file.GetSize() - record.offset) {
+            throw SnapshotException("Snapshot section is corrupted");
+        }
+        data_ = reinterpret_cast<const T*>(file.GetData() + record.offset);
+        size_ = record.size / sizeof(T);
+    }
+
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // returns pointer to count elements starting from offset
+    const T* Range(std::uint64_t offset, std::uint64_t count) const {
+        if (offset > size_ || count > size_ - offset) {
+            throw SnapshotException("Snapshot record is out of section");
+        }
+        return data_ + offset;
+    }
+
+private:
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// sections of the snapshot collected before writing
+struct SnapshotData {
+    std::vector<CellRecord> cells;
+    std::vector<TextRecord> texts;
+    std::string text_blob;
+    std::vector<ProgramRecord> programs;
+    std::vector<FormulaProgram::Instruction> code;
+    std::vector<double> constants;
+    std::vector<Position> positions;
+    std::vector<std::uint32_t> edges;
+    std::vector<ValueRecord> values;
+};
+
+template <typename T>
+std::uint32_t AppendItems(std::vector<T>& section, const std::vector<T>& items) {
+    std::uint32_t offset = static_cast<std::uint32_t>(section.size());
+    section.insert(section.end(), items.begin(), items.end());
+    return offset;
+}
+
+ValueRecord MakeValueRecord(const std::optional<FormulaInterface::Value>& value) {
+    if (!value.has_value()) {
+        return {0.0, ValueKind::None, 0};
+    }
+    if (std::holds_alternative<double>(*value)) {
+        return {std::get<double>(*value), ValueKind::Number, 0};
+    }
+    auto category = std::get<FormulaError>(*value).GetCategory();
+    return {0.0, ValueKind::Error, static_cast<std::uint32_t>(category)};
+}
+
+std::optional<FormulaInterface::Value> FromValueRecord(const ValueRecord& record) {
+    switch (record.kind) {
+        case ValueKind::Number:
+            return record.number;
+        case ValueKind::Error:
+            return FormulaError(static_cast<FormulaError::Category>(record.error_category));
+        default:
+            return std::nullopt;
+    }
+}
+
+SnapshotData CollectSnapshotData(const Sheet& sheet, bool with_values) {
+    SnapshotData data;
+    const auto& table = sheet.GetCells();
+
+    // the cells are written in the order of their positions, so the loaded formula
+    // cells are appended to the ordered set of the sheet without searching it
+    std::vector<const Sheet::Table::value_type*> entries;
+    entries.reserve(table.size());
+    for (const auto& entry : table) {
+        entries.push_back(&entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const auto* lhs, const auto* rhs) {
+        return lhs->first < rhs->first;
+    });
+
+    std::unordered_map<Position, std::uint32_t, PositionHasher> indexes;
+    indexes.reserve(table.size());
+    for (const auto* entry : entries) {
+        indexes.emplace(entry->first, static_cast<std::uint32_t>(indexes.size()));
+    }
+
+    data.cells.reserve(table.size());
+    for (const auto* entry : entries) {
+        const auto& [pos, cell] = *entry;
+        CellRecord record{pos.row, pos.col, CellKind::Empty, 0};
+
+        if (const FormulaInterface* formula = cell.GetFormula(); formula) {
+            FormulaProgram program = formula->Compile();
+            std::vector<std::uint32_t> edges;
+            // the cells of the ranges are not linked, the ranges are registered when the formula is loaded
+            for (Position referenced : formula->GetCellReferences()) {
+                if (auto iter = indexes.find(referenced); iter != indexes.end()) {
+                    edges.push_back(iter->second);
+                }
+            }
+
+            record.kind = CellKind::Formula;
+            record.index = static_cast<std::uint32_t>(data.programs.size());
+            data.programs.push_back({
+                AppendItems(data.code, program.code), static_cast<std::uint32_t>(program.code.size()),
+                AppendItems(data.constants, program.constants), static_cast<std::uint32_t>(program.constants.size()),
+                AppendItems(data.positions, program.cells), static_cast<std::uint32_t>(program.cells.size()),
+                AppendItems(data.edges, edges), static_cast<std::uint32_t>(edges.size()),
+            });
+            if (with_values) {
+                cell.GetValueView();
+                data.values.push_back(MakeValueRecord(cell.GetCachedValue()));
+            }
+        } else if (std::string text = cell.GetText(); !text.empty()) {
+            record.kind = CellKind::Text;
+            record.index = static_cast<std::uint32_t>(data.texts.size());
+            data.texts.push_back({data.text_blob.size(), text.size()});
+            data.text_blob += text;
+        }
+        data.cells.push_back(record);
+    }
+    return data;
+}
+
+// writes sections one after another with the alignment
+class SectionWriter {
+public:
+    explicit SectionWriter(std::uint64_t offset) : offset_{offset} {
+    }
+
+    template <typename T>
+    void Add(Section section, const std::vector<T>& items) {
+        Add(section, items.data(), items.size() * sizeof(T));
+    }
+
+    void Add(Section section, const void* data, std::uint64_t size) {
+        offset_ = (offset_ + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        header_sections_[section] = {offset_, size};
+        chunks_.push_back({static_cast<const char*>(data), size});
+        offset_ += size;
+    }
+
+    void Write(std::ostream& output, Header& header) const {
+        std::copy(std::begin(header_sections_), std::end(header_sections_), std::begin(header.sections));
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::uint64_t written = sizeof(header);
+        const char zeros[SECTION_ALIGNMENT] = {};
+        for (size_t i = 0; i < chunks_.size(); ++i) {
+            const auto& [data, size] = chunks_[i];
+            const auto& section = header_sections_[i];
+            output.write(zeros, section.offset - written);
+            output.write(data, size);
+            written = section.offset + size;
+        }
+    }
+
+private:
+    std::uint64_t offset_;
+    SectionRecord header_sections_[SECTION_COUNT];
+    std::vector<std::pair<const char*, std::uint64_t>> chunks_;
+};
+}  // namespace
+
+// writes the sheet to the file, cached values of formulas are calculated and stored if with_values is set
+void SaveSnapshot(const Sheet& sheet, const std::string& path, bool with_values) {
+    const SnapshotData data = CollectSnapshotData(sheet, with_values);
+
+    Header header{};
+    std::copy(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.flags = with_values ? std::uint32_t{FLAG_HAS_VALUES} : 0;
+
+    // sections are added in the order of the Section enumeration
+    SectionWriter writer(sizeof(Header));
+    writer.Add(SECTION_CELLS, data.cells);
+    writer.Add(SECTION_TEXTS, data.texts);
+    writer.Add(SECTION_TEXT_BLOB, data.text_blob.data(), data.text_blob.size());
+    writer.Add(SECTION_PROGRAMS, data.programs);
+    writer.Add(SECTION_CODE, data.code);
+    writer.Add(SECTION_CONSTANTS, data.constants);
+    writer.Add(SECTION_POSITIONS, data.positions);
+    writer.Add(SECTION_EDGES, data.edges);
+    writer.Add(SECTION_VALUES, data.values);
+
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        throw SnapshotException("Cannot create snapshot " + path);
+    }
+    writer.Write(output, header);
+    if (!output.flush()) {
+        throw SnapshotException("Cannot write snapshot " + path);
+    }
+}
+
+// reads the sheet from the file
+std::unique_ptr<Sheet> LoadSnapshot(const std::string& path) {
+    MappedFile file(path);
+    if (file.GetSize() < sizeof(Header)) {
+        throw SnapshotException("Snapshot is too short");
+    }
+    const Header& header = *reinterpret_cast<const Header*>(file.GetData());
+    if (!std::equal(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), header.magic)) {
+        throw SnapshotException("File is not a snapshot");
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        throw SnapshotException("Unsupported snapshot version " + std::to_string(header.version));
+    }
+
+    const SectionView<CellRecord> cells(file, header.sections[SECTION_CELLS]);
+    const SectionView<TextRecord> texts(file, header.sections[SECTION_TEXTS]);
+    const SectionView<char> text_blob(file, header.sections[SECTION_TEXT_BLOB]);
+    const SectionView<ProgramRecord> programs(file, header.sections[SECTION_PROGRAMS]);
+    const SectionView<FormulaProgram::Instruction> code(file, header.sections[SECTION_CODE]);
+    const SectionView<double> constants(file, header.sections[SECTION_CONSTANTS]);
+    const SectionView<Position> positions(file, header.sections[SECTION_POSITIONS]);
+    const SectionView<std::uint32_t> edges(file, header.sections[SECTION_EDGES]);
+    const SectionView<ValueRecord> values(file, header.sections[SECTION_VALUES]);
+    const bool has_values = header.flags & FLAG_HAS_VALUES;
+
+    auto sheet = std::make_unique<Sheet>();
+    sheet->Reserve(cells.size());
+    sheet->GetStrings().Reserve(texts.size());
+    std::vector<Cell*> cell_ptrs(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        Position pos{cells[i].row, cells[i].col};
+        if (!pos.IsValid()) {
+            throw SnapshotException("Snapshot contains invalid position");
+        }
+        cell_ptrs[i] = sheet->GetOrCreateCell(pos);
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const CellRecord& record = cells[i];
+        if (record.kind == CellKind::Text) {
+            const TextRecord& text = *texts.Range(record.index, 1);
+            cell_ptrs[i]->Load(*sheet, std::string_view(text_blob.Range(text.offset, text.size), text.size));
+        } else if (record.kind == CellKind::Formula) {
+            const ProgramRecord& program_record = *programs.Range(record.index, 1);
+            FormulaProgram program;
+            const auto* code_begin = code.Range(program_record.code_offset, program_record.code_count);
+            program.code.assign(code_begin, code_begin + program_record.code_count);
+            const auto* constants_begin = constants.Range(program_record.constants_offset,
+                                                          program_record.constants_count);
+            program.constants.assign(constants_begin, constants_begin + program_record.constants_count);
+            const auto* positions_begin = positions.Range(program_record.positions_offset,
+                                                          program_record.positions_count);
+            program.cells.assign(positions_begin, positions_begin + program_record.positions_count);
+
+            std::optional<FormulaInterface::Value> cached_value;
+            if (has_values) {
+                cached_value = FromValueRecord(*values.Range(record.index, 1));
+            }
+            try {
+                cell_ptrs[i]->Load(*sheet, {record.row, record.col}, ParseFormula(program), std::move(cached_value));
+            } catch (const FormulaException& exc) {
+                throw SnapshotException(exc.what());
+            }
+
+            const auto* edges_begin = edges.Range(program_record.edges_offset, program_record.edges_count);
+            for (std::uint32_t j = 0; j < program_record.edges_count; ++j) {
+                if (edges_begin[j] >= cell_ptrs.size()) {
+                    throw SnapshotException("Snapshot contains invalid dependency");
+                }
+                cell_ptrs[i]->LinkReferencedCell(cell_ptrs[edges_begin[j]]);
+            }
+        }
+    }
+    return sheet;
+}
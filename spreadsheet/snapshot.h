@@ -0,0 +1,30 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Binary snapshot of a sheet.
+// The file consists of a header and flat, 8-byte aligned sections: cell
+// records, the text blob, compiled formula programs, dependency edges and,
+// optionally, cached formula values. The cells are stored in the order of
+// their positions. Loading maps the file into memory and rebuilds the sheet
+// directly from the sections: formulas are restored from their programs
+// without parsing and the dependency graph is linked as stored, without cycle
+// checks.
+inline constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+// Исключение, выбрасываемое при ошибке чтения или записи снимка таблицы
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// writes the sheet to the file, cached values of formulas are calculated and stored if with_values is set
+void SaveSnapshot(const Sheet& sheet, const std::string& path, bool with_values = true);
+
+// reads the sheet from the file
+std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
@@ -0,0 +1,75 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if SPREADSHEET_STATS
+namespace {
+struct Registry {
+    std::mutex mutex;
+    std::vector<const ThreadCounters*> threads;
+    // the counters of finished threads
+    CounterValues finished{};
+};
+
+Registry& GetRegistry() {
+    // never destroyed, so that threads finishing after the end of main can use it
+    static Registry* registry = new Registry;
+    return *registry;
+}
+}  // namespace
+
+ThreadCounters::ThreadCounters() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.threads.push_back(this);
+}
+
+ThreadCounters::~ThreadCounters() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        registry.finished[i] += Get(i);
+    }
+    registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+// returns the sums of the counters of all threads, including finished ones
+CounterValues ReadCounters() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    CounterValues values = registry.finished;
+    for (const ThreadCounters* counters : registry.threads) {
+        for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+            values[i] += counters->Get(i);
+        }
+    }
+    return values;
+}
+#else
+CounterValues ReadCounters() {
+    return {};
+}
+#endif
+
+// outputs the stats as "name value" lines
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats) {
+    return output << "formula_evaluations " << stats.formula_evaluations << '\n'
+                  << "cache_hits " << stats.cache_hits << '\n'
+                  << "cache_misses " << stats.cache_misses << '\n'
+                  << "writes " << stats.writes << '\n'
+                  << "cells_invalidated " << stats.cells_invalidated << '\n'
+                  << "invalidations_skipped " << stats.invalidations_skipped << '\n'
+                  << "cells_recalculated " << stats.cells_recalculated << '\n'
+                  << "recalculation_cutoffs " << stats.recalculation_cutoffs << '\n'
+                  << "cells_validated " << stats.cells_validated << '\n'
+                  << "cycle_checks " << stats.cycle_checks << '\n'
+                  << "cycle_check_nodes " << stats.cycle_check_nodes << '\n'
+                  << "parses " << stats.parses << '\n'
+                  << "parse_time_us " << stats.parse_time.count() / 1000 << '\n'
+                  << "cells " << stats.cells << '\n'
+                  << "formula_cells " << stats.formula_cells << '\n'
+                  << "placeholder_cells " << stats.placeholder_cells << '\n';
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+// Hot-path counters of the engine. Every thread increments its own block of
+// relaxed atomics, so counting costs a load and a store to a thread-local
+// cache line; the blocks are summed only when the counters are read.
+// The counters are process-wide. Building with SPREADSHEET_STATS=0 compiles
+// them out: CountEvent does nothing and the counters read as zeros.
+#ifndef SPREADSHEET_STATS
+#define SPREADSHEET_STATS 1
+#endif
+
+enum class Counter : std::uint8_t {
+    FormulaEvaluations,
+    CacheHits,
+    CacheMisses,
+    // cells changed by SetCell, SetCells and ClearCell
+    Writes,
+    CellsInvalidated,
+    // dependent cells kept valid because their formulas did not read the changed cell
+    InvalidationsSkipped,
+    // formulas calculated again at once in the eager recalculation mode
+    CellsRecalculated,
+    // recalculated formulas which values did not change, their dependents are kept
+    RecalculationCutoffs,
+    // cached values checked against the stamps of the cells in the validating mode
+    CellsValidated,
+    CycleChecks,
+    CycleCheckNodes,
+    Parses,
+    ParseNanoseconds,
+    Count,
+};
+
+inline constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+
+using CounterValues = std::array<std::uint64_t, COUNTER_COUNT>;
+
+// returns the sums of the counters of all threads, including finished ones
+CounterValues ReadCounters();
+
+#if SPREADSHEET_STATS
+// the counters of one thread, registered while the thread is running
+class ThreadCounters {
+public:
+    ThreadCounters();
+    ThreadCounters(const ThreadCounters&) = delete;
+    ThreadCounters& operator=(const ThreadCounters&) = delete;
+    // the values are kept in the totals of finished threads
+    ~ThreadCounters();
+
+    void Add(Counter counter, std::uint64_t value) {
+        // only the owning thread writes, readers may see a slightly stale value
+        auto& slot = values_[static_cast<size_t>(counter)];
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Get(size_t index) const {
+        return values_[index].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> values_{};
+};
+
+inline thread_local ThreadCounters thread_counters;
+
+inline void CountEvent(Counter counter, std::uint64_t value = 1) {
+    thread_counters.Add(counter, value);
+}
+#else
+inline void CountEvent(Counter /* counter */, std::uint64_t /* value */ = 1) {
+}
+#endif
+
+// adds the time of its life to the counter
+class ScopedTimer {
+public:
+#if SPREADSHEET_STATS
+    explicit ScopedTimer(Counter counter) : counter_{counter}, start_{std::chrono::steady_clock::now()} {
+    }
+    ~ScopedTimer() {
+        const auto elapsed = std::chrono::steady_clock::now() - start_;
+        CountEvent(counter_, static_cast<std::uint64_t>(
+                                 std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+#else
+    explicit ScopedTimer(Counter /* counter */) {
+    }
+#endif
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+#if SPREADSHEET_STATS
+    Counter counter_;
+    std::chrono::steady_clock::time_point start_;
+#endif
+};
+
+// Counters of the engine together with the cell counts of one sheet
+struct SheetStats {
+    std::uint64_t formula_evaluations = 0;
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    std::uint64_t writes = 0;
+    std::uint64_t cells_invalidated = 0;
+    std::uint64_t invalidations_skipped = 0;
+    std::uint64_t cells_recalculated = 0;
+    std::uint64_t recalculation_cutoffs = 0;
+    std::uint64_t cells_validated = 0;
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_nodes = 0;
+    std::uint64_t parses = 0;
+    std::chrono::nanoseconds parse_time{0};
+
+    size_t cells = 0;
+    size_t formula_cells = 0;
+    // empty cells kept only because formulas refer to them
+    size_t placeholder_cells = 0;
+};
+
+// outputs the stats as "name value" lines
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats);
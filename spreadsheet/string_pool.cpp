@@ -0,0 +1,79 @@
+#include "string_pool.h"
+#include "memory_usage.h"
+
+#include <cassert>
+#include <utility>
+
+StringPool::Handle::Handle(Entry* entry) : entry_{entry} {
+    ++entry_->references;
+}
+
+StringPool::Handle::Handle(const Handle& other) : entry_{other.entry_} {
+    if (entry_) {
+        ++entry_->references;
+    }
+}
+
+StringPool::Handle::Handle(Handle&& other) noexcept : entry_{std::exchange(other.entry_, nullptr)} {
+}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if (entry_ && --entry_->references == 0) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+// the view is valid while the handle exists
+std::string_view StringPool::Handle::Get() const {
+    return entry_ ? std::string_view(entry_->text) : std::string_view{};
+}
+
+// all handles must be destroyed before the pool
+StringPool::~StringPool() {
+    assert(entries_.empty());
+}
+
+// returns the handle of the text, the text is added if it is not in the pool
+StringPool::Handle StringPool::Intern(std::string_view text) {
+    if (auto iter = entries_.find(text); iter != entries_.end()) {
+        return Handle(iter->second.get());
+    }
+    auto entry = std::make_unique<Entry>();
+    entry->text = std::string(text);
+    entry->pool = this;
+    Entry* entry_ptr = entry.get();
+    entries_.emplace(entry_ptr->text, std::move(entry));
+    return Handle(entry_ptr);
+}
+
+// reserves space for at least count distinct texts
+void StringPool::Reserve(size_t count) {
+    entries_.reserve(count);
+}
+
+// returns the number of distinct texts
+size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+// returns the size of the texts and of the table of the pool
+size_t StringPool::GetMemoryUsage() const {
+    size_t usage = GetHeapSize(entries_);
+    for (const auto& [text, entry] : entries_) {
+        usage += sizeof(Entry) + GetHeapSize(entry->text);
+    }
+    return usage;
+}
+
+// removes the entry which has no handles
+void StringPool::Release(Entry* entry) {
+    // the key refers to the text of the entry, so the node is erased by the iterator
+    auto iter = entries_.find(entry->text);
+    assert(iter != entries_.end());
+    entries_.erase(iter);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Pool of the texts of a sheet. Equal texts are stored once and shared by
+// reference-counted handles; a text is freed when its last handle is
+// destroyed. Handles of one pool are equal exactly when their texts are
+// equal, so texts are compared by pointer. The pool is not thread-safe:
+// handles are created and destroyed only by the mutations of the sheet.
+class StringPool {
+private:
+    struct Entry;
+
+public:
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        // the view is valid while the handle exists
+        std::string_view Get() const;
+
+        bool operator==(const Handle& other) const {
+            return entry_ == other.entry_;
+        }
+        bool operator!=(const Handle& other) const {
+            return entry_ != other.entry_;
+        }
+
+    private:
+        friend class StringPool;
+        explicit Handle(Entry* entry);
+
+        Entry* entry_ = nullptr;
+    };
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    // all handles must be destroyed before the pool
+    ~StringPool();
+
+    // returns the handle of the text, the text is added if it is not in the pool
+    Handle Intern(std::string_view text);
+    // reserves space for at least count distinct texts
+    void Reserve(size_t count);
+    // returns the number of distinct texts
+    size_t GetSize() const;
+    // returns the size of the texts and of the table of the pool
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Entry {
+        std::string text;
+        size_t references = 0;
+        StringPool* pool = nullptr;
+    };
+
+    // removes the entry which has no handles
+    void Release(Entry* entry);
+
+    // the keys refer to the texts of the entries
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries_;
+};
@@ -1,5 +1,6 @@
 #include "common.h"
 
+#include <algorithm>
 #include <cctype>
 #include <regex>
 #include <sstream>
@@ -85,4 +86,103 @@ Position Position::FromString(std::string_view str) {
     Position pos{std::atoi(row_str.data()) - 1,
                  FromLatinAlphaToDecimal(col_str)};
     return pos.IsValid() ? pos : NONE;
-}
\ No newline at end of file
+}
+
+bool Range::operator==(const Range& rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::operator<(const Range& rhs) const {
+    return std::tie(from.row, from.col, to.row, to.col) < std::tie(rhs.from.row, rhs.from.col, rhs.to.row, rhs.to.col);
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+Size Range::GetSize() const {
+    return {to.row - from.row + 1, to.col - from.col + 1};
+}
+
+size_t Range::GetCellCount() const {
+    const Size size = GetSize();
+    return static_cast<size_t>(size.rows) * size.cols;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return {};
+    }
+    return from.ToString() + ':' + to.ToString();
+}
+
+Range Range::FromCorners(Position first, Position second) {
+    return {{std::min(first.row, second.row), std::min(first.col, second.col)},
+            {std::max(first.row, second.row), std::max(first.col, second.col)}};
+}
+
+// returns the new position of the cell, NONE for a deleted cell and for a cell moved out of the sheet
+Position LayoutChange::Apply(Position pos) const {
+    if (!pos.IsValid()) {
+        return pos;
+    }
+    int& line = axis == Axis::Rows ? pos.row : pos.col;
+    const int max_lines = axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (line < at) {
+        return pos;
+    }
+    if (count < 0 && line < at - count) {
+        return Position::NONE;
+    }
+    line += count;
+    return line < max_lines ? pos : Position::NONE;
+}
+
+// returns the new range, the corners are moved to the nearest lines which are not deleted
+Range LayoutChange::Apply(const Range& range) const {
+    if (!range.IsValid()) {
+        return range;
+    }
+    Range result = range;
+    int& first = axis == Axis::Rows ? result.from.row : result.from.col;
+    int& last = axis == Axis::Rows ? result.to.row : result.to.col;
+    const int max_lines = axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (count > 0) {
+        first += first >= at ? count : 0;
+        last += last >= at ? count : 0;
+        // the lines moved out of the sheet are empty, they are cut off
+        last = std::min(last, max_lines - 1);
+    } else {
+        const int end = at - count;
+        first = first < at ? first : (first < end ? at : first + count);
+        last = last < at ? last : (last < end ? at - 1 : last + count);
+    }
+    if (first > last) {
+        return {Position::NONE, Position::NONE};
+    }
+    return result;
+}
+
+CellInterface::Value ToValue(const CellInterface::ValueView& view) {
+    if (const auto* text = std::get_if<std::string_view>(&view)) {
+        return std::string(*text);
+    }
+    if (const auto* number = std::get_if<double>(&view)) {
+        return *number;
+    }
+    return std::get<FormulaError>(view);
+}
+
+CellInterface::ValueView ToValueView(const CellInterface::Value& value) {
+    if (const auto* text = std::get_if<std::string>(&value)) {
+        return std::string_view(*text);
+    }
+    if (const auto* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    return std::get<FormulaError>(value);
+}
@@ -0,0 +1,711 @@
+#include "sweep.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <unordered_set>
+
+namespace {
+// upper bound of the number of lanes kept for all steps of the cone at once
+constexpr size_t LANES_BUDGET = 1 << 22;
+constexpr size_t MAX_BLOCK_SIZE = 256;
+
+std::uint8_t ToErrorCode(FormulaError error) {
+    return static_cast<std::uint8_t>(error.GetCategory()) + 1;
+}
+
+FormulaError FromErrorCode(std::uint8_t code) {
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+// returns all cells which values depend on the cell at pos, the cell itself need not exist
+std::unordered_set<const Cell*> CollectCone(const Sheet& sheet, Position pos) {
+    std::unordered_set<const Cell*> cone;
+    for (Position dependent : Cell::GetDependentPositions(sheet, {pos})) {
+        cone.insert(sheet.GetCellPtr(dependent));
+    }
+    return cone;
+}
+
+// applies the arithmetic operation or the comparison to every lane, errors of the left operand go first
+template <typename Operation, typename Lanes>
+void ApplyBinary(Lanes& lhs, const Lanes& rhs, size_t count, Operation operation) {
+    const std::uint8_t arithmetic_error = ToErrorCode(FormulaError::Category::Arithmetic);
+    for (size_t i = 0; i < count; ++i) {
+        double value = operation(lhs.values[i], rhs.values[i]);
+        std::uint8_t error = lhs.errors[i] ? lhs.errors[i] : rhs.errors[i];
+        if (!error && !std::isfinite(value)) {
+            error = arithmetic_error;
+        }
+        lhs.values[i] = value;
+        lhs.errors[i] = error;
+    }
+}
+
+// returns the maximum number of operands on the stack while the program is executed
+size_t GetStackDepth(const FormulaProgram& program) {
+    size_t depth = 0;
+    size_t max_depth = 0;
+    for (const auto& instruction : program.code) {
+        switch (instruction.code) {
+            case FormulaProgram::OpCode::Number:
+            case FormulaProgram::OpCode::Cell:
+            case FormulaProgram::OpCode::Range:
+                max_depth = std::max(max_depth, ++depth);
+                break;
+            case FormulaProgram::OpCode::Add:
+            case FormulaProgram::OpCode::Subtract:
+            case FormulaProgram::OpCode::Multiply:
+            case FormulaProgram::OpCode::Divide:
+            case FormulaProgram::OpCode::Equal:
+            case FormulaProgram::OpCode::NotEqual:
+            case FormulaProgram::OpCode::Less:
+            case FormulaProgram::OpCode::LessEqual:
+            case FormulaProgram::OpCode::Greater:
+            case FormulaProgram::OpCode::GreaterEqual:
+                --depth;
+                break;
+            case FormulaProgram::OpCode::UnaryPlus:
+            case FormulaProgram::OpCode::UnaryMinus:
+                break;
+            case FormulaProgram::OpCode::Sum:
+            case FormulaProgram::OpCode::Count:
+            case FormulaProgram::OpCode::Average:
+            case FormulaProgram::OpCode::Min:
+            case FormulaProgram::OpCode::Max:
+            case FormulaProgram::OpCode::Match:
+            case FormulaProgram::OpCode::VLookup:
+            case FormulaProgram::OpCode::XLookup:
+            case FormulaProgram::OpCode::SumIf:
+            case FormulaProgram::OpCode::CountIf:
+            case FormulaProgram::OpCode::AverageIf:
+            case FormulaProgram::OpCode::If:
+            case FormulaProgram::OpCode::And:
+            case FormulaProgram::OpCode::Or:
+            case FormulaProgram::OpCode::Not:
+                depth -= instruction.arg - 1;
+                break;
+        }
+    }
+    return max_depth;
+}
+
+bool IsLookup(FormulaProgram::OpCode code) {
+    return code == FormulaProgram::OpCode::Match || code == FormulaProgram::OpCode::VLookup
+           || code == FormulaProgram::OpCode::XLookup;
+}
+
+bool IsConditional(FormulaProgram::OpCode code) {
+    return code == FormulaProgram::OpCode::SumIf || code == FormulaProgram::OpCode::CountIf
+           || code == FormulaProgram::OpCode::AverageIf;
+}
+
+// returns a flag for every Range instruction of the program, set if the range
+// is searched by a lookup function or grouped by a conditional one
+std::vector<bool> GetSearchedRanges(const FormulaProgram& program) {
+    std::vector<bool> searched;
+    // the index of the range of every operand on the stack, npos for the numbers
+    constexpr size_t npos = static_cast<size_t>(-1);
+    std::vector<size_t> stack;
+    for (const auto& instruction : program.code) {
+        size_t popped = 0;
+        switch (instruction.code) {
+            case FormulaProgram::OpCode::Range:
+                stack.push_back(searched.size());
+                searched.push_back(false);
+                continue;
+            case FormulaProgram::OpCode::Number:
+            case FormulaProgram::OpCode::Cell:
+                break;
+            case FormulaProgram::OpCode::Add:
+            case FormulaProgram::OpCode::Subtract:
+            case FormulaProgram::OpCode::Multiply:
+            case FormulaProgram::OpCode::Divide:
+            case FormulaProgram::OpCode::Equal:
+            case FormulaProgram::OpCode::NotEqual:
+            case FormulaProgram::OpCode::Less:
+            case FormulaProgram::OpCode::LessEqual:
+            case FormulaProgram::OpCode::Greater:
+            case FormulaProgram::OpCode::GreaterEqual:
+                popped = 2;
+                break;
+            case FormulaProgram::OpCode::UnaryPlus:
+            case FormulaProgram::OpCode::UnaryMinus:
+                popped = 1;
+                break;
+            default:
+                popped = instruction.arg;
+                break;
+        }
+        for (size_t i = stack.size() - popped; i < stack.size(); ++i) {
+            if (stack[i] != npos && (IsLookup(instruction.code) || IsConditional(instruction.code))) {
+                searched[stack[i]] = true;
+            }
+        }
+        stack.resize(stack.size() - popped);
+        stack.push_back(npos);
+    }
+    return searched;
+}
+
+LookupFunction ToLookupFunction(FormulaProgram::OpCode code) {
+    switch (code) {
+        case FormulaProgram::OpCode::VLookup:
+            return LookupFunction::VLookup;
+        case FormulaProgram::OpCode::XLookup:
+            return LookupFunction::XLookup;
+        default:
+            return LookupFunction::Match;
+    }
+}
+
+AggregateFunction ToAggregateFunction(FormulaProgram::OpCode code) {
+    switch (code) {
+        case FormulaProgram::OpCode::Count:
+        case FormulaProgram::OpCode::CountIf:
+            return AggregateFunction::Count;
+        case FormulaProgram::OpCode::Average:
+        case FormulaProgram::OpCode::AverageIf:
+            return AggregateFunction::Average;
+        case FormulaProgram::OpCode::Min:
+            return AggregateFunction::Min;
+        case FormulaProgram::OpCode::Max:
+            return AggregateFunction::Max;
+        default:
+            return AggregateFunction::Sum;
+    }
+}
+}  // namespace
+
+ParameterSweep::ParameterSweep(const Sheet& sheet, Position input, std::vector<Position> outputs)
+        : sheet_{sheet}, input_{input}, outputs_{std::move(outputs)} {
+    StepIndexes step_indexes;
+    for (Position pos : OrderCone()) {
+        const FormulaInterface* formula = sheet_.GetCellPtr(pos)->GetFormula();
+        Step step{formula->Compile(), {}, {}};
+        for (Position referenced : step.program.cells) {
+            step.sources.push_back(GetSource(referenced, step_indexes));
+        }
+        const std::vector<bool> searched = GetSearchedRanges(step.program);
+        for (const auto& instruction : step.program.code) {
+            if (instruction.code == FormulaProgram::OpCode::Range) {
+                const Range range{step.program.cells[instruction.arg], step.program.cells[instruction.arg + 1]};
+                step.ranges.push_back(searched[step.ranges.size()] ? GetLookupOperand(range, step_indexes)
+                                                                   : GetRangeOperand(range, step_indexes));
+            }
+        }
+        max_stack_depth_ = std::max(max_stack_depth_, GetStackDepth(step.program));
+        step_indexes[pos] = static_cast<std::uint32_t>(steps_.size());
+        steps_.push_back(std::move(step));
+    }
+
+    for (Position pos : outputs_) {
+        const Cell* cell = sheet_.GetCellPtr(pos);
+        if (pos == input_) {
+            output_sources_.push_back({Source::Kind::Input});
+        } else if (auto iter = step_indexes.find(pos); iter != step_indexes.end()) {
+            output_sources_.push_back({Source::Kind::Step, iter->second});
+        } else {
+            output_sources_.push_back({Source::Kind::Constant,
+                                       static_cast<std::uint32_t>(constant_outputs_.size())});
+            constant_outputs_.push_back(cell ? cell->GetValue() : CellInterface::Value{});
+        }
+    }
+}
+
+// returns values of the outputs for every input value: result[output][i]
+std::vector<ParameterSweep::Values> ParameterSweep::Run(const std::vector<double>& input_values) const {
+    std::vector<Values> result(outputs_.size());
+    for (auto& values : result) {
+        values.reserve(input_values.size());
+    }
+
+    const size_t block_size = std::clamp(LANES_BUDGET / std::max<size_t>(steps_.size(), 1),
+                                         size_t{1}, MAX_BLOCK_SIZE);
+    const Lanes empty_lanes{std::vector<double>(block_size), std::vector<std::uint8_t>(block_size)};
+    std::vector<Lanes> steps(steps_.size(), empty_lanes);
+    std::vector<Lanes> stack(max_stack_depth_, empty_lanes);
+
+    for (size_t begin = 0; begin < input_values.size(); begin += block_size) {
+        const size_t count = std::min(block_size, input_values.size() - begin);
+        const double* input = input_values.data() + begin;
+
+        for (size_t i = 0; i < steps_.size(); ++i) {
+            RunStep(steps_[i], input, count, steps, stack);
+            std::swap(steps[i], stack[0]);
+        }
+
+        for (size_t k = 0; k < outputs_.size(); ++k) {
+            const Source source = output_sources_[k];
+            for (size_t i = 0; i < count; ++i) {
+                if (source.kind == Source::Kind::Input) {
+                    result[k].push_back(input[i]);
+                } else if (source.kind == Source::Kind::Constant) {
+                    result[k].push_back(constant_outputs_[source.index]);
+                } else if (std::uint8_t error = steps[source.index].errors[i]; error) {
+                    result[k].push_back(FromErrorCode(error));
+                } else {
+                    result[k].push_back(steps[source.index].values[i]);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// returns the number of formulas recalculated for each input value
+size_t ParameterSweep::GetConeSize() const {
+    return steps_.size();
+}
+
+// returns positions of the cone formulas needed by the outputs, the referenced ones go first
+std::vector<Position> ParameterSweep::OrderCone() const {
+    const auto cone = CollectCone(sheet_, input_);
+
+    std::vector<Position> order;
+    std::unordered_set<Position, PositionHasher> visited;
+    // the flag is set when all cells referenced by the position are already ordered
+    std::vector<std::pair<Position, bool>> to_visit;
+    for (auto iter = outputs_.rbegin(); iter != outputs_.rend(); ++iter) {
+        to_visit.push_back({*iter, false});
+    }
+    while (!to_visit.empty()) {
+        auto [pos, referenced_ordered] = to_visit.back();
+        to_visit.pop_back();
+        if (referenced_ordered) {
+            order.push_back(pos);
+            continue;
+        }
+        if (!pos.IsValid() || pos == input_ || visited.count(pos)) {
+            continue;
+        }
+        const Cell* cell = sheet_.GetCellPtr(pos);
+        if (!cell || !cone.count(cell)) {
+            continue;
+        }
+        visited.insert(pos);
+        to_visit.push_back({pos, true});
+        for (Position referenced : cell->GetReferencedCells()) {
+            to_visit.push_back({referenced, false});
+        }
+    }
+    return order;
+}
+
+// returns the source of the value of the cell at pos
+ParameterSweep::Source ParameterSweep::GetSource(Position pos, const StepIndexes& step_indexes) {
+    if (pos == input_) {
+        return {Source::Kind::Input};
+    }
+    if (auto iter = step_indexes.find(pos); iter != step_indexes.end()) {
+        return {Source::Kind::Step, iter->second};
+    }
+
+    Constant constant;
+    if (!pos.IsValid()) {
+        constant.error = ToErrorCode(FormulaError::Category::Ref);
+    } else if (const Cell* cell = sheet_.GetCellPtr(pos); cell) {
+        try {
+            constant.value = CellValueToNumber(cell->GetValueView());
+            constant.is_number = AggregateInput::FromValue(cell->GetValueView()).kind == AggregateInput::Kind::Number;
+        } catch (const FormulaError& error) {
+            constant.error = ToErrorCode(error);
+        }
+    }
+    constants_.push_back(constant);
+    return {Source::Kind::Constant, static_cast<std::uint32_t>(constants_.size() - 1)};
+}
+
+// splits the cells of the range into the constant and the recalculated ones
+ParameterSweep::RangeOperand ParameterSweep::GetRangeOperand(const Range& range,
+                                                             const StepIndexes& step_indexes) const {
+    RangeOperand operand;
+    operand.range = range;
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            const Position pos{row, col};
+            if (pos == input_) {
+                operand.sources.push_back({Source::Kind::Input});
+            } else if (auto iter = step_indexes.find(pos); iter != step_indexes.end()) {
+                operand.sources.push_back({Source::Kind::Step, iter->second});
+            } else if (const Cell* cell = sheet_.GetCellPtr(pos); cell) {
+                operand.constant.Add(AggregateInput::FromValue(cell->GetValueView()));
+            }
+        }
+    }
+    return operand;
+}
+
+// returns the sources of all cells of the range searched by a lookup function or grouped by a conditional one
+ParameterSweep::RangeOperand ParameterSweep::GetLookupOperand(const Range& range, const StepIndexes& step_indexes) {
+    RangeOperand operand;
+    operand.range = range;
+    operand.cells.reserve(range.GetCellCount());
+    for (int row = range.from.row; row <= range.to.row; ++row) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            operand.cells.push_back(GetSource({row, col}, step_indexes));
+        }
+    }
+    return operand;
+}
+
+// applies the aggregate function to the arguments, the result is left in args[0]
+void ParameterSweep::ApplyAggregate(AggregateFunction function, Lanes* args, size_t arg_count, const double* input,
+                                    size_t count, const std::vector<Lanes>& steps) const {
+    for (size_t i = 0; i < count; ++i) {
+        AggregateValue value;
+        // as in the formula, the error of a number argument is returned at once
+        std::uint8_t error = 0;
+        for (size_t k = 0; k < arg_count && !error; ++k) {
+            const Lanes& arg = args[k];
+            if (!arg.range) {
+                error = arg.errors[i];
+                value.Add({AggregateInput::Kind::Number, arg.values[i]});
+                continue;
+            }
+            value.Merge(arg.range->constant);
+            for (const Source source : arg.range->sources) {
+                if (source.kind == Source::Kind::Input) {
+                    value.Add({AggregateInput::Kind::Number, input[i]});
+                } else if (std::uint8_t step_error = steps[source.index].errors[i]; step_error) {
+                    value.Add({AggregateInput::Kind::Error, 0.0, FromErrorCode(step_error).GetCategory()});
+                } else {
+                    value.Add({AggregateInput::Kind::Number, steps[source.index].values[i]});
+                }
+            }
+        }
+        if (!error) {
+            try {
+                args[0].values[i] = value.GetResult(function);
+            } catch (const FormulaError& result_error) {
+                error = ToErrorCode(result_error);
+            }
+        }
+        args[0].errors[i] = error;
+    }
+    args[0].range = nullptr;
+}
+
+// applies the lookup function to the arguments, the result is left in args[0]
+void ParameterSweep::ApplyLookup(LookupFunction function, Lanes* args, size_t arg_count, const double* input,
+                                 size_t count, const std::vector<Lanes>& steps) const {
+    for (size_t i = 0; i < count; ++i) {
+        double value = 0.0;
+        std::uint8_t error = 0;
+        try {
+            value = Lookup(function, args, arg_count, i, input, steps);
+        } catch (const FormulaError& lookup_error) {
+            error = ToErrorCode(lookup_error);
+        }
+        args[0].values[i] = value;
+        args[0].errors[i] = error;
+    }
+    args[0].range = nullptr;
+}
+
+// applies the conditional aggregate function to the arguments, the result is left in args[0]
+void ParameterSweep::ApplyConditional(AggregateFunction function, Lanes* args, size_t arg_count,
+                                      const double* input, size_t count, const std::vector<Lanes>& steps) const {
+    const RangeOperand& criteria = *args[0].range;
+    const RangeOperand& values = arg_count > 2 ? *args[2].range : criteria;
+    // as in the formula, the error of the key goes before the errors of the ranges
+    std::uint8_t range_error = 0;
+    if (!criteria.range.IsValid() || !values.range.IsValid()) {
+        range_error = ToErrorCode(FormulaError::Category::Ref);
+    } else if (!(criteria.range.GetSize() == values.range.GetSize())) {
+        range_error = ToErrorCode(FormulaError::Category::Value);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        // returns the number the criteria are matched by, nullopt for the other values
+        auto get_number = [&](Source source) -> std::optional<double> {
+            if (source.kind == Source::Kind::Input) {
+                return input[i];
+            } else if (source.kind == Source::Kind::Step) {
+                return steps[source.index].errors[i] ? std::nullopt : std::optional{steps[source.index].values[i]};
+            }
+            const Constant& constant = constants_[source.index];
+            return constant.error || !constant.is_number ? std::nullopt : std::optional{constant.value};
+        };
+        auto get_input = [&](Source source) -> AggregateInput {
+            if (source.kind == Source::Kind::Input) {
+                return {AggregateInput::Kind::Number, input[i]};
+            }
+            const auto [value, error] = source.kind == Source::Kind::Step
+                                            ? std::pair{steps[source.index].values[i], steps[source.index].errors[i]}
+                                            : std::pair{constants_[source.index].value, constants_[source.index].error};
+            if (error) {
+                return {AggregateInput::Kind::Error, 0.0, FromErrorCode(error).GetCategory()};
+            }
+            const bool empty = source.kind == Source::Kind::Constant && !constants_[source.index].is_number;
+            return empty ? AggregateInput{} : AggregateInput{AggregateInput::Kind::Number, value};
+        };
+
+        std::uint8_t error = args[1].errors[i] ? args[1].errors[i] : range_error;
+        if (!error) {
+            const double key = args[1].values[i];
+            AggregateValue value;
+            for (size_t k = 0; k < criteria.cells.size(); ++k) {
+                if (get_number(criteria.cells[k]) == key) {
+                    value.Add(get_input(values.cells[k]));
+                }
+            }
+            try {
+                args[0].values[i] = value.GetResult(function);
+            } catch (const FormulaError& result_error) {
+                error = ToErrorCode(result_error);
+            }
+        }
+        args[0].errors[i] = error;
+    }
+    args[0].range = nullptr;
+}
+
+// applies the logical function to the arguments, the result is left in args[0];
+// all arguments are evaluated in every lane, and the errors of the ones the
+// formula does not evaluate in the lane are ignored
+void ParameterSweep::ApplyLogical(FormulaProgram::OpCode code, Lanes* args, size_t arg_count, size_t count) const {
+    for (size_t i = 0; i < count; ++i) {
+        double value = 0.0;
+        std::uint8_t error = 0;
+        switch (code) {
+            case FormulaProgram::OpCode::If: {
+                error = args[0].errors[i];
+                // the omitted else branch is false
+                const size_t branch = args[0].values[i] != 0.0 ? 1 : 2;
+                if (!error && branch < arg_count) {
+                    value = args[branch].values[i];
+                    error = args[branch].errors[i];
+                }
+                break;
+            }
+            case FormulaProgram::OpCode::And:
+            case FormulaProgram::OpCode::Or: {
+                // AND stops at the first false argument, OR at the first true one
+                const bool deciding = code == FormulaProgram::OpCode::Or;
+                value = deciding ? 0.0 : 1.0;
+                for (size_t k = 0; k < arg_count; ++k) {
+                    if (args[k].errors[i]) {
+                        error = args[k].errors[i];
+                        break;
+                    }
+                    if ((args[k].values[i] != 0.0) == deciding) {
+                        value = deciding ? 1.0 : 0.0;
+                        break;
+                    }
+                }
+                break;
+            }
+            default:
+                error = args[0].errors[i];
+                value = args[0].values[i] == 0.0 ? 1.0 : 0.0;
+                break;
+        }
+        args[0].values[i] = value;
+        args[0].errors[i] = error;
+    }
+    args[0].range = nullptr;
+}
+
+// evaluates the lookup function in the lane as the formula does, throws FormulaError
+double ParameterSweep::Lookup(LookupFunction function, const Lanes* args, size_t arg_count, size_t lane,
+                              const double* input, const std::vector<Lanes>& steps) const {
+    // returns the value of the cell in the lane, throws its error
+    auto get_value = [&](Source source) {
+        if (source.kind == Source::Kind::Input) {
+            return input[lane];
+        }
+        const auto [value, error] = source.kind == Source::Kind::Step
+                                        ? std::pair{steps[source.index].values[lane], steps[source.index].errors[lane]}
+                                        : std::pair{constants_[source.index].value, constants_[source.index].error};
+        return error ? throw FromErrorCode(error) : value;
+    };
+    // returns the number the lookup functions match, nullopt for the other values
+    auto get_number = [&](Source source) -> std::optional<double> {
+        if (source.kind == Source::Kind::Input) {
+            return input[lane];
+        } else if (source.kind == Source::Kind::Step) {
+            return steps[source.index].errors[lane] ? std::nullopt : std::optional{steps[source.index].values[lane]};
+        }
+        const Constant& constant = constants_[source.index];
+        return constant.error || !constant.is_number ? std::nullopt : std::optional{constant.value};
+    };
+    auto get_arg = [&](size_t index) {
+        return args[index].errors[lane] ? throw FromErrorCode(args[index].errors[lane]) : args[index].values[lane];
+    };
+    auto get_mode = [&](size_t index) {
+        return GetMatchMode(function, index < arg_count ? std::optional{get_arg(index)} : std::nullopt);
+    };
+    // searches every stride-th cell of the range
+    auto find = [&](const RangeOperand& operand, size_t count, size_t stride, MatchMode mode, double key) {
+        return FindByScan(count, key, mode, [&](size_t offset) {
+            return get_number(operand.cells[offset * stride]);
+        });
+    };
+    const auto not_found = FormulaError(FormulaError::Category::Value);
+
+    const double key = get_arg(0);
+    const RangeOperand& operand = *args[1].range;
+    const Range& range = operand.range;
+    if (!range.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    switch (function) {
+        case LookupFunction::Match: {
+            if (!IsVector(range)) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            const auto offset = find(operand, operand.cells.size(), 1, get_mode(2), key);
+            return offset ? static_cast<double>(*offset + 1) : throw not_found;
+        }
+        case LookupFunction::VLookup: {
+            const double column = std::trunc(get_arg(2));
+            const Size size = range.GetSize();
+            if (column < 1) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            if (column > size.cols) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            const auto offset = find(operand, size.rows, size.cols, get_mode(3), key);
+            if (!offset) {
+                throw not_found;
+            }
+            return get_value(operand.cells[*offset * size.cols + static_cast<size_t>(column) - 1]);
+        }
+        case LookupFunction::XLookup: {
+            const RangeOperand& results = *args[2].range;
+            if (!results.range.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            if (!IsVector(range) || !(results.range.GetSize() == range.GetSize())) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            const auto offset = find(operand, operand.cells.size(), 1, get_mode(4), key);
+            if (!offset) {
+                return arg_count > 3 ? get_arg(3) : throw not_found;
+            }
+            return get_value(results.cells[*offset]);
+        }
+    }
+    throw not_found;
+}
+
+// evaluates the step for count lanes, the result is left in stack[0]
+void ParameterSweep::RunStep(const Step& step, const double* input, size_t count,
+                             const std::vector<Lanes>& steps, std::vector<Lanes>& stack) const {
+    size_t top = 0;
+    size_t range_index = 0;
+    for (const auto& instruction : step.program.code) {
+        switch (instruction.code) {
+            case FormulaProgram::OpCode::Number: {
+                Lanes& operand = stack[top++];
+                operand.range = nullptr;
+                std::fill_n(operand.values.begin(), count, step.program.constants[instruction.arg]);
+                std::fill_n(operand.errors.begin(), count, 0);
+                break;
+            }
+            case FormulaProgram::OpCode::Cell: {
+                Lanes& operand = stack[top++];
+                operand.range = nullptr;
+                const Source source = step.sources[instruction.arg];
+                if (source.kind == Source::Kind::Input) {
+                    std::copy_n(input, count, operand.values.begin());
+                    std::fill_n(operand.errors.begin(), count, 0);
+                } else if (source.kind == Source::Kind::Step) {
+                    std::copy_n(steps[source.index].values.begin(), count, operand.values.begin());
+                    std::copy_n(steps[source.index].errors.begin(), count, operand.errors.begin());
+                } else {
+                    std::fill_n(operand.values.begin(), count, constants_[source.index].value);
+                    std::fill_n(operand.errors.begin(), count, constants_[source.index].error);
+                }
+                break;
+            }
+            case FormulaProgram::OpCode::Add:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::plus<double>{});
+                break;
+            case FormulaProgram::OpCode::Subtract:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::minus<double>{});
+                break;
+            case FormulaProgram::OpCode::Multiply:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::multiplies<double>{});
+                break;
+            case FormulaProgram::OpCode::Divide:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::divides<double>{});
+                break;
+            case FormulaProgram::OpCode::UnaryPlus:
+                break;
+            case FormulaProgram::OpCode::UnaryMinus: {
+                Lanes& operand = stack[top - 1];
+                std::transform(operand.values.begin(), operand.values.begin() + count,
+                               operand.values.begin(), std::negate<double>{});
+                break;
+            }
+            case FormulaProgram::OpCode::Range:
+                stack[top++].range = &step.ranges[range_index++];
+                break;
+            case FormulaProgram::OpCode::Sum:
+            case FormulaProgram::OpCode::Count:
+            case FormulaProgram::OpCode::Average:
+            case FormulaProgram::OpCode::Min:
+            case FormulaProgram::OpCode::Max:
+                top -= instruction.arg;
+                ApplyAggregate(ToAggregateFunction(instruction.code), &stack[top], instruction.arg,
+                               input, count, steps);
+                ++top;
+                break;
+            case FormulaProgram::OpCode::Match:
+            case FormulaProgram::OpCode::VLookup:
+            case FormulaProgram::OpCode::XLookup:
+                top -= instruction.arg;
+                ApplyLookup(ToLookupFunction(instruction.code), &stack[top], instruction.arg, input, count, steps);
+                ++top;
+                break;
+            case FormulaProgram::OpCode::SumIf:
+            case FormulaProgram::OpCode::CountIf:
+            case FormulaProgram::OpCode::AverageIf:
+                top -= instruction.arg;
+                ApplyConditional(ToAggregateFunction(instruction.code), &stack[top], instruction.arg,
+                                 input, count, steps);
+                ++top;
+                break;
+            case FormulaProgram::OpCode::Equal:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::equal_to<double>{});
+                break;
+            case FormulaProgram::OpCode::NotEqual:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::not_equal_to<double>{});
+                break;
+            case FormulaProgram::OpCode::Less:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::less<double>{});
+                break;
+            case FormulaProgram::OpCode::LessEqual:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::less_equal<double>{});
+                break;
+            case FormulaProgram::OpCode::Greater:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::greater<double>{});
+                break;
+            case FormulaProgram::OpCode::GreaterEqual:
+                --top;
+                ApplyBinary(stack[top - 1], stack[top], count, std::greater_equal<double>{});
+                break;
+            case FormulaProgram::OpCode::If:
+            case FormulaProgram::OpCode::And:
+            case FormulaProgram::OpCode::Or:
+            case FormulaProgram::OpCode::Not:
+                top -= instruction.arg;
+                ApplyLogical(instruction.code, &stack[top], instruction.arg, count);
+                ++top;
+                break;
+        }
+    }
+}
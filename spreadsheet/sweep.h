@@ -0,0 +1,117 @@
+#pragma once
+
+#include "aggregate.h"
+#include "common.h"
+#include "lookup.h"
+#include "program.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Sensitivity analysis (data table): evaluates output cells for many values
+// of one input cell. The cone of formulas between the input and the outputs
+// is extracted and compiled once, then all input values are evaluated
+// together, block by block, with every instruction applied to the whole
+// block. The sheet is not modified, the sweep sees the sheet as it was
+// at the moment of construction.
+class ParameterSweep {
+public:
+    using Values = std::vector<CellInterface::Value>;
+
+    ParameterSweep(const Sheet& sheet, Position input, std::vector<Position> outputs);
+
+    // returns values of the outputs for every input value: result[output][i]
+    std::vector<Values> Run(const std::vector<double>& input_values) const;
+
+    // returns the number of formulas recalculated for each input value
+    size_t GetConeSize() const;
+
+private:
+    // where the value of a referenced cell is taken from
+    struct Source {
+        enum class Kind : std::uint8_t {
+            Input,
+            Step,
+            Constant,
+        };
+        Kind kind;
+        std::uint32_t index = 0;
+    };
+
+    // value of a cell which does not depend on the input
+    struct Constant {
+        double value = 0.0;
+        std::uint8_t error = 0;
+        // false for the empty cells and the texts, the lookup and the conditional functions do not match them
+        bool is_number = false;
+    };
+
+    // range argument of a function: for an aggregate function the cells which
+    // do not depend on the input are aggregated once, the others are added in
+    // every lane; a lookup or a conditional function reads all cells in every lane
+    struct RangeOperand {
+        Range range;
+        AggregateValue constant;
+        std::vector<Source> sources;
+        // the sources of all cells in the row-major order, for the lookup and the conditional functions only
+        std::vector<Source> cells;
+    };
+
+    // formula of the cone to be recalculated
+    struct Step {
+        FormulaProgram program;
+        std::vector<Source> sources;
+        // the operands of the Range instructions in the order of the code
+        std::vector<RangeOperand> ranges;
+    };
+
+    // a buffer of values and error codes for every lane of the block
+    struct Lanes {
+        std::vector<double> values;
+        std::vector<std::uint8_t> errors;
+        // set when the operand is a range, the lanes are not used then
+        const RangeOperand* range = nullptr;
+    };
+
+    using StepIndexes = std::unordered_map<Position, std::uint32_t, PositionHasher>;
+
+    // returns positions of the cone formulas needed by the outputs, the referenced ones go first
+    std::vector<Position> OrderCone() const;
+    // returns the source of the value of the cell at pos
+    Source GetSource(Position pos, const StepIndexes& step_indexes);
+    // splits the cells of the range into the constant and the recalculated ones
+    RangeOperand GetRangeOperand(const Range& range, const StepIndexes& step_indexes) const;
+    // returns the sources of all cells of the range searched by a lookup function or grouped by a conditional one
+    RangeOperand GetLookupOperand(const Range& range, const StepIndexes& step_indexes);
+
+    // evaluates the step for count lanes, the result is left in stack[0]
+    void RunStep(const Step& step, const double* input, size_t count,
+                 const std::vector<Lanes>& steps, std::vector<Lanes>& stack) const;
+    // applies the aggregate function to the arguments, the result is left in args[0]
+    void ApplyAggregate(AggregateFunction function, Lanes* args, size_t arg_count, const double* input,
+                        size_t count, const std::vector<Lanes>& steps) const;
+    // applies the conditional aggregate function to the arguments, the result is left in args[0]
+    void ApplyConditional(AggregateFunction function, Lanes* args, size_t arg_count, const double* input,
+                          size_t count, const std::vector<Lanes>& steps) const;
+    // applies the logical function to the arguments, the result is left in args[0]
+    void ApplyLogical(FormulaProgram::OpCode code, Lanes* args, size_t arg_count, size_t count) const;
+    // applies the lookup function to the arguments, the result is left in args[0]
+    void ApplyLookup(LookupFunction function, Lanes* args, size_t arg_count, const double* input,
+                     size_t count, const std::vector<Lanes>& steps) const;
+    // evaluates the lookup function in the lane, throws FormulaError
+    double Lookup(LookupFunction function, const Lanes* args, size_t arg_count, size_t lane, const double* input,
+                  const std::vector<Lanes>& steps) const;
+
+    const Sheet& sheet_;
+    Position input_;
+    std::vector<Position> outputs_;
+    std::vector<Source> output_sources_;
+
+    std::vector<Step> steps_;
+    std::vector<Constant> constants_;
+    // original values of the outputs which do not depend on the input
+    std::vector<CellInterface::Value> constant_outputs_;
+    size_t max_stack_depth_ = 0;
+};
@@ -0,0 +1,278 @@
+#include "trace.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <ostream>
+#include <streambuf>
+
+namespace {
+constexpr char TRACE_SIGNATURE[8] = {'S', 'H', 'T', 'R', 'A', 'C', 'E', '1'};
+constexpr size_t WRITE_BLOCK_SIZE = 64 << 10;
+
+using Clock = std::chrono::steady_clock;
+
+// the stream buffer which drops everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char_type* /* data */, std::streamsize count) override {
+        return count;
+    }
+};
+
+bool IsLayoutChange(TraceCommand command) {
+    return command == TraceCommand::InsertRows || command == TraceCommand::DeleteRows
+           || command == TraceCommand::InsertCols || command == TraceCommand::DeleteCols;
+}
+
+bool HasPosition(TraceCommand command) {
+    return command == TraceCommand::Set || command == TraceCommand::Clear || IsLayoutChange(command);
+}
+
+// returns the sheet for the commands SheetInterface does not have
+Sheet& GetCells(SheetInterface& sheet) {
+    if (auto* cells = dynamic_cast<Sheet*>(&sheet)) {
+        return *cells;
+    }
+    throw std::invalid_argument("Not supported by the sheet");
+}
+}  // namespace
+
+TraceWriter::TraceWriter(const std::string& path)
+        : file_{std::fopen(path.c_str(), "wb")}, start_{Clock::now()} {
+    if (!file_) {
+        throw TraceException("Cannot create trace " + path);
+    }
+    buffer_.append(TRACE_SIGNATURE, sizeof(TRACE_SIGNATURE));
+}
+
+TraceWriter::~TraceWriter() {
+    Flush();
+    std::fclose(file_);
+}
+
+// records the command with the current time
+void TraceWriter::Record(TraceCommand command, Position pos, std::string_view text) {
+    AppendHeader(command);
+    if (HasPosition(command)) {
+        AppendVarint(static_cast<std::uint64_t>(pos.row));
+        AppendVarint(static_cast<std::uint64_t>(pos.col));
+    }
+    if (command == TraceCommand::Set) {
+        AppendVarint(text.size());
+        buffer_ += text;
+    }
+    FlushBlock();
+}
+
+// records the print diff command with the version
+void TraceWriter::RecordPrintDiff(std::uint64_t version) {
+    AppendHeader(TraceCommand::PrintDiff);
+    AppendVarint(version);
+    FlushBlock();
+}
+
+// records the insertion or the deletion of count lines starting with the row or the column of pos
+void TraceWriter::RecordLayoutChange(TraceCommand command, Position pos, int count) {
+    AppendHeader(command);
+    AppendVarint(static_cast<std::uint64_t>(pos.row));
+    AppendVarint(static_cast<std::uint64_t>(pos.col));
+    AppendVarint(static_cast<std::uint64_t>(count));
+    FlushBlock();
+}
+
+// appends the command and the time since the previous record
+void TraceWriter::AppendHeader(TraceCommand command) {
+    const auto time = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start_);
+    buffer_.push_back(static_cast<char>(command));
+    AppendVarint(static_cast<std::uint64_t>((time - last_time_).count()));
+    last_time_ = time;
+}
+
+// writes the buffer if it holds a block
+void TraceWriter::FlushBlock() {
+    if (buffer_.size() >= WRITE_BLOCK_SIZE) {
+        Flush();
+    }
+}
+
+void TraceWriter::Flush() {
+    if (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size() || std::fflush(file_) != 0) {
+        throw TraceException("Cannot write trace");
+    }
+    buffer_.clear();
+}
+
+void TraceWriter::AppendVarint(std::uint64_t value) {
+    while (value >= 0x80) {
+        buffer_.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer_.push_back(static_cast<char>(value));
+}
+
+TraceReader::TraceReader(const std::string& path) : file_{std::fopen(path.c_str(), "rb")} {
+    if (!file_) {
+        throw TraceException("Cannot open trace " + path);
+    }
+    char signature[sizeof(TRACE_SIGNATURE)];
+    if (std::fread(signature, 1, sizeof(signature), file_) != sizeof(signature)
+        || !std::equal(signature, signature + sizeof(signature), TRACE_SIGNATURE)) {
+        std::fclose(file_);
+        throw TraceException("Invalid trace " + path);
+    }
+}
+
+TraceReader::~TraceReader() {
+    std::fclose(file_);
+}
+
+// returns the next record or nothing at the end of the trace
+std::optional<TraceRecord> TraceReader::Next() {
+    std::uint8_t command;
+    if (!ReadByte(command)) {
+        return std::nullopt;
+    }
+    if (command >= TRACE_COMMAND_COUNT) {
+        throw TraceException("Invalid trace command");
+    }
+
+    TraceRecord record;
+    record.command = static_cast<TraceCommand>(command);
+    time_ += std::chrono::microseconds(ReadVarint());
+    record.time = time_;
+    if (HasPosition(record.command)) {
+        record.pos.row = static_cast<int>(ReadVarint());
+        record.pos.col = static_cast<int>(ReadVarint());
+    }
+    if (record.command == TraceCommand::Set) {
+        record.text.resize(ReadVarint());
+        if (std::fread(record.text.data(), 1, record.text.size(), file_) != record.text.size()) {
+            throw TraceException("Truncated trace");
+        }
+    }
+    if (record.command == TraceCommand::PrintDiff) {
+        record.version = ReadVarint();
+    }
+    if (IsLayoutChange(record.command)) {
+        record.count = static_cast<int>(ReadVarint());
+    }
+    return record;
+}
+
+// returns false at the end of the file
+bool TraceReader::ReadByte(std::uint8_t& byte) {
+    const int ch = std::fgetc(file_);
+    if (ch == EOF) {
+        return false;
+    }
+    byte = static_cast<std::uint8_t>(ch);
+    return true;
+}
+
+std::uint64_t TraceReader::ReadVarint() {
+    std::uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        std::uint8_t byte;
+        if (!ReadByte(byte)) {
+            throw TraceException("Truncated trace");
+        }
+        value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw TraceException("Invalid trace number");
+}
+
+void LatencyHistogram::Add(std::chrono::nanoseconds latency) {
+    const auto nanoseconds = static_cast<std::uint64_t>(std::max<std::int64_t>(latency.count(), 1));
+    // the bucket i holds latencies in [2^i, 2^(i+1))
+    int bucket = 0;
+    while (bucket + 1 < static_cast<int>(buckets_.size()) && (nanoseconds >> (bucket + 1))) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    total_ += latency;
+    max_ = std::max(max_, latency);
+}
+
+std::uint64_t LatencyHistogram::GetCount() const {
+    return count_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetTotal() const {
+    return total_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetMax() const {
+    return max_;
+}
+
+// returns the upper bound of the bucket holding the percentile, fraction is in [0, 1]
+std::chrono::nanoseconds LatencyHistogram::GetPercentile(double fraction) const {
+    if (count_ == 0) {
+        return std::chrono::nanoseconds{0};
+    }
+    const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(fraction * count_ + 0.5));
+    std::uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets_.size(); ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= rank) {
+            return std::min(max_, std::chrono::nanoseconds{(std::int64_t{2} << bucket) - 1});
+        }
+    }
+    return max_;
+}
+
+// executes the commands of the trace on the sheet as fast as possible, printed output is discarded
+TraceReplayStats ReplayTrace(const std::string& path, SheetInterface& sheet) {
+    TraceReplayStats stats;
+    TraceReader reader(path);
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+
+    while (auto record = reader.Next()) {
+        const auto start = Clock::now();
+        try {
+            switch (record->command) {
+                case TraceCommand::Set:
+                    sheet.SetCell(record->pos, std::move(record->text));
+                    break;
+                case TraceCommand::Clear:
+                    sheet.ClearCell(record->pos);
+                    break;
+                case TraceCommand::PrintValues:
+                    sheet.PrintValues(null_output);
+                    break;
+                case TraceCommand::PrintTexts:
+                    sheet.PrintTexts(null_output);
+                    break;
+                case TraceCommand::PrintDiff:
+                    GetCells(sheet).PrintDiff(null_output, record->version);
+                    break;
+                case TraceCommand::InsertRows:
+                    GetCells(sheet).InsertRows(record->pos.row, record->count);
+                    break;
+                case TraceCommand::DeleteRows:
+                    GetCells(sheet).DeleteRows(record->pos.row, record->count);
+                    break;
+                case TraceCommand::InsertCols:
+                    GetCells(sheet).InsertCols(record->pos.col, record->count);
+                    break;
+                case TraceCommand::DeleteCols:
+                    GetCells(sheet).DeleteCols(record->pos.col, record->count);
+                    break;
+            }
+        } catch (const std::exception&) {
+            ++stats.errors;
+        }
+        const auto latency = Clock::now() - start;
+        stats.latencies[static_cast<size_t>(record->command)].Add(latency);
+        stats.total += latency;
+    }
+    return stats;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Trace of the commands executed by a sheet, used to reproduce performance
+// problems. The file starts with an 8-byte signature, then the records follow:
+// the command (uint8), the time since the previous record in microseconds,
+// and, for set and clear, the row and the column; set is followed by the
+// size of the text and the text, print diff by the version. The commands
+// inserting and deleting the rows and the columns store the row and the column
+// of the first line and the count of the lines. Numbers are stored as LEB128
+// varints.
+enum class TraceCommand : std::uint8_t {
+    Set,
+    Clear,
+    PrintValues,
+    PrintTexts,
+    PrintDiff,
+    InsertRows,
+    DeleteRows,
+    InsertCols,
+    DeleteCols,
+};
+
+// the number of the commands, the last one is DeleteCols
+constexpr size_t TRACE_COMMAND_COUNT = static_cast<size_t>(TraceCommand::DeleteCols) + 1;
+
+struct TraceRecord {
+    TraceCommand command;
+    // time since the start of the recording
+    std::chrono::microseconds time{0};
+    Position pos;
+    std::string text;
+    // the version of the sheet the diff is printed after
+    std::uint64_t version = 0;
+    // the number of the inserted or deleted lines, the first one is at pos
+    int count = 0;
+};
+
+// Исключение, выбрасываемое при ошибке чтения или записи трассы
+class TraceException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Appends the commands to the trace file. The records are buffered and
+// written in blocks, the rest is written on Flush and on destruction.
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path);
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+    ~TraceWriter();
+
+    // records the command with the current time
+    void Record(TraceCommand command, Position pos = {}, std::string_view text = {});
+    // records the print diff command with the version
+    void RecordPrintDiff(std::uint64_t version);
+    // records the insertion or the deletion of count lines starting with the row or the column of pos
+    void RecordLayoutChange(TraceCommand command, Position pos, int count);
+    void Flush();
+
+private:
+    // appends the command and the time since the previous record
+    void AppendHeader(TraceCommand command);
+    // writes the buffer if it holds a block
+    void FlushBlock();
+    void AppendVarint(std::uint64_t value);
+
+    std::FILE* file_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::microseconds last_time_{0};
+};
+
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+    ~TraceReader();
+
+    // returns the next record or nothing at the end of the trace
+    std::optional<TraceRecord> Next();
+
+private:
+    // returns false at the end of the file
+    bool ReadByte(std::uint8_t& byte);
+    std::uint64_t ReadVarint();
+
+    std::FILE* file_;
+    std::chrono::microseconds time_{0};
+};
+
+// Histogram of latencies with power of two buckets of nanoseconds
+class LatencyHistogram {
+public:
+    void Add(std::chrono::nanoseconds latency);
+
+    std::uint64_t GetCount() const;
+    std::chrono::nanoseconds GetTotal() const;
+    std::chrono::nanoseconds GetMax() const;
+    // returns the upper bound of the bucket holding the percentile, fraction is in [0, 1]
+    std::chrono::nanoseconds GetPercentile(double fraction) const;
+
+private:
+    std::array<std::uint64_t, 64> buckets_{};
+    std::uint64_t count_ = 0;
+    std::chrono::nanoseconds total_{0};
+    std::chrono::nanoseconds max_{0};
+};
+
+struct TraceReplayStats {
+    // indexed by TraceCommand
+    std::array<LatencyHistogram, TRACE_COMMAND_COUNT> latencies;
+    // commands rejected by the sheet
+    std::uint64_t errors = 0;
+    std::chrono::nanoseconds total{0};
+};
+
+// executes the commands of the trace on the sheet as fast as possible, printed output is discarded;
+// print diff and the layout changes are rejected by a sheet which is not a Sheet
+TraceReplayStats ReplayTrace(const std::string& path, SheetInterface& sheet);
@@ -0,0 +1,381 @@
+#include "wal.h"
+#include "snapshot.h"
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+const char SNAPSHOT_FILE[] = "sheet.snapshot";
+const char SNAPSHOT_TMP_FILE[] = "sheet.snapshot.tmp";
+const char LOG_FILE[] = "sheet.wal";
+const char SEALED_LOG_FILE[] = "sheet.wal.sealed";
+
+// record: payload size, payload checksum, payload (operation, row, col, text)
+constexpr size_t RECORD_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+constexpr size_t PAYLOAD_HEADER_SIZE = sizeof(std::uint8_t) + 2 * sizeof(std::int32_t);
+
+std::array<std::uint32_t, 256> MakeCrcTable() {
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < table.size(); ++i) {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+std::uint32_t Crc32(const char* data, size_t size) {
+    static const auto table = MakeCrcTable();
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+template <typename T>
+void AppendRaw(std::string& buffer, T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadRaw(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// returns false if the written data may be lost
+bool SyncFile(std::FILE* file) {
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// makes the file (or the directory entry) durable, throws if it cannot
+void SyncPath(const fs::path& path) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    const bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!synced) {
+        throw DurabilityException("Cannot sync " + path.string());
+    }
+#endif
+}
+}  // namespace
+
+// opens the log for appending, the file is created if it does not exist
+WriteAheadLog::WriteAheadLog(const std::string& path)
+        : file_{std::fopen(path.c_str(), "ab")} {
+    if (!file_) {
+        throw DurabilityException("Cannot open log " + path);
+    }
+    std::error_code error;
+    size_ = fs::file_size(path, error);
+    flusher_ = std::thread([this] {
+        FlushLoop();
+    });
+}
+
+// makes all appended records durable
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stopped_ = true;
+    }
+    has_records_.notify_one();
+    flusher_.join();
+    std::fclose(file_);
+}
+
+// adds the record to the log and returns its sequence number, the record is not durable yet
+WriteAheadLog::Lsn WriteAheadLog::Append(Operation operation, Position pos, std::string_view text) {
+    std::string payload;
+    payload.reserve(PAYLOAD_HEADER_SIZE + text.size());
+    AppendRaw(payload, static_cast<std::uint8_t>(operation));
+    AppendRaw(payload, static_cast<std::int32_t>(pos.row));
+    AppendRaw(payload, static_cast<std::int32_t>(pos.col));
+    payload.append(text);
+
+    Lsn lsn;
+    {
+        std::lock_guard lock(mutex_);
+        AppendRaw(pending_, static_cast<std::uint32_t>(payload.size()));
+        AppendRaw(pending_, Crc32(payload.data(), payload.size()));
+        pending_ += payload;
+        size_ += RECORD_HEADER_SIZE + payload.size();
+        lsn = ++appended_lsn_;
+    }
+    has_records_.notify_one();
+    return lsn;
+}
+
+// blocks until all records up to lsn are written and synced
+void WriteAheadLog::Commit(Lsn lsn) {
+    std::unique_lock lock(mutex_);
+    records_durable_.wait(lock, [this, lsn] {
+        return durable_lsn_ >= lsn || !error_.empty();
+    });
+    if (!error_.empty()) {
+        throw DurabilityException(error_);
+    }
+}
+
+// blocks until all appended records are durable
+void WriteAheadLog::Commit() {
+    Lsn lsn;
+    {
+        std::lock_guard lock(mutex_);
+        lsn = appended_lsn_;
+    }
+    Commit(lsn);
+}
+
+// returns the size of the log including the records not written yet
+std::uint64_t WriteAheadLog::GetSize() const {
+    std::lock_guard lock(mutex_);
+    return size_;
+}
+
+// the background thread writing and syncing the appended records
+void WriteAheadLog::FlushLoop() {
+    std::string records;
+    std::unique_lock lock(mutex_);
+    while (true) {
+        has_records_.wait(lock, [this] {
+            return !pending_.empty() || stopped_;
+        });
+        if (pending_.empty() && stopped_) {
+            return;
+        }
+        // the records appended while the group is being written form the next group
+        records.swap(pending_);
+        const Lsn group_lsn = appended_lsn_;
+        lock.unlock();
+
+        // the records are durable only when the sync succeeds
+        const bool written = std::fwrite(records.data(), 1, records.size(), file_) == records.size()
+                             && std::fflush(file_) == 0 && SyncFile(file_);
+        records.clear();
+
+        lock.lock();
+        if (written) {
+            durable_lsn_ = group_lsn;
+        } else {
+            error_ = "Cannot write or sync log";
+        }
+        records_durable_.notify_all();
+    }
+}
+
+// applies the records of the log to the sheet
+WriteAheadLog::ReplayResult WriteAheadLog::Replay(const std::string& path, SheetInterface& sheet) {
+    ReplayResult result;
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return result;
+    }
+
+    std::error_code error;
+    const std::uint64_t file_size = fs::file_size(path, error);
+    char header[RECORD_HEADER_SIZE];
+    std::string payload;
+    while (input.read(header, RECORD_HEADER_SIZE)) {
+        const auto payload_size = ReadRaw<std::uint32_t>(header);
+        const auto checksum = ReadRaw<std::uint32_t>(header + sizeof(std::uint32_t));
+        // the size is not covered by the checksum, so the size of a torn header
+        // is checked against the rest of the file before the payload is allocated
+        const std::uint64_t rest = error ? 0 : file_size - result.valid_size - RECORD_HEADER_SIZE;
+        if (payload_size < PAYLOAD_HEADER_SIZE || payload_size > rest) {
+            break;
+        }
+        payload.resize(payload_size);
+        if (!input.read(payload.data(), payload_size) || Crc32(payload.data(), payload.size()) != checksum) {
+            break;
+        }
+
+        const auto operation = static_cast<Operation>(ReadRaw<std::uint8_t>(payload.data()));
+        const Position pos{ReadRaw<std::int32_t>(payload.data() + sizeof(std::uint8_t)),
+                           ReadRaw<std::int32_t>(payload.data() + sizeof(std::uint8_t) + sizeof(std::int32_t))};
+        try {
+            if (operation == Operation::Set) {
+                sheet.SetCell(pos, payload.substr(PAYLOAD_HEADER_SIZE));
+            } else {
+                sheet.ClearCell(pos);
+            }
+        } catch (const std::exception&) {
+            // the mutation was overwritten later in the log, see DurableSheet::Compact
+        }
+        ++result.records;
+        result.valid_size += RECORD_HEADER_SIZE + payload_size;
+    }
+    return result;
+}
+
+DurableSheet::DurableSheet(std::string directory, std::uint64_t compaction_threshold)
+        : directory_{std::move(directory)}, compaction_threshold_{compaction_threshold} {
+    fs::create_directories(directory_);
+    Recover();
+    log_ = std::make_unique<WriteAheadLog>((fs::path(directory_) / LOG_FILE).string());
+}
+
+DurableSheet::~DurableSheet() {
+    if (compaction_.joinable()) {
+        compaction_.join();
+    }
+}
+
+void DurableSheet::SetCell(Position pos, std::string text) {
+    sheet_->SetCell(pos, text);
+    log_->Append(WriteAheadLog::Operation::Set, pos, text);
+    CompactIfNeeded();
+}
+
+const CellInterface* DurableSheet::GetCell(Position pos) const {
+    return sheet_->GetCell(pos);
+}
+
+CellInterface* DurableSheet::GetCell(Position pos) {
+    return sheet_->GetCell(pos);
+}
+
+void DurableSheet::ClearCell(Position pos) {
+    sheet_->ClearCell(pos);
+    log_->Append(WriteAheadLog::Operation::Clear, pos);
+    CompactIfNeeded();
+}
+
+Size DurableSheet::GetPrintableSize() const {
+    return sheet_->GetPrintableSize();
+}
+
+void DurableSheet::PrintValues(std::ostream& output) const {
+    Commit();
+    sheet_->PrintValues(output);
+}
+
+void DurableSheet::PrintTexts(std::ostream& output) const {
+    Commit();
+    sheet_->PrintTexts(output);
+}
+
+// blocks until all mutations are durable
+void DurableSheet::Commit() const {
+    log_->Commit();
+}
+
+// seals the current log and folds it into a new snapshot in the background
+void DurableSheet::Compact() {
+    WaitCompaction();
+
+    const fs::path directory(directory_);
+    // the log sealed by a failed compaction is folded first, the current one waits for the next compaction
+    if (!fs::exists(directory / SEALED_LOG_FILE)) {
+        log_.reset();
+        fs::rename(directory / LOG_FILE, directory / SEALED_LOG_FILE);
+        SyncPath(directory);
+        log_ = std::make_unique<WriteAheadLog>((directory / LOG_FILE).string());
+    }
+
+    // the live sheet is not touched: the snapshot is rebuilt from the files.
+    // If the process stops after the new snapshot is renamed, but before the
+    // sealed log is removed, the sealed log is replayed over the snapshot
+    // which already contains it; the mutations set absolute contents, so the
+    // replay does not change the result
+    compacting_ = true;
+    compaction_ = std::thread([this, directory] {
+        try {
+            std::unique_ptr<Sheet> sheet = fs::exists(directory / SNAPSHOT_FILE)
+                                           ? LoadSnapshot((directory / SNAPSHOT_FILE).string())
+                                           : std::make_unique<Sheet>();
+            WriteAheadLog::Replay((directory / SEALED_LOG_FILE).string(), *sheet);
+            SaveSnapshot(*sheet, (directory / SNAPSHOT_TMP_FILE).string());
+            SyncPath(directory / SNAPSHOT_TMP_FILE);
+            fs::rename(directory / SNAPSHOT_TMP_FILE, directory / SNAPSHOT_FILE);
+            SyncPath(directory);
+            fs::remove(directory / SEALED_LOG_FILE);
+        } catch (...) {
+            compaction_error_ = std::current_exception();
+        }
+        compacting_ = false;
+    });
+}
+
+// waits for the background compaction to finish
+void DurableSheet::WaitCompaction() {
+    if (compaction_.joinable()) {
+        compaction_.join();
+    }
+    if (compaction_error_) {
+        std::rethrow_exception(std::exchange(compaction_error_, nullptr));
+    }
+}
+
+// returns the number of log records applied during the recovery
+size_t DurableSheet::GetRecoveredRecords() const {
+    return recovered_records_;
+}
+
+Sheet& DurableSheet::GetSheet() {
+    return *sheet_;
+}
+
+// recovers the sheet from the snapshot and the logs of the directory
+void DurableSheet::Recover() {
+    const fs::path directory(directory_);
+    fs::remove(directory / SNAPSHOT_TMP_FILE);
+    if (fs::exists(directory / SNAPSHOT_FILE)) {
+        try {
+            sheet_ = LoadSnapshot((directory / SNAPSHOT_FILE).string());
+        } catch (const SnapshotException& exc) {
+            throw DurabilityException(exc.what());
+        }
+    } else {
+        sheet_ = std::make_unique<Sheet>();
+    }
+
+    // the log sealed by an unfinished compaction goes before the current one
+    for (const char* log_file : {SEALED_LOG_FILE, LOG_FILE}) {
+        const fs::path log_path = directory / log_file;
+        if (!fs::exists(log_path)) {
+            continue;
+        }
+        auto result = WriteAheadLog::Replay(log_path.string(), *sheet_);
+        recovered_records_ += result.records;
+        // the torn tail is cut off so that new records follow the valid ones
+        if (fs::file_size(log_path) != result.valid_size) {
+            fs::resize_file(log_path, result.valid_size);
+        }
+    }
+}
+
+void DurableSheet::CompactIfNeeded() {
+    if (log_->GetSize() < compaction_threshold_) {
+        return;
+    }
+    if (compacting_) {
+        // the log keeps growing until the previous compaction finishes
+        return;
+    }
+    Compact();
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Исключение, выбрасываемое при ошибке записи журнала или восстановления таблицы
+class DurabilityException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Append-only log of sheet mutations with group commit.
+// Records are appended to an in-memory buffer and written by the background
+// thread; while one fsync is in progress new records accumulate, so under load
+// many records share one fsync. Every record carries a checksum: a torn record
+// at the end of the log, left by a crash, ends the replay.
+class WriteAheadLog {
+public:
+    enum class Operation : std::uint8_t {
+        Set,
+        Clear,
+    };
+    // sequence number of the record
+    using Lsn = std::uint64_t;
+
+    struct ReplayResult {
+        size_t records = 0;
+        // size of the valid part of the log
+        std::uint64_t valid_size = 0;
+    };
+
+    // opens the log for appending, the file is created if it does not exist
+    explicit WriteAheadLog(const std::string& path);
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    // makes all appended records durable
+    ~WriteAheadLog();
+
+    // adds the record to the log and returns its sequence number, the record is not durable yet
+    Lsn Append(Operation operation, Position pos, std::string_view text = {});
+    // blocks until all records up to lsn are written and synced, throws
+    // DurabilityException if the log cannot be written or synced
+    void Commit(Lsn lsn);
+    // blocks until all appended records are durable
+    void Commit();
+    // returns the size of the log including the records not written yet
+    std::uint64_t GetSize() const;
+
+    // applies the records of the log to the sheet; rejected mutations are skipped,
+    // so the same log can be safely replayed over a snapshot which already contains it
+    static ReplayResult Replay(const std::string& path, SheetInterface& sheet);
+
+private:
+    // the background thread writing and syncing the appended records
+    void FlushLoop();
+
+    std::FILE* file_;
+    mutable std::mutex mutex_;
+    std::condition_variable has_records_;
+    std::condition_variable records_durable_;
+
+    std::string pending_;
+    Lsn appended_lsn_ = 0;
+    Lsn durable_lsn_ = 0;
+    std::uint64_t size_ = 0;
+    std::string error_;
+    bool stopped_ = false;
+
+    std::thread flusher_;
+};
+
+// Sheet which survives crashes. The directory holds the last snapshot and the
+// log of the mutations made after it; on construction the sheet is recovered
+// from them. Every successful SetCell/ClearCell is appended to the log. The
+// mutations become durable in groups: at the latest before the sheet is
+// printed, on Commit() and on destruction. When the log grows over the
+// threshold, it is sealed and folded into a new snapshot by a background
+// thread, which works on its own copy of the data.
+class DurableSheet : public SheetInterface {
+public:
+    explicit DurableSheet(std::string directory, std::uint64_t compaction_threshold = 64 << 20);
+    ~DurableSheet();
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // blocks until all mutations are durable
+    void Commit() const;
+    // seals the current log and folds it into a new snapshot in the background
+    void Compact();
+    // waits for the background compaction to finish
+    void WaitCompaction();
+
+    // returns the number of log records applied during the recovery
+    size_t GetRecoveredRecords() const;
+    Sheet& GetSheet();
+
+private:
+    // recovers the sheet from the snapshot and the logs of the directory
+    void Recover();
+    void CompactIfNeeded();
+
+    std::string directory_;
+    std::uint64_t compaction_threshold_;
+    std::unique_ptr<Sheet> sheet_;
+    std::unique_ptr<WriteAheadLog> log_;
+    size_t recovered_records_ = 0;
+    std::thread compaction_;
+    std::atomic<bool> compacting_ = false;
+    std::exception_ptr compaction_error_;
+};